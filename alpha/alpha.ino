@@ -8,6 +8,12 @@
 #include "opentracev2.h"
 #include "serial_cmd.h"
 #include "storage.h"
+#include "scheduler.h"
+#include "jsonpull.h"
+#include "http.h"
+#include "upload.h"
+#include "inflate.h"
+#include "logcrypt.h"
 
 // Notes:
 // - look at mods/boards.diff.txt -- set CPU to 80mhz instead of 240mhz
@@ -22,6 +28,8 @@ void setup() {
 
   OT_ProtocolV2.begin();
 
+  TS_RADIO.init();
+
   TS_POWER.init();
   
   // This starts a new task
@@ -36,7 +44,53 @@ void setup() {
 
 #ifdef TESTDRIVER
 
+#ifdef TESTDRIVER_SCHEDULER
+  TS_SchedulerTests.run_all();
+#endif
+
+#ifdef TESTDRIVER_DENSITY
+  TS_DensityTests.run_all();
+#endif
+
+#ifdef TESTDRIVER_RSSI
+  TS_RssiTests.run_all();
+#endif
+
+#ifdef TESTDRIVER_METRICS
+  TS_MetricsTests.run_all();
+#endif
+
+#ifdef TESTDRIVER_OPENTRACE
+  OT_ProtocolV2Tests.run_all();
+#endif
+
+#ifdef TESTDRIVER_TXPOWER
+  TS_TxPowerTests.run_all();
+#endif
+
+#ifdef TESTDRIVER_JSONPULL
+  TS_JsonPullTests.run_all();
+#endif
+
+#ifdef TESTDRIVER_HTTP
+  TS_HttpTests.run_all();
+#endif
+
+#ifdef TESTDRIVER_UPLOAD
+  TS_UploadTests.run_all();
+#endif
+
+#ifdef TESTDRIVER_INFLATE
+  TS_InflateTests.run_all();
+#endif
+
+#ifdef TESTDRIVER_LOGCRYPT
+  TS_LogCryptTests.run_all();
+#endif
+
+#ifdef TESTDRIVER_STORAGE
   TS_StorageTests.run_all_repeatedly();
+#endif
 
 #endif
 }
@@ -7,6 +7,7 @@
 
 #include "hal.h"
 #include <list>
+#include <atomic>
 
 #define STRINGIFY2(x) #x
 #define STRINGIFY(x) STRINGIFY2(x)
@@ -105,4 +106,173 @@ template <typename T, typename U> class LargestN : public SmallestN<T,U>
     };
 };
 
+// FNV-1a hash over raw bytes
+inline uint32_t hash_fnv1a(const uint8_t *data, size_t len)
+{
+  uint32_t h = 2166136261UL;
+  for(size_t i = 0; i < len; ++i)
+  {
+    h ^= data[i];
+    h *= 16777619UL;
+  }
+  return h;
+}
+
+// Fixed-size bloom filter over raw keys
+// - BITS must be a power of 2
+// - may report false positives, never false negatives
+template <uint16_t BITS, uint8_t HASHES> class BloomFilter
+{
+  public:
+    BloomFilter()
+    {
+      clear();
+    };
+
+    void clear()
+    {
+      memset(bits, 0, sizeof(bits));
+      added = 0;
+    };
+
+    void add(const uint8_t *key, size_t len)
+    {
+      uint32_t h = hash_fnv1a(key, len);
+      for(uint8_t i = 0; i < HASHES; ++i)
+      {
+        uint16_t bit = bit_of(h, i);
+        bits[bit >> 3] |= (1 << (bit & 7));
+      }
+      ++added;
+    };
+
+    bool contains(const uint8_t *key, size_t len)
+    {
+      uint32_t h = hash_fnv1a(key, len);
+      for(uint8_t i = 0; i < HASHES; ++i)
+      {
+        uint16_t bit = bit_of(h, i);
+        if((bits[bit >> 3] & (1 << (bit & 7))) == 0) return false;
+      }
+      return true;
+    };
+
+    // number of keys added since last clear
+    uint16_t size()
+    {
+      return added;
+    };
+
+  protected:
+    // double hashing, derive the ith bit from both halves of one hash
+    uint16_t bit_of(uint32_t h, uint8_t i)
+    {
+      return ((h & 0xFFFF) + i * ((h >> 16) | 1)) & (BITS - 1);
+    };
+
+    uint8_t bits[BITS / 8];
+    uint16_t added;
+};
+
+// Lock-free single-producer/single-consumer ring of fixed-size items
+// - push from exactly one task and pop from exactly one other task, neither blocks
+// - N must be a power of 2
+template <typename T, uint16_t N> class SpscRing
+{
+  public:
+    SpscRing()
+    : head(0), tail(0)
+    {
+    };
+
+    // Producer side, returns false if full
+    bool push(const T &item)
+    {
+      uint32_t h = head.load(std::memory_order_relaxed);
+      if(h - tail.load(std::memory_order_acquire) >= N) return false;
+
+      items[h & (N - 1)] = item;
+      head.store(h + 1, std::memory_order_release);
+      return true;
+    };
+
+    // Consumer side, returns false if empty
+    bool pop(T &item)
+    {
+      uint32_t t = tail.load(std::memory_order_relaxed);
+      if(t == head.load(std::memory_order_acquire)) return false;
+
+      item = items[t & (N - 1)];
+      tail.store(t + 1, std::memory_order_release);
+      return true;
+    };
+
+    uint16_t size()
+    {
+      return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
+    };
+
+  protected:
+    T items[N];
+    std::atomic<uint32_t> head;   // written by producer only
+    std::atomic<uint32_t> tail;   // written by consumer only
+};
+
+// Bump allocator over a fixed buffer, for the short-lived buffers of one job at a time
+// - keeps the memory of the job bounded and off the heap
+// - a job claims it with acquire and gives it back with release, which frees everything
+// - alloc only serves a claimed arena, a second job gets false from acquire instead of sharing
+template <size_t N> class ScratchArena
+{
+  public:
+    ScratchArena()
+    : used(0), peak(0), owned(false)
+    {
+    };
+
+    bool acquire()
+    {
+      if(owned.exchange(true, std::memory_order_acquire)) return false;
+      used = 0;
+      return true;
+    };
+
+    void release()
+    {
+      used = 0;
+      owned.store(false, std::memory_order_release);
+    };
+
+    // 4-byte aligned, NULL once the budget is spent or when not acquired
+    void* alloc(size_t size)
+    {
+      if(!owned.load(std::memory_order_relaxed)) return NULL;
+
+      size_t aligned = (size + 3) & ~(size_t)3;
+      if(aligned > N - used) return NULL;
+
+      void *p = buffer + used;
+      used += aligned;
+      if(used > peak) peak = used;
+      return p;
+    };
+
+    size_t get_used()
+    {
+      return used;
+    };
+
+    // Most ever used at once, to size N
+    size_t get_peak()
+    {
+      return peak;
+    };
+
+  protected:
+    uint8_t buffer[N] __attribute__((aligned(4)));
+    size_t  used;
+    size_t  peak;
+    std::atomic<bool> owned;
+};
+
 #endif
@@ -0,0 +1,91 @@
+#include "density.h"
+
+// Scan interval backs off from min to max while nothing new shows up, to peers max while peers are around
+#ifdef DEBUG_TIMINGS
+  #define SCAN_INTERVAL_MIN_SECS        10
+  #define SCAN_INTERVAL_PEERS_MAX_SECS  20
+  #define SCAN_INTERVAL_MAX_SECS        60
+#else
+  #define SCAN_INTERVAL_MIN_SECS        30
+  #define SCAN_INTERVAL_PEERS_MAX_SECS  60
+  #define SCAN_INTERVAL_MAX_SECS        120
+#endif
+
+// Rssi cutoff rises by 1 per peer of smoothed density, up to the max
+#define SCAN_RSSI_CUTOFF      -95
+#define SCAN_RSSI_CUTOFF_MAX  -75
+
+// Exchange budget per scan, grows with new and nearby peers
+#define EXCHANGE_MS_PER_PEER  1500
+#define EXCHANGE_BUDGET_MIN   1500
+#define EXCHANGE_BUDGET_MAX   6000
+
+// Density smoothing: new = old + (sample - old) / 2^DENSITY_SHIFT
+#define DENSITY_SHIFT         2
+
+//
+// TS_DensityController
+//
+
+TS_DensityController::TS_DensityController()
+{
+  reset();
+}
+
+void TS_DensityController::reset()
+{
+  this->intervalMs = SCAN_INTERVAL_MIN_SECS * 1000;
+  this->densityQ4 = 0;
+  this->lastNewPeers = 0;
+}
+
+void TS_DensityController::update(uint16_t peers, uint16_t newPeers)
+{
+  // round away from zero so density settles on the sample instead of stalling just short of it
+  int32_t delta = ((int32_t)peers << 4) - (int32_t)this->densityQ4;
+  int32_t round = (1 << DENSITY_SHIFT) - 1;
+  this->densityQ4 += (delta >= 0 ? delta + round : delta - round) / (1 << DENSITY_SHIFT);
+  this->lastNewPeers = newPeers;
+
+  if(newPeers > 0)
+  {
+    this->intervalMs = SCAN_INTERVAL_MIN_SECS * 1000;
+  }
+  else
+  {
+    // multiplicative backoff, x1.5
+    // - less far while peers are seen, a static crowd has nothing new but its minutes still count
+    uint32_t maxMs = (peers > 0 ? SCAN_INTERVAL_PEERS_MAX_SECS : SCAN_INTERVAL_MAX_SECS) * 1000;
+    this->intervalMs += this->intervalMs / 2;
+    if(this->intervalMs > maxMs) this->intervalMs = maxMs;
+  }
+}
+
+uint32_t TS_DensityController::get_scan_interval_ms()
+{
+  return this->intervalMs;
+}
+
+int8_t TS_DensityController::get_rssi_cutoff()
+{
+  int16_t cutoff = SCAN_RSSI_CUTOFF + (this->densityQ4 >> 4);
+  if(cutoff > SCAN_RSSI_CUTOFF_MAX) cutoff = SCAN_RSSI_CUTOFF_MAX;
+  return (int8_t)cutoff;
+}
+
+uint32_t TS_DensityController::get_exchange_budget_ms()
+{
+  // the rssi cutoff already thins out crowds, budget for the larger of new and typical peers
+  uint32_t peers = this->densityQ4 >> 4;
+  if(this->lastNewPeers > peers) peers = this->lastNewPeers;
+
+  uint32_t budget = peers * EXCHANGE_MS_PER_PEER;
+  if(budget < EXCHANGE_BUDGET_MIN) budget = EXCHANGE_BUDGET_MIN;
+  if(budget > EXCHANGE_BUDGET_MAX) budget = EXCHANGE_BUDGET_MAX;
+  return budget;
+}
+
+uint16_t TS_DensityController::get_density_q4()
+{
+  return this->densityQ4;
+}
@@ -0,0 +1,233 @@
+//
+// Scan density controller
+// - the scan interval, rssi cutoff and exchange budget from the outcome of recent scans
+// - no radio or OS calls, tools/synchost builds and tests it on the host
+//
+
+#ifndef __TS_DENSITY__
+#define __TS_DENSITY__
+
+#include <stdint.h>
+#include "tests.h"
+
+// DEBUG_TIMINGS, here or as a build flag, scans at short intervals while debugging
+//#define DEBUG_TIMINGS
+
+// Adapts the scan budget to recent peer density
+// - backs off the scan interval while nothing new shows up, resets it when new TempIDs appear
+// - peers still around keep the backoff short, their encounter minutes come from being seen again
+// - raises the rssi cutoff in crowds to focus on the closest peers
+// - deterministic, only depends on the scans fed to it
+class TS_DensityController
+{
+  public:
+    TS_DensityController();
+
+    void reset();
+
+    // Feed the outcome of one scan
+    // - peers: OpenTrace peers seen, also those exchanged with recently
+    // - newPeers: peers with TempIDs not seen recently
+    void update(uint16_t peers, uint16_t newPeers);
+
+    uint32_t get_scan_interval_ms();
+    int8_t   get_rssi_cutoff();
+    uint32_t get_exchange_budget_ms();
+
+    // Smoothed peers per scan, 4 fractional bits
+    uint16_t get_density_q4();
+
+  private:
+    uint32_t intervalMs;
+    uint16_t densityQ4;
+    uint16_t lastNewPeers;
+};
+
+
+
+//
+// Tests
+//
+
+#if defined(TESTDRIVER) && defined(TESTDRIVER_DENSITY)
+
+// Recorded encounter trace, one entry per scan
+// - quiet office, people arriving, packed train, everyone leaving
+struct TS_DensityTraceEntry
+{
+  uint16_t peers;
+  uint16_t newPeers;
+};
+
+static const TS_DensityTraceEntry densityTrace[] = {
+  {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0},
+  {1, 1}, {1, 0}, {2, 1}, {2, 0}, {2, 0},
+  {12, 10}, {18, 8}, {25, 9}, {30, 6}, {28, 4}, {31, 5}, {29, 3},
+  {8, 0}, {2, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0},
+  {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0},
+};
+
+#define DENSITY_TRACE_LEN (sizeof(densityTrace) / sizeof(densityTrace[0]))
+
+static class _TS_DensityTests : public _TS_Tests
+{
+public:
+  uint32_t intervals[DENSITY_TRACE_LEN];
+  int8_t   cutoffs[DENSITY_TRACE_LEN];
+  uint32_t budgets[DENSITY_TRACE_LEN];
+
+  void init() override {}
+
+  // replay the trace, recording controller outputs after every scan
+  void replay(TS_DensityController &controller)
+  {
+    controller.reset();
+    for(uint8_t i = 0; i < DENSITY_TRACE_LEN; ++i)
+    {
+      controller.update(densityTrace[i].peers, densityTrace[i].newPeers);
+      intervals[i] = controller.get_scan_interval_ms();
+      cutoffs[i] = controller.get_rssi_cutoff();
+      budgets[i] = controller.get_exchange_budget_ms();
+    }
+  }
+
+  bool test_density_backoff_when_quiet()
+  {
+    TS_DensityController controller;
+    replay(controller);
+
+    for(uint8_t i = 1; i < 6; ++i)
+    {
+      if(intervals[i] < intervals[i - 1])
+      {
+        log_e("Interval should not shrink while quiet, scan %d: %d < %d", i, intervals[i], intervals[i - 1]);
+        return false;
+      }
+    }
+
+    if(intervals[5] <= intervals[0])
+    {
+      log_e("Interval should have backed off while quiet");
+      return false;
+    }
+
+    if(intervals[DENSITY_TRACE_LEN - 1] <= intervals[17])
+    {
+      log_e("Interval should back off again after the crowd leaves");
+      return false;
+    }
+
+    return true;
+  }
+
+  bool test_density_new_peers_reset_interval()
+  {
+    TS_DensityController controller;
+    replay(controller);
+
+    if(intervals[6] >= intervals[5])
+    {
+      log_e("New peers should shorten the interval, %d >= %d", intervals[6], intervals[5]);
+      return false;
+    }
+
+    for(uint8_t i = 11; i < 18; ++i)
+    {
+      if(intervals[i] != intervals[11])
+      {
+        log_e("Interval should stay at its minimum while new peers keep appearing, scan %d", i);
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+  bool test_density_cutoff_follows_crowd()
+  {
+    TS_DensityController controller;
+    replay(controller);
+
+    if(cutoffs[17] <= cutoffs[5])
+    {
+      log_e("Rssi cutoff should rise in a crowd, %d <= %d", cutoffs[17], cutoffs[5]);
+      return false;
+    }
+
+    if(cutoffs[DENSITY_TRACE_LEN - 1] != cutoffs[0])
+    {
+      log_e("Rssi cutoff should return to base once empty, %d != %d", cutoffs[DENSITY_TRACE_LEN - 1], cutoffs[0]);
+      return false;
+    }
+
+    if(budgets[13] <= budgets[5])
+    {
+      log_e("Exchange budget should grow with new peers, %d <= %d", budgets[13], budgets[5]);
+      return false;
+    }
+
+    return true;
+  }
+
+  bool test_density_deterministic()
+  {
+    TS_DensityController controller;
+    replay(controller);
+
+    uint32_t firstIntervals[DENSITY_TRACE_LEN];
+    int8_t   firstCutoffs[DENSITY_TRACE_LEN];
+    memcpy(firstIntervals, intervals, sizeof(intervals));
+    memcpy(firstCutoffs, cutoffs, sizeof(cutoffs));
+
+    replay(controller);
+    if(memcmp(firstIntervals, intervals, sizeof(intervals)) != 0 || memcmp(firstCutoffs, cutoffs, sizeof(cutoffs)) != 0)
+    {
+      log_e("Replaying the same trace should give the same outputs");
+      return false;
+    }
+
+    return true;
+  }
+
+  bool test_density_static_crowd()
+  {
+    // a crowd that arrives together and stays, against an empty room
+    TS_DensityController crowd, empty;
+    crowd.update(20, 20);
+    empty.update(0, 0);
+    for(uint8_t i = 0; i < 20; ++i)
+    {
+      crowd.update(20, 0);
+      empty.update(0, 0);
+    }
+
+    if(crowd.get_scan_interval_ms() >= empty.get_scan_interval_ms())
+    {
+      log_e("Peers still around should cap the backoff, %d >= %d", crowd.get_scan_interval_ms(), empty.get_scan_interval_ms());
+      return false;
+    }
+
+    crowd.update(20, 0);
+    if(crowd.get_scan_interval_ms() <= TS_DensityController().get_scan_interval_ms())
+    {
+      log_e("A static crowd should still back off some, %d", crowd.get_scan_interval_ms());
+      return false;
+    }
+
+    return true;
+  }
+
+  // Ctor
+  _TS_DensityTests()
+  {
+    add(std::bind(&_TS_DensityTests::test_density_backoff_when_quiet, this), "test_density_backoff_when_quiet");
+    add(std::bind(&_TS_DensityTests::test_density_new_peers_reset_interval, this), "test_density_new_peers_reset_interval");
+    add(std::bind(&_TS_DensityTests::test_density_cutoff_follows_crowd, this), "test_density_cutoff_follows_crowd");
+    add(std::bind(&_TS_DensityTests::test_density_deterministic, this), "test_density_deterministic");
+    add(std::bind(&_TS_DensityTests::test_density_static_crowd, this), "test_density_static_crowd");
+  }
+} TS_DensityTests;
+
+#endif
+
+#endif
@@ -1,5 +1,6 @@
 #include "hal.h"
 #include "esp_pm.h"
+#include "esp_coexist.h"
 
 // Lower level library include decisions go here
 
@@ -24,6 +25,9 @@
 // Default power of 1dBm for ~1-2m range
 #define DEFAULT_BLE_POWER TS_BlePower::P1
 
+// Accepted scan results waiting to be processed, excess results are dropped
+#define BLE_SCAN_QUEUE_MAX 8
+
 #define ENTER_CRITICAL  xSemaphoreTake(halMutex, portMAX_DELAY)
 #define EXIT_CRITICAL   xSemaphoreGive(halMutex)
 static SemaphoreHandle_t halMutex;
@@ -33,6 +37,64 @@ static SemaphoreHandle_t halMutex;
 // - Lost during powerdown
 RTC_NOINIT_ATTR _TS_PersistMem TS_PersistMem;
 
+// Filters scan results as they arrive and queues accepted ones
+// - the BLE lib stores every device after calling onResult, so a rejected device
+//   is erased on the next callback or when the scan resumes
+// - accepted devices stay stored, which stops the lib from reporting them again
+class TS_HAL_ScanCallbacks : public BLEAdvertisedDeviceCallbacks
+{
+  public:
+    BLEScan          *scan;
+    QueueHandle_t    queue;
+    TS_BleScanFilter filter;
+    bool             hasRejected;
+    esp_bd_addr_t    rejected;
+
+    void onResult(BLEAdvertisedDevice device) override
+    {
+      this->erase_rejected();
+      
+      if(this->filter != NULL && !this->filter(device))
+      {
+        memcpy(this->rejected, device.getAddress().getNative(), sizeof(esp_bd_addr_t));
+        this->hasRejected = true;
+        return;
+      }
+
+      TS_BleScanResult result;
+      memcpy(result.address, device.getAddress().getNative(), sizeof(esp_bd_addr_t));
+      result.addressType = device.getAddressType();
+      result.rssi = (int8_t)device.getRSSI();
+      result.mfrDataLength = 0;
+
+      if(device.haveManufacturerData())
+      {
+        std::string mfrData = device.getManufacturerData();
+        if(mfrData.length() <= TS_BLE_MFR_DATA_MAX)
+        {
+          memcpy(result.mfrData, mfrData.data(), mfrData.length());
+          result.mfrDataLength = mfrData.length();
+        }
+      }
+
+      if(xQueueSend(this->queue, &result, 0) != pdTRUE)
+      {
+        log_w("Scan queue full, dropping result");
+      }
+    }
+
+    void erase_rejected()
+    {
+      if(!this->hasRejected) return;
+      this->scan->erase(BLEAddress(this->rejected));
+      this->hasRejected = false;
+    }
+};
+static TS_HAL_ScanCallbacks scanCallbacks;
+
+// Scans are stopped explicitly, nothing to do on completion
+static void scan_complete(BLEScanResults results) { }
+
 // Your one and only
 _TS_HAL TS_HAL;
 _TS_HAL::_TS_HAL() {}
@@ -42,6 +104,7 @@ void _TS_HAL::begin()
   persistmem_init();
   this->uart_init();
   this->bleInitialized = false;
+  this->bleScanActive = true;
   halMutex = xSemaphoreCreateMutex();
 
   // init ble before rng
@@ -312,6 +375,29 @@ void _TS_HAL::rtc_set(TS_DateTime &dt)
   EXIT_CRITICAL;
 }
 
+uint32_t _TS_HAL::rtc_get_unix()
+{
+  TS_DateTime dt;
+  this->rtc_get(dt);
+
+  // a fresh RTC starts in 2000
+  if (dt.year < 2020) return 0;
+  return datetime_to_unix(dt) - TS_RTC_UTC_OFFSET_S;
+}
+
+// Days since 1970-01-01 of the civil date, March based years put the leap day last
+uint32_t _TS_HAL::datetime_to_unix(const TS_DateTime &dt)
+{
+  uint32_t year = dt.month <= 2 ? dt.year - 1 : dt.year;
+  uint32_t era = year / 400;
+  uint32_t yearOfEra = year - era * 400;
+  uint32_t dayOfYear = (153 * (dt.month > 2 ? dt.month - 3 : dt.month + 9) + 2) / 5 + dt.day - 1;
+  uint32_t dayOfEra = yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear;
+  uint32_t days = era * 146097 + dayOfEra - 719468;
+
+  return days * 86400 + dt.hour * 3600 + dt.minute * 60 + dt.second;
+}
+
 
 
 //
@@ -419,7 +505,13 @@ void _TS_HAL::ble_init()
     pBLEAdvertiser = BLEDevice::getAdvertising();
 
     this->pBLEScan = BLEDevice::getScan();  //create new scan
-    this->pBLEScan->setActiveScan(true);    //active scan uses more power, but get results faster
+    this->pBLEScan->setActiveScan(this->bleScanActive);    //active scan uses more power, but get results faster
+    this->pBLEScan->setAdvertisedDeviceCallbacks(&scanCallbacks);
+    
+    if(scanCallbacks.queue == NULL)
+    {
+      scanCallbacks.queue = xQueueCreate(BLE_SCAN_QUEUE_MAX, sizeof(TS_BleScanResult));
+    }
     // pBLEScan->setInterval(100);    // in ms , left to defaults
     // pBLEScan->setWindow(99);
 
@@ -436,10 +528,46 @@ void _TS_HAL::ble_deinit()
   }
 }
 
-BLEScanResults _TS_HAL::ble_scan(uint8_t seconds)
+// Starts scanning in the background until ble_scan_stop
+// - resume: continue a paused scan, devices reported before are not reported again
+// - accepted devices are queued for ble_scan_next as they arrive
+bool _TS_HAL::ble_scan_start(TS_BleScanFilter filter, bool resume)
+{
+  if(resume)
+  {
+    scanCallbacks.erase_rejected();
+  }
+  else
+  {
+    this->pBLEScan->clearResults();
+    scanCallbacks.hasRejected = false;
+    xQueueReset(scanCallbacks.queue);
+  }
+
+  scanCallbacks.scan = this->pBLEScan;
+  scanCallbacks.filter = filter;
+  this->pBLEScan->setActiveScan(this->bleScanActive);
+
+  // duration 0: scan until stopped
+  return this->pBLEScan->start(0, scan_complete, resume);
+}
+
+// Passive scans only listen for advertisements, without asking for scan responses
+// - applies from the next ble_scan_start
+void _TS_HAL::ble_scan_set_active(bool active)
+{
+  this->bleScanActive = active;
+}
+
+// Waits up to timeoutMs for the next accepted device, returns false on timeout
+bool _TS_HAL::ble_scan_next(TS_BleScanResult &result, uint32_t timeoutMs)
+{
+  return xQueueReceive(scanCallbacks.queue, &result, timeoutMs / portTICK_PERIOD_MS) == pdTRUE;
+}
+
+void _TS_HAL::ble_scan_stop()
 {
-  this->pBLEScan->clearResults();
-  return this->pBLEScan->start(seconds, false);
+  this->pBLEScan->stop();
 }
 
 BLEServer* _TS_HAL::ble_server_get()
@@ -452,7 +580,7 @@ bool _TS_HAL::ble_is_init()
   return this->bleInitialized;
 }
 
-void _TS_HAL::ble_set_power(TS_BlePower dbm)
+void _TS_HAL::ble_set_power(TS_BlePower dbm, TS_BlePowerType type)
 {
   esp_power_level_t p = ESP_PWR_LVL_N14;
 
@@ -483,9 +611,41 @@ void _TS_HAL::ble_set_power(TS_BlePower dbm)
       break;
   }
   
-  BLEDevice::setPower(p, ESP_BLE_PWR_TYPE_DEFAULT);
-  BLEDevice::setPower(p, ESP_BLE_PWR_TYPE_ADV);
-  BLEDevice::setPower(p, ESP_BLE_PWR_TYPE_SCAN);
+  // default covers connections made from now on
+  if(type != BLE_POWER_ADV)
+  {
+    BLEDevice::setPower(p, ESP_BLE_PWR_TYPE_DEFAULT);
+    BLEDevice::setPower(p, ESP_BLE_PWR_TYPE_SCAN);
+  }
+
+  if(type != BLE_POWER_CONN)
+  {
+    BLEDevice::setPower(p, ESP_BLE_PWR_TYPE_ADV);
+  }
+}
+
+// the stack has no level per connection until it is connected, the default one is borrowed meanwhile
+void _TS_HAL::ble_reset_conn_power()
+{
+  this->ble_set_power(DEFAULT_BLE_POWER, BLE_POWER_CONN);
+}
+
+void _TS_HAL::coex_prefer(TS_CoexPrefer prefer)
+{
+  esp_coex_prefer_t p = ESP_COEX_PREFER_BALANCE;
+
+  switch(prefer) {
+    case TS_CoexPrefer::CoexWifi:
+      p = ESP_COEX_PREFER_WIFI;
+      break;
+    case TS_CoexPrefer::CoexBluetooth:
+      p = ESP_COEX_PREFER_BT;
+      break;
+    default:
+      break;
+  }
+
+  esp_coex_preference_set(p);
 }
 
 
@@ -26,6 +26,9 @@
 #define DEVICE_NAME "TraceStick V0.1"
 #define TS_PERSISTMEM_VALID 0xABCDFEDC
 
+// Seconds the RTC runs ahead of UTC, 0 for an RTC kept in UTC
+#define TS_RTC_UTC_OFFSET_S 0
+
 struct TS_DateTime
 {
   uint8_t hour, minute, second;
@@ -41,6 +44,14 @@ enum TS_SleepMode
   Deep,     // suspends cpu, wake w/ reboot
 };
 
+// Airtime preference while WiFi and BLE are both up
+enum TS_CoexPrefer
+{
+  CoexBalance,
+  CoexWifi,
+  CoexBluetooth,
+};
+
 enum TS_Led
 {
   Red,
@@ -58,6 +69,31 @@ enum TS_BlePower
   P7,   // 7 dBm
 };
 
+// Transmissions a power level applies to
+enum TS_BlePowerType
+{
+  BLE_POWER_ALL,
+  BLE_POWER_ADV,    // advertising
+  BLE_POWER_CONN,   // connections made from now on and scans, until ble_reset_conn_power
+};
+
+// Scan filter, return false to reject an advertised device
+// - called from the BLE stack task while scanning, keep it short
+typedef bool (*TS_BleScanFilter)(BLEAdvertisedDevice &device);
+
+// Manufacturer data kept from an advertisement, including the 2 byte company id
+#define TS_BLE_MFR_DATA_MAX 8
+
+// Accepted advertisement, queued while scanning
+struct TS_BleScanResult
+{
+  esp_bd_addr_t       address;
+  esp_ble_addr_type_t addressType;
+  int8_t              rssi;
+  uint8_t             mfrDataLength;  // 0 if none or too long
+  uint8_t             mfrData[TS_BLE_MFR_DATA_MAX];
+};
+
 // Persistent memory
 // - across reboots
 // - 1KB
@@ -66,6 +102,17 @@ struct _TS_PersistMem
   uint32_t validStart;  // validity guard bytes, data invalid if pattern not matched
   bool     gracefulShutdown;
   uint32_t crashCount;
+
+  // Last WiFi connection, for a direct reconnect without a scan
+  // - valid if wifiSsid matches the configured one and wifiChannel is not 0
+  char     wifiSsid[33];
+  uint8_t  wifiBssid[6];
+  uint8_t  wifiChannel;
+  uint32_t wifiIp;
+  uint32_t wifiGateway;
+  uint32_t wifiSubnet;
+  uint32_t wifiDns;
+
   uint32_t validEnd;  // validity guard bytes, data invalid if pattern not matched
 };
 extern _TS_PersistMem TS_PersistMem;
@@ -139,6 +186,10 @@ class _TS_HAL
     void rtc_get(TS_DateTime &);
     void rtc_set(TS_DateTime &);
 
+    // Unix seconds of the RTC, 0 while the clock is not set
+    uint32_t rtc_get_unix();
+    static uint32_t datetime_to_unix(const TS_DateTime &dt);
+
 
 
     //
@@ -159,9 +210,18 @@ class _TS_HAL
     void ble_init();
     void ble_deinit();
     BLEServer* ble_server_get();
-    BLEScanResults ble_scan(uint8_t seconds);
+    bool ble_scan_start(TS_BleScanFilter filter, bool resume);
+    bool ble_scan_next(TS_BleScanResult &result, uint32_t timeoutMs);
+    void ble_scan_stop();
+    void ble_scan_set_active(bool active);
     bool ble_is_init();
-    void ble_set_power(TS_BlePower dbm);
+    void ble_set_power(TS_BlePower dbm, TS_BlePowerType type = BLE_POWER_ALL);
+
+    // Back to the default level for connections and scans, once a connection set up with its own level ended
+    void ble_reset_conn_power();
+
+    // Shares the radio between WiFi and BLE, both stay up
+    void coex_prefer(TS_CoexPrefer prefer);
 
     
     //
@@ -191,6 +251,7 @@ class _TS_HAL
 
   private:
     bool            bleInitialized;
+    bool            bleScanActive;
     BLEScan*        pBLEScan;
     BLEServer*      pBLEServer;
     BLEAdvertising* pBLEAdvertiser;
@@ -0,0 +1,408 @@
+#include "http.h"
+#include <string.h>
+#include <strings.h>
+
+//
+// TS_HttpClient
+//
+
+TS_HttpClient::TS_HttpClient(Client &client, const char *host, uint16_t port)
+: client(client), host(host), port(port), keepAlive(false), chunked(false), gzip(false), chunkStarted(false),
+  bodyDone(true), bodyRemaining(0), headerLength(0), body(NULL), bodyLength(0), resendable(false), chunkedRequest(false), chunkFailed(false), chunkLength(0),
+  connects(0), requests(0), bytesSent(0), bytesReceived(0)
+{
+  this->setTimeout(HTTP_TIMEOUT_MS);
+  this->client.setTimeout(HTTP_TIMEOUT_MS);
+}
+
+bool TS_HttpClient::request(const char *method, const char *uri, const char *contentType, const uint8_t *body, size_t bodyLength, bool acceptGzip)
+{
+  char framing[32];
+  snprintf(framing, sizeof(framing), "Content-Length: %u", (unsigned)bodyLength);
+  return this->open(method, uri, contentType, framing, body, bodyLength, acceptGzip);
+}
+
+bool TS_HttpClient::request_begin(const char *method, const char *uri, const char *contentType)
+{
+  if(!this->open(method, uri, contentType, "Transfer-Encoding: chunked", NULL, 0, false)) return false;
+
+  this->resendable = false;
+  this->chunkedRequest = true;
+  this->chunkLength = 0;
+  this->chunkFailed = false;
+  return true;
+}
+
+bool TS_HttpClient::request_end()
+{
+  if(!this->chunkedRequest) return false;
+
+  this->flush_chunk();
+  this->chunkedRequest = false;
+
+  // last chunk, no trailers
+  if(!this->chunkFailed && this->client.write((const uint8_t*)"0\r\n\r\n", 5) != 5) this->chunkFailed = true;
+  this->bytesSent += 5;
+
+  // half a request leaves the connection unusable
+  if(this->chunkFailed) this->stop();
+  return !this->chunkFailed;
+}
+
+bool TS_HttpClient::open(const char *method, const char *uri, const char *contentType, const char *framing, const uint8_t *body, size_t bodyLength, bool acceptGzip)
+{
+  int headerLength = snprintf(this->header, sizeof(this->header),
+    "%s %s HTTP/1.1\r\n"
+    "Host: %s\r\n"
+    "Connection: keep-alive\r\n"
+    "Content-Type: %s\r\n"
+    "%s"
+    "%s\r\n"
+    "\r\n",
+    method, uri, this->host, contentType, acceptGzip ? "Accept-Encoding: gzip\r\n" : "", framing);
+
+  this->resendable = false;
+  if(headerLength < 0 || headerLength >= (int)sizeof(this->header))
+  {
+    log_e("Request header too long for %s", uri);
+    return false;
+  }
+
+  this->headerLength = headerLength;
+  this->body = body;
+  this->bodyLength = bodyLength;
+
+  // the server may have closed an idle connection since, that only shows when writing, or as no response
+  bool reused = this->is_connected();
+  if(this->send(this->header, this->headerLength, body, bodyLength))
+  {
+    this->resendable = reused;
+    return true;
+  }
+  if(!reused) return false;
+
+  log_i("Kept connection was closed, reconnecting");
+  this->stop();
+  return this->send(this->header, this->headerLength, body, bodyLength);
+}
+
+bool TS_HttpClient::send(const char *header, size_t headerLength, const uint8_t *body, size_t bodyLength)
+{
+  if(!this->connect()) return false;
+
+  this->bodyDone = true;
+  this->bodyRemaining = 0;
+  this->setTimeout(HTTP_TIMEOUT_MS);
+
+  if(this->client.write((const uint8_t*)header, headerLength) != headerLength) return false;
+  if(bodyLength > 0 && this->client.write(body, bodyLength) != bodyLength) return false;
+
+  this->bytesSent += headerLength + bodyLength;
+  ++this->requests;
+  return true;
+}
+
+uint16_t TS_HttpClient::response()
+{
+  char line[HTTP_LINE_MAX];
+
+  // HTTP/1.1 200 OK
+  uint32_t received = this->bytesReceived;
+  bool valid = this->read_line(line, sizeof(line)) && strncmp(line, "HTTP/1.", 7) == 0;
+
+  // a kept connection closed before any of the response, the server did not take the request
+  if(!valid && this->resendable && this->bytesReceived == received)
+  {
+    log_i("Kept connection closed before the response, resending");
+    this->stop();
+    this->resendable = false;
+    valid = this->send(this->header, this->headerLength, this->body, this->bodyLength) &&
+      this->read_line(line, sizeof(line)) && strncmp(line, "HTTP/1.", 7) == 0;
+  }
+
+  this->resendable = false;
+  if(!valid)
+  {
+    log_e("Unexpected response %s", line);
+    this->stop();
+    return 0;
+  }
+
+  uint16_t status = atoi(line + 8);
+  this->keepAlive = line[7] == '1';
+  this->chunked = false;
+  this->gzip = false;
+  this->chunkStarted = false;
+  this->bodyDone = false;
+  this->bodyRemaining = UINT32_MAX;   // until the server closes, unless told otherwise
+
+  while(true)
+  {
+    if(!this->read_line(line, sizeof(line)))
+    {
+      log_w("Invalid response headers");
+      this->stop();
+      return 0;
+    }
+
+    if(line[0] == '\0') break;
+
+    if(strncasecmp(line, "Content-Length:", 15) == 0)
+    {
+      this->bodyRemaining = strtoul(line + 15, NULL, 10);
+    }
+    else if(strncasecmp(line, "Transfer-Encoding:", 18) == 0)
+    {
+      this->chunked = strcasestr(line + 18, "chunked") != NULL;
+      this->bodyRemaining = 0;
+    }
+    else if(strncasecmp(line, "Content-Encoding:", 17) == 0)
+    {
+      this->gzip = strcasestr(line + 17, "gzip") != NULL;
+    }
+    else if(strncasecmp(line, "Connection:", 11) == 0)
+    {
+      this->keepAlive = strcasestr(line + 11, "close") == NULL;
+    }
+  }
+
+  // the end of an unframed body is the end of the connection
+  if(!this->chunked && this->bodyRemaining == UINT32_MAX) this->keepAlive = false;
+
+  return status;
+}
+
+void TS_HttpClient::end()
+{
+  if(this->keepAlive)
+  {
+    uint32_t startMs = millis();
+    while(this->body_ready() && millis() - startMs < HTTP_TIMEOUT_MS)
+    {
+      if(this->read() >= 0) continue;
+
+      // closed halfway, nothing more will come
+      if(!this->client.connected()) break;
+      delay(1);
+    }
+  }
+
+  if(!this->keepAlive || !this->bodyDone)
+  {
+    this->stop();
+  }
+}
+
+bool TS_HttpClient::connect()
+{
+  if(this->is_connected()) return true;
+
+  log_d("Connecting to %s", this->host);
+  if(!this->client.connect(this->host, this->port))
+  {
+    log_e("Connection to %s failed", this->host);
+    return false;
+  }
+
+  ++this->connects;
+  return true;
+}
+
+void TS_HttpClient::stop()
+{
+  this->client.stop();
+  this->bodyDone = true;
+  this->bodyRemaining = 0;
+}
+
+bool TS_HttpClient::is_connected()
+{
+  return this->client.connected();
+}
+
+bool TS_HttpClient::is_gzip()
+{
+  return this->gzip;
+}
+
+uint32_t TS_HttpClient::get_connects()
+{
+  return this->connects;
+}
+
+uint32_t TS_HttpClient::get_requests()
+{
+  return this->requests;
+}
+
+uint32_t TS_HttpClient::get_bytes_sent()
+{
+  return this->bytesSent;
+}
+
+uint32_t TS_HttpClient::get_bytes_received()
+{
+  return this->bytesReceived;
+}
+
+// Line without the CRLF, empty for the end of the headers
+// - false if the connection ended or timed out before the line did
+// - longer lines are cut, the rest is skipped
+bool TS_HttpClient::read_line(char *line, size_t lineMax)
+{
+  size_t length = 0;
+  bool terminated = false;
+
+  uint32_t startMs = millis();
+  while(millis() - startMs < HTTP_TIMEOUT_MS)
+  {
+    int c = this->client.read();
+    if(c < 0)
+    {
+      if(!this->client.connected()) break;
+      delay(1);
+      continue;
+    }
+
+    ++this->bytesReceived;
+    if(c == '\n')
+    {
+      terminated = true;
+      break;
+    }
+
+    if(length < lineMax - 1) line[length++] = c;
+  }
+
+  line[length] = '\0';
+  if(length > 0 && line[length - 1] == '\r') line[--length] = '\0';
+
+  return terminated;
+}
+
+// True while there is body left, reading the next chunk header if needed
+bool TS_HttpClient::body_ready()
+{
+  if(this->bodyDone) return false;
+  if(this->bodyRemaining > 0) return true;
+
+  if(!this->chunked)
+  {
+    this->bodyDone = true;
+    return false;
+  }
+
+  char line[HTTP_LINE_MAX];
+
+  // CRLF ending the previous chunk
+  if(this->chunkStarted && !this->read_line(line, sizeof(line)))
+  {
+    this->stop();
+    return false;
+  }
+  this->chunkStarted = true;
+
+  if(!this->read_line(line, sizeof(line)))
+  {
+    this->stop();
+    return false;
+  }
+
+  this->bodyRemaining = strtoul(line, NULL, 16);
+  if(this->bodyRemaining > 0) return true;
+
+  // last chunk, skip trailers
+  while(this->read_line(line, sizeof(line)) && line[0] != '\0');
+  this->bodyDone = true;
+  return false;
+}
+
+int TS_HttpClient::available()
+{
+  if(!this->body_ready()) return 0;
+
+  int available = this->client.available();
+  return (uint32_t)available < this->bodyRemaining ? available : this->bodyRemaining;
+}
+
+int TS_HttpClient::read()
+{
+  // past the end of the body, readBytes() returns at once rather than waiting out the timeout
+  if(!this->body_ready())
+  {
+    this->setTimeout(0);
+    return -1;
+  }
+
+  int c = this->client.read();
+  if(c < 0)
+  {
+    if(!this->client.connected()) this->body_closed();
+    return c;
+  }
+
+  ++this->bytesReceived;
+  if(this->bodyRemaining != UINT32_MAX) --this->bodyRemaining;
+  return c;
+}
+
+// The connection ended the body, cut off unless it was unframed
+void TS_HttpClient::body_closed()
+{
+  if(this->bodyRemaining != UINT32_MAX) log_w("Response cut off, %u bytes short", this->bodyRemaining);
+
+  this->stop();
+}
+
+int TS_HttpClient::peek()
+{
+  if(!this->body_ready()) return -1;
+  return this->client.peek();
+}
+
+size_t TS_HttpClient::write(uint8_t c)
+{
+  return this->write(&c, 1);
+}
+
+// Straight to the connection, or into the current chunk of a streamed request
+size_t TS_HttpClient::write(const uint8_t *buffer, size_t size)
+{
+  if(!this->chunkedRequest) return this->client.write(buffer, size);
+  if(this->chunkFailed) return 0;
+
+  size_t written = 0;
+  while(written < size)
+  {
+    size_t length = size - written;
+    size_t room = HTTP_CHUNK_MAX - this->chunkLength;
+    if(length > room) length = room;
+
+    memcpy(this->chunk + HTTP_CHUNK_PREFIX + this->chunkLength, buffer + written, length);
+    this->chunkLength += length;
+    written += length;
+
+    if(this->chunkLength == HTTP_CHUNK_MAX && !this->flush_chunk()) return 0;
+  }
+
+  return written;
+}
+
+// Sends the buffered chunk with its size line and CRLF in one write
+bool TS_HttpClient::flush_chunk()
+{
+  if(this->chunkFailed) return false;
+  if(this->chunkLength == 0) return true;
+
+  char prefix[HTTP_CHUNK_PREFIX + 1];
+  snprintf(prefix, sizeof(prefix), "%04x\r\n", this->chunkLength);
+  memcpy(this->chunk, prefix, HTTP_CHUNK_PREFIX);
+  memcpy(this->chunk + HTTP_CHUNK_PREFIX + this->chunkLength, "\r\n", 2);
+
+  size_t length = HTTP_CHUNK_PREFIX + this->chunkLength + 2;
+  if(this->client.write((const uint8_t*)this->chunk, length) != length) this->chunkFailed = true;
+
+  this->bytesSent += length;
+  this->chunkLength = 0;
+  return !this->chunkFailed;
+}
@@ -0,0 +1,309 @@
+//
+// Minimal HTTP/1.1 client over one long-lived connection
+// - the connection stays open between requests while the server allows it, a sync pays for one TLS handshake
+// - the response body is read through this Stream, bounded by Content-Length or chunked encoding,
+//   so the connection is left at the start of the next response
+// - one request at a time: request(), response(), read the body, end()
+// - request bodies may also be streamed: request_begin(), print or write, request_end(),
+//   sent with chunked encoding through a fixed buffer
+//
+
+#ifndef __TS_HTTP__
+#define __TS_HTTP__
+
+#include <stdint.h>
+#include <Arduino.h>
+#include <Client.h>
+#include "tests.h"
+
+#define HTTP_REQUEST_HEADER_MAX  256   // request line and headers, sent as one write
+#define HTTP_LINE_MAX            96    // response header lines, longer ones are cut
+#define HTTP_TIMEOUT_MS          5000
+#define HTTP_CHUNK_MAX           512   // streamed request bodies are sent in chunks of up to this
+#define HTTP_CHUNK_PREFIX        6     // "%04x\r\n"
+
+class TS_HttpClient : public Stream
+{
+  public:
+    TS_HttpClient(Client &client, const char *host, uint16_t port);
+
+    // Sends a request with a body, connecting first unless the last connection is still open
+    // - a reused connection the server already closed is reconnected once, when writing or
+    //   when it closes before the response, so body has to stay valid until response()
+    // - acceptGzip offers a gzip response, is_gzip() tells whether the server sent one
+    bool request(const char *method, const char *uri, const char *contentType, const uint8_t *body, size_t bodyLength, bool acceptGzip = false);
+
+    // Starts a request with a streamed body, written through this Print until request_end()
+    // - it cannot be resent, a reused connection closed before the response fails it
+    bool request_begin(const char *method, const char *uri, const char *contentType);
+
+    // Sends the last chunk, false if any of the body failed to send
+    bool request_end();
+
+    // Reads the status line and headers, returns the status code, 0 on failure
+    uint16_t response();
+
+    // Skips what is left of the body, the connection is kept if the server allows it
+    void end();
+
+    // Opens the connection unless it is still open, requests do this themselves
+    bool connect();
+
+    void stop();
+    bool is_connected();
+
+    // Body of the last response is gzip, read it through TS_InflateStream
+    bool is_gzip();
+
+    // Connections opened and requests sent, the difference is the handshakes saved
+    uint32_t get_connects();
+    uint32_t get_requests();
+    uint32_t get_bytes_sent();
+    uint32_t get_bytes_received();
+
+    // Response body
+    int available() override;
+    int read() override;
+    int peek() override;
+
+    // Writes go straight to the connection, or into chunks between request_begin() and request_end()
+    size_t write(uint8_t c) override;
+    size_t write(const uint8_t *buffer, size_t size) override;
+
+  private:
+    bool open(const char *method, const char *uri, const char *contentType, const char *framing, const uint8_t *body, size_t bodyLength, bool acceptGzip);
+    bool send(const char *header, size_t headerLength, const uint8_t *body, size_t bodyLength);
+    bool flush_chunk();
+    bool read_line(char *line, size_t lineMax);
+    bool body_ready();
+    void body_closed();
+
+    Client     &client;
+    const char *host;
+    uint16_t   port;
+
+    bool     keepAlive;
+    bool     chunked;
+    bool     gzip;
+    bool     chunkStarted;
+    bool     bodyDone;
+    uint32_t bodyRemaining;   // of the body, or of the current chunk
+
+    // last request, kept to resend it once
+    char           header[HTTP_REQUEST_HEADER_MAX];
+    size_t         headerLength;
+    const uint8_t *body;
+    size_t         bodyLength;
+    bool           resendable;  // sent on a reused connection, with a body that is still there
+
+    bool     chunkedRequest;
+    bool     chunkFailed;
+    uint16_t chunkLength;
+    char     chunk[HTTP_CHUNK_PREFIX + HTTP_CHUNK_MAX + 2];
+
+    uint32_t connects;
+    uint32_t requests;
+    uint32_t bytesSent;
+    uint32_t bytesReceived;
+};
+
+
+
+//
+// Tests
+//
+
+#if defined(TESTDRIVER) && defined(TESTDRIVER_HTTP)
+
+// Connection replaying canned responses, one per connect
+class TS_HttpTestClient : public Client
+{
+  public:
+    // lingering: the end of a connection is only noticed when reading, as with a server closing a kept connection
+    TS_HttpTestClient(const char **responses, bool lingering = false) : responses(responses), pos(0), open(false), lingering(lingering), connects(0) {}
+
+    int connect(const char *host, uint16_t port) override { this->open = this->responses[this->connects] != NULL; this->data = this->responses[this->connects++]; this->pos = 0; return this->open; }
+    uint8_t connected() override { return this->open && (this->data[this->pos] || this->lingering); }
+    void stop() override { this->open = false; }
+    int available() override { return this->open ? strlen(this->data + this->pos) : 0; }
+    int read() override { if(this->open && this->data[this->pos]) return this->data[this->pos++]; this->open = false; return -1; }
+    int peek() override { return this->open && this->data[this->pos] ? this->data[this->pos] : -1; }
+    size_t write(uint8_t c) override { return this->write(&c, 1); }
+    size_t write(const uint8_t *buffer, size_t size) override { if(!this->open) return 0; this->sent.append((const char*)buffer, size); return size; }
+
+    std::string sent;
+
+  private:
+    const char **responses;
+    const char *data;
+    size_t pos;
+    bool open;
+    bool lingering;
+    uint8_t connects;
+};
+
+static class _TS_HttpTests : public _TS_Tests
+{
+public:
+  void init() override {}
+
+  bool read_body(TS_HttpClient &http, const char *expected)
+  {
+    char body[32];
+    size_t length = 0;
+    for(int c = http.read(); c >= 0 && length < sizeof(body) - 1; c = http.read())
+    {
+      body[length++] = c;
+    }
+    body[length] = '\0';
+    if(strcmp(body, expected) != 0)
+    {
+      log_e("Expected body '%s', got '%s'", expected, body);
+      return false;
+    }
+    return true;
+  }
+
+  bool test_http_keep_alive()
+  {
+    // two responses on one connection, the first chunked with a trailer, then a server side close
+    const char *responses[] = {
+      "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\nX-Long: 0123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789\r\n\r\n"
+      "5\r\n{\"a\":\r\n3\r\n12}\r\n0\r\nX-Trailer: 1\r\n\r\n"
+      "HTTP/1.1 404 Not Found\r\nContent-Length: 4\r\n\r\nnope",
+      "HTTP/1.1 200 OK\r\nContent-Length: 2\r\nConnection: close\r\n\r\n{}",
+      NULL,
+    };
+    TS_HttpTestClient client(responses);
+    TS_HttpClient http(client, "localhost", 80);
+
+    if(!http.request("POST", "/a", "application/json", (const uint8_t*)"{}", 2) || http.response() != 200 || !read_body(http, "{\"a\":12}"))
+    {
+      log_e("Chunked response failed");
+      return false;
+    }
+    http.end();
+
+    // reused, only the status matters, the body is skipped by end()
+    if(!http.request("POST", "/b", "application/json", NULL, 0) || http.response() != 404)
+    {
+      log_e("Second response on the kept connection failed");
+      return false;
+    }
+    http.end();
+
+    if(http.get_connects() != 1 || http.get_requests() != 2)
+    {
+      log_e("Connection not kept, connects: %d, requests: %d", http.get_connects(), http.get_requests());
+      return false;
+    }
+
+    // the first connection ran out, as if the server closed it, so a new one is opened
+    if(!http.request("GET", "/c", "application/json", NULL, 0) || http.response() != 200 || !read_body(http, "{}"))
+    {
+      log_e("Reconnect failed");
+      return false;
+    }
+    http.end();
+
+    if(http.get_connects() != 2 || http.is_connected())
+    {
+      log_e("Connection: close not honored, connects: %d", http.get_connects());
+      return false;
+    }
+
+    return true;
+  }
+
+  bool test_http_chunked_request()
+  {
+    const char *responses[] = { "HTTP/1.1 200 OK\r\nContent-Length: 0\r\n\r\n", NULL };
+    TS_HttpTestClient client(responses);
+    TS_HttpClient http(client, "localhost", 80);
+
+    // one full chunk and the rest
+    if(!http.request_begin("POST", "/up", "text/csv"))
+    {
+      log_e("Unable to begin the request");
+      return false;
+    }
+
+    for(uint16_t i = 0; i < HTTP_CHUNK_MAX + 88; ++i)
+    {
+      http.print((char)('a' + i % 26));
+    }
+
+    if(!http.request_end() || http.response() != 200)
+    {
+      log_e("Chunked request failed");
+      return false;
+    }
+    http.end();
+
+    size_t body = client.sent.find("\r\n\r\n");
+    if(client.sent.find("Transfer-Encoding: chunked\r\n") == std::string::npos || body == std::string::npos)
+    {
+      log_e("Missing chunked header:\n%s", client.sent.c_str());
+      return false;
+    }
+
+    std::string chunks = client.sent.substr(body + 4);
+    size_t second = HTTP_CHUNK_PREFIX + HTTP_CHUNK_MAX + 2;
+    if(chunks.length() != second + HTTP_CHUNK_PREFIX + 88 + 2 + 5 || chunks.compare(0, HTTP_CHUNK_PREFIX, "0200\r\n") != 0 ||
+      chunks.compare(second, HTTP_CHUNK_PREFIX, "0058\r\n") != 0 || chunks.compare(chunks.length() - 5, 5, "0\r\n\r\n") != 0)
+    {
+      log_e("Unexpected chunks, %d bytes", chunks.length());
+      return false;
+    }
+
+    return true;
+  }
+
+  bool test_http_resend()
+  {
+    // the server closes the kept connection without answering the second request
+    const char *responses[] = {
+      "HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\n{}",
+      "HTTP/1.1 201 Created\r\nContent-Length: 0\r\n\r\n",
+      NULL,
+    };
+    TS_HttpTestClient client(responses, true);
+    TS_HttpClient http(client, "localhost", 80);
+
+    if(!http.request("POST", "/a", "application/json", (const uint8_t*)"{}", 2) || http.response() != 200 || !read_body(http, "{}"))
+    {
+      log_e("First response failed");
+      return false;
+    }
+    http.end();
+
+    if(!http.request("POST", "/b", "application/json", (const uint8_t*)"xy", 2) || http.response() != 201)
+    {
+      log_e("Request not resent on a new connection");
+      return false;
+    }
+    http.end();
+
+    size_t first = client.sent.find("POST /b");
+    size_t second = first == std::string::npos ? first : client.sent.find("POST /b", first + 1);
+    if(http.get_connects() != 2 || http.get_requests() != 3 || second == std::string::npos || client.sent.compare(client.sent.length() - 2, 2, "xy") != 0)
+    {
+      log_e("Unexpected resend, connects: %d, requests: %d", http.get_connects(), http.get_requests());
+      return false;
+    }
+
+    return true;
+  }
+
+  // Ctor
+  _TS_HttpTests()
+  {
+    add(std::bind(&_TS_HttpTests::test_http_keep_alive, this), "test_http_keep_alive");
+    add(std::bind(&_TS_HttpTests::test_http_chunked_request, this), "test_http_chunked_request");
+    add(std::bind(&_TS_HttpTests::test_http_resend, this), "test_http_resend");
+  }
+} TS_HttpTests;
+
+#endif
+
+#endif
@@ -0,0 +1,234 @@
+#include "inflate.h"
+#include <rom/crc.h>
+
+#define GZIP_FHCRC     0x02
+#define GZIP_FEXTRA    0x04
+#define GZIP_FNAME     0x08
+#define GZIP_FCOMMENT  0x10
+
+//
+// TS_InflateStream
+//
+
+TS_InflateStream::TS_InflateStream(Stream &source)
+: source(source), decompressor(NULL), window(NULL), windowPos(0), outPos(0), outEnd(0),
+  inputPos(0), inputLength(0), sourceEnded(false), done(false), failed(true), corrupt(false),
+  crc(0), deflated(0), inflated(0)
+{
+  memset(this->tail, 0, sizeof(this->tail));
+  this->setTimeout(0);
+}
+
+TS_InflateStream::~TS_InflateStream()
+{
+  free(this->decompressor);
+  free(this->window);
+}
+
+uint32_t TS_InflateStream::get_heap_needed()
+{
+  return sizeof(tinfl_decompressor) + INFLATE_WINDOW;
+}
+
+bool TS_InflateStream::begin()
+{
+  this->decompressor = (tinfl_decompressor*)malloc(sizeof(tinfl_decompressor));
+  this->window = (uint8_t*)malloc(INFLATE_WINDOW);
+  if(this->decompressor == NULL || this->window == NULL)
+  {
+    log_w("No heap to inflate");
+    return false;
+  }
+
+  // ID1 ID2 CM FLG MTIME(4) XFL OS
+  uint8_t header[10];
+  for(uint8_t i = 0; i < sizeof(header); ++i)
+  {
+    int c = this->input_get();
+    if(c < 0) return false;
+    header[i] = c;
+  }
+
+  if(header[0] != 0x1f || header[1] != 0x8b || header[2] != 8)
+  {
+    log_w("Not a gzip body");
+    return false;
+  }
+
+  uint8_t flags = header[3];
+  if(flags & GZIP_FEXTRA)
+  {
+    int low = this->input_get();
+    int high = this->input_get();
+    if(low < 0 || high < 0) return false;
+    for(uint16_t length = low | high << 8; length > 0; --length)
+    {
+      if(this->input_get() < 0) return false;
+    }
+  }
+
+  // zero terminated
+  if(flags & GZIP_FNAME)
+  {
+    for(int c = this->input_get(); c != 0; c = this->input_get())
+    {
+      if(c < 0) return false;
+    }
+  }
+  if(flags & GZIP_FCOMMENT)
+  {
+    for(int c = this->input_get(); c != 0; c = this->input_get())
+    {
+      if(c < 0) return false;
+    }
+  }
+  if(flags & GZIP_FHCRC)
+  {
+    if(this->input_get() < 0 || this->input_get() < 0) return false;
+  }
+
+  tinfl_init(this->decompressor);
+  this->failed = false;
+  return true;
+}
+
+// Next source byte, for the header
+int TS_InflateStream::input_get()
+{
+  if(this->inputPos >= this->inputLength && !this->input_refill()) return -1;
+  return this->input[this->inputPos++];
+}
+
+// Reads what the source has, blocking for a single byte only when it has nothing
+bool TS_InflateStream::input_refill()
+{
+  if(this->sourceEnded) return false;
+
+  int available = this->source.available();
+  size_t wanted = available > 0 ? (available < INFLATE_INPUT ? available : INFLATE_INPUT) : 1;
+
+  size_t length = this->source.readBytes((char*)this->input, wanted);
+  this->inputPos = 0;
+  this->inputLength = length;
+  if(length == 0)
+  {
+    this->sourceEnded = true;
+    return false;
+  }
+
+  this->deflated += length;
+
+  // keep the last 8 bytes, tinfl may read ahead into the trailer
+  if(length >= sizeof(this->tail))
+  {
+    memcpy(this->tail, this->input + length - sizeof(this->tail), sizeof(this->tail));
+  }
+  else
+  {
+    memmove(this->tail, this->tail + length, sizeof(this->tail) - length);
+    memcpy(this->tail + sizeof(this->tail) - length, this->input, length);
+  }
+
+  return true;
+}
+
+// Inflates into the window until there is output, the end, or an error
+bool TS_InflateStream::fill()
+{
+  while(this->outPos >= this->outEnd)
+  {
+    if(this->done || this->failed) return false;
+
+    if(this->inputPos >= this->inputLength) this->input_refill();
+
+    // output runs up to the end of the window, then wraps
+    size_t inSize = this->inputLength - this->inputPos;
+    size_t outSize = INFLATE_WINDOW - this->windowPos;
+    tinfl_status status = tinfl_decompress(this->decompressor, this->input + this->inputPos, &inSize,
+      this->window, this->window + this->windowPos, &outSize, this->sourceEnded ? 0 : TINFL_FLAG_HAS_MORE_INPUT);
+
+    this->inputPos += inSize;
+    if(outSize > 0)
+    {
+      this->outPos = this->windowPos;
+      this->outEnd = this->windowPos + outSize;
+      this->windowPos = (this->windowPos + outSize) & (INFLATE_WINDOW - 1);
+      this->crc = crc32_le(this->crc, this->window + this->outPos, outSize);
+      this->inflated += outSize;
+    }
+
+    if(status == TINFL_STATUS_DONE)
+    {
+      this->done = true;
+    }
+    else if(status < 0 || (this->sourceEnded && inSize == 0 && outSize == 0))
+    {
+      log_w("Inflate failed, status: %d, deflated: %u", status, this->deflated);
+      this->failed = true;
+    }
+  }
+
+  return true;
+}
+
+bool TS_InflateStream::finish()
+{
+  while(this->fill()) this->outPos = this->outEnd;
+  if(!this->done) return false;
+
+  // CRC32 and ISIZE, little endian
+  uint8_t trailer[8];
+  if((size_t)(this->inputLength - this->inputPos) >= sizeof(trailer))
+  {
+    memcpy(trailer, this->input + this->inputPos, sizeof(trailer));
+  }
+  else
+  {
+    // the rest of the source, the trailer is then its last 8 bytes
+    while(this->input_refill());
+    memcpy(trailer, this->tail, sizeof(trailer));
+  }
+
+  uint32_t crc = trailer[0] | trailer[1] << 8 | trailer[2] << 16 | (uint32_t)trailer[3] << 24;
+  uint32_t size = trailer[4] | trailer[5] << 8 | trailer[6] << 16 | (uint32_t)trailer[7] << 24;
+  if(crc != this->crc || size != this->inflated)
+  {
+    log_w("Gzip trailer mismatch, crc: %08x, expected: %08x, size: %u, inflated: %u", crc, this->crc, size, this->inflated);
+    this->corrupt = true;
+    return false;
+  }
+
+  return true;
+}
+
+bool TS_InflateStream::is_corrupt()
+{
+  return this->corrupt;
+}
+
+uint32_t TS_InflateStream::get_deflated()
+{
+  return this->deflated;
+}
+
+uint32_t TS_InflateStream::get_inflated()
+{
+  return this->inflated;
+}
+
+int TS_InflateStream::available()
+{
+  return this->outEnd - this->outPos;
+}
+
+int TS_InflateStream::read()
+{
+  if(!this->fill()) return -1;
+  return this->window[this->outPos++];
+}
+
+int TS_InflateStream::peek()
+{
+  if(!this->fill()) return -1;
+  return this->window[this->outPos];
+}
@@ -0,0 +1,188 @@
+//
+// Gzip decoding stream
+// - inflates a gzip body as it is read, with the ROM tinfl and a small circular window
+// - deflate may refer up to 32KB back, the window only covers INFLATE_WINDOW of it: bodies up to that size
+//   always decode, longer ones only while the server's matches stay within it
+// - finish() checks the gzip trailer, a CRC mismatch is reported as corrupt so gzip can be turned off
+// - buffers are allocated in begin() and freed with the stream
+//
+
+#ifndef __TS_INFLATE__
+#define __TS_INFLATE__
+
+#include <stdint.h>
+#include <Arduino.h>
+#include <rom/miniz.h>
+#include "tests.h"
+
+#define INFLATE_WINDOW  8192   // power of 2
+#define INFLATE_INPUT   256
+
+class TS_InflateStream : public Stream
+{
+  public:
+    TS_InflateStream(Stream &source);
+    ~TS_InflateStream();
+
+    // Allocates and reads the gzip header, false if either fails
+    bool begin();
+
+    // Inflates what is left and checks the trailer, true if the body was whole
+    bool finish();
+    bool is_corrupt();
+
+    // Bytes read from the source and inflated so far
+    uint32_t get_deflated();
+    uint32_t get_inflated();
+
+    // Heap begin() takes
+    static uint32_t get_heap_needed();
+
+    int available() override;
+    int read() override;
+    int peek() override;
+
+    // Read only
+    size_t write(uint8_t c) override { return 0; }
+
+  private:
+    bool fill();
+    int  input_get();
+    bool input_refill();
+
+    Stream &source;
+    tinfl_decompressor *decompressor;
+    uint8_t  *window;
+    uint16_t windowPos;   // where tinfl writes next
+    uint16_t outPos;      // inflated bytes not read yet, outPos to outEnd of the window
+    uint16_t outEnd;
+
+    uint8_t  input[INFLATE_INPUT];
+    uint16_t inputPos;
+    uint16_t inputLength;
+    bool     sourceEnded;
+    uint8_t  tail[8];     // last bytes read from the source, the trailer once it ended
+
+    bool     done;
+    bool     failed;
+    bool     corrupt;
+    uint32_t crc;
+    uint32_t deflated;
+    uint32_t inflated;
+};
+
+
+
+//
+// Tests
+//
+
+#if defined(TESTDRIVER) && defined(TESTDRIVER_INFLATE)
+
+// Stream over constant bytes
+class TS_InflateTestStream : public Stream
+{
+  public:
+    TS_InflateTestStream(const uint8_t *data, size_t length) : data(data), length(length), pos(0) {}
+
+    int available() override { return this->length - this->pos; }
+    int read() override { return this->pos < this->length ? this->data[this->pos++] : -1; }
+    int peek() override { return this->pos < this->length ? this->data[this->pos] : -1; }
+    size_t write(uint8_t c) override { return 0; }
+
+  private:
+    const uint8_t *data;
+    size_t length;
+    size_t pos;
+};
+
+static class _TS_InflateTests : public _TS_Tests
+{
+public:
+  void init() override {}
+
+  // {"tempIDs":["abcabcabcabcabcabcabcabcabcabc","abcabcabcabcabcabcabcabcabcabc"]}, gzip -n
+  const uint8_t* gzipped(size_t &length)
+  {
+    static const uint8_t data[] = {
+      0x1f, 0x8b, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x03, 0xab, 0x56, 0x2a, 0x49, 0xcd, 0x2d,
+      0xf0, 0x74, 0x29, 0x56, 0xb2, 0x8a, 0x56, 0x4a, 0x4c, 0x4a, 0xc6, 0x83, 0x94, 0x74, 0x08, 0x29,
+      0x88, 0xad, 0x05, 0x00, 0xdc, 0x74, 0xef, 0xee, 0x4f, 0x00, 0x00, 0x00,
+    };
+    length = sizeof(data);
+    return data;
+  }
+
+  bool test_inflate()
+  {
+    size_t length;
+    const uint8_t *data = gzipped(length);
+    TS_InflateTestStream source(data, length);
+    TS_InflateStream inflate(source);
+
+    if(!inflate.begin())
+    {
+      log_e("Unable to begin");
+      return false;
+    }
+
+    std::string body;
+    for(int c = inflate.read(); c >= 0; c = inflate.read()) body += (char)c;
+
+    if(body != "{\"tempIDs\":[\"abcabcabcabcabcabcabcabcabcabc\",\"abcabcabcabcabcabcabcabcabcabc\"]}")
+    {
+      log_e("Unexpected body: %s", body.c_str());
+      return false;
+    }
+
+    if(!inflate.finish() || inflate.get_inflated() != body.length() || inflate.get_deflated() != length)
+    {
+      log_e("Trailer not accepted, inflated: %d, deflated: %d", inflate.get_inflated(), inflate.get_deflated());
+      return false;
+    }
+
+    return true;
+  }
+
+  bool test_inflate_corrupt()
+  {
+    size_t length;
+    const uint8_t *data = gzipped(length);
+
+    // one bit of the CRC flipped
+    uint8_t copy[64];
+    memcpy(copy, data, length);
+    copy[length - 8] ^= 1;
+
+    TS_InflateTestStream source(copy, length);
+    TS_InflateStream inflate(source);
+
+    if(!inflate.begin() || inflate.finish() || !inflate.is_corrupt())
+    {
+      log_e("CRC mismatch not caught");
+      return false;
+    }
+
+    // not gzip
+    TS_InflateTestStream plain((const uint8_t*)"{}", 2);
+    TS_InflateStream notGzip(plain);
+    if(notGzip.begin())
+    {
+      log_e("Plain body taken as gzip");
+      return false;
+    }
+
+    return true;
+  }
+
+  // Ctor
+  _TS_InflateTests()
+  {
+    add(std::bind(&_TS_InflateTests::test_inflate, this), "test_inflate");
+    add(std::bind(&_TS_InflateTests::test_inflate_corrupt, this), "test_inflate_corrupt");
+  }
+} TS_InflateTests;
+
+#endif
+
+#endif
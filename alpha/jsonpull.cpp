@@ -0,0 +1,200 @@
+#include "jsonpull.h"
+#include <ctype.h>
+
+//
+// TS_JsonPull
+//
+
+TS_JsonPull::TS_JsonPull(Stream &stream, char *value, uint16_t valueMax)
+: stream(stream), value(value), valueMax(valueMax), valueLength(0), truncated(false),
+  chunkLength(0), chunkPos(0), depth(0), objects(0), expectKey(false)
+{
+  this->value[0] = '\0';
+}
+
+// Refills from what the stream already has, blocking for a single byte only when it has nothing
+int TS_JsonPull::peek()
+{
+  if(this->chunkPos >= this->chunkLength)
+  {
+    int available = this->stream.available();
+    size_t wanted = available > 0 ? (available < JSONPULL_CHUNK ? available : JSONPULL_CHUNK) : 1;
+
+    this->chunkLength = this->stream.readBytes(this->chunk, wanted);
+    this->chunkPos = 0;
+    if(this->chunkLength == 0) return -1;
+  }
+
+  return (uint8_t)this->chunk[this->chunkPos];
+}
+
+int TS_JsonPull::get()
+{
+  int c = this->peek();
+  if(c >= 0) ++this->chunkPos;
+  return c;
+}
+
+void TS_JsonPull::put(char c)
+{
+  if(this->valueLength + 1 >= this->valueMax)
+  {
+    this->truncated = true;
+    return;
+  }
+
+  this->value[this->valueLength++] = c;
+  this->value[this->valueLength] = '\0';
+}
+
+bool TS_JsonPull::push(bool isObject)
+{
+  if(this->depth >= JSONPULL_DEPTH_MAX) return false;
+
+  if(isObject)
+  {
+    this->objects |= 1 << this->depth;
+  }
+  else
+  {
+    this->objects &= ~(1 << this->depth);
+  }
+
+  ++this->depth;
+  this->expectKey = isObject;
+  return true;
+}
+
+TS_JsonToken TS_JsonPull::next()
+{
+  this->valueLength = 0;
+  this->value[0] = '\0';
+  this->truncated = false;
+
+  while(true)
+  {
+    int c = this->get();
+    if(c < 0) return JSON_END;
+
+    switch(c)
+    {
+      case ' ':
+      case '\t':
+      case '\r':
+      case '\n':
+      case ':':
+        break;
+
+      case ',':
+        this->expectKey = this->depth > 0 && (this->objects & (1 << (this->depth - 1)));
+        break;
+
+      case '{':
+        return this->push(true) ? JSON_OBJECT_START : JSON_ERROR;
+
+      case '[':
+        return this->push(false) ? JSON_ARRAY_START : JSON_ERROR;
+
+      case '}':
+      case ']':
+        if(this->depth == 0) return JSON_ERROR;
+        --this->depth;
+        this->expectKey = false;
+        return c == '}' ? JSON_OBJECT_END : JSON_ARRAY_END;
+
+      case '"':
+      {
+        bool isKey = this->expectKey;
+        this->expectKey = false;
+
+        while((c = this->get()) != '"')
+        {
+          if(c < 0) return JSON_END;
+          if(c == '\\')
+          {
+            c = this->get();
+            switch(c)
+            {
+              case 'b': c = '\b'; break;
+              case 'f': c = '\f'; break;
+              case 'n': c = '\n'; break;
+              case 'r': c = '\r'; break;
+              case 't': c = '\t'; break;
+              case 'u':
+              {
+                uint16_t code = 0;
+                for(uint8_t i = 0; i < 4; ++i)
+                {
+                  int h = this->get();
+                  if(!isxdigit(h)) return h < 0 ? JSON_END : JSON_ERROR;
+                  code = (code << 4) | (isdigit(h) ? h - '0' : (tolower(h) - 'a' + 10));
+                }
+                c = code < 0x80 ? code : '?';
+                break;
+              }
+              default:
+                if(c < 0) return JSON_END;
+                break;  // quote, backslash and slash stand for themselves
+            }
+          }
+
+          this->put(c);
+        }
+
+        return isKey ? JSON_KEY : JSON_STRING;
+      }
+
+      default:
+        if(c == '-' || isdigit(c))
+        {
+          this->put(c);
+          for(c = this->peek(); c >= 0 && (isdigit(c) || c == '.' || c == 'e' || c == 'E' || c == '+' || c == '-'); c = this->peek())
+          {
+            this->put(this->get());
+          }
+          return JSON_NUMBER;
+        }
+
+        if(isalpha(c))
+        {
+          this->put(c);
+          for(c = this->peek(); c >= 0 && isalpha(c); c = this->peek())
+          {
+            this->put(this->get());
+          }
+          return JSON_LITERAL;
+        }
+
+        return JSON_ERROR;
+    }
+  }
+}
+
+const char* TS_JsonPull::get_value()
+{
+  return this->value;
+}
+
+bool TS_JsonPull::is_truncated()
+{
+  return this->truncated;
+}
+
+uint8_t TS_JsonPull::get_depth()
+{
+  return this->depth;
+}
+
+bool TS_JsonPull::skip_value()
+{
+  uint8_t outer = this->depth;
+
+  TS_JsonToken token = this->next();
+  while(token != JSON_END && token != JSON_ERROR)
+  {
+    if(this->depth == outer) return true;
+    token = this->next();
+  }
+
+  return false;
+}
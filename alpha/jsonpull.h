@@ -0,0 +1,178 @@
+//
+// Pull style JSON tokenizer
+// - reads a Stream in small chunks and returns one token at a time, nothing is kept but the current value
+// - for large responses that only need a few fields, without a document in memory
+// - values longer than the value buffer are truncated, the rest of the value is skipped
+// - lenient: separators are not validated, \u escapes outside ascii decode as '?'
+//
+
+#ifndef __TS_JSONPULL__
+#define __TS_JSONPULL__
+
+#include <stdint.h>
+#include <Arduino.h>
+#include "tests.h"
+
+#define JSONPULL_CHUNK      64
+#define JSONPULL_DEPTH_MAX  16
+
+enum TS_JsonToken
+{
+  JSON_END,           // stream ended or timed out
+  JSON_ERROR,         // unexpected character, or nested too deep
+  JSON_OBJECT_START,
+  JSON_OBJECT_END,
+  JSON_ARRAY_START,
+  JSON_ARRAY_END,
+  JSON_KEY,           // object key, as value
+  JSON_STRING,        // as value
+  JSON_NUMBER,        // as value, unparsed
+  JSON_LITERAL,       // true, false or null, as value
+};
+
+class TS_JsonPull
+{
+  public:
+    // value: buffer for the current value, of valueMax bytes including the terminator
+    TS_JsonPull(Stream &stream, char *value, uint16_t valueMax);
+
+    TS_JsonToken next();
+
+    const char* get_value();
+    bool is_truncated();
+
+    // Containers open around the last token, 1 inside the top-level one
+    uint8_t get_depth();
+
+    // Skips the value following a key, including nested containers
+    bool skip_value();
+
+  private:
+    int  get();
+    int  peek();
+    void put(char c);
+    bool push(bool isObject);
+
+    Stream   &stream;
+    char     *value;
+    uint16_t valueMax;
+    uint16_t valueLength;
+    bool     truncated;
+
+    char     chunk[JSONPULL_CHUNK];
+    uint8_t  chunkLength;
+    uint8_t  chunkPos;
+
+    uint8_t  depth;
+    uint16_t objects;     // bit per depth, set for objects, so depth is capped at 16
+    bool     expectKey;
+};
+
+
+
+//
+// Tests
+//
+
+#if defined(TESTDRIVER) && defined(TESTDRIVER_JSONPULL)
+
+// Stream over a constant string
+class TS_JsonTestStream : public Stream
+{
+  public:
+    TS_JsonTestStream(const char *data) : data(data), pos(0) {}
+
+    int available() override { return strlen(this->data + this->pos); }
+    int read() override { return this->data[this->pos] ? this->data[this->pos++] : -1; }
+    int peek() override { return this->data[this->pos] ? this->data[this->pos] : -1; }
+    size_t write(uint8_t) override { return 0; }
+
+  private:
+    const char *data;
+    size_t pos;
+};
+
+static class _TS_JsonPullTests : public _TS_Tests
+{
+public:
+  void init() override {}
+
+  bool test_jsonpull_tokens()
+  {
+    TS_JsonTestStream stream("{\"result\": {\"status\":\"SUCCESS\", \"n\": -12.5e3, \"ok\":true,\n"
+      "\"tempIDs\":[{\"tempID\":\"ab\\\"c\\/d\\u0041\",\"startTime\":1590000000}, []]}}");
+    char value[16];
+    TS_JsonPull json(stream, value, sizeof(value));
+
+    const TS_JsonToken expected[] = {
+      JSON_OBJECT_START, JSON_KEY, JSON_OBJECT_START,
+      JSON_KEY, JSON_STRING, JSON_KEY, JSON_NUMBER, JSON_KEY, JSON_LITERAL,
+      JSON_KEY, JSON_ARRAY_START, JSON_OBJECT_START, JSON_KEY, JSON_STRING, JSON_KEY, JSON_NUMBER, JSON_OBJECT_END,
+      JSON_ARRAY_START, JSON_ARRAY_END, JSON_ARRAY_END,
+      JSON_OBJECT_END, JSON_OBJECT_END, JSON_END,
+    };
+    const char *values[] = {
+      "", "result", "",
+      "status", "SUCCESS", "n", "-12.5e3", "ok", "true",
+      "tempIDs", "", "", "tempID", "ab\"c/dA", "startTime", "1590000000", "",
+      "", "", "",
+      "", "", "",
+    };
+
+    for(uint8_t i = 0; i < sizeof(expected) / sizeof(expected[0]); ++i)
+    {
+      TS_JsonToken token = json.next();
+      if(token != expected[i] || strcmp(json.get_value(), values[i]) != 0)
+      {
+        log_e("Token %d: expected %d '%s', got %d '%s'", i, expected[i], values[i], token, json.get_value());
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+  bool test_jsonpull_truncate_and_skip()
+  {
+    TS_JsonTestStream stream("{\"skip\":{\"a\":[1,{\"b\":\"}\"}]},\"long\":\"0123456789abcdefXYZ\",\"bad\":@}");
+    char value[8];
+    TS_JsonPull json(stream, value, sizeof(value));
+
+    if(json.next() != JSON_OBJECT_START || json.next() != JSON_KEY || !json.skip_value())
+    {
+      log_e("Unable to skip nested value");
+      return false;
+    }
+
+    if(json.next() != JSON_KEY || strcmp(json.get_value(), "long") != 0 || json.get_depth() != 1)
+    {
+      log_e("Skip did not stop after the value, at '%s'", json.get_value());
+      return false;
+    }
+
+    if(json.next() != JSON_STRING || strcmp(json.get_value(), "0123456") != 0 || !json.is_truncated())
+    {
+      log_e("Long value should be truncated, '%s'", json.get_value());
+      return false;
+    }
+
+    if(json.next() != JSON_KEY || json.next() != JSON_ERROR)
+    {
+      log_e("Bad character should be an error");
+      return false;
+    }
+
+    return true;
+  }
+
+  // Ctor
+  _TS_JsonPullTests()
+  {
+    add(std::bind(&_TS_JsonPullTests::test_jsonpull_tokens, this), "test_jsonpull_tokens");
+    add(std::bind(&_TS_JsonPullTests::test_jsonpull_truncate_and_skip, this), "test_jsonpull_truncate_and_skip");
+  }
+} TS_JsonPullTests;
+
+#endif
+
+#endif
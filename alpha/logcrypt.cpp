@@ -0,0 +1,298 @@
+#include "logcrypt.h"
+
+#define AES_BLOCK 16
+
+//
+// TS_LogCrypt
+//
+
+_TS_LogCrypt::_TS_LogCrypt()
+: ready(false), headersUsed(0)
+{
+  esp_aes_init(&this->aes);
+}
+
+void _TS_LogCrypt::begin(const uint8_t *key)
+{
+  esp_aes_setkey(&this->aes, key, LOGCRYPT_KEY_SIZE * 8);
+  this->ready = true;
+}
+
+bool _TS_LogCrypt::is_ready()
+{
+  return this->ready;
+}
+
+void _TS_LogCrypt::nonce_new(uint8_t *nonce)
+{
+  for(uint8_t i = 0; i < LOGCRYPT_NONCE_SIZE; i += 4)
+  {
+    uint32_t r = esp_random();
+    memcpy(nonce + i, &r, 4);
+  }
+}
+
+void _TS_LogCrypt::apply(const uint8_t *nonce, uint32_t offset, uint8_t *data, size_t length)
+{
+  // nonce, then the index of the block at offset, big endian
+  uint8_t counter[AES_BLOCK];
+  uint32_t block = offset / AES_BLOCK;
+  memcpy(counter, nonce, LOGCRYPT_NONCE_SIZE);
+  counter[12] = block >> 24;
+  counter[13] = block >> 16;
+  counter[14] = block >> 8;
+  counter[15] = block;
+
+  // into a block, its keystream is made here and the counter moved past it
+  uint8_t stream[AES_BLOCK];
+  size_t streamPos = offset % AES_BLOCK;
+  if(streamPos > 0)
+  {
+    esp_aes_crypt_ecb(&this->aes, ESP_AES_ENCRYPT, counter, stream);
+    for(int8_t i = AES_BLOCK - 1; i >= 0 && ++counter[i] == 0; --i);
+  }
+
+  esp_aes_crypt_ctr(&this->aes, length, &streamPos, counter, stream, data, data);
+}
+
+bool _TS_LogCrypt::header_get(const char *path, uint32_t size, bool &encrypted, uint8_t *nonce)
+{
+  for(uint8_t i = 0; i < LOGCRYPT_HEADERS; ++i)
+  {
+    TS_LogHeader &header = this->headers[i];
+    if(header.size == 0 || header.size != size || header.path != path) continue;
+
+    header.used = ++this->headersUsed;
+    encrypted = header.encrypted;
+    memcpy(nonce, header.nonce, LOGCRYPT_NONCE_SIZE);
+    return true;
+  }
+
+  return false;
+}
+
+void _TS_LogCrypt::header_put(const char *path, uint32_t size, bool encrypted, const uint8_t *nonce)
+{
+  // the file's own entry, else the least recently used
+  TS_LogHeader *header = &this->headers[0];
+  for(uint8_t i = 0; i < LOGCRYPT_HEADERS; ++i)
+  {
+    if(this->headers[i].path == path)
+    {
+      header = &this->headers[i];
+      break;
+    }
+    if(this->headers[i].used < header->used) header = &this->headers[i];
+  }
+
+  header->path = path;
+  header->size = size;
+  header->used = ++this->headersUsed;
+  header->encrypted = encrypted;
+  if(encrypted) memcpy(header->nonce, nonce, LOGCRYPT_NONCE_SIZE);
+}
+
+_TS_LogCrypt TS_LogCrypt;
+
+
+
+//
+// TS_LogFile
+//
+
+TS_LogFile::TS_LogFile()
+: appending(false), encrypted(false), offset(0), bufferPos(0), bufferLength(0)
+{
+  // the file is all there, a short read is its end
+  this->setTimeout(0);
+}
+
+bool TS_LogFile::begin_read(File file)
+{
+  this->file = file;
+  this->appending = false;
+  this->encrypted = false;
+  this->offset = 0;
+  this->bufferPos = 0;
+  this->bufferLength = 0;
+  if(!this->file) return false;
+
+  return this->read_header(sizeof(this->buffer));
+}
+
+bool TS_LogFile::begin_append(File file, bool encrypt)
+{
+  this->file = file;
+  this->appending = false;
+  this->encrypted = false;
+  this->offset = 0;
+  this->bufferPos = 0;
+  this->bufferLength = 0;
+  if(!this->file) return false;
+
+  uint32_t size = this->file.size();
+  if(size == 0)
+  {
+    if(encrypt && TS_LogCrypt.is_ready())
+    {
+      // new file
+      uint8_t header[LOGCRYPT_HEADER_SIZE];
+      memcpy(header, LOGCRYPT_MAGIC, LOGCRYPT_MAGIC_SIZE);
+      TS_LogCrypt.nonce_new(this->nonce);
+      memcpy(header + LOGCRYPT_MAGIC_SIZE, this->nonce, LOGCRYPT_NONCE_SIZE);
+      if(this->file.write(header, sizeof(header)) != sizeof(header))
+      {
+        log_e("Unable to write log header");
+        this->close();
+        return false;
+      }
+
+      this->encrypted = true;
+    }
+
+    this->appending = true;
+    return true;
+  }
+
+  // appends continue the file as it is, "a+" opens at its end
+  // - the header as the last append left it, else read from the start
+  if(!TS_LogCrypt.header_get(this->file.name(), size, this->encrypted, this->nonce))
+  {
+    this->file.seek(0);
+    if(!this->read_header(LOGCRYPT_HEADER_SIZE)) return false;
+    this->file.seek(size);
+  }
+
+  this->offset = size - (this->encrypted ? LOGCRYPT_HEADER_SIZE : 0);
+  this->bufferPos = 0;
+  this->bufferLength = 0;
+  this->appending = true;
+  return true;
+}
+
+// Reads up to wanted bytes and takes the header if there is one, else what was read is plaintext
+// - the rest of what was read is the first buffer, decrypted
+bool TS_LogFile::read_header(size_t wanted)
+{
+  size_t length = this->file.read(this->buffer, wanted);
+  this->bufferPos = 0;
+  this->bufferLength = length;
+  this->offset = length;
+  if(length < LOGCRYPT_HEADER_SIZE || memcmp(this->buffer, LOGCRYPT_MAGIC, LOGCRYPT_MAGIC_SIZE) != 0) return true;
+
+  if(!TS_LogCrypt.is_ready())
+  {
+    log_e("Log %s is encrypted, no log key", this->file.name());
+    this->close();
+    return false;
+  }
+
+  memcpy(this->nonce, this->buffer + LOGCRYPT_MAGIC_SIZE, LOGCRYPT_NONCE_SIZE);
+  this->encrypted = true;
+  this->bufferPos = LOGCRYPT_HEADER_SIZE;
+  this->offset = length - LOGCRYPT_HEADER_SIZE;
+  TS_LogCrypt.apply(this->nonce, 0, this->buffer + LOGCRYPT_HEADER_SIZE, this->offset);
+  return true;
+}
+
+void TS_LogFile::close()
+{
+  if(this->file)
+  {
+    if(this->appending)
+    {
+      TS_LogCrypt.header_put(this->file.name(), this->offset + (this->encrypted ? LOGCRYPT_HEADER_SIZE : 0), this->encrypted, this->nonce);
+    }
+    this->file.close();
+  }
+  this->appending = false;
+  this->bufferPos = 0;
+  this->bufferLength = 0;
+}
+
+bool TS_LogFile::is_encrypted()
+{
+  return this->encrypted;
+}
+
+// Next buffer of the file, decrypted in one pass
+bool TS_LogFile::fill()
+{
+  if(!this->file) return false;
+
+  size_t length = this->file.read(this->buffer, sizeof(this->buffer));
+  if(length == 0) return false;
+
+  if(this->encrypted) TS_LogCrypt.apply(this->nonce, this->offset, this->buffer, length);
+  this->offset += length;
+  this->bufferPos = 0;
+  this->bufferLength = length;
+  return true;
+}
+
+int TS_LogFile::available()
+{
+  int buffered = this->bufferLength - this->bufferPos;
+  return this->file ? buffered + this->file.available() : buffered;
+}
+
+int TS_LogFile::read()
+{
+  if(this->bufferPos >= this->bufferLength && !this->fill()) return -1;
+  return this->buffer[this->bufferPos++];
+}
+
+int TS_LogFile::peek()
+{
+  if(this->bufferPos >= this->bufferLength && !this->fill()) return -1;
+  return this->buffer[this->bufferPos];
+}
+
+size_t TS_LogFile::read(uint8_t *buffer, size_t size)
+{
+  size_t count = 0;
+  while(count < size)
+  {
+    if(this->bufferPos >= this->bufferLength && !this->fill()) break;
+
+    size_t length = this->bufferLength - this->bufferPos;
+    if(length > size - count) length = size - count;
+    memcpy(buffer + count, this->buffer + this->bufferPos, length);
+    this->bufferPos += length;
+    count += length;
+  }
+
+  return count;
+}
+
+size_t TS_LogFile::write(uint8_t c)
+{
+  return this->write(&c, 1);
+}
+
+size_t TS_LogFile::write(const uint8_t *buffer, size_t size)
+{
+  if(!this->file) return 0;
+  if(!this->encrypted)
+  {
+    size_t written = this->file.write(buffer, size);
+    this->offset += written;
+    return written;
+  }
+
+  // through the buffer, the caller's data stays as it is
+  size_t count = 0;
+  while(count < size)
+  {
+    size_t length = size - count < sizeof(this->buffer) ? size - count : sizeof(this->buffer);
+    memcpy(this->buffer, buffer + count, length);
+    TS_LogCrypt.apply(this->nonce, this->offset, this->buffer, length);
+
+    size_t written = this->file.write(this->buffer, length);
+    this->offset += written;
+    count += written;
+    if(written < length) break;
+  }
+
+  return count;
+}
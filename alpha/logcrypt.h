@@ -0,0 +1,252 @@
+//
+// At-rest encryption of the contact logs in /p
+// - AES-256 in CTR mode on the AES peripheral, the keystream of a byte depends only on its file and offset,
+//   so appends encrypt just what they add and reads decrypt just what they read
+// - each file starts with a header holding a random nonce, the counter block is the nonce and the block index
+// - the log key is set by storage, derived from the device key it keeps in NVS
+// - the headers of the files appended to last are kept, an append to a file as it was left reads nothing
+// - files without a header are plaintext, written before encryption or with it off, and stay so
+//
+
+#ifndef __TS_LOGCRYPT__
+#define __TS_LOGCRYPT__
+
+#include <stdint.h>
+#include <Arduino.h>
+#include <FS.h>
+#include <hwcrypto/aes.h>
+#include <string>
+#include "tests.h"
+
+// 0 writes new contact logs in plaintext, encrypted ones are still read
+// - off until the logbench command shows appends and scans within 10% of plaintext on the device,
+//   the bench runs encrypted either way
+#ifndef LOGCRYPT_ENABLED
+#define LOGCRYPT_ENABLED    0
+#endif
+
+#define LOGCRYPT_KEY_SIZE   32    // AES-256
+#define LOGCRYPT_NONCE_SIZE 12    // of the 16 byte counter block, the rest is the block index
+#define LOGCRYPT_MAGIC      "\xe5TS\x01"
+#define LOGCRYPT_MAGIC_SIZE 4
+#define LOGCRYPT_HEADER_SIZE (LOGCRYPT_MAGIC_SIZE + LOGCRYPT_NONCE_SIZE)
+#define LOGCRYPT_HEADERS    4     // of the files appended to last
+#define LOGFILE_BUFFER      128   // reads and writes go through the AES in blocks of up to this
+
+// Header of a file as its last append left it
+struct TS_LogHeader
+{
+  std::string path;
+  uint32_t    size;       // 0 for an unused entry
+  uint32_t    used;
+  bool        encrypted;
+  uint8_t     nonce[LOGCRYPT_NONCE_SIZE];
+};
+
+class _TS_LogCrypt
+{
+  public:
+    _TS_LogCrypt();
+
+    // Sets the log key, files are encrypted from then on
+    void begin(const uint8_t *key);
+    bool is_ready();
+
+    // Random nonce of a new file
+    void nonce_new(uint8_t *nonce);
+
+    // XORs the keystream at offset of the file with nonce into data, encrypting or decrypting it in place
+    void apply(const uint8_t *nonce, uint32_t offset, uint8_t *data, size_t length);
+
+    // Header of a file appended to before, if it is still of size
+    // - not locked, log files are opened under the storage lock
+    bool header_get(const char *path, uint32_t size, bool &encrypted, uint8_t *nonce);
+    void header_put(const char *path, uint32_t size, bool encrypted, const uint8_t *nonce);
+
+  private:
+    esp_aes_context aes;
+    bool ready;
+
+    TS_LogHeader headers[LOGCRYPT_HEADERS];
+    uint32_t     headersUsed;
+};
+
+extern _TS_LogCrypt TS_LogCrypt;
+
+// Contact log file, encrypted when it has a header
+// - takes a file opened by storage, offsets are past the header
+// - reads are buffered and decrypted a buffer at a time, readStringUntil() no longer reads the file byte by byte
+// - the header comes with the first buffer, a short file is a single read
+// - each write() is encrypted in one pass, print a record at a time
+class TS_LogFile : public Stream
+{
+  public:
+    TS_LogFile();
+
+    // File opened for reading
+    // - false if it is not open, or encrypted without the log key
+    bool begin_read(File file);
+
+    // File opened with "a+", writes go to its end
+    // - a new file gets a header if encrypt and the log key is set
+    // - false if it is not open, or encrypted without the log key
+    bool begin_append(File file, bool encrypt = true);
+
+    void close();
+    bool is_encrypted();
+    operator bool() { return this->file; }
+
+    int available() override;
+    int read() override;
+    int peek() override;
+    size_t read(uint8_t *buffer, size_t size);
+
+    size_t write(uint8_t c) override;
+    size_t write(const uint8_t *buffer, size_t size) override;
+
+  private:
+    bool read_header(size_t wanted);
+    bool fill();
+
+    File     file;
+    bool     appending;
+    bool     encrypted;
+    uint8_t  nonce[LOGCRYPT_NONCE_SIZE];
+    uint32_t offset;        // past the header, of the file position
+
+    uint8_t  buffer[LOGFILE_BUFFER];
+    uint8_t  bufferPos;
+    uint8_t  bufferLength;
+};
+
+
+
+//
+// Tests
+//
+
+#if defined(TESTDRIVER) && defined(TESTDRIVER_LOGCRYPT)
+
+#include "FFat.h"
+
+static class _TS_LogCryptTests : public _TS_Tests
+{
+public:
+  void init() override {}
+
+  // AES-256-CTR of 48 zero bytes, key 00..1f, counter block 000102..0b 00000000, as openssl enc -aes-256-ctr
+  bool test_logcrypt_keystream()
+  {
+    static const uint8_t expected[48] = {
+      0xbd, 0xdc, 0x4c, 0xca, 0xb1, 0x50, 0x66, 0xcc, 0xc1, 0xfe, 0x6b, 0x0c, 0xba, 0x13, 0x3e, 0xb6,
+      0xf4, 0xc2, 0xdb, 0x1d, 0xc3, 0x88, 0x05, 0xa3, 0x7b, 0x92, 0x17, 0x1c, 0x5d, 0x0a, 0x81, 0xcc,
+      0x47, 0x02, 0xd6, 0x1b, 0xc5, 0xe5, 0xc2, 0x1b, 0x8d, 0x41, 0x97, 0x8b, 0xb1, 0xe9, 0x78, 0x6d,
+    };
+
+    uint8_t key[LOGCRYPT_KEY_SIZE];
+    uint8_t nonce[LOGCRYPT_NONCE_SIZE];
+    for(uint8_t i = 0; i < sizeof(key); ++i) key[i] = i;
+    for(uint8_t i = 0; i < sizeof(nonce); ++i) nonce[i] = i;
+
+    _TS_LogCrypt crypt;
+    crypt.begin(key);
+
+    // in one pass, then in uneven pieces as appends would
+    uint8_t data[48] = {0};
+    crypt.apply(nonce, 0, data, sizeof(data));
+    if(memcmp(data, expected, sizeof(data)) != 0)
+    {
+      log_e("Unexpected keystream");
+      return false;
+    }
+
+    uint8_t pieces[48] = {0};
+    crypt.apply(nonce, 0, pieces, 7);
+    crypt.apply(nonce, 7, pieces + 7, 20);
+    crypt.apply(nonce, 27, pieces + 27, 21);
+    if(memcmp(pieces, expected, sizeof(pieces)) != 0)
+    {
+      log_e("Keystream differs at unaligned offsets");
+      return false;
+    }
+
+    return true;
+  }
+
+  bool test_logcrypt_file()
+  {
+    if(!TS_LogCrypt.is_ready())
+    {
+      log_e("No log key");
+      return false;
+    }
+
+    const char *path = "/logcrypt.tmp";
+    const char *lines[] = { "abcdefghijklmnopqrstuvwxyz0123456789,1,org,device\n", "second,2,org,device\n" };
+    bool success = false;
+
+    do
+    {
+      FFat.remove(path);
+
+      // two appends, the second to the existing file
+      bool appended = true;
+      for(uint8_t i = 0; i < 2 && appended; ++i)
+      {
+        TS_LogFile file;
+        appended = file.begin_append(FFat.open(path, "a+")) && file.is_encrypted();
+        if(!appended)
+        {
+          log_e("Unable to append, %d", i);
+          break;
+        }
+        file.print(lines[i]);
+        file.close();
+      }
+      if(!appended) break;
+
+      // nothing of it in plaintext on flash
+      File raw = FFat.open(path);
+      std::string stored;
+      for(int c = raw.read(); c >= 0; c = raw.read()) stored += (char)c;
+      raw.close();
+      if(stored.length() != LOGCRYPT_HEADER_SIZE + strlen(lines[0]) + strlen(lines[1]) ||
+        stored.find("org,device") != std::string::npos)
+      {
+        log_e("Unexpected file of %d bytes", stored.length());
+        break;
+      }
+
+      TS_LogFile file;
+      if(!file.begin_read(FFat.open(path)))
+      {
+        log_e("Unable to read");
+        break;
+      }
+
+      std::string first = file.readStringUntil('\n').c_str();
+      std::string second = file.readStringUntil('\n').c_str();
+      if(first != "abcdefghijklmnopqrstuvwxyz0123456789,1,org,device" || second != "second,2,org,device" || file.available() != 0)
+      {
+        log_e("Unexpected lines: %s, %s", first.c_str(), second.c_str());
+        break;
+      }
+
+      success = true;
+    } while(false);
+
+    FFat.remove(path);
+    return success;
+  }
+
+  // Ctor
+  _TS_LogCryptTests()
+  {
+    add(std::bind(&_TS_LogCryptTests::test_logcrypt_keystream, this), "test_logcrypt_keystream");
+    add(std::bind(&_TS_LogCryptTests::test_logcrypt_file, this), "test_logcrypt_file");
+  }
+} TS_LogCryptTests;
+
+#endif
+
+#endif
@@ -0,0 +1,99 @@
+#include "metrics.h"
+#include <string.h>
+
+//
+// TS_LatencyHistogram
+//
+
+TS_LatencyHistogram::TS_LatencyHistogram()
+{
+  this->reset();
+}
+
+void TS_LatencyHistogram::reset()
+{
+  this->ok = 0;
+  this->failed = 0;
+  this->maxUs = 0;
+  this->totalUs = 0;
+  memset(this->buckets, 0, sizeof(this->buckets));
+}
+
+void TS_LatencyHistogram::record(uint32_t us, bool success)
+{
+  // index of the highest set bit, below the first bucket for anything under 2^TS_LATENCY_SHIFT
+  uint8_t bucket = 0;
+  if(us >> TS_LATENCY_SHIFT)
+  {
+    bucket = 31 - __builtin_clz(us) - TS_LATENCY_SHIFT + 1;
+    if(bucket >= TS_LATENCY_BUCKETS) bucket = TS_LATENCY_BUCKETS - 1;
+  }
+
+  ++this->buckets[bucket];
+  this->totalUs += us;
+  if(us > this->maxUs) this->maxUs = us;
+
+  if(success)
+  {
+    ++this->ok;
+  }
+  else
+  {
+    ++this->failed;
+  }
+}
+
+uint32_t TS_LatencyHistogram::get_ok()
+{
+  return this->ok;
+}
+
+uint32_t TS_LatencyHistogram::get_failed()
+{
+  return this->failed;
+}
+
+uint32_t TS_LatencyHistogram::get_count()
+{
+  return this->ok + this->failed;
+}
+
+uint32_t TS_LatencyHistogram::get_avg_us()
+{
+  uint32_t count = this->get_count();
+  return count ? this->totalUs / count : 0;
+}
+
+uint32_t TS_LatencyHistogram::get_max_us()
+{
+  return this->maxUs;
+}
+
+uint32_t TS_LatencyHistogram::get_bucket(uint8_t i)
+{
+  return i < TS_LATENCY_BUCKETS ? this->buckets[i] : 0;
+}
+
+uint32_t TS_LatencyHistogram::get_percentile_us(uint8_t pct)
+{
+  uint32_t count = this->get_count();
+  if(count == 0) return 0;
+
+  // smallest bucket covering pct of all samples
+  uint32_t target = ((uint64_t)count * pct + 99) / 100;
+  uint32_t seen = 0;
+  for(uint8_t i = 0; i < TS_LATENCY_BUCKETS; ++i)
+  {
+    seen += this->buckets[i];
+    if(seen >= target) return bucket_limit_us(i);
+  }
+
+  return bucket_limit_us(TS_LATENCY_BUCKETS - 1);
+}
+
+uint32_t TS_LatencyHistogram::bucket_limit_us(uint8_t i)
+{
+  // the last bucket is open ended
+  if(i >= TS_LATENCY_BUCKETS - 1) return UINT32_MAX;
+  return 1UL << (i + TS_LATENCY_SHIFT);
+}
@@ -0,0 +1,130 @@
+//
+// Lightweight latency metrics
+// - fixed log2 buckets and counters, no allocation, cheap enough to leave on
+// - single writer per histogram, readers may see a sample half recorded
+//
+
+#ifndef __TS_METRICS__
+#define __TS_METRICS__
+
+#include <stdint.h>
+#include "tests.h"
+
+// Bucket i holds latencies below 2^(i + TS_LATENCY_SHIFT) us, the last one everything above
+// - 128us to 16.7s
+#define TS_LATENCY_SHIFT    7
+#define TS_LATENCY_BUCKETS  18
+
+class TS_LatencyHistogram
+{
+  public:
+    TS_LatencyHistogram();
+
+    void reset();
+    void record(uint32_t us, bool success);
+
+    uint32_t get_ok();
+    uint32_t get_failed();
+    uint32_t get_count();
+    uint32_t get_avg_us();
+    uint32_t get_max_us();
+    uint32_t get_bucket(uint8_t i);
+
+    // Upper bound of the bucket holding the pct percentile, in us, 0 if empty
+    uint32_t get_percentile_us(uint8_t pct);
+
+    // Upper bound of bucket i, in us
+    static uint32_t bucket_limit_us(uint8_t i);
+
+  private:
+    uint32_t ok;
+    uint32_t failed;
+    uint32_t maxUs;
+    uint64_t totalUs;
+    uint32_t buckets[TS_LATENCY_BUCKETS];
+};
+
+
+
+//
+// Tests
+//
+
+#if defined(TESTDRIVER) && defined(TESTDRIVER_METRICS)
+
+static class _TS_MetricsTests : public _TS_Tests
+{
+public:
+  void init() override {}
+
+  bool test_latency_buckets()
+  {
+    TS_LatencyHistogram histogram;
+    histogram.record(0, true);
+    histogram.record(127, true);
+    histogram.record(128, true);
+    histogram.record(300000, false);
+    histogram.record(UINT32_MAX, false);
+
+    if(histogram.get_bucket(0) != 2 || histogram.get_bucket(1) != 1 || histogram.get_bucket(TS_LATENCY_BUCKETS - 1) != 1)
+    {
+      log_e("Samples in wrong buckets");
+      return false;
+    }
+
+    // 300ms is below 2^19us
+    if(histogram.get_bucket(19 - TS_LATENCY_SHIFT) != 1)
+    {
+      log_e("300ms should be in the 524ms bucket");
+      return false;
+    }
+
+    if(histogram.get_ok() != 3 || histogram.get_failed() != 2 || histogram.get_max_us() != UINT32_MAX)
+    {
+      log_e("Counters off, ok: %d, failed: %d", histogram.get_ok(), histogram.get_failed());
+      return false;
+    }
+
+    return true;
+  }
+
+  bool test_latency_percentiles()
+  {
+    TS_LatencyHistogram histogram;
+    if(histogram.get_percentile_us(50) != 0)
+    {
+      log_e("Empty histogram has no percentiles");
+      return false;
+    }
+
+    // 90 fast exchanges, 10 slow ones
+    for(uint8_t i = 0; i < 90; ++i) histogram.record(1000, true);
+    for(uint8_t i = 0; i < 10; ++i) histogram.record(2000000, true);
+
+    if(histogram.get_percentile_us(50) != 1024 || histogram.get_percentile_us(90) != 1024 || histogram.get_percentile_us(95) != 2097152)
+    {
+      log_e("Percentiles off, p50: %d, p90: %d, p95: %d",
+        histogram.get_percentile_us(50), histogram.get_percentile_us(90), histogram.get_percentile_us(95));
+      return false;
+    }
+
+    if(histogram.get_avg_us() != 200900)
+    {
+      log_e("Average off, %d", histogram.get_avg_us());
+      return false;
+    }
+
+    return true;
+  }
+
+  // Ctor
+  _TS_MetricsTests()
+  {
+    add(std::bind(&_TS_MetricsTests::test_latency_buckets, this), "test_latency_buckets");
+    add(std::bind(&_TS_MetricsTests::test_latency_percentiles, this), "test_latency_percentiles");
+  }
+} TS_MetricsTests;
+
+#endif
+
+#endif
@@ -3,6 +3,7 @@
 #include "storage.h"
 #include "opentracev2.h"
 #include "power.h"
+#include "scheduler.h"
 
 // For Base64 encode
 extern "C"
@@ -10,265 +11,1411 @@ extern "C"
   #include "crypto/base64.h"
 }
 
+#include <mbedtls/base64.h>
+#include <mbedtls/sha256.h>
+
 #include <BLEDevice.h>
 #include <BLEServer.h>
 #include <BLEUtils.h>
 #include <ArduinoJson.h>
 
-//
-// Defines
-//
+#define ENCOUNTER_THREAD_STACK_SIZE 5000
+#define EXCHANGE_THREAD_STACK_SIZE  8192  // BLE client and json parsing, as much as the loop task has
+
+// Deadline of each exchange step, by OT_Phase
+static const uint16_t exchangeDeadlineMs[OT_PHASE_DISCONNECT + 1] = {
+  OT_DEADLINE_CONNECT_MS,
+  OT_DEADLINE_DISCOVER_MS,
+  OT_DEADLINE_CHARACTERISTIC_MS,
+  OT_DEADLINE_WRITE_MS,
+  OT_DEADLINE_READ_MS,
+  OT_DEADLINE_DISCONNECT_MS,
+};
+
+//
+// OT_ExchangeCache
+//
+
+OT_ExchangeCache::OT_ExchangeCache()
+: count(0), windowMs(OT_REEXCHANGE_WINDOW_SECS * 1000)
+{
+}
+
+void OT_ExchangeCache::set_window(uint32_t seconds)
+{
+  this->windowMs = seconds * 1000;
+}
+
+uint32_t OT_ExchangeCache::get_window()
+{
+  return this->windowMs / 1000;
+}
+
+OT_ConnectionRecord* OT_ExchangeCache::find(BLEAddress &address, uint32_t nowMs)
+{
+  for(uint8_t i = 0; i < this->count; ++i)
+  {
+    OT_ExchangeCacheEntry &entry = this->entries[i];
+    if(memcmp(entry.address, address.getNative(), sizeof(esp_bd_addr_t)) != 0) continue;
+
+    // found, but stale entries have to be exchanged with again
+    if(nowMs - entry.exchangedMs >= this->windowMs) return NULL;
+
+    entry.usedMs = nowMs;
+    return &entry.record;
+  }
+
+  return NULL;
+}
+
+bool OT_ExchangeCache::put(BLEAddress &address, OT_ConnectionRecord &record, uint32_t nowMs)
+{
+  uint8_t slot = this->count;
+  bool found = false;
+
+  // reuse the entry of the same address, else track the least recently used one
+  uint8_t lru = 0;
+  for(uint8_t i = 0; i < this->count; ++i)
+  {
+    if(memcmp(this->entries[i].address, address.getNative(), sizeof(esp_bd_addr_t)) == 0)
+    {
+      slot = i;
+      found = true;
+      break;
+    }
+
+    if(nowMs - this->entries[i].usedMs > nowMs - this->entries[lru].usedMs) lru = i;
+  }
+
+  if(!found)
+  {
+    if(this->count < OT_EXCHANGE_CACHE_MAX)
+    {
+      ++this->count;
+    }
+    else
+    {
+      slot = lru;
+    }
+  }
+
+  OT_ExchangeCacheEntry &entry = this->entries[slot];
+  bool isNew = !found || entry.record.id != record.id;
+  
+  memcpy(entry.address, address.getNative(), sizeof(esp_bd_addr_t));
+  entry.exchangedMs = nowMs;
+  entry.usedMs = nowMs;
+  entry.record = record;
+  return isNew;
+}
+
+void OT_ExchangeCache::clear()
+{
+  this->count = 0;
+}
+
+//
+// OT_FailureTracker
+//
+
+OT_FailureTracker::OT_FailureTracker()
+: count(0), skipped(0)
+{
+  memset(this->results, 0, sizeof(this->results));
+}
+
+int8_t OT_FailureTracker::find(BLEAddress &address)
+{
+  for(uint8_t i = 0; i < this->count; ++i)
+  {
+    if(memcmp(this->entries[i].address, address.getNative(), sizeof(esp_bd_addr_t)) == 0) return i;
+  }
+
+  return -1;
+}
+
+void OT_FailureTracker::remove(uint8_t i)
+{
+  this->entries[i] = this->entries[--this->count];
+}
+
+bool OT_FailureTracker::is_backed_off(BLEAddress &address, uint32_t nowMs)
+{
+  int8_t i = this->find(address);
+  if(i < 0) return false;
+
+  OT_FailureEntry &entry = this->entries[i];
+  if((int32_t)(entry.retryMs - nowMs) > 0)
+  {
+    ++this->skipped;
+    return true;
+  }
+
+  // blacklist expired, start over
+  if(entry.failures >= OT_BLACKLIST_FAILURES)
+  {
+    this->remove(i);
+  }
+
+  return false;
+}
+
+void OT_FailureTracker::record(BLEAddress &address, OT_ExchangeResult result, uint32_t nowMs)
+{
+  ++this->results[result];
+
+  int8_t i = this->find(address);
+  if(result == OT_EXCHANGE_OK)
+  {
+    if(i >= 0) this->remove(i);
+    return;
+  }
+
+  if(i < 0)
+  {
+    if(this->count < OT_FAILURE_TRACK_MAX)
+    {
+      i = this->count++;
+    }
+    else
+    {
+      // evict the entry retrying soonest, it is the least costly to forget
+      i = 0;
+      for(uint8_t j = 1; j < this->count; ++j)
+      {
+        if((int32_t)(this->entries[j].retryMs - this->entries[i].retryMs) < 0) i = j;
+      }
+    }
+
+    memcpy(this->entries[i].address, address.getNative(), sizeof(esp_bd_addr_t));
+    this->entries[i].failures = 0;
+  }
+
+  OT_FailureEntry &entry = this->entries[i];
+  if(entry.failures < OT_BLACKLIST_FAILURES) ++entry.failures;
+
+  uint32_t backoffSecs = OT_BLACKLIST_SECS;
+  if(entry.failures < OT_BLACKLIST_FAILURES)
+  {
+    backoffSecs = OT_BACKOFF_BASE_SECS << (entry.failures - 1);
+    if(backoffSecs > OT_BACKOFF_MAX_SECS) backoffSecs = OT_BACKOFF_MAX_SECS;
+  }
+
+  entry.retryMs = nowMs + backoffSecs * 1000;
+  log_i("%s failed exchange (%d), %d in a row, retry in %ds", address.toString().c_str(), result, entry.failures, backoffSecs);
+}
+
+uint32_t OT_FailureTracker::get_count(OT_ExchangeResult result)
+{
+  return this->results[result];
+}
+
+uint32_t OT_FailureTracker::get_skipped()
+{
+  return this->skipped;
+}
+
+//
+// OT_EncounterMerger
+//
+
+OT_EncounterMerger::OT_EncounterMerger()
+: count(0), merged(0)
+{
+}
+
+bool OT_EncounterMerger::add(OT_EncounterRecord &encounter, OT_EncounterRole role)
+{
+  OT_MergeEntry *entry = NULL;
+  for(uint8_t i = 0; i < this->count; ++i)
+  {
+    if(strcmp(this->entries[i].record.id, encounter.id) == 0)
+    {
+      entry = &this->entries[i];
+      ++this->merged;
+      break;
+    }
+  }
+
+  if(entry == NULL)
+  {
+    if(this->count >= OT_MERGE_MAX) return false;
+
+    // entries stay in arrival order, the oldest first
+    entry = &this->entries[this->count++];
+    entry->record = encounter;
+    entry->firstMs = encounter.capturedMs;
+    memset(entry->samples, 0, sizeof(entry->samples));
+  }
+
+  entry->record.capturedMs = encounter.capturedMs;
+  if(entry->samples[role] < OT_MERGE_SAMPLES_MAX)
+  {
+    entry->rssi[role][entry->samples[role]++] = encounter.rssi;
+  }
+
+  return true;
+}
+
+bool OT_EncounterMerger::pop(OT_MergedEncounter &encounter, uint32_t nowMs, bool force)
+{
+  if(this->count == 0) return false;
+
+  OT_MergeEntry &entry = this->entries[0];
+  if(!force && nowMs - entry.firstMs < OT_MERGE_WINDOW_SECS * 1000) return false;
+
+  // rssi of the two roles are not comparable, only one is kept
+  OT_EncounterRole role = entry.samples[OT_ROLE_PERIPHERAL] > entry.samples[OT_ROLE_CENTRAL] ? OT_ROLE_PERIPHERAL : OT_ROLE_CENTRAL;
+  encounter.record = entry.record;
+  encounter.firstMs = entry.firstMs;
+  encounter.samples = entry.samples[role];
+  memcpy(encounter.rssi, entry.rssi[role], encounter.samples);
+
+  int16_t rssiSum = 0;
+  for(uint8_t i = 0; i < encounter.samples; ++i) rssiSum += encounter.rssi[i];
+  encounter.record.rssi = rssiSum / encounter.samples;
+
+  --this->count;
+  memmove(&this->entries[0], &this->entries[1], this->count * sizeof(OT_MergeEntry));
+  return true;
+}
+
+uint16_t OT_EncounterMerger::get_pending()
+{
+  return this->count;
+}
+
+uint32_t OT_EncounterMerger::get_merged()
+{
+  return this->merged;
+}
+
+//
+// OT_TokenCache
+//
+
+OT_TokenCache::OT_TokenCache()
+: count(0)
+{
+}
+
+OT_ConnectionRecord* OT_TokenCache::find(const uint8_t *token, uint32_t nowMs)
+{
+  for(uint8_t i = 0; i < this->count; ++i)
+  {
+    OT_TokenCacheEntry &entry = this->entries[i];
+    if(memcmp(entry.token, token, OT_TOKEN_LEN) != 0) continue;
+
+    entry.usedMs = nowMs;
+    return &entry.record;
+  }
+
+  return NULL;
+}
+
+void OT_TokenCache::put(const uint8_t *token, OT_ConnectionRecord &record, uint32_t nowMs)
+{
+  uint8_t slot = this->count;
+
+  // reuse the entry of the same token, else track the least recently used one
+  uint8_t lru = 0;
+  for(uint8_t i = 0; i < this->count; ++i)
+  {
+    if(memcmp(this->entries[i].token, token, OT_TOKEN_LEN) == 0)
+    {
+      slot = i;
+      break;
+    }
+
+    if(nowMs - this->entries[i].usedMs > nowMs - this->entries[lru].usedMs) lru = i;
+  }
+
+  if(slot == this->count)
+  {
+    if(this->count < OT_TOKEN_CACHE_MAX)
+    {
+      ++this->count;
+    }
+    else
+    {
+      slot = lru;
+    }
+  }
+
+  OT_TokenCacheEntry &entry = this->entries[slot];
+  memcpy(entry.token, token, OT_TOKEN_LEN);
+  entry.usedMs = nowMs;
+  entry.record = record;
+}
+
+//
+// OT_NegativeCache
+//
+
+OT_NegativeCache::OT_NegativeCache()
+: current(0), rotatedMs(0)
+{
+}
+
+bool OT_NegativeCache::contains(BLEAddress &address)
+{
+  const uint8_t *key = (const uint8_t *)address.getNative();
+  return this->generations[0].contains(key, sizeof(esp_bd_addr_t))
+      || this->generations[1].contains(key, sizeof(esp_bd_addr_t));
+}
+
+void OT_NegativeCache::add(BLEAddress &address, uint32_t nowMs)
+{
+  if(nowMs - this->rotatedMs >= OT_NEGCACHE_ROTATE_SECS * 1000
+    || this->generations[this->current].size() >= OT_NEGCACHE_GEN_MAX)
+  {
+    this->current ^= 1;
+    this->generations[this->current].clear();
+    this->rotatedMs = nowMs;
+  }
+
+  this->generations[this->current].add((const uint8_t *)address.getNative(), sizeof(esp_bd_addr_t));
+}
+
+//
+// Init
+//
+_OT_ProtocolV2 OT_ProtocolV2;
+_OT_ProtocolV2::_OT_ProtocolV2()
+: tempIdCount(0), charCacheUntil(0), advertisementCustom(false), droppedEncounters(0), encounterTask(NULL), exchangeBusy(false), exchangeWedged(false), exchangeWedgedMs(0), exchangeTask(NULL)
+{
+}
+
+void _OT_ProtocolV2::begin()
+{
+  this->characteristicCacheMutex = xSemaphoreCreateMutex();
+  this->tempIdsMutex = xSemaphoreCreateMutex();
+
+  this->serviceUUID = BLEUUID(OT_SERVICEID);
+  this->characteristicUUID = BLEUUID(OT_CHARACTERISTICID);
+  this->binCharacteristicUUID = BLEUUID(OT_BINCHARACTERISTICID);
+
+  this->load_tempids();
+
+  // DEBUG: populate characteristic cache once
+  this->update_characteristic_cache();
+
+  this->scanRssiCutoff = -128;
+  this->exchangeNewPeers = 0;
+  this->reset_encounter_stats();
+
+  // Storage runs at main loop priority, it only has to keep up with the rings
+  xTaskCreatePinnedToCore(
+    _OT_ProtocolV2::staticEncounterTask,  // thread fn
+    "EncounterTask",                      // identifier
+    ENCOUNTER_THREAD_STACK_SIZE,          // stack size
+    NULL,                                 // parameter
+    1,                                    // priority
+    &this->encounterTask,                 // handle
+    1);                                   // core
+
+  // Exchanges block in the BLE library, the main task only waits on deadlines
+  xTaskCreatePinnedToCore(
+    _OT_ProtocolV2::staticExchangeTask,   // thread fn
+    "ExchangeTask",                       // identifier
+    EXCHANGE_THREAD_STACK_SIZE,           // stack size
+    NULL,                                 // parameter
+    1,                                    // priority
+    &this->exchangeTask,                  // handle
+    1);                                   // core
+
+  // Setup BLE and GATT profile
+  BLEDevice::setMTU(OT_CR_MAXLEN);  // try to send whole message in 1 frame
+  this->bleServer = TS_HAL.ble_server_get();
+  //disable on connect/disconnect callbacks
+  // this->bleServer->setCallbacks(this);
+  this->bleService = bleServer->createService(this->serviceUUID);
+
+  this->bleCharacteristic = bleService->createCharacteristic(this->characteristicUUID, BLECharacteristic::PROPERTY_READ | BLECharacteristic::PROPERTY_WRITE);
+  this->bleCharacteristic->setCallbacks(this);
+  this->binCharacteristic = bleService->createCharacteristic(this->binCharacteristicUUID, BLECharacteristic::PROPERTY_READ | BLECharacteristic::PROPERTY_WRITE);
+  this->binCharacteristic->setCallbacks(this);
+  this->bleService->start();
+
+  this->bleAdvertising = this->bleServer->getAdvertising();
+  this->bleAdvertising->addServiceUUID(this->serviceUUID);
+  this->bleAdvertising->setScanResponse(true);  // TODO: do we need this? apparently need this to be true.
+  this->bleAdvertising->setMinPreferred(0x06);  // functions that help with iPhone connections issue
+  // TODO: find out what setMin and setMax interval really means
+
+  this->set_connectionless(TS_Storage.settings_get()->connectionless_flag);
+
+}
+
+void _OT_ProtocolV2::update()
+{
+  uint16_t connectedCount = this->get_connected_count();
+  log_i("Devices connected: %d", connectedCount);
+
+  TS_Scheduler.plan(millis(), TS_POWER.get_state(), connectedCount);
+
+  // the characteristics and the advertised token move on with the TempID, a sync refreshes them too
+  uint32_t nowUnix = TS_HAL.rtc_get_unix();
+  if(this->charCacheUntil > 0 && nowUnix >= this->charCacheUntil) this->update_characteristic_cache();
+
+  // applied when advertising starts, BLE may have been reinitialized since
+  this->txPower.update(millis(), TS_POWER.get_state());
+
+  TS_Slot slot;
+  while(TS_Scheduler.next(slot))
+  {
+    uint32_t startMs = millis();
+    
+    switch(slot.type)
+    {
+      case SLOT_SLEEP:
+        // light sleep would drop the connection of an exchange carried over from the scan
+        if(this->is_exchange_busy())
+        {
+          this->exchange_sleep(slot.durationMs);
+        }
+        else
+        {
+          TS_HAL.sleep(slot.lightSleep ? TS_SleepMode::Light : TS_SleepMode::Task, slot.durationMs);
+        }
+        break;
+
+      case SLOT_SCAN:
+      {
+        OT_ScanSummary summary;
+        this->scan_and_connect(slot.durationMs, slot.rssiCutoff, slot.exchangeBudgetMs, summary);
+        TS_Scheduler.scan_done(summary.peers, summary.newPeers);
+
+        ++this->encounterStats.scans;
+        this->encounterStats.scanMs += millis() - startMs - summary.exchangeMs;
+        this->encounterStats.exchangeMs += summary.exchangeMs;
+        this->encounterStats.peers += summary.peers;
+        this->encounterStats.exchanges += summary.exchanged;
+
+        // exchanges run within the scan, account for them separately
+        TS_Scheduler.record(SLOT_EXCHANGE, slot.exchangeBudgetMs, summary.exchangeMs);
+        startMs += summary.exchangeMs;
+        break;
+      }
+
+      case SLOT_ADVERTISE:
+        this->advertising_start();
+        this->exchange_sleep(slot.durationMs);
+        this->advertising_stop();
+        this->encounterStats.advertiseMs += millis() - startMs;
+        break;
+
+      default:
+        break;
+    }
+
+    TS_Scheduler.record(slot.type, slot.durationMs, millis() - startMs);
+  }
+
+  TS_Scheduler.log_stats(millis());
+}
+
+BLEUUID& _OT_ProtocolV2::getServiceUUID()
+{
+  return this->serviceUUID;
+}
+
+BLEUUID& _OT_ProtocolV2::getCharacteristicUUID()
+{
+  return this->characteristicUUID;
+}
+
+BLEUUID& _OT_ProtocolV2::getBinaryCharacteristicUUID()
+{
+  return this->binCharacteristicUUID;
+}
+
+void _OT_ProtocolV2::load_tempids()
+{
+  log_i("Loading TempIDs from storage");
+
+  xSemaphoreTake( tempIdsMutex, portMAX_DELAY );
+  this->tempIdCount = TS_Storage.file_ids_readall(OT_TEMPID_MAX, this->tempIds, this->tempIdStart, this->tempIdExpiry);
+  uint8_t count = this->tempIdCount;
+  xSemaphoreGive( tempIdsMutex );
+
+  if(count < OT_TEMPID_MAX)
+  {
+    log_w("Insufficient/error loading, %d TempIDs", count);
+  }
+
+  log_i("Loaded TempIDs");
+}
+
+// - the id whose start and expiry hold unixTime
+// - ids without times, or none valid, rotate every 15 mins (900s) as before
+OT_TempID _OT_ProtocolV2::get_tempid_by_time(uint32_t unixTime, uint32_t *until)
+{
+  OT_TempID id;
+
+  xSemaphoreTake( tempIdsMutex, portMAX_DELAY );
+  uint8_t n = this->tempIdCount;
+  for(uint8_t i = 0; i < this->tempIdCount; ++i)
+  {
+    if(this->tempIdStart[i] <= unixTime && unixTime < this->tempIdExpiry[i])
+    {
+      n = i;
+      if(until != NULL) *until = this->tempIdExpiry[i];
+      break;
+    }
+  }
+
+  if(n == this->tempIdCount && this->tempIdCount > 0)
+  {
+    n = (unixTime / 900) % this->tempIdCount;
+    if(until != NULL) *until = (unixTime / 900 + 1) * 900;
+  }
+  if(n < this->tempIdCount) id = this->tempIds[n];
+  xSemaphoreGive( tempIdsMutex );
+
+  return id;
+}
+
+// sets the Nth tempid
+// - returns false if failed
+bool _OT_ProtocolV2::set_tempid(const OT_TempID &id, uint16_t n)
+{
+  if (n < 0 || n >= OT_TEMPID_MAX) return false;
+
+  xSemaphoreTake( tempIdsMutex, portMAX_DELAY );
+  this->tempIds[n] = id;
+  this->tempIdStart[n] = 0;
+  this->tempIdExpiry[n] = 0;
+  if(n >= this->tempIdCount) this->tempIdCount = n + 1;
+  xSemaphoreGive( tempIdsMutex );
+  return true;
+}
+
+static bool scan_filter(BLEAdvertisedDevice &device)
+{
+  return OT_ProtocolV2.filter_advertised_device(device);
+}
+
+// Scans and do handshake w/ relevant peers
+// - windowMs: time to spend scanning, time spent exchanging is not counted
+// - rssiCutoff: lowerbound rssi to ignore
+// - exchangeBudgetMs: time allowed for exchanges, peers beyond it are left for the next scan
+// - peers are exchanged with as soon as they are seen, pausing the scan meanwhile
+// - an exchange still running when the budget runs out is carried over to the next slots
+bool _OT_ProtocolV2::scan_and_connect(uint32_t windowMs, int8_t rssiCutoff, uint32_t exchangeBudgetMs, OT_ScanSummary &summary)
+{
+  uint32_t scannedMs = 0;
+  TS_BleScanResult result;
+
+  memset(&summary, 0, sizeof(summary));
+  this->exchangeNewPeers = 0;
+
+  // never scan while connected, wait for a carried over exchange first
+  // - a wedged one may never return, scan meanwhile and log advertisements only
+  if(this->is_exchange_busy())
+  {
+    uint32_t exchangeStartMs = millis();
+    OT_ExchangeResult exchangeResult;
+    if(this->exchange_poll(this->exchangeWedged ? 0 : windowMs, exchangeResult) && exchangeResult == OT_EXCHANGE_OK) ++summary.exchanged;
+    summary.exchangeMs += millis() - exchangeStartMs;
+    if(this->is_exchange_busy() && !this->exchangeWedged) return false;
+  }
+
+  this->scanRssiCutoff = rssiCutoff;
+  bool scanning = TS_HAL.ble_scan_start(scan_filter, false);
+  uint32_t resumedMs = millis();
+
+  while(scanning)
+  {
+    uint32_t elapsedMs = scannedMs + (millis() - resumedMs);
+    if(elapsedMs >= windowMs) break;
+
+    // wait for the next peer until the window closes
+    if(!TS_HAL.ble_scan_next(result, windowMs - elapsedMs)) break;
+    ++summary.peers;
+
+    if(!this->scan_result_needs_exchange(result)) continue;
+    if(summary.exchangeMs >= exchangeBudgetMs || this->is_exchange_busy())
+    {
+      ++summary.deferred;
+      continue;
+    }
+
+    // pause scanning while connected
+    TS_HAL.ble_scan_stop();
+    uint32_t exchangeStartMs = millis();
+    scannedMs += exchangeStartMs - resumedMs;
+
+    bool finished = this->exchange_with(result, exchangeBudgetMs - summary.exchangeMs, summary);
+    summary.exchangeMs += millis() - exchangeStartMs;
+    if(!finished) break;
+
+    scanning = TS_HAL.ble_scan_start(scan_filter, true);
+    resumedMs = millis();
+  }
+
+  TS_HAL.ble_scan_stop();
+
+  // peers queued just before the scan stopped
+  while(TS_HAL.ble_scan_next(result, 0))
+  {
+    ++summary.peers;
+    if(!this->scan_result_needs_exchange(result)) continue;
+    if(summary.exchangeMs >= exchangeBudgetMs || this->is_exchange_busy())
+    {
+      ++summary.deferred;
+      continue;
+    }
+    
+    uint32_t exchangeStartMs = millis();
+    this->exchange_with(result, exchangeBudgetMs - summary.exchangeMs, summary);
+    summary.exchangeMs += millis() - exchangeStartMs;
+  }
+
+  // peers deferred to the next scan have not been exchanged with recently either
+  summary.newPeers = this->exchangeNewPeers + summary.deferred;
+
+  log_i("Scan done, peers: %d, new: %d, exchanged: %d, deferred: %d, carried over: %d",
+    summary.peers, summary.newPeers, summary.exchanged, summary.deferred, this->is_exchange_busy());
+  return true;
+}
+
+// Exchanges with a scanned peer, waiting up to budgetMs for it
+// - returns false if the exchange is still running
+bool _OT_ProtocolV2::exchange_with(TS_BleScanResult &result, uint32_t budgetMs, OT_ScanSummary &summary)
+{
+  if(!this->exchange_start(result))
+  {
+    ++summary.deferred;
+    return true;
+  }
+
+  OT_ExchangeResult exchangeResult;
+  if(!this->exchange_poll(budgetMs, exchangeResult)) return false;
+
+  if(exchangeResult == OT_EXCHANGE_OK) ++summary.exchanged;
+  return true;
+}
+
+// Token advertised by a stick in connectionless mode, NULL if none
+static const uint8_t *advertised_token(TS_BleScanResult &result)
+{
+  if(result.mfrDataLength != 2 + OT_TOKEN_LEN) return NULL;
+  if(result.mfrData[0] != (OT_TOKEN_COMPANY_ID & 0xFF) || result.mfrData[1] != (OT_TOKEN_COMPANY_ID >> 8)) return NULL;
+  return result.mfrData + 2;
+}
+
+bool _OT_ProtocolV2::scan_result_needs_exchange(TS_BleScanResult &result)
+{
+  BLEAddress address(result.address);
+  uint32_t nowMs = millis();
+  log_i("%s rssi: %d", address.toString().c_str(), result.rssi);
+
+  // Token of a TempID we already hold, no need to connect at all
+  const uint8_t *token = this->connectionless ? advertised_token(result) : NULL;
+  if(token != NULL)
+  {
+    OT_ConnectionRecord *connectionRecord = this->tokenCache.find(token, nowMs);
+    if(connectionRecord != NULL)
+    {
+      this->log_encounter(*connectionRecord, result.rssi);
+      ++this->encounterStats.tokenSamples;
+      return false;
+    }
+
+    ++this->encounterStats.tokenMisses;
+  }
+
+  // Recently exchanged with, the advertisement alone is enough for an rssi sample
+  OT_ConnectionRecord *connectionRecord = this->exchangeCache.find(address, nowMs);
+  if(connectionRecord != NULL)
+  {
+    this->log_encounter(*connectionRecord, result.rssi);
+    ++this->encounterStats.cacheSamples;
+    return false;
+  }
+
+  // Failed recently, retrying now would likely waste the exchange budget again
+  if(this->failureTracker.is_backed_off(address, nowMs))
+  {
+    log_i("%s backed off", address.toString().c_str());
+    return false;
+  }
+
+  return true;
+}
+
+// Called from the BLE stack task for every advertisement while scanning
+// - non-matching addresses are remembered so repeated sightings are rejected cheaply
+bool _OT_ProtocolV2::filter_advertised_device(BLEAdvertisedDevice &device)
+{
+  BLEAddress address = device.getAddress();
+  if(this->negativeCache.contains(address)) return false;
+
+  // filter by service uuid
+  // Note: getServiceUUID crashes for now, do not use
+  if(!device.isAdvertisingService(this->serviceUUID))
+  {
+    this->negativeCache.add(address, millis());
+    return false;
+  }
+
+  // too far away for now, but may come closer later in the scan
+  return device.getRSSI() >= this->scanRssiCutoff;
+}
+
+bool _OT_ProtocolV2::exchange_start(TS_BleScanResult &result)
+{
+  if(this->exchangeBusy) return false;
+
+  // no louder than needed to hold the link, peripherals keep their own level when we connect
+  TS_HAL.ble_set_power(this->txPower.get_conn_power(result.rssi, TS_POWER.get_state()), BLE_POWER_CONN);
+
+  OT_Exchange &exchange = this->exchange;
+  exchange.client = BLEDevice::createClient(); // new BLEClient
+  memcpy(exchange.address, result.address, sizeof(esp_bd_addr_t));
+  exchange.addressType = result.addressType;
+  exchange.rssi = result.rssi;
+  exchange.owner = xTaskGetCurrentTaskHandle();
+  exchange.cancelled = false;
+  exchange.done = false;
+  exchange.result = OT_EXCHANGE_OK;
+  exchange.binary = false;
+  exchange.service = NULL;
+  exchange.characteristic = NULL;
+  exchange.buf.clear();
+  this->exchange_next(exchange, OT_PHASE_CONNECT);
+
+  // clear a completion left over from a previous exchange
+  ulTaskNotifyTake(pdTRUE, 0);
+
+  this->exchangeBusy = true;
+  xTaskNotifyGive(this->exchangeTask);
+  return true;
+}
+
+bool _OT_ProtocolV2::exchange_poll(uint32_t waitMs, OT_ExchangeResult &result)
+{
+  if(!this->exchangeBusy) return false;
+
+  OT_Exchange &exchange = this->exchange;
+  uint32_t startMs = millis();
+  while(!exchange.done)
+  {
+    uint32_t nowMs = millis();
+    uint32_t deadlineMs = exchange.phaseStartMs + exchangeDeadlineMs[exchange.phase];
+    if(!exchange.cancelled && (int32_t)(nowMs - deadlineMs) >= 0)
+    {
+      log_w("Exchange %s step timed out", get_phase_name(exchange.phase));
+      this->exchange_cancel();
+    }
+
+    // the library did not return after being disconnected, nothing else to do but wait
+    if(exchange.cancelled && exchange.phase != OT_PHASE_DISCONNECT && (int32_t)(nowMs - deadlineMs) >= OT_DEADLINE_DISCONNECT_MS)
+    {
+      if(!this->exchangeWedged)
+      {
+        log_e("Exchange stuck in %s step", get_phase_name(exchange.phase));
+        this->exchangeWedged = true;
+        this->exchangeWedgedMs = nowMs;
+      }
+
+      // the client cannot be deleted while the library is in it, only a reboot gets the radio back
+      if(nowMs - this->exchangeWedgedMs >= OT_WEDGE_REBOOT_MS)
+      {
+        TS_HAL.fail_reboot("Exchange wedged, rebooting");
+      }
+    }
+
+    uint32_t elapsedMs = nowMs - startMs;
+    if(elapsedMs >= waitMs) return false;
+
+    // wake up for the deadline, or when the exchange task moves on
+    uint32_t sleepMs = waitMs - elapsedMs;
+    if(!exchange.cancelled && deadlineMs - nowMs < sleepMs) sleepMs = deadlineMs - nowMs;
+    ulTaskNotifyTake(pdTRUE, sleepMs / portTICK_PERIOD_MS + 1);
+  }
+
+  // collected here, the caches are only used by the main task
+  BLEAddress address(exchange.address);
+  this->failureTracker.record(address, exchange.result, millis());
+  if(exchange.result == OT_EXCHANGE_OK)
+  {
+    this->log_encounter(exchange.record, exchange.rssi);
+    if(this->exchangeCache.put(address, exchange.record, millis())) ++this->exchangeNewPeers;
+
+    // sticks advertise the token of their current TempID, refreshed as it rotates
+    if(this->connectionless)
+    {
+      uint8_t token[OT_TOKEN_LEN];
+      make_token(exchange.record.id, token);
+      this->tokenCache.put(token, exchange.record, millis());
+    }
+  }
+
+  delete exchange.client;
+  exchange.client = NULL;
+  this->exchangeBusy = false;
+
+  // the connection level also applied to scans
+  TS_HAL.ble_reset_conn_power();
+  this->exchangeWedged = false;
+
+  result = exchange.result;
+  return true;
+}
+
+// Disconnecting makes the BLE library return from its blocking calls
+// - a connect still pending only ends when the stack gives up on it
+void _OT_ProtocolV2::exchange_cancel()
+{
+  if(!this->exchangeBusy || this->exchange.done || this->exchange.cancelled) return;
+
+  this->exchange.cancelled = true;
+  this->exchange.client->disconnect();
+}
+
+bool _OT_ProtocolV2::is_exchange_busy()
+{
+  return this->exchangeBusy;
+}
+
+void _OT_ProtocolV2::exchange_sleep(uint32_t durationMs)
+{
+  uint32_t startMs = millis();
+
+  OT_ExchangeResult result;
+  if(this->exchange_poll(durationMs, result) && result == OT_EXCHANGE_OK) ++this->encounterStats.exchanges;
+
+  uint32_t elapsedMs = millis() - startMs;
+  if(elapsedMs < durationMs) TS_HAL.sleep(TS_SleepMode::Task, durationMs - elapsedMs);
+}
+
+void _OT_ProtocolV2::exchange_next(OT_Exchange &exchange, OT_Phase phase)
+{
+  exchange.phaseStartMs = millis();
+  exchange.phase = phase;
+}
+
+// Skips to disconnecting, keeping the first failure
+void _OT_ProtocolV2::exchange_fail(OT_Exchange &exchange, OT_ExchangeResult result, const char *reason)
+{
+  if(exchange.result == OT_EXCHANGE_OK)
+  {
+    exchange.result = exchange.cancelled ? OT_EXCHANGE_TIMEOUT : result;
+    log_w("%s", exchange.cancelled ? "Exchange cancelled" : reason);
+  }
+
+  this->exchange_next(exchange, OT_PHASE_DISCONNECT);
+}
+
+bool _OT_ProtocolV2::exchange_step(OT_Exchange &exchange)
+{
+  BLEClient *bleClient = exchange.client;
+  uint32_t phaseUs = micros();
+
+  switch(exchange.phase)
+  {
+    case OT_PHASE_CONNECT:
+    {
+      // NOTE: the address type has to be the advertised one, a hardcoded
+      // BLE_ADDR_TYPE_RANDOM failed to do TraceStick-TraceStick connection
+      BLEAddress address(exchange.address);
+      bleClient->connect(address, exchange.addressType);
+
+      if(!this->record_phase(OT_PHASE_CONNECT, phaseUs, bleClient->isConnected() && !exchange.cancelled))
+      {
+        this->exchange_fail(exchange, OT_EXCHANGE_CONNECT_FAILED, "Client connection failed");
+        break;
+      }
+
+      this->exchange_next(exchange, OT_PHASE_DISCOVER);
+      break;
+    }
+
+    case OT_PHASE_DISCOVER:
+      exchange.service = bleClient->getService(this->serviceUUID);
+      if (!this->record_phase(OT_PHASE_DISCOVER, phaseUs, exchange.service != NULL && !exchange.cancelled))
+      {
+        this->exchange_fail(exchange, OT_EXCHANGE_NO_SERVICE, "Failed to find our service UUID");
+        break;
+      }
+
+      this->exchange_next(exchange, OT_PHASE_CHARACTERISTIC);
+      break;
+
+    case OT_PHASE_CHARACTERISTIC:
+    {
+      // TraceSticks also expose the binary characteristic, phones only have the json one
+      BLERemoteCharacteristic *characteristic = exchange.service->getCharacteristic(this->binCharacteristicUUID);
+      if (characteristic != NULL && characteristic->canRead() && characteristic->canWrite())
+      {
+        exchange.binary = this->prepare_central_write_binary(exchange.buf, exchange.rssi);
+      }
+
+      if (!exchange.binary)
+      {
+        characteristic = exchange.service->getCharacteristic(this->characteristicUUID);
+      }
+
+      if (!this->record_phase(OT_PHASE_CHARACTERISTIC, phaseUs, characteristic != NULL && !exchange.cancelled))
+      {
+        this->exchange_fail(exchange, OT_EXCHANGE_NO_CHARACTERISTIC, "Failed to find our characteristic UUID");
+        break;
+      }
+
+      if(!characteristic->canRead() || !characteristic->canWrite())
+      {
+        this->exchange_fail(exchange, OT_EXCHANGE_NO_ACCESS, "Unable to read or write");
+        break;
+      }
+
+      // frames are prepared outside of the write phase
+      if(!exchange.binary)
+      {
+        this->prepare_central_write_request(exchange.buf, exchange.rssi);
+      }
 
-#define DEBUG_TIMINGS
+      exchange.characteristic = characteristic;
+      this->exchange_next(exchange, OT_PHASE_WRITE);
+      break;
+    }
 
-#ifdef DEBUG_TIMINGS
-  #define SCAN_INTERVAL_SECS 10
-#else
-  #define SCAN_INTERVAL_SECS 57
-#endif
+    case OT_PHASE_WRITE:
+      // the library does not report write failures, they show up as failed reads
+      exchange.characteristic->writeValue(exchange.buf, false);
+      if(!this->record_phase(OT_PHASE_WRITE, phaseUs, !exchange.cancelled))
+      {
+        this->exchange_fail(exchange, OT_EXCHANGE_TIMEOUT, "Exchange cancelled");
+        break;
+      }
 
-#define SLEEP_MIN 1900
-#define SLEEP_MAX 2300
-#define ADVERTISE_DURATION  1000
+      if(exchange.binary)
+      {
+        log_i("BLE central Send: binary, %d bytes", exchange.buf.length());
+      }
+      else
+      {
+        log_i("BLE central Send: %s", exchange.buf.c_str());
+      }
 
-//
-// Init
-//
-_OT_ProtocolV2 OT_ProtocolV2;
-_OT_ProtocolV2::_OT_ProtocolV2() { }
+      this->exchange_next(exchange, OT_PHASE_READ);
+      break;
 
-void _OT_ProtocolV2::begin()
-{
-  this->characteristicCacheMutex = xSemaphoreCreateMutex();
+    case OT_PHASE_READ:
+    {
+      exchange.buf = exchange.characteristic->readValue();
+      this->record_phase(OT_PHASE_READ, phaseUs, exchange.buf.length() > 0 && !exchange.cancelled);
 
-  this->serviceUUID = BLEUUID(OT_SERVICEID);
-  this->characteristicUUID = BLEUUID(OT_CHARACTERISTICID);
+      bool valid = !exchange.cancelled && (exchange.binary ?
+        this->process_binary_frame(exchange.buf, false, exchange.record) :
+        this->process_central_read_request(exchange.buf, exchange.record));
+      if(!valid)
+      {
+        this->exchange_fail(exchange, OT_EXCHANGE_BAD_FRAME, exchange.binary ? "Binary frame invalid or read failed" : "Json parse error or read failed");
+        break;
+      }
 
-  log_i("Loading TempIDs from storage");
-  if( TS_Storage.file_ids_readall(OT_TEMPID_MAX, tempIds) < OT_TEMPID_MAX)
-  {
-    log_w("Insufficient/error loading, creating TempIDs");
+      if(exchange.binary)
+      {
+        log_i("BLE central Recv: binary, %d bytes, id: %s", exchange.buf.length(), exchange.record.id.c_str());
+      }
+      else
+      {
+        log_i("BLE central Recv: %s", exchange.buf.c_str());
+      }
+
+      this->exchange_next(exchange, OT_PHASE_DISCONNECT);
+      break;
+    }
+
+    case OT_PHASE_DISCONNECT:
+    default:
+      // Trigger anyway to ensure cleanup, ble lib is glitchy
+      bleClient->disconnect();
+
+      // Waits up to 1s for it, the owner deletes the client afterwards (and crashes if still connected)
+      for(uint8_t stone = 0; stone < 10 && bleClient->isConnected(); ++stone)
+      {
+        TS_HAL.sleep(TS_SleepMode::Task, 100);
+      }
+
+      if(!this->record_phase(OT_PHASE_DISCONNECT, phaseUs, !bleClient->isConnected()))
+      {
+        log_w("_OT_ProtocolV2::exchange_step: bleClient still connected when deleted!");
+      }
+
+      return true;
   }
-  
-  log_i("Loaded TempIDs");
 
-  // DEBUG: populate characteristic cache once
-  this->update_characteristic_cache();
+  return false;
+}
 
-  this->lastScanTs = 0;
+// Static function to call instance method
+void _OT_ProtocolV2::staticExchangeTask(void* parameter)
+{
+  OT_ProtocolV2.exchange_task(parameter);
+}
 
-  // Setup BLE and GATT profile
-  BLEDevice::setMTU(OT_CR_MAXLEN);  // try to send whole message in 1 frame
-  this->bleServer = TS_HAL.ble_server_get();
-  //disable on connect/disconnect callbacks
-  // this->bleServer->setCallbacks(this);
-  this->bleService = bleServer->createService(this->serviceUUID);
+void _OT_ProtocolV2::exchange_task(void* parameter)
+{
+  // one notification per exchange, run to its end
+  // - done is only read by the owner, once it is set the owner may start the next exchange at any time
+  while(true)
+  {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
 
-  this->bleCharacteristic = bleService->createCharacteristic(this->characteristicUUID, BLECharacteristic::PROPERTY_READ | BLECharacteristic::PROPERTY_WRITE);
-  this->bleCharacteristic->setCallbacks(this);
-  this->bleService->start();
+    OT_Exchange &exchange = this->exchange;
+    TaskHandle_t owner = exchange.owner;
+    while(!this->exchange_step(exchange))
+    {
+      xTaskNotifyGive(owner);
+    }
 
-  this->bleAdvertising = this->bleServer->getAdvertising();
-  this->bleAdvertising->addServiceUUID(this->serviceUUID);
-  this->bleAdvertising->setScanResponse(true);  // TODO: do we need this? apparently need this to be true.
-  this->bleAdvertising->setMinPreferred(0x06);  // functions that help with iPhone connections issue
-  // TODO: find out what setMin and setMax interval really means
+    exchange.done = true;
+    xTaskNotifyGive(owner);
+  }
+}
 
+OT_FailureTracker& _OT_ProtocolV2::get_failure_tracker()
+{
+  return this->failureTracker;
 }
 
-void _OT_ProtocolV2::update()
+// Records a phase ending now, and starts the next one
+// - returns success, to wrap checks
+bool _OT_ProtocolV2::record_phase(OT_Phase phase, uint32_t &startUs, bool success)
+{
+  uint32_t nowUs = micros();
+  this->phaseLatency[phase].record(nowUs - startUs, success);
+  startUs = nowUs;
+  return success;
+}
+
+TS_LatencyHistogram& _OT_ProtocolV2::get_phase_latency(OT_Phase phase)
 {
-  // don't turn off radio if we have connected clients
-  uint16_t connectedCount = OT_ProtocolV2.get_connected_count();
-  uint16_t sleepDuration = TS_HAL.random_get(1000, 3000);
+  return this->phaseLatency[phase];
+}
 
-  log_i("Devices connected: %d", connectedCount);
-    
-  if(connectedCount > 0)
+const char* _OT_ProtocolV2::get_phase_name(OT_Phase phase)
+{
+  static const char *names[OT_PHASES] = { "connect", "discover", "characteristic", "write", "read", "disconnect", "peripheral_read", "peripheral_write" };
+  return phase < OT_PHASES ? names[phase] : "";
+}
+
+void _OT_ProtocolV2::reset_phase_latency()
+{
+  for(uint8_t i = 0; i < OT_PHASES; ++i)
   {
-    TS_HAL.sleep(TS_SleepMode::Task, sleepDuration);
+    this->phaseLatency[i].reset();
   }
-  else
+}
+
+void _OT_ProtocolV2::phase_metrics_to_json(std::string &buf)
+{
+  char num[12];
+
+  buf += "{";
+  for(uint8_t i = 0; i < OT_PHASES; ++i)
   {
-    if(TS_POWER.get_state() == TS_PowerState::HIGH_POWER)
-    {
-      TS_HAL.sleep(TS_SleepMode::Task, sleepDuration);
-    }
-    else
+    TS_LatencyHistogram &latency = this->phaseLatency[i];
+
+    if(i > 0) buf += ",";
+    buf += "\"";
+    buf += get_phase_name((OT_Phase)i);
+    buf += "\":{\"ok\":";
+    buf += utoa(latency.get_ok(), num, 10);
+    buf += ",\"fail\":";
+    buf += utoa(latency.get_failed(), num, 10);
+    buf += ",\"avg\":";
+    buf += utoa(latency.get_avg_us(), num, 10);
+    buf += ",\"max\":";
+    buf += utoa(latency.get_max_us(), num, 10);
+    buf += ",\"h\":[";
+    for(uint8_t j = 0; j < TS_LATENCY_BUCKETS; ++j)
     {
-      // Power-saving sleep in low-power mode + no connected clients
-      TS_HAL.sleep(TS_SleepMode::Light, sleepDuration);
+      if(j > 0) buf += ",";
+      buf += utoa(latency.get_bucket(j), num, 10);
     }
+    buf += "]}";
   }
+  buf += "}";
+}
 
-  TS_DateTime datetime;
-  TS_HAL.rtc_get(datetime);
-  int secs = time_to_secs(&datetime);
-  int secs_diff = time_diff(secs, lastScanTs, 86400);
-  
-  if(secs_diff >= SCAN_INTERVAL_SECS)
-  {
-    // spend up to 1s scanning, lowest acceptable rssi: -95
-    OT_ProtocolV2.scan_and_connect(1, -95);
+void _OT_ProtocolV2::set_reexchange_window(uint32_t seconds)
+{
+  this->exchangeCache.set_window(seconds);
+}
 
-    lastScanTs = secs;
-  }
+void _OT_ProtocolV2::set_connectionless(bool enabled)
+{
+  this->connectionless = enabled;
+  this->advertisementStale = true;
 
-  // enable advertising
-  OT_ProtocolV2.advertising_start();
-    
-  // just advertise for 1s
-  TS_HAL.sleep(TS_SleepMode::Task, ADVERTISE_DURATION);
-    
-  // disable advertising, get back to sleep
-  OT_ProtocolV2.advertising_stop();
+  // tokens are in the advertisement itself, scan responses are not needed
+  TS_HAL.ble_scan_set_active(!enabled);
+  log_i("Connectionless mode: %d", enabled);
 }
 
-BLEUUID& _OT_ProtocolV2::getServiceUUID()
+bool _OT_ProtocolV2::is_connectionless()
 {
-  return this->serviceUUID;
+  return this->connectionless;
 }
 
-BLEUUID& _OT_ProtocolV2::getCharacteristicUUID()
+void _OT_ProtocolV2::make_token(const std::string &id, uint8_t *token)
 {
-  return this->characteristicUUID;
+  uint8_t digest[32];
+  mbedtls_sha256_ret((const unsigned char *)id.data(), id.length(), digest, 0);
+  memcpy(token, digest, OT_TOKEN_LEN);
 }
 
-// gets the tempid by time from RTC, in seconds
-// - quantize total seconds by 15 mins (900), mod by OT_TEMPID_MAX and return the relative TempID
-OT_TempID& _OT_ProtocolV2::get_tempid_by_time(uint32_t seconds)
+TS_TxPowerController& _OT_ProtocolV2::get_tx_power()
 {
-  return this->tempIds[(seconds / 900) % OT_TEMPID_MAX];
+  return this->txPower;
 }
 
-// sets the Nth tempid
-// - returns false if failed
-bool _OT_ProtocolV2::set_tempid(const OT_TempID &id, uint16_t n)
+OT_EncounterStats& _OT_ProtocolV2::get_encounter_stats()
 {
-  if (n < 0 || n >= OT_TEMPID_MAX) return false;
-  this->tempIds[n] = id;
+  return this->encounterStats;
+}
+
+void _OT_ProtocolV2::reset_encounter_stats()
+{
+  memset(&this->encounterStats, 0, sizeof(this->encounterStats));
+  this->encounterStats.sinceMs = millis();
+  this->encounterStats.battLevel = TS_HAL.power_get_batt_level();
+}
+
+void _OT_ProtocolV2::log_encounter(OT_ConnectionRecord &connectionRecord, int8_t rssi)
+{
+  this->queue_encounter(this->centralEncounters, connectionRecord, rssi);
+}
+
+// Fixed-size copy of a connection record
+// - lengths are validated by the frame parsers, truncate anyway
+static void pack_encounter(OT_EncounterRecord &encounter, OT_ConnectionRecord &connectionRecord, int8_t rssi, uint32_t capturedMs)
+{
+  strlcpy(encounter.id, connectionRecord.id.c_str(), sizeof(encounter.id));
+  strlcpy(encounter.org, connectionRecord.org.c_str(), sizeof(encounter.org));
+  strlcpy(encounter.deviceType, connectionRecord.deviceType.c_str(), sizeof(encounter.deviceType));
+  encounter.rssi = rssi;
+  encounter.capturedMs = capturedMs;
+}
+
+bool _OT_ProtocolV2::queue_encounter(OT_EncounterRing &ring, OT_ConnectionRecord &connectionRecord, int8_t rssi)
+{
+  OT_EncounterRecord encounter;
+  pack_encounter(encounter, connectionRecord, rssi, millis());
+
+  if(!ring.push(encounter))
+  {
+    this->droppedEncounters.fetch_add(1);
+    return false;
+  }
+
+  if(this->encounterTask != NULL) xTaskNotifyGive(this->encounterTask);
   return true;
 }
 
-// Scans and do handshake w/ relevant peers
-// - seconds: seconds to spend scanning
-// - rssiCutoff: lowerbound rssi to ignore
-bool _OT_ProtocolV2::scan_and_connect(uint8_t seconds, int8_t rssiCutoff)
+bool _OT_ProtocolV2::capture_peripheral_write(BLECharacteristic *pCharacteristic)
 {
-  // Blocking scan
-  BLEScanResults results = TS_HAL.ble_scan(seconds);
+  // the ring slot is only claimed on push, so stage it on the stack
+  OT_RawWrite write;
+  write.binary = pCharacteristic == this->binCharacteristic;
 
-  uint16_t deviceCount = results.getCount();
-  for (uint32_t i = 0; i < deviceCount; i++)
+  if(write.binary)
   {
-    BLEAdvertisedDevice device = results.getDevice(i);
+    // binary frames may contain zero bytes, their length is only known from a copy
+    std::string value = pCharacteristic->getValue();
+    if(value.length() == 0 || value.length() > OT_CR_MAXLEN) return false;
 
-    // filter by service uuid
-    // Note: getServiceUUID crashes for now, do not use
-    if (!device.isAdvertisingService(this->serviceUUID)) continue;
+    write.length = value.length();
+    memcpy(write.data, value.data(), write.length);
+  }
+  else
+  {
+    // getValue would copy into a std::string, the value buffer is already null terminated
+    const char *data = (const char *)pCharacteristic->getData();
+    size_t length = strnlen(data, OT_CR_MAXLEN + 1);
 
-    BLEAddress deviceAddress = device.getAddress();
-    //uint8_t txPower = device.getTXPower();
-    int8_t rssi = (int8_t)device.getRSSI();
+    // ignore empties, oversized frames would be rejected by the parser anyway
+    if(length == 0 || length > OT_CR_MAXLEN) return false;
 
-    if(rssi < rssiCutoff) continue;
+    write.length = length;
+    memcpy(write.data, data, length);
+  }
 
-    log_i("%s rssi: %d", deviceAddress.toString().c_str(), rssi);
+  write.capturedMs = millis();
 
-    // We do not need a map of last-seen as this function should have long intervals between calls
-    // Connect to each one and read + write iff parameters are correct
-    // TODO: see if we can parallelize this process
-    this->connect_and_exchange(device, deviceAddress, rssi);
+  if(!this->peripheralWrites.push(write))
+  {
+    this->droppedEncounters.fetch_add(1);
+    return false;
   }
+
+  if(this->encounterTask != NULL) xTaskNotifyGive(this->encounterTask);
+  return true;
 }
 
-bool _OT_ProtocolV2::connect_and_exchange(BLEAdvertisedDevice &device, BLEAddress &address, int8_t rssi)
+bool _OT_ProtocolV2::decode_peripheral_write(std::string &payload, bool binary, OT_ConnectionRecord &connectionRecord)
 {
-  BLEClient *bleClient = BLEDevice::createClient(); // new BLEClient
-  bool ret = this->connect_and_exchange_impl(bleClient, device, address, rssi);
-
-  // Trigger anyway to ensure cleanup, ble lib is glitchy
-  bleClient->disconnect();
-
-  // Waits up to 1s for it before forcefully deleting (and crashing)
-  for(uint8_t stone = 0; stone < 10; ++stone)
+  if(binary)
   {
-    if(bleClient->isConnected())
+    if(!this->process_binary_frame(payload, true, connectionRecord))
     {
-      if(stone >= 9)
-      {
-        log_w("_OT_ProtocolV2::connect_and_exchange: bleClient still connected when deleted!");
-      }
-      
-      TS_HAL.sleep(TS_SleepMode::Task, 100);
+      log_w("Binary frame invalid");
+      return false;
     }
+
+    log_i("BLE peripheral Recv: binary, %d bytes, id: %s", payload.length(), connectionRecord.id.c_str());
+    return true;
   }
-  
-  delete bleClient;
-  return ret;
+
+  log_i("BLE peripheral Recv: %s", payload.c_str());
+
+  if(!this->process_peripheral_write_request(payload, connectionRecord))
+  {
+    log_w("Parse error or data invalid");
+    return false;
+  }
+
+  return true;
 }
 
-bool _OT_ProtocolV2::connect_and_exchange_impl(BLEClient *bleClient, BLEAdvertisedDevice &device, BLEAddress &address, int8_t rssi)
+uint16_t _OT_ProtocolV2::store_encounters()
 {
-  // Connect to the BLE Server
+  OT_EncounterRing *rings[] = { &this->centralEncounters, &this->peripheralEncounters };
+  OT_EncounterRecord encounter;
+  OT_RawWrite write;
+  TS_DateTime datetime;
+  uint16_t stored = 0;
 
-  // NOTE: used to be this but failed to do TraceStick-TraceStick connection
-  // bleClient->connect(address, BLE_ADDR_TYPE_RANDOM);
-  bleClient->connect(&device);
-  
-  BLERemoteService* pRemoteService;
-  BLERemoteCharacteristic* pRemoteCharacteristic;
+  TS_HAL.rtc_get(datetime); // this takes some time, read once per batch
+  uint32_t nowMs = millis();
 
-  if(!bleClient->isConnected()) 
+  OT_EncounterRole roles[] = { OT_ROLE_CENTRAL, OT_ROLE_PERIPHERAL };
+  for(uint8_t i = 0; i < 2; ++i)
   {
-    log_w("Client connection failed");
-    return false;
+    while(rings[i]->pop(encounter))
+    {
+      this->merge_encounter(encounter, roles[i], datetime, nowMs, stored);
+    }
   }
 
-  pRemoteService = bleClient->getService(this->serviceUUID);
-  if (pRemoteService == NULL)
+  while(this->peripheralWrites.pop(write))
   {
-    log_w("Failed to find our service UUID");
-    return false;
+    std::string payload((const char *)write.data, write.length);
+    OT_ConnectionRecord connectionRecord;
+    if(!this->decode_peripheral_write(payload, write.binary, connectionRecord)) continue;
+
+    // peer reports the rssi it saw us at
+    pack_encounter(encounter, connectionRecord, connectionRecord.rssi, write.capturedMs);
+    this->merge_encounter(encounter, OT_ROLE_PERIPHERAL, datetime, nowMs, stored);
   }
 
-  pRemoteCharacteristic = pRemoteService->getCharacteristic(this->characteristicUUID);
-  if (pRemoteCharacteristic == NULL)
+  // merged records are stored once their window is over
+  OT_MergedEncounter merged;
+  while(this->encounterMerger.pop(merged, nowMs, false))
   {
-    log_w("Failed to find our characteristic UUID");
-    return false;
+    if(this->store_encounter(merged, datetime, nowMs)) ++stored;
   }
 
-  if(!pRemoteCharacteristic->canRead() || !pRemoteCharacteristic->canWrite())
+  uint32_t dropped = this->droppedEncounters.exchange(0);
+  if(dropped > 0)
   {
-    log_w("Unable to read or write");
-    return false;
+    log_w("Encounter rings full, dropped: %d", dropped);
   }
 
-  std::string buf;
-  this->prepare_central_write_request(buf, rssi);
-  pRemoteCharacteristic->writeValue(buf, false);
-  
-  log_i("BLE central Send: %s", buf.c_str());
+  // throttles itself, only does work when due or low on memory
+  TS_Storage.peer_cleanup(&datetime);
 
-  OT_ConnectionRecord connectionRecord;
-  buf = pRemoteCharacteristic->readValue();
-  
-  if(!this->process_central_read_request(buf, connectionRecord))
+  return stored;
+}
+
+// Hands a sighting to the merger, storing the oldest pending record early if it is full
+void _OT_ProtocolV2::merge_encounter(OT_EncounterRecord &encounter, OT_EncounterRole role, TS_DateTime &datetime, uint32_t nowMs, uint16_t &stored)
+{
+  // centrals writing to us report how well they hear our advertising
+  if(role == OT_ROLE_PERIPHERAL) this->txPower.report(encounter.rssi);
+
+  OT_MergedEncounter oldest;
+  while(!this->encounterMerger.add(encounter, role))
+  {
+    if(!this->encounterMerger.pop(oldest, nowMs, true)) break;
+    if(this->store_encounter(oldest, datetime, nowMs)) ++stored;
+  }
+}
+
+OT_EncounterMerger& _OT_ProtocolV2::get_encounter_merger()
+{
+  return this->encounterMerger;
+}
+
+bool _OT_ProtocolV2::store_encounter(OT_MergedEncounter &merged, TS_DateTime &datetime, uint32_t nowMs)
+{
+  OT_EncounterRecord &encounter = merged.record;
+
+  // backdate to the first sighting, without crossing midnight
+  TS_DateTime capturedAt = datetime;
+  int secs = time_to_secs(&datetime) - (int)((nowMs - merged.firstMs) / 1000);
+  if(secs < 0) secs = 0;
+  capturedAt.hour = secs / 3600;
+  capturedAt.minute = (secs / 60) % 60;
+  capturedAt.second = secs % 60;
+
+  if(!TS_Storage.peer_log_incident(encounter.id, encounter.org, encounter.deviceType, merged.rssi, merged.samples, &capturedAt))
   {
-    log_w("Json parse error or read failed");
+    log_w("Unable to log encounter");
     return false;
   }
 
-  log_i("BLE central Recv: %s", buf.c_str());
+  return true;
+}
+
+void _OT_ProtocolV2::log_callback_stats()
+{
+  TS_LatencyHistogram &latency = this->phaseLatency[OT_PHASE_PERIPHERAL_WRITE];
+  if(latency.get_count() == 0) return;
+
+  log_i("onWrite latency, count: %d, avg: %dus, p90: <%dus, max: %dus (deferred decode: %d)",
+    latency.get_count(), latency.get_avg_us(), latency.get_percentile_us(90), latency.get_max_us(), OT_DEFER_WRITE_DECODE);
+}
+
+// Static function to call instance method
+void _OT_ProtocolV2::staticEncounterTask(void* parameter)
+{
+  OT_ProtocolV2.encounter_task(parameter);
+}
+
+void _OT_ProtocolV2::encounter_task(void* parameter)
+{
+  uint32_t statsMs = millis();
   
-  // TODO: store data read into connectionRecord somewhere
+  while(true)
+  {
+    // woken by producers, or periodically so cleanup still runs when nobody is around
+    // - sooner while merged records wait for their window to end
+    uint32_t waitSecs = this->encounterMerger.get_pending() > 0 ? OT_MERGE_WINDOW_SECS / 4 : OT_ENCOUNTER_CLEANUP_SECS;
+    ulTaskNotifyTake(pdTRUE, (waitSecs * 1000) / portTICK_PERIOD_MS);
+    this->store_encounters();
 
-  return true;
+    if(millis() - statsMs >= OT_ENCOUNTER_CLEANUP_SECS * 1000)
+    {
+      this->log_callback_stats();
+      statsMs = millis();
+    }
+  }
 }
 
 void _OT_ProtocolV2::advertising_start()
 {
+  // once set, the data stays custom, turning connectionless off has to rebuild the default one
+  if(this->advertisementStale && (this->connectionless || this->advertisementCustom))
+  {
+    this->update_advertisement_data();
+  }
+
+  TS_HAL.ble_set_power(this->txPower.get_adv_power(), BLE_POWER_ADV);
   this->bleAdvertising->start();
 }
 
@@ -277,6 +1424,27 @@ void _OT_ProtocolV2::advertising_stop()
   this->bleAdvertising->stop();
 }
 
+// Flags and service, with the token in connectionless mode
+// - the scan response is left to the library
+void _OT_ProtocolV2::update_advertisement_data()
+{
+  std::string mfrData;
+  mfrData += (char)(OT_TOKEN_COMPANY_ID & 0xFF);
+  mfrData += (char)(OT_TOKEN_COMPANY_ID >> 8);
+
+  xSemaphoreTake( characteristicCacheMutex, portMAX_DELAY );
+  mfrData.append((const char *)this->advertisedToken, OT_TOKEN_LEN);
+  this->advertisementStale = false;
+  xSemaphoreGive( characteristicCacheMutex );
+
+  BLEAdvertisementData data;
+  data.setFlags(ESP_BLE_ADV_FLAG_GEN_DISC | ESP_BLE_ADV_FLAG_BREDR_NOT_SPT);
+  data.setCompleteServices(this->serviceUUID);
+  if(this->connectionless) data.setManufacturerData(mfrData);
+  this->bleAdvertising->setAdvertisementData(data);
+  this->advertisementCustom = true;
+}
+
 uint16_t _OT_ProtocolV2::get_connected_count()
 {
   return this->bleServer->getConnectedCount();
@@ -284,19 +1452,24 @@ uint16_t _OT_ProtocolV2::get_connected_count()
 
 void _OT_ProtocolV2::update_characteristic_cache()
 {
-  uint32_t secondsNow;
-  TS_DateTime datetime;
-
-  TS_HAL.rtc_get(datetime); // this takes some time
-  secondsNow = datetime.second + datetime.minute * 60 + datetime.hour * 3600;
-
-  OT_TempID& tempId = this->get_tempid_by_time( secondsNow );
+  // this takes some time, 0 while the clock is not set
+  uint32_t until = 0;
+  OT_TempID tempId = this->get_tempid_by_time( TS_HAL.rtc_get_unix(), &until );
 
   // Take semaphore to write string cache
   xSemaphoreTake( characteristicCacheMutex, portMAX_DELAY );
   this->charCacheTempId = tempId;
+  this->charCacheUntil = until;
   this->prepare_peripheral_read_request( characteristicCache, tempId );
+  bool binaryPacked = this->prepare_binary_frame( binCharacteristicCache, tempId );
+  make_token( tempId, this->advertisedToken );
+  this->advertisementStale = true;
   xSemaphoreGive( characteristicCacheMutex );
+
+  if(!binaryPacked)
+  {
+    log_w("TempID is not valid base64, binary frames disabled until the next TempID");
+  }
 }
 
 void _OT_ProtocolV2::onConnect(BLEServer* pServer)
@@ -310,36 +1483,58 @@ void _OT_ProtocolV2::onDisconnect(BLEServer* pServer)
 }
 
 // Callback after data is written from writer
+// - runs on the BLE stack task, keep it short as it delays the ATT response
 void _OT_ProtocolV2::onWrite(BLECharacteristic *pCharacteristic)
 {
-  std::string payload = pCharacteristic->getValue();
-  if (payload.length() ==  0) return; // ignore empties
-
-  log_i("BLE peripheral Recv: %s", payload.c_str());
+  uint32_t startCycles = ESP.getCycleCount();
 
+#if OT_DEFER_WRITE_DECODE
+  this->capture_peripheral_write(pCharacteristic);
+#else
+  std::string payload = pCharacteristic->getValue();
   OT_ConnectionRecord cr;
-
-  if(!this->process_peripheral_write_request(payload, cr))
+  if (payload.length() != 0 && this->decode_peripheral_write(payload, pCharacteristic == this->binCharacteristic, cr))
   {
-    log_w("Parse error or data invalid");
+    // peer reports the rssi it saw us at
+    this->queue_encounter(this->peripheralEncounters, cr, cr.rssi);
   }
+#endif
 
-  // TODO: cumulate to flash
+  uint32_t cycles = ESP.getCycleCount() - startCycles;
+  this->phaseLatency[OT_PHASE_PERIPHERAL_WRITE].record(cycles / getCpuFrequencyMhz(), true);
 }
 
 // Callback before data is returned to reader
 // - we got a chance to change characteristic data before data is returned
 void _OT_ProtocolV2::onRead(BLECharacteristic* pCharacteristic)
 {
-  if (pCharacteristic != this->bleCharacteristic) return; // ignore things we don't care about
+  uint32_t startCycles = ESP.getCycleCount();
 
-  // Take semaphore to read string
-  xSemaphoreTake( characteristicCacheMutex, portMAX_DELAY );
-  // write characteristicCache to characteristic
-  pCharacteristic->setValue( characteristicCache );
-  xSemaphoreGive( characteristicCacheMutex );
+  if (pCharacteristic == this->binCharacteristic)
+  {
+    xSemaphoreTake( characteristicCacheMutex, portMAX_DELAY );
+    pCharacteristic->setValue( binCharacteristicCache );
+    xSemaphoreGive( characteristicCacheMutex );
+
+    log_i("BLE peripheral Send: binary, %d bytes", binCharacteristicCache.length() );
+  }
+  else if (pCharacteristic == this->bleCharacteristic)
+  {
+    // Take semaphore to read string
+    xSemaphoreTake( characteristicCacheMutex, portMAX_DELAY );
+    // write characteristicCache to characteristic
+    pCharacteristic->setValue( characteristicCache );
+    xSemaphoreGive( characteristicCacheMutex );
+
+    log_i("BLE peripheral Send: %s", characteristicCache.c_str() );
+  }
+  else
+  {
+    return; // ignore things we don't care about
+  }
 
-  log_i("BLE peripheral Send: %s", characteristicCache.c_str() );
+  uint32_t cycles = ESP.getCycleCount() - startCycles;
+  this->phaseLatency[OT_PHASE_PERIPHERAL_READ].record(cycles / getCpuFrequencyMhz(), true);
 }
 
 //
@@ -396,7 +1591,7 @@ bool _OT_ProtocolV2::process_peripheral_write_request(std::string& payload, OT_C
   raw = root["id"];
   if(raw == NULL) return false;
   connectionRecord.id = raw;
-  if(connectionRecord.deviceType.length() > OT_CR_ID_MAX) return false;
+  if(connectionRecord.id.length() > OT_CR_ID_MAX) return false;
 
   return true;
 }
@@ -458,12 +1653,109 @@ bool _OT_ProtocolV2::process_central_read_request(std::string& payload, OT_Conne
   raw = root["id"];
   if(raw == NULL) return false;
   connectionRecord.id = raw;
-  if(connectionRecord.deviceType.length() > OT_CR_ID_MAX) return false;
+  if(connectionRecord.id.length() > OT_CR_ID_MAX) return false;
+
+  return true;
+}
+
+static void append_tlv(std::string &buf, uint8_t tag, const void *value, uint8_t length)
+{
+  buf += (char)tag;
+  buf += (char)length;
+  buf.append((const char *)value, length);
+}
+
+// Pack binary frame
+// - version, id, o, mp
+bool _OT_ProtocolV2::prepare_binary_frame(std::string &buf, std::string &id)
+{
+  uint8_t rawId[OT_BIN_ID_MAX];
+  size_t rawIdLen;
+
+  buf.clear();
+  if(mbedtls_base64_decode(rawId, sizeof(rawId), &rawIdLen, (const unsigned char *)id.data(), id.length()) != 0) return false;
+
+  buf += (char)OT_PROTOVER;
+  append_tlv(buf, OT_BIN_TAG_ID, rawId, rawIdLen);
+  append_tlv(buf, OT_BIN_TAG_ORG, OT_ORG, strlen(OT_ORG));
+  append_tlv(buf, OT_BIN_TAG_MODEL, DEVICE_NAME, strlen(DEVICE_NAME));
+  return true;
+}
+
+// Pack binary frame as central
+// - version, id, o, mc, rs
+bool _OT_ProtocolV2::prepare_central_write_binary(std::string& buf, int8_t rssi)
+{
+  // Take semaphore to read cached frame, mc is the same as mp
+  xSemaphoreTake( characteristicCacheMutex, portMAX_DELAY );
+  buf = this->binCharacteristicCache;
+  xSemaphoreGive( characteristicCacheMutex );
+
+  if(buf.length() == 0) return false;
 
+  append_tlv(buf, OT_BIN_TAG_RSSI, &rssi, 1);
   return true;
 }
 
+// Process binary frame into ConnectionRecord
+// - strict checking to avoid overflowing, unknown tags are skipped for newer peers
+bool _OT_ProtocolV2::process_binary_frame(std::string& payload, bool fromCentral, OT_ConnectionRecord& connectionRecord)
+{
+  const uint8_t *data = (const uint8_t *)payload.data();
+  size_t length = payload.length();
+  bool hasId = false, hasOrg = false, hasModel = false, hasRssi = false;
+
+  connectionRecord.rssi = 127;  // unused field for peripherals, set to known value
+
+  if (length == 0 || length > OT_CR_MAXLEN) return false; // filter empty and excessive length
+  if (data[0] != OT_PROTOVER) return false;               // filter invalid version
+
+  for(size_t i = 1; i < length;)
+  {
+    if(i + 2 > length) return false;  // truncated tag
+
+    uint8_t tag = data[i];
+    uint8_t tagLength = data[i + 1];
+    const uint8_t *value = data + i + 2;
 
+    i += 2 + tagLength;
+    if(i > length) return false;      // truncated value
 
+    switch(tag)
+    {
+      case OT_BIN_TAG_ID:
+      {
+        char id[OT_CR_ID_MAX + 1];
+        size_t idLength;
+        if(tagLength > OT_BIN_ID_MAX) return false;
+        if(mbedtls_base64_encode((unsigned char *)id, sizeof(id), &idLength, value, tagLength) != 0) return false;
+        connectionRecord.id.assign(id, idLength);
+        hasId = true;
+        break;
+      }
 
+      case OT_BIN_TAG_ORG:
+        if(tagLength > OT_CR_SHORT_MAX) return false;
+        connectionRecord.org.assign((const char *)value, tagLength);
+        hasOrg = true;
+        break;
+
+      case OT_BIN_TAG_MODEL:
+        if(tagLength > OT_CR_SHORT_MAX) return false;
+        connectionRecord.deviceType.assign((const char *)value, tagLength);
+        hasModel = true;
+        break;
+
+      case OT_BIN_TAG_RSSI:
+        if(tagLength != 1) return false;
+        connectionRecord.rssi = (int8_t)value[0];
+        hasRssi = true;
+        break;
+
+      default:
+        break;
+    }
+  }
 
+  return hasId && hasOrg && hasModel && (hasRssi || !fromCentral);
+}
@@ -15,6 +15,9 @@
 #include <BLEServer.h>
 #include <BLEUtils.h>
 #include <BLEDevice.h>
+#include "cleanbox.h"
+#include "metrics.h"
+#include "txpower.h"
 
 #define OT_ORG          "SG_MOH"
 #define OT_PROTOVER     2
@@ -26,8 +29,78 @@
 #define OT_SERVICEID        "B82AB3FC-1595-4F6A-80F0-FE094CC218F9"
 #define OT_CHARACTERISTICID "117BDD58-57CE-4E7A-8E87-7CCCDDA2A804"
 
+// Binary frame characteristic, only exposed by TraceSticks
+// - phones do not have it and keep exchanging json
+#define OT_BINCHARACTERISTICID "5C3A9E27-8D1B-4F60-A2C4-3B7E6D19F0A5"
+
+// Binary frame: version byte, then tag, length, value triplets
+// - TempID is sent as raw bytes instead of base64
+#define OT_BIN_ID_MAX   ((OT_CR_ID_MAX / 4) * 3)
+#define OT_BIN_TAG_ID     0x01
+#define OT_BIN_TAG_ORG    0x02
+#define OT_BIN_TAG_MODEL  0x03  // mp from peripherals, mc from centrals
+#define OT_BIN_TAG_RSSI   0x04  // centrals only
+
 #define OT_TEMPID_MAX   100
 
+// Recently exchanged peers are not reconnected to within this window
+#define OT_EXCHANGE_CACHE_MAX     16
+#define OT_REEXCHANGE_WINDOW_SECS 300
+
+// Non-OpenTrace advertisers are remembered for 1-2 rotations
+// - rotates early when a generation holds too many addresses to keep false positives low
+// - (1-e^(-3*120/2048))^3 is 0.4% a generation, under 1% with both checked, each one drops a real peer until rotated out
+#define OT_NEGCACHE_BITS          2048
+#define OT_NEGCACHE_HASHES        3
+#define OT_NEGCACHE_GEN_MAX       120
+#define OT_NEGCACHE_ROTATE_SECS   300
+
+// Encounters are handed from BLE callbacks to the storage task through fixed-size rings
+// - one ring per producer, central exchanges and peripheral writes
+#define OT_ENCOUNTER_RING_MAX     16
+#define OT_ENCOUNTER_CLEANUP_SECS 60
+
+// Peripheral writes are copied raw in the GATT callback and decoded by the storage task
+// - set to 0 to decode inside the callback instead, to compare callback latency
+#define OT_DEFER_WRITE_DECODE     1
+#define OT_WRITE_RING_MAX         8
+
+// Sightings of one TempID within the window are merged before storage, across both roles
+// - a phone is often read by us and writes to us within the same minute
+#define OT_MERGE_WINDOW_SECS      60
+#define OT_MERGE_MAX              16
+#define OT_MERGE_SAMPLES_MAX      16    // per role, further sightings only move the timestamp
+
+// Peers failing exchanges are backed off exponentially, then blacklisted for a while
+// - backoff doubles from base up to max with every consecutive failure
+#define OT_FAILURE_TRACK_MAX      16
+#define OT_BACKOFF_BASE_SECS      30
+#define OT_BACKOFF_MAX_SECS       600
+#define OT_BLACKLIST_FAILURES     5
+#define OT_BLACKLIST_SECS         3600
+
+// Connectionless mode: sticks advertise a short token of their active TempID in manufacturer data
+// - scanners log the rssi of tokens they already hold the TempID of, without connecting
+// - the token changes with the TempID, so each TempID is exchanged with once per peer
+// - advertisement is full with flags, service uuid and token, 31 bytes
+#define OT_TOKEN_LEN          6
+#define OT_TOKEN_COMPANY_ID   0xFFFF  // reserved for tests, no company id assigned
+#define OT_TOKEN_CACHE_MAX    32
+
+// Central exchanges run on their own task, one step at a time
+// - each step has a deadline, past it the exchange is cancelled by disconnecting
+// - the caller polls for completion and may return to the scheduler meanwhile
+#define OT_DEADLINE_CONNECT_MS        3000
+#define OT_DEADLINE_DISCOVER_MS       2000
+#define OT_DEADLINE_CHARACTERISTIC_MS 1000
+#define OT_DEADLINE_WRITE_MS          1000
+#define OT_DEADLINE_READ_MS           1000
+#define OT_DEADLINE_DISCONNECT_MS     1000
+
+// An exchange the BLE library never returned from, scans go on without exchanges meanwhile
+// - past this the library is assumed hung for good and the device reboots
+#define OT_WEDGE_REBOOT_MS            60000
+
 // TODO: store in mem as byte arrays instead of encoded strings
 
 //
@@ -36,6 +109,33 @@
 
 typedef std::string OT_TempID;
 
+// Outcome of one exchange, failures by category
+enum OT_ExchangeResult
+{
+  OT_EXCHANGE_OK,
+  OT_EXCHANGE_CONNECT_FAILED,
+  OT_EXCHANGE_NO_SERVICE,
+  OT_EXCHANGE_NO_CHARACTERISTIC,
+  OT_EXCHANGE_NO_ACCESS,        // characteristic not readable or writable
+  OT_EXCHANGE_BAD_FRAME,        // read failed or frame invalid
+  OT_EXCHANGE_TIMEOUT,          // a step missed its deadline and was cancelled
+  OT_EXCHANGE_RESULTS,
+};
+
+// Timed phases of exchanges, as central and as peripheral
+enum OT_Phase
+{
+  OT_PHASE_CONNECT,
+  OT_PHASE_DISCOVER,          // service lookup
+  OT_PHASE_CHARACTERISTIC,    // characteristic lookup
+  OT_PHASE_WRITE,
+  OT_PHASE_READ,
+  OT_PHASE_DISCONNECT,        // including the wait for the client to let go
+  OT_PHASE_PERIPHERAL_READ,   // onRead callback
+  OT_PHASE_PERIPHERAL_WRITE,  // onWrite callback
+  OT_PHASES,
+};
+
 //
 // Structs
 //
@@ -49,10 +149,243 @@ struct OT_ConnectionRecord
   int8_t      rssi;   // valid range: -128 to 127
 };
 
+// Fixed-size copy of a connection record, queued for storage
+struct OT_EncounterRecord
+{
+  char      id[OT_CR_ID_MAX + 1];
+  char      org[OT_CR_SHORT_MAX + 1];
+  char      deviceType[OT_CR_SHORT_MAX + 1];
+  int8_t    rssi;
+  uint32_t  capturedMs;   // millis() when queued, backdated against the RTC when stored
+};
+
+typedef SpscRing<OT_EncounterRecord, OT_ENCOUNTER_RING_MAX> OT_EncounterRing;
+
+// Role we had in an encounter
+// - as central the rssi is ours, as peripheral it is the one the peer reports
+enum OT_EncounterRole
+{
+  OT_ROLE_CENTRAL,
+  OT_ROLE_PERIPHERAL,
+  OT_ROLES,
+};
+
+// Sightings of a TempID waiting to be merged
+struct OT_MergeEntry
+{
+  OT_EncounterRecord record;            // first sighting, stamped with the last one
+  uint32_t           firstMs;           // the window counts from here
+  int8_t             rssi[OT_ROLES][OT_MERGE_SAMPLES_MAX];
+  uint8_t            samples[OT_ROLES];
+};
+
+// Sightings of a TempID once merged, the samples are those of the role with the most
+struct OT_MergedEncounter
+{
+  OT_EncounterRecord record;            // rssi is the mean of the samples
+  uint32_t           firstMs;           // first sighting, the incident starts here
+  int8_t             rssi[OT_MERGE_SAMPLES_MAX];
+  uint8_t            samples;
+};
+
+// Peripheral write payload, copied as received
+struct OT_RawWrite
+{
+  uint16_t  length;
+  uint8_t   data[OT_CR_MAXLEN];
+  uint32_t  capturedMs;
+  bool      binary;       // written to the binary characteristic
+};
+
+typedef SpscRing<OT_RawWrite, OT_WRITE_RING_MAX> OT_RawWriteRing;
+
+
+// Outcome of one scan
+struct OT_ScanSummary
+{
+  uint16_t peers;       // OpenTrace peers seen
+  uint16_t newPeers;    // peers which were not exchanged with recently, or changed TempID
+  uint16_t exchanged;   // successful exchanges
+  uint16_t deferred;    // peers left for the next scan, exchange budget ran out
+  uint32_t exchangeMs;  // time spent exchanging
+};
+
+// Central exchange in flight
+// - steps are OT_Phase values from connect to disconnect
+// - written by the exchange task, except cancelled which the owner sets
+struct OT_Exchange
+{
+  BLEClient               *client;        // owned by the task which started the exchange
+  esp_bd_addr_t            address;
+  esp_ble_addr_type_t      addressType;
+  int8_t                   rssi;
+  TaskHandle_t             owner;         // notified after every step
+  volatile OT_Phase        phase;         // step running
+  volatile uint32_t        phaseStartMs;  // step deadlines count from here
+  volatile bool            cancelled;
+  volatile bool            done;          // set last, the exchange task no longer touches it afterwards
+  OT_ExchangeResult        result;
+  bool                     binary;
+  BLERemoteService        *service;
+  BLERemoteCharacteristic *characteristic;
+  std::string              buf;
+  OT_ConnectionRecord      record;
+};
+
+// Recent exchange, keyed by BLE address
+struct OT_ExchangeCacheEntry
+{
+  esp_bd_addr_t       address;
+  uint32_t            exchangedMs;  // time of last successful exchange
+  uint32_t            usedMs;       // time of last lookup, for LRU eviction
+  OT_ConnectionRecord record;       // last record received from this address
+};
+
+// Consecutive exchange failures of an address
+struct OT_FailureEntry
+{
+  esp_bd_addr_t address;
+  uint8_t       failures;
+  uint32_t      retryMs;    // no exchanges before this time
+};
+
+// Token of a TempID seen in advertisements
+struct OT_TokenCacheEntry
+{
+  uint8_t             token[OT_TOKEN_LEN];
+  uint32_t            usedMs;       // time of last lookup, for LRU eviction
+  OT_ConnectionRecord record;       // record received from the token's TempID
+};
+
+// Encounter counters since the last reset, to compare connectionless and exchange modes
+struct OT_EncounterStats
+{
+  uint32_t sinceMs;
+  uint8_t  battLevel;     // at reset
+  uint32_t scans;
+  uint32_t scanMs;        // radio on scanning, exchanges excluded
+  uint32_t exchangeMs;
+  uint32_t advertiseMs;
+  uint32_t peers;         // OpenTrace advertisements accepted
+  uint32_t exchanges;     // successful GATT exchanges
+  uint32_t cacheSamples;  // logged from the exchange cache
+  uint32_t tokenSamples;  // logged from the token cache
+  uint32_t tokenMisses;   // advertised tokens not in the token cache
+};
+
 //
 // Classes
 //
 
+// Small LRU of peers we have recently exchanged with
+// - lets the scanner skip reconnecting to a peer until the re-exchange window lapses
+class OT_ExchangeCache
+{
+  public:
+    OT_ExchangeCache();
+
+    void set_window(uint32_t seconds);
+    uint32_t get_window();
+
+    // Returns the last record of address if exchanged within the window, NULL otherwise
+    OT_ConnectionRecord* find(BLEAddress &address, uint32_t nowMs);
+
+    // Adds or refreshes an address, evicting the least recently used entry when full
+    // - returns true if the address is new or has a new TempID
+    bool put(BLEAddress &address, OT_ConnectionRecord &record, uint32_t nowMs);
+
+    void clear();
+
+  private:
+    OT_ExchangeCacheEntry entries[OT_EXCHANGE_CACHE_MAX];
+    uint8_t               count;
+    uint32_t              windowMs;
+};
+
+// Tracks addresses failing exchanges, so they do not use up the exchange budget of every scan
+// - bounded, entries retrying soonest are evicted first
+// - blacklisted entries are dropped once their blacklist expires
+class OT_FailureTracker
+{
+  public:
+    OT_FailureTracker();
+
+    // Returns true if address should not be exchanged with yet
+    bool is_backed_off(BLEAddress &address, uint32_t nowMs);
+
+    // Records an exchange outcome, success clears the address
+    void record(BLEAddress &address, OT_ExchangeResult result, uint32_t nowMs);
+
+    uint32_t get_count(OT_ExchangeResult result);
+    uint32_t get_skipped();
+
+  private:
+    OT_FailureEntry entries[OT_FAILURE_TRACK_MAX];
+    uint8_t         count;
+    uint32_t        results[OT_EXCHANGE_RESULTS];
+    uint32_t        skipped;  // exchanges skipped while backed off
+
+    int8_t find(BLEAddress &address);
+    void remove(uint8_t i);
+};
+
+// LRU of advertised tokens we hold the TempID of
+class OT_TokenCache
+{
+  public:
+    OT_TokenCache();
+
+    // Returns the record of token, NULL if unknown
+    OT_ConnectionRecord* find(const uint8_t *token, uint32_t nowMs);
+
+    // Adds or refreshes a token, evicting the least recently used entry when full
+    void put(const uint8_t *token, OT_ConnectionRecord &record, uint32_t nowMs);
+
+  private:
+    OT_TokenCacheEntry entries[OT_TOKEN_CACHE_MAX];
+    uint8_t            count;
+};
+
+// Coalesces sightings by TempID before they are stored
+// - one record per TempID and window, with the mean rssi of the role with most samples
+// - ties go to the central role, our own measurement
+class OT_EncounterMerger
+{
+  public:
+    OT_EncounterMerger();
+
+    // Merges a sighting into a pending one of the same TempID
+    // - returns false if it is new and there is no room left
+    bool add(OT_EncounterRecord &encounter, OT_EncounterRole role);
+
+    // Pops the oldest pending record if its window is over, or if forced
+    bool pop(OT_MergedEncounter &encounter, uint32_t nowMs, bool force);
+
+    uint16_t get_pending();
+    uint32_t get_merged();
+
+  private:
+    OT_MergeEntry entries[OT_MERGE_MAX];
+    uint8_t       count;
+    uint32_t      merged;   // sightings folded into another one since boot
+};
+
+// Remembers addresses of recently seen non-OpenTrace advertisers
+// - two bloom filter generations, the older one is cleared on rotation
+class OT_NegativeCache
+{
+  public:
+    OT_NegativeCache();
+
+    bool contains(BLEAddress &address);
+    void add(BLEAddress &address, uint32_t nowMs);
+
+  private:
+    BloomFilter<OT_NEGCACHE_BITS, OT_NEGCACHE_HASHES> generations[2];
+    uint8_t  current;
+    uint32_t rotatedMs;
+};
+
 class _OT_ProtocolV2
 : public BLECharacteristicCallbacks, public BLEServerCallbacks
 {
@@ -61,19 +394,24 @@ class _OT_ProtocolV2
 
     void begin();
 
-    // Blocking update, call at least once a second
+    // Blocking update, runs one scheduled radio cycle
     void update();
 
     //////////
     // UUIDs
     BLEUUID& getServiceUUID();
     BLEUUID& getCharacteristicUUID();
+    BLEUUID& getBinaryCharacteristicUUID();
 
     //////////
     // TempID
 
-    // gets the tempid by time from RTC, in seconds
-    OT_TempID& get_tempid_by_time(uint32_t seconds);
+    // Loads the TempIDs and their times from storage, again whenever a sync replaced them
+    void load_tempids();
+
+    // TempID valid at unixTime, by its start and expiry
+    // - until, if given, gets the time it stops being the current one
+    OT_TempID get_tempid_by_time(uint32_t unixTime, uint32_t *until = NULL);
 
     // sets the Nth tempid
     bool set_tempid(const OT_TempID &id, uint16_t n);
@@ -83,18 +421,107 @@ class _OT_ProtocolV2
     //////////
     // Client scan and connect
     
-    bool scan_and_connect(uint8_t seconds, int8_t rssiCutoff);
+    bool scan_and_connect(uint32_t windowMs, int8_t rssiCutoff, uint32_t exchangeBudgetMs, OT_ScanSummary &summary);
+
+    // Scan filter, rejects non-OpenTrace advertisers and weak signals while scanning
+    bool filter_advertised_device(BLEAdvertisedDevice &device);
+
+    // Logs a cached peer, returns true if the scan result needs an exchange
+    bool scan_result_needs_exchange(TS_BleScanResult &result);
+
+    // Exchanges with a scanned peer, waiting up to budgetMs, returns false if still running
+    bool exchange_with(TS_BleScanResult &result, uint32_t budgetMs, OT_ScanSummary &summary);
+
+    //////////
+    // Client exchange engine
+
+    // Hands an exchange with result to the exchange task, returns false if one is still running
+    bool exchange_start(TS_BleScanResult &result);
+
+    // Waits up to waitMs for the running exchange, cancelling it past a step deadline
+    // - returns true once it finished, with its result, and records it
+    bool exchange_poll(uint32_t waitMs, OT_ExchangeResult &result);
 
-    bool connect_and_exchange(BLEAdvertisedDevice &device, BLEAddress &address, int8_t rssi);
-    bool connect_and_exchange_impl(BLEClient *bleClient, BLEAdvertisedDevice &device, BLEAddress &address, int8_t rssi);
+    // Cancels the running exchange, exchange_poll still has to collect it
+    void exchange_cancel();
+    bool is_exchange_busy();
 
-    // TODO: callback for storage
+    // Sleeps durationMs without suspending the radio, collecting the running exchange if it finishes
+    void exchange_sleep(uint32_t durationMs);
+
+    // Runs the current step, blocking in the BLE library, and moves to the next
+    // - returns true once the exchange disconnected
+    bool exchange_step(OT_Exchange &exchange);
+    void exchange_next(OT_Exchange &exchange, OT_Phase phase);
+    void exchange_fail(OT_Exchange &exchange, OT_ExchangeResult result, const char *reason);
+
+    // Exchange task, sole caller of the BLE client
+    static void staticExchangeTask(void* parameter);
+    void exchange_task(void* parameter);
+
+    OT_FailureTracker& get_failure_tracker();
+    bool record_phase(OT_Phase phase, uint32_t &startUs, bool success);
+
+    //////////
+    // Metrics
+
+    // Latency and success of each exchange phase since boot or reset
+    // - central phases are written by the exchange task, peripheral ones by the BLE stack task
+    TS_LatencyHistogram& get_phase_latency(OT_Phase phase);
+    static const char* get_phase_name(OT_Phase phase);
+    void reset_phase_latency();
+
+    // Appends phase metrics as a json object, keyed by phase name
+    // - {"connect":{"ok":1,"fail":0,"avg":1500,"max":1500,"h":[0,...]},...}, latencies in us
+    void phase_metrics_to_json(std::string &buf);
+
+    // Peers inside this window are logged from their advertisement without reconnecting
+    void set_reexchange_window(uint32_t seconds);
+
+    // Advertise tokens and log known ones without connecting, scans turn passive
+    void set_connectionless(bool enabled);
+    bool is_connectionless();
+
+    // Token of a TempID, the first bytes of its sha256
+    static void make_token(const std::string &id, uint8_t *token);
+
+    TS_TxPowerController& get_tx_power();
+
+    OT_EncounterStats& get_encounter_stats();
+    void reset_encounter_stats();
+
+    // Queue an encounter with rssi for storage, called from the central (main) task
+    void log_encounter(OT_ConnectionRecord &connectionRecord, int8_t rssi);
+
+    // Copies a record into ring, never blocks
+    // - returns false and counts a drop if the ring is full
+    bool queue_encounter(OT_EncounterRing &ring, OT_ConnectionRecord &connectionRecord, int8_t rssi);
+
+    // Copies a peripheral write into the raw write ring, never blocks
+    bool capture_peripheral_write(BLECharacteristic *pCharacteristic);
+
+    // Parses a peripheral write, slow
+    bool decode_peripheral_write(std::string &payload, bool binary, OT_ConnectionRecord &connectionRecord);
+
+    // Drains the encounter and raw write rings into storage through the merger, returns number stored
+    uint16_t store_encounters();
+    void merge_encounter(OT_EncounterRecord &encounter, OT_EncounterRole role, TS_DateTime &datetime, uint32_t nowMs, uint16_t &stored);
+    OT_EncounterMerger& get_encounter_merger();
+    bool store_encounter(OT_MergedEncounter &merged, TS_DateTime &datetime, uint32_t nowMs);
+
+    // Logs onWrite latency
+    void log_callback_stats();
+
+    // Storage task, sole consumer of the encounter rings
+    static void staticEncounterTask(void* parameter);
+    void encounter_task(void* parameter);
 
 
     //////////
     // Server advertise and listen
     void advertising_start();
     void advertising_stop();
+    void update_advertisement_data();
     uint16_t get_connected_count();
 
     void update_characteristic_cache();
@@ -125,29 +552,247 @@ class _OT_ProtocolV2
     bool process_central_read_request(std::string& payload,
                                       OT_ConnectionRecord& connectionRecord);
 
+    // Pack binary frame without rssi, as read from peripherals
+    bool prepare_binary_frame(std::string& buf,
+                              std::string &id);
+
+    // Pack binary frame with rssi, returns false if there is no binary frame cached
+    bool prepare_central_write_binary(std::string& buf,
+                                      int8_t rssi);
+
+    // Process binary frame into ConnectionRecord, rssi is required from centrals
+    bool process_binary_frame(std::string& payload,
+                              bool fromCentral,
+                              OT_ConnectionRecord& connectionRecord);
+
   private:
     // Store OT_TEMPID_MAX TempIDs for rotation
     // - Average TempID : ~86 chars of base64 encode, 8600b total
     // TODO: this should be stored on flash at some point
     OT_TempID tempIds[OT_TEMPID_MAX];
+    uint32_t  tempIdStart[OT_TEMPID_MAX];   // unix seconds, 0 for ids stored without times
+    uint32_t  tempIdExpiry[OT_TEMPID_MAX];
+    uint8_t   tempIdCount;
+    SemaphoreHandle_t tempIdsMutex;         // ids are reloaded by the sync task
 
     BLEUUID   serviceUUID;
     BLEUUID   characteristicUUID;
+    BLEUUID   binCharacteristicUUID;
     
     BLEServer         *bleServer;
     BLEService        *bleService;
     BLECharacteristic *bleCharacteristic;
+    BLECharacteristic *binCharacteristic;
     BLEAdvertising    *bleAdvertising;
 
     // Caches the json string to be put in characteristic cache
     // - we do not want to repeatedly recompute this string, as its only updated once every 15 min
     std::string       characteristicCache;
+    std::string       binCharacteristicCache;   // binary frame of the same TempID, empty if it could not be packed
     OT_TempID         charCacheTempId;
+    uint32_t          charCacheUntil;   // unix time the cached TempID rotates out, refreshed by update()
     SemaphoreHandle_t characteristicCacheMutex;
 
-    int               lastScanTs;
+    OT_ExchangeCache  exchangeCache;
+    OT_TokenCache     tokenCache;
+    OT_FailureTracker failureTracker;
+    bool              connectionless;
+    uint8_t           advertisedToken[OT_TOKEN_LEN];  // guarded by characteristicCacheMutex
+    bool              advertisementStale;
+    bool              advertisementCustom; // data set by us, the library no longer builds its default
+    OT_EncounterStats encounterStats;
+    uint16_t          exchangeNewPeers;   // new TempIDs received in the current scan
+
+    // Producers: main task for central, BLE stack task for peripheral
+    OT_EncounterRing      centralEncounters;
+    OT_EncounterRing      peripheralEncounters;
+    OT_RawWriteRing       peripheralWrites;
+    TS_LatencyHistogram   phaseLatency[OT_PHASES];
+    std::atomic<uint32_t> droppedEncounters;
+    TaskHandle_t          encounterTask;
+    OT_EncounterMerger    encounterMerger;  // storage task only
+    TS_TxPowerController  txPower;          // fed by the storage task, decided by the main task
+
+    // Only one exchange runs at a time, busy until its owner collected it
+    OT_Exchange           exchange;
+    bool                  exchangeBusy;
+    bool                  exchangeWedged;   // cancelled, and the BLE library has not returned yet
+    uint32_t              exchangeWedgedMs; // since when
+    TaskHandle_t          exchangeTask;
+
+    // Only accessed from the scan filter
+    OT_NegativeCache  negativeCache;
+    int8_t            scanRssiCutoff;
 };
 
 extern _OT_ProtocolV2 OT_ProtocolV2;
 
+
+
+//
+// Tests
+//
+
+#if defined(TESTDRIVER) && defined(TESTDRIVER_OPENTRACE)
+
+static class _OT_ProtocolV2Tests : public _TS_Tests
+{
+public:
+  void init() override {}
+
+  void make_encounter(OT_EncounterRecord &encounter, const char *id, int8_t rssi, uint32_t capturedMs)
+  {
+    memset(&encounter, 0, sizeof(encounter));
+    strlcpy(encounter.id, id, sizeof(encounter.id));
+    strlcpy(encounter.org, OT_ORG, sizeof(encounter.org));
+    encounter.rssi = rssi;
+    encounter.capturedMs = capturedMs;
+  }
+
+  bool test_merge_across_roles()
+  {
+    OT_EncounterMerger merger;
+    OT_EncounterRecord encounter;
+    OT_MergedEncounter merged;
+
+    // read by us once, wrote to us twice in the same minute
+    make_encounter(encounter, "phoneA", -70, 1000);
+    merger.add(encounter, OT_ROLE_CENTRAL);
+    make_encounter(encounter, "phoneA", -60, 5000);
+    merger.add(encounter, OT_ROLE_PERIPHERAL);
+    make_encounter(encounter, "phoneA", -64, 20000);
+    merger.add(encounter, OT_ROLE_PERIPHERAL);
+    make_encounter(encounter, "phoneB", -80, 30000);
+    merger.add(encounter, OT_ROLE_CENTRAL);
+
+    if(merger.get_pending() != 2 || merger.get_merged() != 2)
+    {
+      log_e("Expected 2 pending and 2 merged, %d/%d", merger.get_pending(), merger.get_merged());
+      return false;
+    }
+
+    if(merger.pop(merged, 1000 + OT_MERGE_WINDOW_SECS * 1000 - 1, false))
+    {
+      log_e("Popped before the window ended");
+      return false;
+    }
+
+    // peripheral has more samples, they are kept and the record has their mean, and both sighting times
+    if(!merger.pop(merged, 1000 + OT_MERGE_WINDOW_SECS * 1000, false) || strcmp(merged.record.id, "phoneA") != 0
+      || merged.record.rssi != -62 || merged.firstMs != 1000 || merged.record.capturedMs != 20000)
+    {
+      log_e("Merged record off, id: %s, rssi: %d, first: %u", merged.record.id, merged.record.rssi, merged.firstMs);
+      return false;
+    }
+
+    if(merged.samples != 2 || merged.rssi[0] != -60 || merged.rssi[1] != -64)
+    {
+      log_e("Expected the 2 peripheral samples, %d", merged.samples);
+      return false;
+    }
+
+    if(merger.pop(merged, 1000 + OT_MERGE_WINDOW_SECS * 1000, false) || !merger.pop(merged, 0, true) || merged.record.rssi != -80)
+    {
+      log_e("Second record should wait for its own window");
+      return false;
+    }
+
+    return true;
+  }
+
+  bool test_merge_full()
+  {
+    OT_EncounterMerger merger;
+    OT_EncounterRecord encounter;
+    OT_MergedEncounter merged;
+    char id[8];
+
+    for(uint8_t i = 0; i < OT_MERGE_MAX; ++i)
+    {
+      snprintf(id, sizeof(id), "id%d", i);
+      make_encounter(encounter, id, -50, i);
+      if(!merger.add(encounter, OT_ROLE_CENTRAL)) return false;
+    }
+
+    // known ids still merge, new ones need room
+    make_encounter(encounter, "id0", -60, 100);
+    if(!merger.add(encounter, OT_ROLE_PERIPHERAL))
+    {
+      log_e("Known id should merge when full");
+      return false;
+    }
+
+    make_encounter(encounter, "new", -60, 100);
+    if(merger.add(encounter, OT_ROLE_CENTRAL) || !merger.pop(merged, 0, true) || strcmp(merged.record.id, "id0") != 0)
+    {
+      log_e("New id should be refused and the oldest popped");
+      return false;
+    }
+
+    // tie goes to central
+    if(merged.record.rssi != -50 || merged.samples != 1)
+    {
+      log_e("Central should win ties, %d", merged.record.rssi);
+      return false;
+    }
+
+    return true;
+  }
+
+  // Addresses from a fixed xorshift sequence
+  void next_address(uint32_t &state, esp_bd_addr_t address)
+  {
+    for(uint8_t i = 0; i < sizeof(esp_bd_addr_t); ++i)
+    {
+      state ^= state << 13;
+      state ^= state >> 17;
+      state ^= state << 5;
+      address[i] = state;
+    }
+  }
+
+  bool test_negcache_false_positives()
+  {
+    OT_NegativeCache cache;
+    esp_bd_addr_t native;
+    uint32_t state = 1;
+
+    // both generations full, as just before the next rotation
+    for(uint16_t i = 0; i < 2 * OT_NEGCACHE_GEN_MAX; ++i)
+    {
+      next_address(state, native);
+      BLEAddress address(native);
+      cache.add(address, 0);
+    }
+
+    const uint16_t probes = 10000;
+    uint16_t positives = 0;
+    for(uint16_t i = 0; i < probes; ++i)
+    {
+      next_address(state, native);
+      BLEAddress address(native);
+      if(cache.contains(address)) ++positives;
+    }
+
+    log_i("Negative cache false positives: %d / %d", positives, probes);
+    if(positives > probes / 100)
+    {
+      log_e("False positives over 1%%");
+      return false;
+    }
+
+    return true;
+  }
+
+  // Ctor
+  _OT_ProtocolV2Tests()
+  {
+    add(std::bind(&_OT_ProtocolV2Tests::test_merge_across_roles, this), "test_merge_across_roles");
+    add(std::bind(&_OT_ProtocolV2Tests::test_merge_full, this), "test_merge_full");
+    add(std::bind(&_OT_ProtocolV2Tests::test_negcache_false_positives, this), "test_negcache_false_positives");
+  }
+} OT_ProtocolV2Tests;
+
+#endif
+
 #endif
@@ -1,31 +1,27 @@
 #include "radio.h"
+#include "cleanbox.h"
 #include "hal.h"
 #include <WiFi.h>
 #include <WiFiClientSecure.h>
-#include <ArduinoJson.h>
+#include "http.h"
+#include "inflate.h"
+#include "jsonpull.h"
 #include "opentracev2.h"
+#include "scheduler.h"
 #include "storage.h"
+#include "tempids.h"
+#include "upload.h"
 
 // WiFi functions, call wifi_connect() to connect to "Test" wifi, wifi_disconnect() to disconnect.
 // Prints helpful debug to console upon call. 
 
 #define SSID_DISPLAY_COUNT 1
 
-#define WIFI_RETRY_INTERVAL 5000
-
-#define TEMPID_BATCH_SIZE 100
-#define HTTPS_PORT 443
-const PROGMEM char* host = "asia-east2-bettr-trace-1.cloudfunctions.net";
-const PROGMEM char* uri_getTempIDs = "/getTempIDs";
-const PROGMEM char* body_template = "{\"data\":{\"uid\":\"%s\"}}";
-const PROGMEM char* post_request_template = \
-    "POST %s HTTP/1.1\r\n"               \ 
-    "Host: %s\r\n"                       \ 
-    "Content-Type: application/json\r\n" \
-    "Content-Length: %d\r\n"             \ 
-    "\r\n"                               \
-    "%s";
-const PROGMEM char* end_of_headers = "\r\n\r\n";
+#define SYNC_THREAD_STACK_SIZE 8192  // TLS handshake
+
+const PROGMEM char* uri_uploadEncounters = "/uploadEncounters";
+const PROGMEM char* uri_uploadMetrics = "/uploadMetrics";
+const PROGMEM char* content_type_json = "application/json";
 const PROGMEM char* root_ca = \
     "-----BEGIN CERTIFICATE-----\n" \
     "MIIDujCCAqKgAwIBAgILBAAAAAABD4Ym5g0wDQYJKoZIhvcNAQEFBQAwTDEgMB4G\n" \
@@ -50,31 +46,137 @@ const PROGMEM char* root_ca = \
     "TBj0/VLZjmmx6BEP3ojY+x1J96relc8geMJgEtslQIxq/H5COEBkEveegeGTLg==\n" \
     "-----END CERTIFICATE-----\n";
 
+static_assert(TEMPIDS_ID_MAX == OT_CR_ID_MAX, "TempIDs are kept in OT_CR_ID_MAX buffers");
+
 _TS_RADIO TS_RADIO;
 
+// Buffers of the running sync, reset for each
+static ScratchArena<WIFI_SCRATCH_SIZE> syncScratch;
+
+// Per state timeouts, 0 for none
+static const uint32_t syncTimeoutMs[SYNC_STATES] = {
+  0,                          // idle
+  SYNC_TIMEOUT_SCAN_MS,
+  SYNC_TIMEOUT_CONNECT_MS,
+  SYNC_TIMEOUT_TLS_MS,
+  SYNC_TIMEOUT_REQUEST_MS,
+  SYNC_TIMEOUT_STREAM_MS,
+  SYNC_TIMEOUT_PERSIST_MS,
+  SYNC_TIMEOUT_UPLOAD_MS,
+  SYNC_TIMEOUT_TEARDOWN_MS,
+  0,                          // done
+  0,                          // backoff
+};
+
 // Ctor
 _TS_RADIO::_TS_RADIO() {
   this->wifiEnabled = false;
-  this->wifiTimerStart = -(WIFI_RETRY_INTERVAL);
+  this->wifiDirect = false;
+  this->wifiConnectStartMs = 0;
+  this->syncTask = NULL;
+  this->syncClient = NULL;
+  this->syncHttp = NULL;
+  this->syncUserId = NULL;
+  this->syncUpload = false;
+  this->syncGzip = true;
+  this->syncState = SYNC_IDLE;
+  this->stateStartMs = 0;
+  this->stateFailed = false;
+  this->syncCancelled = false;
+  this->syncStopped = false;
+  this->syncFailures = 0;
+  this->retryAtMs = 0;
+  memset(&this->syncStats, 0, sizeof(this->syncStats));
+}
+
+void _TS_RADIO::init()
+{
+  // One client for all syncs, its TLS buffers only exist while connected
+#if SYNC_SECURE
+  WiFiClientSecure *client = new WiFiClientSecure;
+  client->setCACert(root_ca);
+  client->setHandshakeTimeout(SYNC_TIMEOUT_TLS_MS / 1000);
+  this->syncClient = client;
+#else
+  log_w("Syncing over plain HTTP with %s", SYNC_HOST);
+  this->syncClient = new WiFiClient;
+#endif
+  this->syncHttp = new TS_HttpClient(*this->syncClient, SYNC_HOST, SYNC_PORT);
+
+  // Downloads block on the network, tracing carries on in the main loop
+  xTaskCreatePinnedToCore(
+    _TS_RADIO::staticSyncTask,  // thread fn
+    "SyncTask",                 // identifier
+    SYNC_THREAD_STACK_SIZE,     // stack size
+    NULL,                       // parameter
+    1,                          // priority
+    &this->syncTask,            // handle
+    1);                         // core
 }
 
 
 //
 // Connect to WIFI
-// Scans for SSIDs, if preset SSID is found, attempt to connect, 
-// else prints the failed connection attempt. 
-void _TS_RADIO::wifi_connect(char* wifiSsid, char* wifiPass)
+// Goes straight to the access point of the last connection if there is one,
+// else starts a scan in the background, wifi_scan_update() connects once it is done.
+void _TS_RADIO::wifi_connect(char* wifiSsid, char* wifiPass, uint32_t nowMs)
 {
-  if (this->wifi_scan_networks(wifiSsid))
+  WiFi.mode(WIFI_STA);
+  WiFi.setSleep(true);  // modem sleep, required for WiFi to share the radio with BLE
+  this->wifiConnectStartMs = nowMs;
+  this->wifiDirect = this->wifi_cache_valid(wifiSsid);
+
+  if (this->wifiDirect)
   {
-    //Attempt to connect to 'WIFI_SSID', prints name of connected WIFI. 
-    WiFi.begin(wifiSsid, wifiPass);
-    log_i("Connecting to WIFI: %s", WiFi.SSID());
-  } 
-  else 
+    // Known channel and address, no scan and no DHCP
+    WiFi.config(IPAddress(TS_PersistMem.wifiIp), IPAddress(TS_PersistMem.wifiGateway), IPAddress(TS_PersistMem.wifiSubnet), IPAddress(TS_PersistMem.wifiDns));
+    WiFi.begin(wifiSsid, wifiPass, TS_PersistMem.wifiChannel, TS_PersistMem.wifiBssid);
+    log_i("Connecting to WIFI: %s, cached channel %d", wifiSsid, TS_PersistMem.wifiChannel);
+    this->sync_enter(SYNC_CONNECT, nowMs);
+    return;
+  }
+
+  WiFi.disconnect();
+  WiFi.config(IPAddress((uint32_t)0), IPAddress((uint32_t)0), IPAddress((uint32_t)0));  // back to DHCP
+  if (WiFi.scanNetworks(true) == WIFI_SCAN_FAILED)
   {
-    log_i("Known SSID not detected");
+    log_w("WiFi scan failed to start");
+    this->sync_backoff(nowMs);
+    return;
   }
+
+  this->sync_enter(SYNC_SCAN, nowMs);
+}
+
+// Picks up a background scan, connects to the strongest access point of the known SSID
+void _TS_RADIO::wifi_scan_update(char* wifiSsid, char* wifiPass, uint32_t nowMs)
+{
+  int16_t count = WiFi.scanComplete();
+  if (count == WIFI_SCAN_RUNNING) return;
+
+  int16_t best = -1;
+  for (int16_t i = 0; i < count; i++)
+  {
+    if (strcmp(WiFi.SSID(i).c_str(), wifiSsid) == 0 && (best < 0 || WiFi.RSSI(i) > WiFi.RSSI(best)))
+    {
+      best = i;
+    }
+  }
+
+  if (best >= 0)
+  {
+    log_i("Known networks are available, connecting to WIFI: %s, channel %d", wifiSsid, WiFi.channel(best));
+    WiFi.begin(wifiSsid, wifiPass, WiFi.channel(best), WiFi.BSSID(best));
+    this->sync_enter(SYNC_CONNECT, nowMs);
+  }
+  else
+  {
+    log_i("No known SSID found");
+    this->sync_fail(nowMs);
+    this->sync_backoff(nowMs);
+  }
+
+  WiFi.scanDelete();
 }
 
 void _TS_RADIO::wifi_disconnect()
@@ -87,24 +189,26 @@ bool _TS_RADIO::wifi_is_connected()
   return WiFi.status() == WL_CONNECTED;
 }
 
-// Returns true if network is available to connect
-bool _TS_RADIO::wifi_scan_networks(char* knownSsid)
+bool _TS_RADIO::wifi_cache_valid(char* wifiSsid)
 {
-  WiFi.mode(WIFI_STA);
-  WiFi.disconnect();
-  int SSID_COUNT = WiFi.scanNetworks();
-  for(int i = 0; i < SSID_COUNT; i++)
-  {
-    if(strcmp(WiFi.SSID(i).c_str(), knownSsid) == 0)
-    {
-      log_i("Known networks are available");
-      return true;
-    }
-  }
+  return TS_PersistMem.wifiChannel != 0 && TS_PersistMem.wifiIp != 0 && strcmp(TS_PersistMem.wifiSsid, wifiSsid) == 0;
+}
 
-  log_i("No known SSID found");
+// Remembers the current connection for the next one
+void _TS_RADIO::wifi_cache_store(char* wifiSsid)
+{
+  strlcpy(TS_PersistMem.wifiSsid, wifiSsid, sizeof(TS_PersistMem.wifiSsid));
+  memcpy(TS_PersistMem.wifiBssid, WiFi.BSSID(), sizeof(TS_PersistMem.wifiBssid));
+  TS_PersistMem.wifiChannel = WiFi.channel();
+  TS_PersistMem.wifiIp = WiFi.localIP();
+  TS_PersistMem.wifiGateway = WiFi.gatewayIP();
+  TS_PersistMem.wifiSubnet = WiFi.subnetMask();
+  TS_PersistMem.wifiDns = WiFi.dnsIP();
+}
 
-  return false;
+void _TS_RADIO::wifi_cache_clear()
+{
+  TS_PersistMem.wifiChannel = 0;
 }
 
 void _TS_RADIO::wifi_enable(bool enable)
@@ -115,139 +219,504 @@ void _TS_RADIO::wifi_enable(bool enable)
 void _TS_RADIO::wifi_update()
 {
   log_d("ESP FREE HEAP: %d", ESP.getFreeHeap());
-    
-  if (this->wifiEnabled)
+
+  uint32_t nowMs = millis();
+  TS_SyncState state = this->syncState;
+
+  // Radio slots shrink while a sync shares the air
+  TS_Scheduler.set_reduced_duty(is_task_state(state));
+
+  if (!this->wifiEnabled)
   {
-    TS_Settings* settings = TS_Storage.settings_get();
+    this->sync_stop(nowMs);
+    return;
+  }
 
-    if (!this->wifi_is_connected())
-    {
-      if (millis() - this->wifiTimerStart > WIFI_RETRY_INTERVAL)
+  TS_Settings* settings = TS_Storage.settings_get();
+
+  switch (state)
+  {
+    case SYNC_IDLE:
+      if (this->wifi_is_connected())
       {
-        log_i("Connecting to WiFi.");
-        this->wifi_connect(settings->wifiSsid, settings->wifiPass);
-        this->wifiTimerStart = millis();
+        this->sync_start(settings, nowMs);
       }
       else
       {
-        log_i("Waiting for WiFi interval");
+        log_i("Connecting to WiFi.");
+        this->wifi_connect(settings->wifiSsid, settings->wifiPass, nowMs);
       }
-    } else {
-      log_i("Wifi is connected, deinitializing BLE for RAM");
-      log_d("Before ble deinit: %d", ESP.getFreeHeap());
-      TS_HAL.ble_deinit();
-      log_d("After ble deinit: %d", ESP.getFreeHeap());
-      log_i("Downloading tempIds from server");
-      this->download_temp_ids(settings->userId);
-    }
+      break;
+
+    case SYNC_SCAN:
+      this->wifi_scan_update(settings->wifiSsid, settings->wifiPass, nowMs);
+      break;
+
+    case SYNC_CONNECT:
+      if (this->wifi_is_connected())
+      {
+        log_i("WiFi connected in %d ms, %s", nowMs - this->wifiConnectStartMs, this->wifiDirect ? "cached" : "scanned");
+        this->wifi_cache_store(settings->wifiSsid);
+        this->sync_start(settings, nowMs);
+      }
+      break;
+
+    case SYNC_DONE:
+      // synced again on the next connection
+      if (!this->wifi_is_connected())
+      {
+        log_i("WiFi connection lost");
+        this->sync_enter(SYNC_IDLE, nowMs);
+      }
+      break;
+
+    case SYNC_BACKOFF:
+      if ((int32_t)(nowMs - this->retryAtMs) >= 0)
+      {
+        this->sync_enter(SYNC_IDLE, nowMs);
+      }
+      break;
+
+    default:
+      // the sync task moves through the rest, only deadlines are kept here
+      break;
   }
-  else
+
+  this->sync_check_timeout(nowMs);
+}
+
+bool _TS_RADIO::wifi_is_syncing()
+{
+  return is_task_state(this->syncState);
+}
+
+// Hands the sync to the sync task
+// - BLE stays up, so the TLS buffers have to fit next to it
+void _TS_RADIO::sync_start(TS_Settings* settings, uint32_t nowMs)
+{
+  if (this->syncTask == NULL) return;
+
+  uint32_t largest = ESP.getMaxAllocHeap();
+  if (largest < WIFI_SYNC_HEAP_MIN)
   {
-    if (wifi_is_connected())
+    log_w("Not enough heap to sync next to BLE, largest block: %d", largest);
+    this->sync_backoff(nowMs);
+    return;
+  }
+
+  log_i("Wifi is connected, syncing with server");
+  this->syncUserId = settings->userId;
+  this->syncUpload = settings->upload_flag;
+  TS_HAL.rtc_get(this->syncToday);
+  this->syncCancelled = false;
+  this->syncStopped = false;
+
+#if WIFI_COEX_BLE
+  TS_HAL.coex_prefer(CoexWifi);
+#else
+  log_d("Before ble deinit: %d", ESP.getFreeHeap());
+  TS_HAL.ble_deinit();
+  log_d("After ble deinit: %d", ESP.getFreeHeap());
+#endif
+
+  TS_Scheduler.set_reduced_duty(true);
+  this->sync_enter(SYNC_TLS, nowMs);
+  xTaskNotifyGive(this->syncTask);
+}
+
+// WiFi disabled, a running sync is cancelled and waited for
+void _TS_RADIO::sync_stop(uint32_t nowMs)
+{
+  TS_SyncState state = this->syncState;
+
+  if (is_task_state(state))
+  {
+    if (!this->syncCancelled)
     {
-      log_i("Disconnecting WiFi.");
-      this->wifi_disconnect();
-      log_i("Initializing BLE.");
-      TS_HAL.ble_init();
+      log_i("WiFi disabled, cancelling sync");
+      this->syncStopped = true;
+      this->syncCancelled = true;
     }
+    return;
+  }
+
+  if (state == SYNC_SCAN) WiFi.scanDelete();
+  if (state == SYNC_IDLE && !this->wifi_is_connected()) return;
+
+  log_i("Disconnecting WiFi.");
+  this->wifi_disconnect();
+  TS_HAL.coex_prefer(CoexBalance);
+
+  if (!TS_HAL.ble_is_init())
+  {
+    log_i("Initializing BLE.");
+    TS_HAL.ble_init();
   }
+
+  this->sync_enter(SYNC_IDLE, nowMs, false);
 }
 
-// internal function
-// - used by _TS_RADIO::download_temp_ids
-void _download_temp_ids(char* userId, WiFiClientSecure *client)
+void _TS_RADIO::sync_check_timeout(uint32_t nowMs)
 {
-  client->setCACert(root_ca);
-    
-  log_d("Connecting to %s", host);
-  if (!client->connect(host, HTTPS_PORT)) 
-  { 
-    log_e("Connection to %s failed", host);
+  TS_SyncState state = this->syncState;
+  uint32_t timeoutMs = syncTimeoutMs[state];
+  if (timeoutMs == 0 || nowMs - this->stateStartMs < timeoutMs) return;
+
+  // the sync task fails at its next step or read timeout
+  if (is_task_state(state))
+  {
+    if (!this->syncCancelled)
+    {
+      log_w("Sync %s timed out", get_sync_state_name(state));
+      ++this->syncStats.timeouts;
+      this->syncCancelled = true;
+    }
     return;
   }
 
-  uint8_t body_size = strlen(body_template) + strlen(userId) - 2 + 1; // -2 for format characters
-  char body[body_size];
-  sprintf(body, body_template, userId);
+  log_w("Sync %s timed out", get_sync_state_name(state));
+  ++this->syncStats.timeouts;
+
+  // the access point moved or is gone, find it again
+  if (state == SYNC_CONNECT && this->wifiDirect)
+  {
+    log_i("Cached WiFi network not reached, scanning next time");
+    this->wifi_cache_clear();
+  }
+
+  if (state == SYNC_SCAN) WiFi.scanDelete();
+  this->wifi_disconnect();
+  this->sync_fail(nowMs);
+  this->sync_backoff(nowMs);
+}
+
+// Records how long the state took, unless it failed
+void _TS_RADIO::sync_enter(TS_SyncState state, uint32_t nowMs, bool recordPrevious)
+{
+  TS_SyncState previous = this->syncState;
+  if (recordPrevious && !this->stateFailed && syncTimeoutMs[previous] != 0)
+  {
+    this->stateLatency[previous].record((nowMs - this->stateStartMs) * 1000, true);
+  }
+
+  log_d("Sync %s -> %s", get_sync_state_name(previous), get_sync_state_name(state));
+
+  // start first, the other task reads the state then the start
+  this->stateFailed = false;
+  this->stateStartMs = nowMs;
+  this->syncState = state;
+}
+
+// Records the current state as failed, always false
+bool _TS_RADIO::sync_fail(uint32_t nowMs)
+{
+  TS_SyncState state = this->syncState;
+  log_w("Sync failed in %s", get_sync_state_name(state));
+
+  this->stateLatency[state].record((nowMs - this->stateStartMs) * 1000, false);
+  this->stateFailed = true;
+  return false;
+}
+
+// Waits twice as long after each failure in a row, jittered so devices charging together spread out
+void _TS_RADIO::sync_backoff(uint32_t nowMs)
+{
+  ++this->syncStats.failed;
+  if (this->syncFailures < UINT8_MAX) ++this->syncFailures;
+
+  uint8_t shift = this->syncFailures - 1 < 16 ? this->syncFailures - 1 : 16;
+  uint32_t backoffMs = (uint32_t)SYNC_BACKOFF_MIN_MS << shift;
+  if (backoffMs > SYNC_BACKOFF_MAX_MS) backoffMs = SYNC_BACKOFF_MAX_MS;
+
+  uint32_t jitterMs = backoffMs / 100 * SYNC_BACKOFF_JITTER_PCT;
+  backoffMs = backoffMs - jitterMs + TS_HAL.random_get(0, 2 * jitterMs);
+
+  log_i("Sync retry in %d ms, failures: %d", backoffMs, this->syncFailures);
+  this->retryAtMs = nowMs + backoffMs;
+  this->sync_enter(SYNC_BACKOFF, nowMs);
+}
+
+// On the sync task, moves on unless cancelled
+bool _TS_RADIO::sync_next(TS_SyncState state)
+{
+  if (this->syncCancelled) return this->sync_fail(millis());
+
+  this->sync_enter(state, millis());
+  return true;
+}
+
+bool _TS_RADIO::is_task_state(TS_SyncState state)
+{
+  return state >= SYNC_TLS && state <= SYNC_TEARDOWN;
+}
+
+// Static function to call instance method
+void _TS_RADIO::staticSyncTask(void* parameter)
+{
+  TS_RADIO.sync_task(parameter);
+}
+
+void _TS_RADIO::sync_task(void* parameter)
+{
+  while(true)
+  {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+    uint32_t sentBefore = this->syncHttp->get_bytes_sent();
+    uint32_t receivedBefore = this->syncHttp->get_bytes_received();
+
+    // the scratch buffers belong to this sync until it ends
+    bool scratch = syncScratch.acquire();
+    if (!scratch) log_e("Sync scratch arena in use");
+    bool success = scratch ? this->sync_run() : this->sync_fail(millis());
+
+    // always, the connection only lives through one sync
+    // - the last state is recorded unless it failed
+    this->sync_enter(SYNC_TEARDOWN, millis());
+    this->syncHttp->stop();
+    TS_HAL.coex_prefer(CoexBalance);
+
+    this->syncStats.bytesSent = this->syncHttp->get_bytes_sent() - sentBefore;
+    this->syncStats.bytesReceived = this->syncHttp->get_bytes_received() - receivedBefore;
+    log_i("Sync %s, connections: %d, requests: %d, sent: %d, received: %d, scratch peak: %d of %d", success ? "done" : "failed",
+      this->syncHttp->get_connects(), this->syncHttp->get_requests(), this->syncStats.bytesSent, this->syncStats.bytesReceived,
+      syncScratch.get_peak(), WIFI_SCRATCH_SIZE);
+    if (scratch) syncScratch.release();
+
+    if (success)
+    {
+      ++this->syncStats.ok;
+      this->syncFailures = 0;
+      this->sync_enter(SYNC_DONE, millis());
+    }
+    else if (this->syncStopped)
+    {
+      // on purpose, the failures and backoff are left as they were
+      log_i("Sync stopped, WiFi disabled");
+      this->sync_enter(SYNC_IDLE, millis(), false);
+    }
+    else
+    {
+      // a cached address may have been given to someone else since, DHCP next time
+      if (this->wifiDirect)
+      {
+        log_w("Sync failed on a cached address, dropping the WiFi cache");
+        this->wifi_cache_clear();
+      }
+
+      this->sync_backoff(millis());
+    }
+  }
+}
+
+// The network part of a sync, from the handshake to the upload
+// - each step is bounded by the stream timeouts, a cancel ends the sync at the next one
+bool _TS_RADIO::sync_run()
+{
+  TS_HttpClient &http = *this->syncHttp;
+
+  // TempIDs only once the supply runs low, all of them while the clock is not set
+  uint32_t nowTime = TS_HAL.rtc_get_unix();
+  uint32_t horizon = 0;
+  uint8_t valid = nowTime == 0 ? 0 : TS_Storage.file_ids_valid(nowTime, horizon);
+  bool refresh = valid < TEMPID_REFRESH_BELOW;
+
+  if (!refresh)
+  {
+    log_i("TempIDs left: %d, valid until %u, not refreshed", valid, horizon);
+    if (!this->syncUpload) return true;
+  }
+
+  // SYNC_TLS
+  if (!http.connect()) return this->sync_fail(millis());
+
+  if (refresh && !this->sync_temp_ids(nowTime, valid, horizon)) return false;
+
+  // Past days of contact logs, on the same connection
+  if (this->syncUpload)
+  {
+    if (!this->sync_next(SYNC_UPLOAD)) return false;
+
+    log_i("Uploading contact logs");
+    if (!TS_Uploader.upload(http, uri_uploadEncounters, this->syncUserId, this->syncToday, &this->syncCancelled))
+    {
+      return this->sync_fail(millis());
+    }
+
+    // best effort, the logs are what matters
+    this->sync_metrics();
+  }
+
+  return !this->syncCancelled || this->sync_fail(millis());
+}
+
+// Posts the exchange phase metrics on the sync connection, {"data":{"uid":"...","phases":{...}}}
+// - how exchanges do in the field, only sent along with the contact logs
+bool _TS_RADIO::sync_metrics()
+{
+  TS_HttpClient &http = *this->syncHttp;
+
+  std::string body = "{\"data\":{\"uid\":\"";
+  body += this->syncUserId;
+  body += "\",\"phases\":";
+  OT_ProtocolV2.phase_metrics_to_json(body);
+  body += "}}";
+
+  uint16_t status = http.request("POST", uri_uploadMetrics, content_type_json, (const uint8_t*)body.data(), body.length()) ? http.response() : 0;
+  http.end();
+  if (status != 200)
+  {
+    log_w("Metrics not accepted, status: %d", status);
+    return false;
+  }
+
+  return true;
+}
+
+// Requests the TempIDs past the horizon and merges them into the ids file
+// - the ids still valid stay, expired ones are dropped
+// - 304, or nothing past the horizon, leaves the ids file as it is
+bool _TS_RADIO::sync_temp_ids(uint32_t nowTime, uint8_t valid, uint32_t horizon)
+{
+  TS_HttpClient &http = *this->syncHttp;
 
-  uint8_t request_size = strlen(post_request_template) + strlen(uri_getTempIDs) + strlen(host) + strlen(body) - 6 + 1; // -6 for format characters
+  if (!this->sync_next(SYNC_REQUEST)) return false;
 
-  char postRequest[request_size]; // max request size is 182 with uid of length 31
-  sprintf(postRequest, post_request_template, uri_getTempIDs, host, strlen(body), body);
+  uint8_t missing = valid < OT_TEMPID_MAX ? OT_TEMPID_MAX - valid : 0;
+  uint8_t body_size = strlen(TEMPIDS_BODY_TEMPLATE) + strlen(this->syncUserId) + 2 * 10 + 1;
+  char *body = (char*)syncScratch.alloc(body_size);
+  if (body == NULL) return this->sync_fail(millis());
 
-  client->print(postRequest);
+  // gzip only with the heap to inflate it, after the TLS buffers
+  bool acceptGzip = this->syncGzip && ESP.getMaxAllocHeap() >= TS_InflateStream::get_heap_needed() + SYNC_GZIP_HEAP_MARGIN;
 
-  if (client->println() == 0) {
+  if (!request_temp_ids(http, body, body_size, this->syncUserId, horizon, missing, acceptGzip))
+  {
     log_e("Failed to send request");
-    return;
+    return this->sync_fail(millis());
   }
 
-  // Check HTTP status
-  char status[32] = {0};
-  client->readBytesUntil('\r', status, sizeof(status));
-  if (strcmp(status, "HTTP/1.1 200 OK") != 0) {
-    log_e("Unexpected response %s", status);
-    return;
+  if (!this->sync_next(SYNC_STREAM)) return false;
+
+  uint16_t status = http.response();
+  if (status == 304)
+  {
+    log_i("No TempIDs past %u", horizon);
+    http.end();
+    return true;
   }
 
-  // Skip HTTP headers
-  if (!client->find(end_of_headers)) {
-    log_w("Invalid response");
-    return;
+  if (status != 200)
+  {
+    log_e("Unexpected response %d", status);
+    http.end();
+    return this->sync_fail(millis());
   }
-  
-  const size_t capacity = JSON_ARRAY_SIZE(TEMPID_BATCH_SIZE) + JSON_OBJECT_SIZE(1) + (TEMPID_BATCH_SIZE + 1)*JSON_OBJECT_SIZE(3) + 12610;
 
-  DynamicJsonDocument doc(capacity);
+  log_d("Before parsing: %d, min: %d", ESP.getFreeHeap(), ESP.getMinFreeHeap());
 
-  // Parse JSON object
-  DeserializationError error = deserializeJson(doc, *client);
-  if (error) 
+  // Written straight to flash as they are parsed, kept only if the status says so
+  if (!TS_Storage.file_ids_begin(nowTime))
   {
-    log_w("deserializeJson() failed: %s", error.c_str());
-    return;
+    http.end();
+    TS_Storage.file_ids_commit(false);
+    return this->sync_fail(millis());
   }
 
-  JsonObject result = doc["result"];
-  const char* result_status = result["status"];
+  char *value = (char*)syncScratch.alloc(TEMPIDS_ID_MAX + 1);
+  char *tempId = (char*)syncScratch.alloc(TEMPIDS_ID_MAX + 1);
+  TS_TempIdSink append = [](const char *id, uint32_t startTime, uint32_t expiryTime) {
+    return TS_Storage.file_ids_append(id, startTime, expiryTime);
+  };
 
-  if (strcmp(result_status, "SUCCESS") != 0)
+  TS_TempIdsReceived received;
+  memset(&received, 0, sizeof(received));
+  bool parsed = false;
+  if (value != NULL && tempId != NULL)
   {
-    log_w("Error in JSON result status");
+    parsed = receive_temp_ids(http, value, tempId, append, this->syncCancelled, received);
   }
   else
   {
-    log_d("***Request status: OK***");
-    
-    JsonArray result_tempIDs = result["tempIDs"];
+    http.end();
+  }
 
-    OT_TempID tempIds[OT_TEMPID_MAX];
-  
-    log_d("tempID_0 id: %s", result_tempIDs[0]["tempID"].as<const char*>());
-    log_d("tempID_0 start: %ld", result_tempIDs[0]["startTime"]);
-    log_d("tempID_0 expiry: %ld", result_tempIDs[0]["expiryTime"]);
+  // ids written from a body that fails its CRC are dropped, and the next syncs go without gzip
+  if (received.corrupt)
+  {
+    log_w("Gzip response corrupt, no longer requested");
+    this->syncGzip = false;
+  }
 
-    for (int i = 0; i < OT_TEMPID_MAX; i++)
-    {
-      std::string tempId = result_tempIDs[i]["tempID"];
-      tempIds[i] = tempId;
-    }
+  log_d("After parsing: %d, min: %d", ESP.getFreeHeap(), ESP.getMinFreeHeap());
 
-    log_d("Saving TempIDs to storage");
-    if(TS_Storage.file_ids_writeall(OT_TEMPID_MAX, tempIds) != OT_TEMPID_MAX)
-    {
-      log_e("Error saving TempIDs");
-    }
+  if (!parsed)
+  {
+    log_w("Error in JSON result status");
+    TS_Storage.file_ids_commit(false);
+    return this->sync_fail(millis());
   }
+
+  if (!this->sync_next(SYNC_PERSIST))
+  {
+    TS_Storage.file_ids_commit(false);
+    return false;
+  }
+
+  // nothing to rewrite the ids file for
+  uint8_t appended = TS_Storage.file_ids_get_appended();
+  if (appended == 0)
+  {
+    log_i("No TempIDs past %u", horizon);
+    TS_Storage.file_ids_commit(false);
+    return true;
+  }
+
+  uint8_t count = TS_Storage.file_ids_commit(true);
+  if (count == 0)
+  {
+    log_e("Error saving TempIDs");
+    return this->sync_fail(millis());
+  }
+  log_d("***Request status: OK***, TempIDs saved: %d, new: %d", count, appended);
+
+  // the id of the current slot may only have come with this sync
+  OT_ProtocolV2.load_tempids();
+  OT_ProtocolV2.update_characteristic_cache();
+
+  return true;
 }
 
-void _TS_RADIO::download_temp_ids(char* userId)
+TS_SyncState _TS_RADIO::get_sync_state()
 {
-  WiFiClientSecure *client = new WiFiClientSecure;
+  return this->syncState;
+}
+
+const char* _TS_RADIO::get_sync_state_name(TS_SyncState state)
+{
+  static const char *names[SYNC_STATES] = { "idle", "scan", "connect", "tls", "request", "stream", "persist", "upload", "teardown", "done", "backoff" };
+  return state < SYNC_STATES ? names[state] : "";
+}
+
+TS_LatencyHistogram& _TS_RADIO::get_sync_latency(TS_SyncState state)
+{
+  return this->stateLatency[state < SYNC_STATES ? state : SYNC_IDLE];
+}
+
+TS_SyncStats& _TS_RADIO::get_sync_stats()
+{
+  return this->syncStats;
+}
+
+uint8_t _TS_RADIO::get_sync_failures()
+{
+  return this->syncFailures;
+}
+
+uint32_t _TS_RADIO::get_sync_retry_ms()
+{
+  if (this->syncState != SYNC_BACKOFF) return 0;
 
-  _download_temp_ids(userId, client);
-    
-  // Disconnect, cleanup
-  client->stop();
-  delete client;
+  int32_t remainingMs = this->retryAtMs - millis();
+  return remainingMs > 0 ? remainingMs : 0;
 }
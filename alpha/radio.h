@@ -1,11 +1,91 @@
 #ifndef __TS_RADIO__
 #define __TS_RADIO__
 
+#include <Arduino.h>
+#include "hal.h"
+#include "metrics.h"
+
 #define HAL_M5STICK_C
 #define HAL_SERIAL_LOG
 
 #define DEVICE_NAME "TraceStick V0.1"
 
+// Sync server, may be overridden in build_flags to sync with a stand-in server, see tools/sync_server.py
+// - SYNC_SECURE 0 syncs over plain HTTP, only for a server on the local network
+#ifndef SYNC_HOST
+#define SYNC_HOST           "asia-east2-bettr-trace-1.cloudfunctions.net"
+#endif
+#ifndef SYNC_PORT
+#define SYNC_PORT           443
+#endif
+#ifndef SYNC_SECURE
+#define SYNC_SECURE         1
+#endif
+
+// Keep BLE up while WiFi syncs, sharing the radio
+// - 0 deinitializes BLE for the duration of the sync, as before
+#define WIFI_COEX_BLE       1
+
+// Largest free block a sync needs next to the BLE stack, for the TLS record buffers
+#define WIFI_SYNC_HEAP_MIN  50000
+
+// Request and response buffers of one sync
+#define WIFI_SCRATCH_SIZE   1024
+
+// Largest free block left once a gzip TempID response is being inflated, else it is asked for uncompressed
+#define SYNC_GZIP_HEAP_MARGIN  16384
+
+// Longest each sync state may take, a state past it fails the sync
+// - the sync task states are cancelled, they end at the next step or read timeout
+#define SYNC_TIMEOUT_SCAN_MS      8000
+#define SYNC_TIMEOUT_CONNECT_MS   10000
+#define SYNC_TIMEOUT_TLS_MS       15000
+#define SYNC_TIMEOUT_REQUEST_MS   5000
+#define SYNC_TIMEOUT_STREAM_MS    30000
+#define SYNC_TIMEOUT_PERSIST_MS   5000
+#define SYNC_TIMEOUT_UPLOAD_MS    120000
+#define SYNC_TIMEOUT_TEARDOWN_MS  3000
+
+// TempIDs are only requested once fewer than this are left valid, 8 hours of 15 minute ids
+// - then only those past the last one held
+#define TEMPID_REFRESH_BELOW      32
+
+// Retries after failed syncs double from min to max, jittered by +-pct
+#define SYNC_BACKOFF_MIN_MS       5000
+#define SYNC_BACKOFF_MAX_MS       600000
+#define SYNC_BACKOFF_JITTER_PCT   25
+
+// Sync, once per WiFi connection
+// - the main task scans and connects without blocking, then hands over to the sync task
+enum TS_SyncState
+{
+  SYNC_IDLE,        // WiFi disabled, or about to connect
+  SYNC_SCAN,        // background scan for the known SSID
+  SYNC_CONNECT,     // associating and getting an address
+  SYNC_TLS,         // sync task: connection and handshake
+  SYNC_REQUEST,     // sync task: TempID request
+  SYNC_STREAM,      // sync task: response parsed into the new ids file
+  SYNC_PERSIST,     // sync task: new ids merged into the ids file
+  SYNC_UPLOAD,      // sync task: contact logs, if enabled
+  SYNC_TEARDOWN,    // sync task: connection closed
+  SYNC_DONE,        // synced on this connection
+  SYNC_BACKOFF,     // waiting to retry
+  SYNC_STATES,
+};
+
+struct TS_SyncStats
+{
+  uint32_t ok;
+  uint32_t failed;
+  uint32_t timeouts;
+  uint32_t bytesSent;       // of the last sync
+  uint32_t bytesReceived;
+};
+
+class Client;
+class TS_HttpClient;
+struct TS_Settings;
+
 class _TS_RADIO
 {
   public:
@@ -15,16 +95,67 @@ class _TS_RADIO
 
     bool wifi_is_connected();
     void wifi_enable(bool);
+
+    // Steps the sync, never blocks
     void wifi_update();
 
+    // In one of the sync task states
+    bool wifi_is_syncing();
+
+    // Metrics
+    TS_SyncState get_sync_state();
+    static const char* get_sync_state_name(TS_SyncState state);
+    TS_LatencyHistogram& get_sync_latency(TS_SyncState state);
+    TS_SyncStats& get_sync_stats();
+    uint8_t get_sync_failures();    // in a row
+    uint32_t get_sync_retry_ms();   // until the next attempt, while backing off
+
   private:
-    void wifi_connect(char*, char*);
+    void wifi_connect(char*, char*, uint32_t nowMs);
+    void wifi_scan_update(char*, char*, uint32_t nowMs);
     void wifi_disconnect();
-    bool wifi_scan_networks(char*);
-    void download_temp_ids(char*);
+    bool wifi_cache_valid(char*);
+    void wifi_cache_store(char*);
+    void wifi_cache_clear();
+
+    void sync_start(TS_Settings* settings, uint32_t nowMs);
+    void sync_stop(uint32_t nowMs);
+    void sync_check_timeout(uint32_t nowMs);
+    void sync_enter(TS_SyncState state, uint32_t nowMs, bool recordPrevious = true);
+    bool sync_fail(uint32_t nowMs);
+    void sync_backoff(uint32_t nowMs);
+    bool sync_next(TS_SyncState state);
+    bool sync_run();
+    bool sync_temp_ids(uint32_t nowTime, uint8_t valid, uint32_t horizon);
+    bool sync_metrics();
+    static bool is_task_state(TS_SyncState state);
+
+    static void staticSyncTask(void* parameter);
+    void sync_task(void* parameter);
 
     bool wifiEnabled;
-    long wifiTimerStart;
+    bool wifiDirect;    // connecting or connected with the cached access point and address
+    uint32_t wifiConnectStartMs;
+
+    TaskHandle_t     syncTask;
+    Client           *syncClient;
+    TS_HttpClient    *syncHttp;   // kept alive across the requests of a sync
+    char             *syncUserId;
+    bool             syncUpload;
+    bool             syncGzip;    // off after a corrupt gzip response
+    TS_DateTime      syncToday;   // days before are uploaded
+
+    // state changes hands between the main and the sync task, each only moves it in its own states
+    volatile TS_SyncState syncState;
+    volatile uint32_t     stateStartMs;
+    bool                  stateFailed;    // already recorded as failed
+    volatile bool         syncCancelled;
+    volatile bool         syncStopped;    // cancelled because WiFi was disabled, not a failure
+    uint8_t               syncFailures;
+    uint32_t              retryAtMs;
+
+    TS_LatencyHistogram   stateLatency[SYNC_STATES];
+    TS_SyncStats          syncStats;
 };
 
 extern _TS_RADIO TS_RADIO;
@@ -0,0 +1,196 @@
+#include "rssi.h"
+#include <string.h>
+
+// 10^(i/20) x100, distance factor of every dB within a 20dB decade
+static const uint16_t pow10Twentieths[20] = {
+  100, 112, 126, 141, 158, 178, 200, 224, 251, 282,
+  316, 355, 398, 447, 501, 562, 631, 708, 794, 891,
+};
+
+static int8_t median3(int8_t a, int8_t b, int8_t c)
+{
+  if(a > b) { int8_t t = a; a = b; b = t; }
+  if(b > c) b = c;
+  return a > b ? a : b;
+}
+
+static uint16_t isqrt(uint32_t x)
+{
+  uint32_t root = 0;
+  uint32_t bit = 1UL << 30;
+
+  while(bit > x) bit >>= 2;
+  while(bit != 0)
+  {
+    if(x >= root + bit)
+    {
+      x -= root + bit;
+      root = (root >> 1) + bit;
+    }
+    else
+    {
+      root >>= 1;
+    }
+    bit >>= 2;
+  }
+
+  return root;
+}
+
+// Division rounding half away from zero
+static int32_t div_round(int32_t num, int32_t den)
+{
+  return num >= 0 ? (num + den / 2) / den : (num - den / 2) / den;
+}
+
+//
+// TS_RssiEstimator
+//
+
+TS_RssiEstimator::TS_RssiEstimator()
+{
+  this->reset();
+}
+
+void TS_RssiEstimator::reset()
+{
+  this->samples = 0;
+  this->min = 0;
+  this->max = 0;
+  this->window[0] = this->window[1] = 0;
+  this->meanQ8 = 0;
+  this->m2Q8 = 0;
+  this->smoothedQ8 = 0;
+  this->varianceQ8 = RSSI_KALMAN_R_Q8;
+}
+
+void TS_RssiEstimator::add(int8_t rssi)
+{
+  int32_t rssiQ8 = (int32_t)rssi * 256;
+
+  if(this->samples == 0)
+  {
+    this->samples = 1;
+    this->min = this->max = rssi;
+    this->window[0] = this->window[1] = rssi;
+    this->meanQ8 = rssiQ8;
+    this->m2Q8 = 0;
+    this->smoothedQ8 = rssiQ8;
+    this->varianceQ8 = RSSI_KALMAN_R_Q8;
+    return;
+  }
+
+  // median of the last 3 rejects single sample drops before smoothing
+  int8_t filtered = median3(this->window[0], this->window[1], rssi);
+  this->window[0] = this->window[1];
+  this->window[1] = rssi;
+
+  if(rssi < this->min) this->min = rssi;
+  if(rssi > this->max) this->max = rssi;
+
+  // Welford, both deltas share a sign so their product is never negative
+  if(this->samples < UINT16_MAX)
+  {
+    ++this->samples;
+    int32_t delta = rssiQ8 - this->meanQ8;
+    this->meanQ8 += div_round(delta, this->samples);
+    int32_t delta2 = rssiQ8 - this->meanQ8;
+
+    this->m2Q8 += ((int64_t)delta * delta2) >> 8;
+  }
+
+  // Kalman, constant model
+  uint32_t priorQ8 = this->varianceQ8 + RSSI_KALMAN_Q_Q8;
+  uint32_t gainQ8 = (priorQ8 << 8) / (priorQ8 + RSSI_KALMAN_R_Q8);
+  this->smoothedQ8 += div_round(((int32_t)filtered * 256 - this->smoothedQ8) * (int32_t)gainQ8, 256);
+  this->varianceQ8 = ((256 - gainQ8) * priorQ8) >> 8;
+}
+
+uint16_t TS_RssiEstimator::get_samples()
+{
+  return this->samples;
+}
+
+int8_t TS_RssiEstimator::get_min()
+{
+  return this->min;
+}
+
+int8_t TS_RssiEstimator::get_max()
+{
+  return this->max;
+}
+
+int16_t TS_RssiEstimator::get_mean_q8()
+{
+  return this->meanQ8;
+}
+
+uint16_t TS_RssiEstimator::get_stddev_q4()
+{
+  if(this->samples < 2) return 0;
+
+  // root of a Q8 variance is Q4
+  uint64_t varianceQ8 = this->m2Q8 / (this->samples - 1);
+  return isqrt(varianceQ8 > UINT32_MAX ? UINT32_MAX : varianceQ8);
+}
+
+int8_t TS_RssiEstimator::get_smoothed()
+{
+  return div_round(this->smoothedQ8, 256);
+}
+
+TS_RssiBucket TS_RssiEstimator::get_bucket()
+{
+  if(this->samples == 0) return RSSI_BUCKET_NONE;
+
+  int16_t attenuation = RSSI_REF_1M - this->get_smoothed();
+  if(attenuation < RSSI_BUCKET_NEAR_DB) return RSSI_BUCKET_IMMEDIATE;
+  if(attenuation < RSSI_BUCKET_MEDIUM_DB) return RSSI_BUCKET_NEAR;
+  if(attenuation < RSSI_BUCKET_FAR_DB) return RSSI_BUCKET_MEDIUM;
+  return RSSI_BUCKET_FAR;
+}
+
+// d = 10^((ref - rssi) / (10n)), in 20ths of a decade from a table
+uint32_t TS_RssiEstimator::get_distance_cm()
+{
+  if(this->samples == 0) return 0;
+
+  // clamp to 1cm..1km
+  int32_t twentieths = (RSSI_REF_1M - this->get_smoothed()) * 20 / RSSI_PATHLOSS_N10;
+  if(twentieths < -40) twentieths = -40;
+  if(twentieths > 99) twentieths = 99;
+
+  int32_t decades = (twentieths + 40) / 20 - 2;
+  uint32_t distance = pow10Twentieths[(twentieths + 40) % 20];  // cm at 1m
+  for(; decades > 0; --decades) distance *= 10;
+  for(; decades < 0; ++decades) distance /= 10;
+  return distance;
+}
+
+void TS_RssiEstimator::summarize(TS_RssiSummary &summary)
+{
+  summary.samples = this->samples;
+  summary.min = this->min;
+  summary.max = this->max;
+  summary.meanQ8 = this->meanQ8;
+  summary.stddevQ4 = this->get_stddev_q4();
+  summary.smoothed = this->get_smoothed();
+  summary.bucket = this->get_bucket();
+}
+
+void TS_RssiEstimator::restore(const TS_RssiSummary &summary)
+{
+  this->reset();
+  if(summary.samples == 0) return;
+
+  this->samples = summary.samples;
+  this->min = summary.min;
+  this->max = summary.max;
+  this->window[0] = this->window[1] = summary.smoothed;
+  this->meanQ8 = summary.meanQ8;
+  this->smoothedQ8 = (int16_t)summary.smoothed * 256;
+
+  // m2 = variance * (n - 1)
+  this->m2Q8 = (uint64_t)summary.stddevQ4 * summary.stddevQ4 * (summary.samples - 1);
+}
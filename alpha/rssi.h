@@ -0,0 +1,286 @@
+//
+// Per-peer RSSI estimation
+// - streaming statistics at constant memory, fixed point only
+// - Welford mean and variance, min/max
+// - median of 3 spike rejection feeding a 1-D Kalman filter for a smoothed rssi
+// - smoothed rssi maps to an attenuation bucket and a rough distance
+//
+
+#ifndef __TS_RSSI__
+#define __TS_RSSI__
+
+#include <stdint.h>
+#include "tests.h"
+
+// Kalman noise variances in dB^2, 8 fractional bits
+// - process: drift of the true rssi between two samples
+// - measurement: spread of single samples around the true rssi
+#define RSSI_KALMAN_Q_Q8    (4 << 8)
+#define RSSI_KALMAN_R_Q8    (36 << 8)
+
+// Log-distance path loss model
+// - rssi measured at 1m, and path loss exponent x10 (20: free space)
+#define RSSI_REF_1M         -59
+#define RSSI_PATHLOSS_N10   20
+
+// Attenuation below RSSI_REF_1M bounding each bucket, in dB
+// - with free space path loss every 6dB doubles the distance
+#define RSSI_BUCKET_NEAR_DB     0   // 1m
+#define RSSI_BUCKET_MEDIUM_DB   6   // 2m
+#define RSSI_BUCKET_FAR_DB      12  // 4m
+
+enum TS_RssiBucket
+{
+  RSSI_BUCKET_IMMEDIATE,
+  RSSI_BUCKET_NEAR,
+  RSSI_BUCKET_MEDIUM,
+  RSSI_BUCKET_FAR,
+  RSSI_BUCKET_NONE,     // no samples
+};
+
+// Compact statistics, as stored on flash
+struct TS_RssiSummary
+{
+  uint16_t samples;
+  int8_t   min;
+  int8_t   max;
+  int16_t  meanQ8;      // 8 fractional bits
+  uint16_t stddevQ4;    // 4 fractional bits
+  int8_t   smoothed;
+  uint8_t  bucket;      // TS_RssiBucket
+};
+
+class TS_RssiEstimator
+{
+  public:
+    TS_RssiEstimator();
+
+    void reset();
+    void add(int8_t rssi);
+
+    uint16_t get_samples();
+    int8_t   get_min();
+    int8_t   get_max();
+    int16_t  get_mean_q8();
+    uint16_t get_stddev_q4();
+    int8_t   get_smoothed();
+
+    TS_RssiBucket get_bucket();
+
+    // Distance from the smoothed rssi, in cm, 0 if no samples
+    uint32_t get_distance_cm();
+
+    void summarize(TS_RssiSummary &summary);
+
+    // Continues from a stored summary, the filter window starts empty
+    void restore(const TS_RssiSummary &summary);
+
+  private:
+    uint16_t samples;     // saturates, statistics freeze while smoothing goes on
+    int8_t   min;
+    int8_t   max;
+    int8_t   window[2];   // last two raw samples
+    int16_t  meanQ8;
+    uint64_t m2Q8;        // sum of squared deviations from the mean
+    int16_t  smoothedQ8;  // Kalman estimate
+    uint16_t varianceQ8;  // Kalman estimate variance
+};
+
+
+
+//
+// Tests
+//
+
+#if defined(TESTDRIVER) && defined(TESTDRIVER_RSSI)
+
+#include <math.h>
+
+// Recorded rssi traces, one sample per advertisement
+// - stationary: peer on the next desk, with two multipath drops
+// - approaching: peer walking up from across the room and stopping at arm's length
+static const int8_t rssiTraceStationary[] = {
+  -66, -64, -65, -67, -63, -66, -65, -91, -64, -66,
+  -65, -67, -64, -65, -66, -63, -65, -66, -64, -88,
+  -65, -66, -67, -64, -65, -65, -66, -63, -64, -66,
+  -65, -64, -67, -65, -66, -64, -65, -66, -65, -64,
+};
+
+static const int8_t rssiTraceApproaching[] = {
+  -86, -84, -87, -85, -83, -84, -82, -83, -80, -81,
+  -79, -78, -80, -76, -75, -77, -73, -72, -74, -70,
+  -69, -70, -67, -66, -68, -64, -63, -62, -64, -60,
+  -58, -57, -56, -55, -54, -55, -53, -54, -55, -54,
+};
+
+#define RSSI_TRACE_LEN(trace) (sizeof(trace) / sizeof(trace[0]))
+
+static class _TS_RssiTests : public _TS_Tests
+{
+public:
+  void init() override {}
+
+  void replay(TS_RssiEstimator &estimator, const int8_t *trace, uint16_t length)
+  {
+    estimator.reset();
+    for(uint16_t i = 0; i < length; ++i)
+    {
+      estimator.add(trace[i]);
+    }
+  }
+
+  bool test_rssi_spikes_rejected()
+  {
+    TS_RssiEstimator estimator;
+    estimator.reset();
+
+    for(uint16_t i = 0; i < RSSI_TRACE_LEN(rssiTraceStationary); ++i)
+    {
+      estimator.add(rssiTraceStationary[i]);
+      if(i >= 4 && (estimator.get_smoothed() < -68 || estimator.get_smoothed() > -62))
+      {
+        log_e("Smoothed rssi should stay near -65 through drops, sample %d: %d", i, estimator.get_smoothed());
+        return false;
+      }
+    }
+
+    if(estimator.get_min() != -91 || estimator.get_max() != -63)
+    {
+      log_e("Min/max should include spikes, %d/%d", estimator.get_min(), estimator.get_max());
+      return false;
+    }
+
+    return true;
+  }
+
+  bool test_rssi_tracks_approach()
+  {
+    TS_RssiEstimator estimator;
+    estimator.reset();
+
+    TS_RssiBucket first = RSSI_BUCKET_NONE;
+    for(uint16_t i = 0; i < RSSI_TRACE_LEN(rssiTraceApproaching); ++i)
+    {
+      estimator.add(rssiTraceApproaching[i]);
+      if(i == 0) first = estimator.get_bucket();
+    }
+
+    if(first != RSSI_BUCKET_FAR || estimator.get_bucket() != RSSI_BUCKET_IMMEDIATE)
+    {
+      log_e("Bucket should go from far to immediate, %d -> %d", first, estimator.get_bucket());
+      return false;
+    }
+
+    if(estimator.get_smoothed() < -58 || estimator.get_smoothed() > -52)
+    {
+      log_e("Smoothed rssi should settle near -54, %d", estimator.get_smoothed());
+      return false;
+    }
+
+    uint32_t distance = estimator.get_distance_cm();
+    if(distance < 30 || distance > 100)
+    {
+      log_e("Distance at arm's length expected, %dcm", distance);
+      return false;
+    }
+
+    return true;
+  }
+
+  // compare with floating point Welford over a long trace, the old int16 sums overflowed after a few samples
+  bool test_rssi_statistics_exact()
+  {
+    TS_RssiEstimator estimator;
+    estimator.reset();
+
+    double mean = 0, m2 = 0;
+    uint32_t seed = 1;
+    for(uint16_t i = 1; i <= 5000; ++i)
+    {
+      seed = seed * 1103515245 + 12345;
+      int8_t rssi = -95 + (int8_t)((seed >> 16) % 60);
+
+      estimator.add(rssi);
+      double delta = rssi - mean;
+      mean += delta / i;
+      m2 += delta * (rssi - mean);
+    }
+
+    double stddev = sqrt(m2 / (5000 - 1));
+    double gotMean = estimator.get_mean_q8() / 256.0;
+    double gotStddev = estimator.get_stddev_q4() / 16.0;
+
+    if(estimator.get_samples() != 5000 || fabs(gotMean - mean) > 0.1 || fabs(gotStddev - stddev) > 0.2)
+    {
+      log_e("Statistics off, mean %d/%d stddev %d/%d (x100)",
+        (int)(gotMean * 100), (int)(mean * 100), (int)(gotStddev * 100), (int)(stddev * 100));
+      return false;
+    }
+
+    return true;
+  }
+
+  bool test_rssi_summary_roundtrip()
+  {
+    TS_RssiEstimator estimator;
+    replay(estimator, rssiTraceStationary, RSSI_TRACE_LEN(rssiTraceStationary));
+
+    TS_RssiSummary summary, restoredSummary;
+    estimator.summarize(summary);
+
+    TS_RssiEstimator restored;
+    restored.restore(summary);
+    restored.summarize(restoredSummary);
+
+    if(memcmp(&summary, &restoredSummary, sizeof(summary)) != 0)
+    {
+      log_e("Restored summary differs");
+      return false;
+    }
+
+    return true;
+  }
+
+  // as stored, summarized after every few samples and restored for the next ones
+  bool test_rssi_replay_per_incident()
+  {
+    const uint16_t length = RSSI_TRACE_LEN(rssiTraceApproaching);
+    TS_RssiEstimator continuous, stored;
+    TS_RssiSummary summary;
+    replay(continuous, rssiTraceApproaching, length);
+
+    memset(&summary, 0, sizeof(summary));
+    for(uint16_t i = 0; i < length; ++i)
+    {
+      if(i % 6 == 0) stored.restore(summary);
+      stored.add(rssiTraceApproaching[i]);
+      if(i % 6 == 5 || i == length - 1) stored.summarize(summary);
+    }
+
+    int16_t meanDiff = summary.meanQ8 - continuous.get_mean_q8();
+    int16_t stddevDiff = summary.stddevQ4 - continuous.get_stddev_q4();
+    int16_t smoothedDiff = summary.smoothed - continuous.get_smoothed();
+    if(summary.samples != length || summary.min != continuous.get_min() || summary.max != continuous.get_max()
+      || abs(meanDiff) > 26 || abs(stddevDiff) > 8 || abs(smoothedDiff) > 2 || summary.bucket != continuous.get_bucket())
+    {
+      log_e("Stored statistics drift, mean %d stddev %d smoothed %d (Q8/Q4/dB)", meanDiff, stddevDiff, smoothedDiff);
+      return false;
+    }
+
+    return true;
+  }
+
+  // Ctor
+  _TS_RssiTests()
+  {
+    add(std::bind(&_TS_RssiTests::test_rssi_spikes_rejected, this), "test_rssi_spikes_rejected");
+    add(std::bind(&_TS_RssiTests::test_rssi_tracks_approach, this), "test_rssi_tracks_approach");
+    add(std::bind(&_TS_RssiTests::test_rssi_statistics_exact, this), "test_rssi_statistics_exact");
+    add(std::bind(&_TS_RssiTests::test_rssi_summary_roundtrip, this), "test_rssi_summary_roundtrip");
+    add(std::bind(&_TS_RssiTests::test_rssi_replay_per_incident, this), "test_rssi_replay_per_incident");
+  }
+} TS_RssiTests;
+
+#endif
+
+#endif
@@ -0,0 +1,144 @@
+#include "scheduler.h"
+#include "hal.h"
+
+// +- % applied to every scan interval so peers do not stay in lockstep
+#define SCAN_JITTER_PCT     10
+#define SCAN_WINDOW         1000
+
+#define SLEEP_MIN           1000
+#define SLEEP_MAX           3000
+#define ADVERTISE_DURATION  1000
+
+#define STATS_INTERVAL      60000
+
+// While WiFi syncs alongside BLE, radio slots shrink to this share and scans come half as often
+#define REDUCED_DUTY_PCT    50
+
+static const char *slotNames[SLOT_TYPES] = { "sleep", "scan", "exchange", "advertise" };
+
+//
+// TS_Scheduler
+//
+
+_TS_Scheduler TS_Scheduler;
+
+// Ctor
+_TS_Scheduler::_TS_Scheduler()
+: slotCount(0), slotNext(0), scanned(false), lastScanMs(0), scanIntervalMs(0), reducedDuty(false), statsSinceMs(0)
+{
+  this->scanIntervalMs = this->density.get_scan_interval_ms();
+  memset(stats, 0, sizeof(stats));
+}
+
+void _TS_Scheduler::plan(uint32_t nowMs, TS_PowerState powerState, uint16_t connectedCount)
+{
+  this->slotCount = 0;
+  this->slotNext = 0;
+
+  // Sleep first, jittered
+  // - only power-saving sleep in low-power mode with no connected clients
+  this->add_slot(SLOT_SLEEP, TS_HAL.random_get(SLEEP_MIN, SLEEP_MAX));
+  this->slots[0].lightSleep = powerState == TS_PowerState::LOW_POWER && connectedCount == 0;
+
+  // Scan when due, but not while serving connected clients
+  uint32_t scanIntervalMs = this->reducedDuty ? this->scanIntervalMs * 2 : this->scanIntervalMs;
+  if(connectedCount == 0 && (!this->scanned || nowMs - this->lastScanMs >= scanIntervalMs))
+  {
+    this->add_slot(SLOT_SCAN, this->duty(SCAN_WINDOW));
+    this->slots[this->slotCount - 1].rssiCutoff = this->density.get_rssi_cutoff();
+    this->slots[this->slotCount - 1].exchangeBudgetMs = this->duty(this->density.get_exchange_budget_ms());
+
+    this->lastScanMs = nowMs;
+    this->scanned = true;
+  }
+
+  this->add_slot(SLOT_ADVERTISE, this->duty(ADVERTISE_DURATION));
+}
+
+void _TS_Scheduler::set_reduced_duty(bool reduced)
+{
+  if(reduced != this->reducedDuty)
+  {
+    log_i("Radio duty %s", reduced ? "reduced" : "restored");
+  }
+
+  this->reducedDuty = reduced;
+}
+
+bool _TS_Scheduler::is_reduced_duty()
+{
+  return this->reducedDuty;
+}
+
+uint32_t _TS_Scheduler::duty(uint32_t durationMs)
+{
+  return this->reducedDuty ? durationMs * REDUCED_DUTY_PCT / 100 : durationMs;
+}
+
+bool _TS_Scheduler::next(TS_Slot &slot)
+{
+  if(this->slotNext >= this->slotCount) return false;
+  slot = this->slots[this->slotNext++];
+  return true;
+}
+
+void _TS_Scheduler::record(TS_SlotType type, uint32_t plannedMs, uint32_t actualMs)
+{
+  TS_SlotStats &s = this->stats[type];
+  ++s.count;
+  s.plannedMs += plannedMs;
+  s.actualMs += actualMs;
+  if(actualMs > plannedMs && actualMs - plannedMs > s.maxLateMs)
+  {
+    s.maxLateMs = actualMs - plannedMs;
+  }
+}
+
+void _TS_Scheduler::scan_done(uint16_t peers, uint16_t newPeers)
+{
+  this->density.update(peers, newPeers);
+
+  // the next scan is due one jittered interval after this one
+  uint32_t intervalMs = this->density.get_scan_interval_ms();
+  uint32_t jitterMs = intervalMs / 100 * SCAN_JITTER_PCT;
+  this->scanIntervalMs = intervalMs - jitterMs + TS_HAL.random_get(0, 2 * jitterMs);
+
+  log_i("Density %d.%02d peers/scan, next scan in %dms, rssi cutoff %d", this->density.get_density_q4() >> 4,
+    (this->density.get_density_q4() & 0xF) * 100 / 16, this->scanIntervalMs, this->density.get_rssi_cutoff());
+}
+
+TS_SlotStats * _TS_Scheduler::get_stats(TS_SlotType type)
+{
+  return &this->stats[type];
+}
+
+void _TS_Scheduler::log_stats(uint32_t nowMs)
+{
+  uint32_t elapsedMs = nowMs - this->statsSinceMs;
+  if(elapsedMs < STATS_INTERVAL) return;
+
+  uint32_t radioMs = 0;
+  for(uint8_t i = 0; i < SLOT_TYPES; ++i)
+  {
+    TS_SlotStats &s = this->stats[i];
+    log_i("Slot %s: %d slots, planned %dms, actual %dms, max late %dms", slotNames[i], s.count, s.plannedMs, s.actualMs, s.maxLateMs);
+    if(i != SLOT_SLEEP) radioMs += s.actualMs;
+  }
+  
+  log_i("Radio on %dms of %dms (%d%%)", radioMs, elapsedMs, radioMs * 100 / elapsedMs);
+
+  memset(this->stats, 0, sizeof(this->stats));
+  this->statsSinceMs = nowMs;
+}
+
+void _TS_Scheduler::add_slot(TS_SlotType type, uint32_t durationMs)
+{
+  if(this->slotCount >= TS_SCHEDULE_MAX_SLOTS) return;
+
+  TS_Slot &slot = this->slots[this->slotCount++];
+  slot.type = type;
+  slot.durationMs = durationMs;
+  slot.lightSleep = false;
+  slot.rssiCutoff = -128;
+  slot.exchangeBudgetMs = 0;
+}
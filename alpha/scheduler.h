@@ -0,0 +1,170 @@
+//
+// Radio duty-cycle scheduler
+// - plans each cycle of radio activity as timed slots: scan (with an exchange budget), advertise, sleep
+// - adapts to power state, connected clients and peer density
+// - records planned vs actual slot timings
+//
+
+#ifndef __TS_SCHEDULER__
+#define __TS_SCHEDULER__
+
+#include <stdint.h>
+#include "power.h"
+#include "density.h"
+#include "tests.h"
+
+#define TS_SCHEDULE_MAX_SLOTS 4
+
+enum TS_SlotType
+{
+  SLOT_SLEEP,
+  SLOT_SCAN,
+  SLOT_EXCHANGE,  // runs within a scan slot, up to its exchange budget
+  SLOT_ADVERTISE,
+  SLOT_TYPES,
+};
+
+struct TS_Slot
+{
+  TS_SlotType type;
+  uint32_t    durationMs;
+  
+  bool        lightSleep;        // SLOT_SLEEP: power-saving sleep
+  int8_t      rssiCutoff;        // SLOT_SCAN: lowest acceptable rssi
+  uint32_t    exchangeBudgetMs;  // SLOT_SCAN: time allowed for exchanges
+};
+
+// Planned vs actual timings of one slot type
+struct TS_SlotStats
+{
+  uint32_t count;
+  uint32_t plannedMs;
+  uint32_t actualMs;
+  uint32_t maxLateMs;   // largest overrun of a single slot
+};
+
+class _TS_Scheduler
+{
+  public:
+    _TS_Scheduler();
+
+    // Plans the next cycle
+    // - connectedCount: connected centrals, radio is kept responsive and scans deferred while > 0
+    void plan(uint32_t nowMs, TS_PowerState powerState, uint16_t connectedCount);
+
+    // Pops the next planned slot, returns false when the cycle is done
+    bool next(TS_Slot &slot);
+
+    // Records the actual duration of an executed slot
+    void record(TS_SlotType type, uint32_t plannedMs, uint32_t actualMs);
+
+    // Outcome of the last scan
+    void scan_done(uint16_t peers, uint16_t newPeers);
+
+    TS_SlotStats *get_stats(TS_SlotType type);
+
+    // Logs and resets stats once every stats interval
+    void log_stats(uint32_t nowMs);
+
+    // Shorter radio slots and fewer scans, leaving airtime to WiFi while it syncs
+    void set_reduced_duty(bool reduced);
+    bool is_reduced_duty();
+
+  private:
+    void add_slot(TS_SlotType type, uint32_t durationMs);
+    uint32_t duty(uint32_t durationMs);
+
+    TS_Slot      slots[TS_SCHEDULE_MAX_SLOTS];
+    uint8_t      slotCount;
+    uint8_t      slotNext;
+
+    bool         scanned;
+    uint32_t     lastScanMs;
+    uint32_t     scanIntervalMs;  // jittered
+    bool         reducedDuty;
+
+    TS_DensityController density;
+
+    TS_SlotStats stats[SLOT_TYPES];
+    uint32_t     statsSinceMs;
+};
+
+extern _TS_Scheduler TS_Scheduler;
+
+
+
+//
+// Tests
+//
+
+#if defined(TESTDRIVER) && defined(TESTDRIVER_SCHEDULER)
+
+static class _TS_SchedulerTests : public _TS_Tests
+{
+public:
+  void init() override {}
+
+  // first slot of type in the planned cycle, false if none
+  bool find_slot(_TS_Scheduler &scheduler, TS_SlotType type, TS_Slot &found)
+  {
+    TS_Slot slot;
+    bool any = false;
+    while(scheduler.next(slot))
+    {
+      if(slot.type == type && !any)
+      {
+        found = slot;
+        any = true;
+      }
+    }
+    return any;
+  }
+
+  bool test_reduced_duty()
+  {
+    _TS_Scheduler normal, reduced;
+    TS_Slot normalScan, reducedScan, normalAdvertise, reducedAdvertise;
+    reduced.set_reduced_duty(true);
+
+    normal.plan(0, HIGH_POWER, 0);
+    find_slot(normal, SLOT_SCAN, normalScan);
+    normal.plan(0, HIGH_POWER, 0);
+    find_slot(normal, SLOT_ADVERTISE, normalAdvertise);
+
+    reduced.plan(0, HIGH_POWER, 0);
+    find_slot(reduced, SLOT_SCAN, reducedScan);
+    reduced.plan(0, HIGH_POWER, 0);
+    find_slot(reduced, SLOT_ADVERTISE, reducedAdvertise);
+
+    if(reducedScan.durationMs >= normalScan.durationMs || reducedScan.exchangeBudgetMs >= normalScan.exchangeBudgetMs
+      || reducedAdvertise.durationMs >= normalAdvertise.durationMs || reducedAdvertise.durationMs == 0)
+    {
+      log_e("Reduced duty should shorten slots, scan %d/%d, advertise %d/%d",
+        reducedScan.durationMs, normalScan.durationMs, reducedAdvertise.durationMs, normalAdvertise.durationMs);
+      return false;
+    }
+
+    // one and a half intervals later only the normal scheduler scans again
+    TS_Slot slot;
+    uint32_t nowMs = TS_DensityController().get_scan_interval_ms() * 3 / 2;
+    normal.plan(nowMs, HIGH_POWER, 0);
+    reduced.plan(nowMs, HIGH_POWER, 0);
+    if(!find_slot(normal, SLOT_SCAN, slot) || find_slot(reduced, SLOT_SCAN, slot))
+    {
+      log_e("Reduced duty should scan half as often");
+      return false;
+    }
+
+    return true;
+  }
+
+  // Ctor
+  _TS_SchedulerTests()
+  {
+    add(std::bind(&_TS_SchedulerTests::test_reduced_duty, this), "test_reduced_duty");
+  }
+} TS_SchedulerTests;
+
+#endif
+
+#endif
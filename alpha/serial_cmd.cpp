@@ -7,6 +7,8 @@
 #include "hal.h"
 #include "serial_cmd.h"
 #include "storage.h"
+#include "opentracev2.h"
+#include "radio.h"
 
 
 // Increase as UI thread uses more things
@@ -338,13 +340,15 @@ static struct
 {
   struct arg_lit *get;
   struct arg_int *upload_flag;
+  struct arg_int *connectionless_flag;
   struct arg_lit *ram_flag;
   struct arg_end *end;
 } flagArgs;
 
 static void print_flags(TS_Settings* settings)
 {
-  printf("upload: %d\n\n", 1 ? settings->upload_flag : 0);
+  printf("upload: %d\n", 1 ? settings->upload_flag : 0);
+  printf("connectionless: %d\n\n", 1 ? settings->connectionless_flag : 0);
 }
 
 static int do_flag_cmd(int argc, char **argv)
@@ -378,6 +382,23 @@ static int do_flag_cmd(int argc, char **argv)
     }
     save_to_ram_or_eeprom(flagArgs.ram_flag);
   }
+  else if (flagArgs.connectionless_flag->count == 1)
+  {
+    switch (flagArgs.connectionless_flag->ival[0])
+    {
+      case 0:
+        settings->connectionless_flag = false;
+        break;
+      case 1:
+        settings->connectionless_flag = true;
+        break;
+      default:
+        print_cmd_help(argv[0], (void**) &flagArgs);
+        return ESP_ERR_INVALID_ARG;
+    }
+    OT_ProtocolV2.set_connectionless(settings->connectionless_flag);
+    save_to_ram_or_eeprom(flagArgs.ram_flag);
+  }
   else
   {
     print_cmd_help(argv[0], (void**) &flagArgs);
@@ -390,6 +411,7 @@ static void register_flag_cmd()
 {
   flagArgs.get = arg_lit0("g", "get", "get flag settings");
   flagArgs.upload_flag = arg_int0("u", "upload", "<int>", "1: upload temp IDs when WIFI connected, 0: disabled");
+  flagArgs.connectionless_flag = arg_int0("c", "connectionless", "<int>", "1: advertise TempID tokens and log known ones without connecting, 0: always exchange");
   flagArgs.ram_flag = arg_lit0("r", "ram", "[debug] save to RAM not EEPROM, will not persist after power cycle (e.g. flag -u 1 -r)");
   flagArgs.end = arg_end(20);
 
@@ -404,6 +426,270 @@ static void register_flag_cmd()
   ESP_ERROR_CHECK( esp_console_cmd_register(&cmd) );
 }
 
+// Transmit power levels and the last decisions, newest first
+static int do_txpower_cmd(int argc, char **argv)
+{
+  TS_TxPowerController &txPower = OT_ProtocolV2.get_tx_power();
+  TS_PowerState state = TS_POWER.get_state();
+
+  printf("advertising: %d, max: %d (levels 0: -14dBm to 7: 7dBm, 3dB apart)\n",
+    txPower.get_adv_power(), TS_TxPowerController::get_max_power(state));
+
+  TS_TxPowerDecision decision;
+  for (uint8_t i = 0; txPower.get_decision(i, decision); ++i)
+  {
+    printf("%10ums state: %d, reports: %u, strongest: %d, %d -> %d, %s\n", decision.atMs, decision.state,
+      decision.reports, decision.strongest, decision.from, decision.to, TS_TxPowerController::get_reason_name(decision.reason));
+  }
+  printf("\n");
+
+  return ESP_OK;
+}
+
+static void register_txpower_cmd()
+{
+  const esp_console_cmd_t cmd =
+  {
+    .command = "txpower",
+    .help = "Transmit power levels and recent power control decisions",
+    .hint = NULL,
+    .func = &do_txpower_cmd,
+  };
+  ESP_ERROR_CHECK( esp_console_cmd_register(&cmd) );
+}
+
+static struct
+{
+  struct arg_lit *json;
+  struct arg_lit *reset;
+  struct arg_end *end;
+} metricsArgs;
+
+// Exchange phase latencies, percentiles are bucket upper bounds
+static int do_metrics_cmd(int argc, char **argv)
+{
+  int nerrors = arg_parse(argc, argv, (void **) &metricsArgs);
+  if (nerrors != 0)
+  {
+    arg_print_errors(stderr, metricsArgs.end, argv[0]);
+    return ESP_ERR_INVALID_ARG;
+  }
+
+  if (metricsArgs.reset->count == 1)
+  {
+    OT_ProtocolV2.reset_phase_latency();
+    printf("Phase metrics reset\n\n");
+    return ESP_OK;
+  }
+
+  if (metricsArgs.json->count == 1)
+  {
+    std::string buf;
+    OT_ProtocolV2.phase_metrics_to_json(buf);
+    printf("%s\n\n", buf.c_str());
+    return ESP_OK;
+  }
+
+  printf("%-16s %6s %6s %9s %9s %9s %9s\n", "phase", "ok", "fail", "avg(us)", "p50(us)", "p90(us)", "max(us)");
+  for (uint8_t i = 0; i < OT_PHASES; ++i)
+  {
+    TS_LatencyHistogram &latency = OT_ProtocolV2.get_phase_latency((OT_Phase)i);
+    printf("%-16s %6u %6u %9u %9u %9u %9u\n", OT_ProtocolV2.get_phase_name((OT_Phase)i),
+      latency.get_ok(), latency.get_failed(), latency.get_avg_us(),
+      latency.get_percentile_us(50), latency.get_percentile_us(90), latency.get_max_us());
+  }
+  printf("\n");
+
+  return ESP_OK;
+}
+
+static void register_metrics_cmd()
+{
+  metricsArgs.json = arg_lit0("j", "json", "print as json");
+  metricsArgs.reset = arg_lit0("r", "reset", "reset phase metrics");
+  metricsArgs.end = arg_end(20);
+
+  const esp_console_cmd_t cmd =
+  {
+    .command = "metrics",
+    .help = "Exchange phase latency histograms and success counters",
+    .hint = NULL,
+    .func = &do_metrics_cmd,
+    .argtable = &metricsArgs
+  };
+  ESP_ERROR_CHECK( esp_console_cmd_register(&cmd) );
+}
+
+static struct
+{
+  struct arg_lit *reset;
+  struct arg_end *end;
+} benchArgs;
+
+// Run for the same time with each flag -c setting and compare
+// - radio on time stands in for power, peers and samples for detection
+static int do_bench_cmd(int argc, char **argv)
+{
+  int nerrors = arg_parse(argc, argv, (void **) &benchArgs);
+  if (nerrors != 0)
+  {
+    arg_print_errors(stderr, benchArgs.end, argv[0]);
+    return ESP_ERR_INVALID_ARG;
+  }
+
+  if (benchArgs.reset->count == 1)
+  {
+    OT_ProtocolV2.reset_encounter_stats();
+    printf("Encounter stats reset\n\n");
+    return ESP_OK;
+  }
+
+  OT_EncounterStats &stats = OT_ProtocolV2.get_encounter_stats();
+  uint32_t elapsedMs = millis() - stats.sinceMs;
+  uint32_t radioMs = stats.scanMs + stats.exchangeMs + stats.advertiseMs;
+
+  printf("mode: %s\n", OT_ProtocolV2.is_connectionless() ? "connectionless" : "exchange");
+  printf("elapsed: %us\n", elapsedMs / 1000);
+  printf("radio on: %ums (%u%%), scan: %ums, exchange: %ums, advertise: %ums\n",
+    radioMs, elapsedMs ? (uint32_t)((uint64_t)radioMs * 100 / elapsedMs) : 0, stats.scanMs, stats.exchangeMs, stats.advertiseMs);
+  printf("scans: %u, peers seen: %u, exchanges: %u\n", stats.scans, stats.peers, stats.exchanges);
+  printf("samples, exchanged: %u, cached: %u, token: %u, token misses: %u\n",
+    stats.exchanges, stats.cacheSamples, stats.tokenSamples, stats.tokenMisses);
+  printf("sightings merged since boot: %u\n", OT_ProtocolV2.get_encounter_merger().get_merged());
+
+  OT_FailureTracker &failures = OT_ProtocolV2.get_failure_tracker();
+  printf("failures since boot, connect: %u, service: %u, characteristic: %u, access: %u, frame: %u, timeout: %u, backed off: %u\n",
+    failures.get_count(OT_EXCHANGE_CONNECT_FAILED), failures.get_count(OT_EXCHANGE_NO_SERVICE), failures.get_count(OT_EXCHANGE_NO_CHARACTERISTIC),
+    failures.get_count(OT_EXCHANGE_NO_ACCESS), failures.get_count(OT_EXCHANGE_BAD_FRAME), failures.get_count(OT_EXCHANGE_TIMEOUT), failures.get_skipped());
+  printf("battery: %u%% -> %u%%\n\n", stats.battLevel, TS_HAL.power_get_batt_level());
+
+  return ESP_OK;
+}
+
+static void register_bench_cmd()
+{
+  benchArgs.reset = arg_lit0("r", "reset", "reset encounter stats");
+  benchArgs.end = arg_end(20);
+
+  const esp_console_cmd_t cmd =
+  {
+    .command = "bench",
+    .help = "Encounter stats since reset, to compare power and detection of flag -c modes",
+    .hint = NULL,
+    .func = &do_bench_cmd,
+    .argtable = &benchArgs
+  };
+  ESP_ERROR_CHECK( esp_console_cmd_register(&cmd) );
+}
+
+static struct
+{
+  struct arg_int *peers;
+  struct arg_int *incidents;
+  struct arg_int *rounds;
+  struct arg_end *end;
+} logbenchArgs;
+
+// Contact log append and scan, plaintext then encrypted each round, on the device's flash
+// - the workload of tools/synchost/log_bench, encryption is to cost under 10% of either
+static int do_logbench_cmd(int argc, char **argv)
+{
+  int nerrors = arg_parse(argc, argv, (void **) &logbenchArgs);
+  if (nerrors != 0)
+  {
+    arg_print_errors(stderr, logbenchArgs.end, argv[0]);
+    return ESP_ERR_INVALID_ARG;
+  }
+
+  uint16_t peers = logbenchArgs.peers->count == 1 ? logbenchArgs.peers->ival[0] : 50;
+  uint16_t incidents = logbenchArgs.incidents->count == 1 ? logbenchArgs.incidents->ival[0] : 10;
+  uint8_t rounds = logbenchArgs.rounds->count == 1 ? logbenchArgs.rounds->ival[0] : 2;
+
+  printf("%-10s %-5s %-4s %9s %11s %9s\n", "mode", "round", "ok", "bytes", "append(ms)", "scan(ms)");
+
+  uint64_t appendUs[2] = { 0, 0 }, scanUs[2] = { 0, 0 };
+  uint16_t failed = 0;
+  for (uint8_t round = 0; round < rounds; ++round)
+  {
+    for (uint8_t mode = 0; mode < 2; ++mode)
+    {
+      TS_LogBenchResult result;
+      bool ok = TS_Storage.peer_log_bench("/logbench", peers, incidents, mode == 1, result);
+      if (!ok) ++failed;
+      appendUs[mode] += result.appendUs;
+      scanUs[mode] += result.scanUs;
+
+      printf("%-10s %-5u %-4s %9u %11.1f %9.1f\n", mode == 0 ? "plaintext" : "encrypted", round, ok ? "ok" : "fail",
+        result.bytes, result.appendUs / 1000.0, result.scanUs / 1000.0);
+    }
+  }
+
+  printf("failed: %u\n", failed);
+  if (appendUs[0] > 0 && scanUs[0] > 0)
+  {
+    float appendPct = 100.0 * appendUs[1] / appendUs[0] - 100;
+    float scanPct = 100.0 * scanUs[1] / scanUs[0] - 100;
+    printf("encrypted vs plaintext, append: %+.1f%%, scan: %+.1f%%, %s\n", appendPct, scanPct,
+      appendPct <= 10 && scanPct <= 10 ? "within 10%" : "over 10%");
+  }
+  printf("\n");
+
+  return ESP_OK;
+}
+
+static void register_logbench_cmd()
+{
+  logbenchArgs.peers = arg_int0("k", "peers", "<int>", "peers of the day, 50");
+  logbenchArgs.incidents = arg_int0("i", "incidents", "<int>", "incidents per peer, 10");
+  logbenchArgs.rounds = arg_int0("r", "rounds", "<int>", "rounds of each mode, 2");
+  logbenchArgs.end = arg_end(20);
+
+  const esp_console_cmd_t cmd =
+  {
+    .command = "logbench",
+    .help = "Time contact log appends and scans, plaintext against encrypted, logging waits meanwhile",
+    .hint = NULL,
+    .func = &do_logbench_cmd,
+    .argtable = &logbenchArgs
+  };
+  ESP_ERROR_CHECK( esp_console_cmd_register(&cmd) );
+}
+
+// WiFi sync state latencies and counters, percentiles are bucket upper bounds
+static int do_sync_cmd(int argc, char **argv)
+{
+  printf("%-10s %6s %6s %9s %9s %9s\n", "state", "ok", "fail", "avg(ms)", "p90(ms)", "max(ms)");
+  for (uint8_t i = 0; i < SYNC_STATES; ++i)
+  {
+    TS_LatencyHistogram &latency = TS_RADIO.get_sync_latency((TS_SyncState)i);
+    if (latency.get_count() == 0) continue;
+
+    printf("%-10s %6u %6u %9u %9u %9u\n", _TS_RADIO::get_sync_state_name((TS_SyncState)i),
+      latency.get_ok(), latency.get_failed(), latency.get_avg_us() / 1000,
+      latency.get_percentile_us(90) / 1000, latency.get_max_us() / 1000);
+  }
+
+  TS_SyncStats &stats = TS_RADIO.get_sync_stats();
+  printf("state: %s, syncs ok: %u, failed: %u, timeouts: %u\n", _TS_RADIO::get_sync_state_name(TS_RADIO.get_sync_state()),
+    stats.ok, stats.failed, stats.timeouts);
+  printf("last sync, sent: %u, received: %u\n", stats.bytesSent, stats.bytesReceived);
+  printf("failures in a row: %u, retry in: %ums\n\n", TS_RADIO.get_sync_failures(), TS_RADIO.get_sync_retry_ms());
+
+  return ESP_OK;
+}
+
+static void register_sync_cmd()
+{
+  const esp_console_cmd_t cmd =
+  {
+    .command = "sync",
+    .help = "WiFi sync state latencies, counters and backoff",
+    .hint = NULL,
+    .func = &do_sync_cmd,
+  };
+  ESP_ERROR_CHECK( esp_console_cmd_register(&cmd) );
+}
+
 static struct
 {
   struct arg_lit *get;
@@ -470,8 +756,13 @@ static void register_userid_cmd(void)
 //
 void _TS_SerialCmd::register_commands()
 {
+  register_bench_cmd();
   register_clock_cmd();
   register_flag_cmd();
+  register_logbench_cmd();
+  register_metrics_cmd();
+  register_sync_cmd();
+  register_txpower_cmd();
   register_userid_cmd();
   register_version();
   register_wifi_cmd();
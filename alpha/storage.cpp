@@ -3,10 +3,19 @@
 #include "cleanbox.h"
 #include "FS.h"
 #include <EEPROM.h>
+#include <mbedtls/sha256.h>
 #include "storage_ffat.h"
 
 #define EEPROM_SIZE       1024
-#define SETTINGS_VERSION  0x02
+#define SETTINGS_VERSION  0x03
+
+// Older layouts which are a prefix of the current one, migrated by settings_load
+#define SETTINGS_VERSION_V2 0x02    // before connectionless_flag
+
+// Device key of the contact log encryption, past the settings so that resetting them keeps it
+#define EEPROM_DEVICEKEY_OFFSET  512
+#define DEVICEKEY_MAGIC          0x314b4454   // "TDK1"
+#define LOGKEY_LABEL             "TS log key 1"
 
 // Cleanup every 3 mins
 #define CLEANUP_MINS      3
@@ -36,31 +45,72 @@
 
 const char *rootDir = "/";
 const char *tempIdsFile = "/ids";
+const char *tempIdsTmpFile = "/ids.tmp";
 const char *appPeersDir = "/p";
 const char *dailyPeersDir = "/p/%02d%02d";
 const char *dailyPeersIdFile = "/p/%02d%02d/id";
 const char *peerEncounterLogFile = "/p/%02d%02d/%d";
+const char *peerUploadCursorFile = "/up";
+
+
 
+// Bump when PeerIncidentFileFrame changes
+// - frames start with 0xA0 | version, never a valid hour, so legacy frames
+//   which start with firstSeen.hour can still be told apart and migrated
+#define PEER_FRAME_VERSION 2
+#define PEER_FRAME_MARKER (0xA0 | PEER_FRAME_VERSION)
 
+struct TS_DeviceKey
+{
+  uint32_t magic;
+  uint8_t  key[LOGCRYPT_KEY_SIZE];
+};
+
+static_assert(sizeof(TS_Settings) <= EEPROM_DEVICEKEY_OFFSET, "TS_Settings overlaps the device key");
+static_assert(EEPROM_DEVICEKEY_OFFSET + sizeof(TS_DeviceKey) <= EEPROM_SIZE, "Device key past EEPROM_SIZE");
 
 struct PeerIncidentFileFrame
 {
-  TS_DateTime firstSeen;
-  uint8_t     mins;
-  int8_t      rssi_min;
-  int8_t      rssi_max;
-  int16_t     rssi_sum;
-  int8_t      rssi_samples;
-  int16_t     rssi_dsquared;
+  uint8_t         marker;
+  TS_DateTime     firstSeen;
+  uint8_t         mins;
+  TS_RssiSummary  rssi;
 };
 
-//
-// TS_Peer
-//
+// Frames written before the RSSI summary, without a marker
+struct PeerIncidentLegacyFrame
+{
+  TS_DateTime     firstSeen;
+  uint8_t         mins;
+  int8_t          rssi_min;
+  int8_t          rssi_max;
+  int16_t         rssi_sum;
+  int8_t          rssi_samples;
+  int16_t         rssi_dsquared;
+};
+
+static_assert(offsetof(PeerIncidentLegacyFrame, firstSeen) == 0 && offsetof(TS_DateTime, hour) == 0, "Legacy frames must start with the hour");
+static_assert(PEER_FRAME_MARKER >= 24, "Frame marker must not be a valid hour");
 
-TS_Peer::TS_Peer()
-: id(0), mins(0), rssi_min(0), rssi_max(0), rssi_sum(0), rssi_samples(0), rssi_dsquared(0)
+// Legacy frames carry no usable spread and no smoothing, the mean stands in
+// for both and the estimator works out the bucket
+static void peer_frame_migrate(const PeerIncidentLegacyFrame &legacy, TS_Peer &peer)
 {
+  TS_RssiSummary rssi;
+  memset(&rssi, 0, sizeof(rssi));
+
+  rssi.samples = (uint8_t)legacy.rssi_samples;
+  if(rssi.samples > 0)
+  {
+    rssi.min = legacy.rssi_min;
+    rssi.max = legacy.rssi_max;
+    rssi.meanQ8 = (int32_t)legacy.rssi_sum * 256 / rssi.samples;
+    rssi.smoothed = legacy.rssi_sum / rssi.samples;
+  }
+
+  peer.firstSeen = legacy.firstSeen;
+  peer.mins = legacy.mins;
+  peer.rssi.restore(rssi);
 }
 
 //
@@ -70,10 +120,13 @@ TS_Peer::TS_Peer()
 TS_PeerIterator::TS_PeerIterator()
 : validPeer(false), validIncident(false)
 { 
+  ++TS_Storage.peerIterators;
 }
 
 TS_PeerIterator::~TS_PeerIterator()
 {
+  --TS_Storage.peerIterators;
+
   if(fileId)
   {
     fileId.close();
@@ -119,10 +172,10 @@ uint8_t TS_PeerIterator::log()
   }
   else
   {
-    log_i("TS_PeerIterator %s %s %d %s %s (%d-%d-%d %d:%d:%d) (%d) %d, %d, %d %d %d",
+    log_i("TS_PeerIterator %s %s %d %s %s (%d-%d-%d %d:%d:%d) (%d) %d, %d, %d %d %d %d",
       this->getDayFile()->c_str(), peerId->c_str(), pi->id, pi->org.c_str(), pi->deviceType.c_str(),
       pi->firstSeen.day, pi->firstSeen.month, pi->firstSeen.year, pi->firstSeen.hour, pi->firstSeen.minute, pi->firstSeen.second,
-      pi->mins, pi->rssi_min, pi->rssi_max, pi->rssi_sum, pi->rssi_samples, pi->rssi_dsquared);
+      pi->mins, pi->rssi.get_min(), pi->rssi.get_max(), pi->rssi.get_samples(), pi->rssi.get_smoothed(), pi->rssi.get_stddev_q4(), pi->rssi.get_bucket());
     return 2;
   }
 }
@@ -132,14 +185,31 @@ uint8_t TS_PeerIterator::log()
 // TS_Storage
 //
 
+// Held by the public functions for their whole call, they may call each other
+class TS_StorageLock
+{
+  public:
+    TS_StorageLock(SemaphoreHandle_t mutex) : mutex(mutex) { xSemaphoreTakeRecursive(this->mutex, portMAX_DELAY); }
+    ~TS_StorageLock() { xSemaphoreGiveRecursive(this->mutex); }
+
+  private:
+    SemaphoreHandle_t mutex;
+};
+
+#define STORAGE_LOCK  TS_StorageLock storageLock(this->mutex)
+
 _TS_Storage TS_Storage;
 _TS_Storage::_TS_Storage()
+: peerIterators(0)
 {
+  this->mutex = xSemaphoreCreateRecursiveMutex();
   reset();
 }
 
 void _TS_Storage::begin()
 {
+  STORAGE_LOCK;
+
   EEPROM.begin(EEPROM_SIZE);
 
   // Initialize Settings, copy from EEPROM and possibly reinitialize
@@ -184,13 +254,19 @@ void _TS_Storage::begin()
     StorageFFat::listDir(rootDir, 4);
   }
 
+  // Encrypted logs are read with the key of an earlier boot, a new one is made once peers are logged
+  this->log_key_begin(false);
+
   this->set_default_settings();
 }
 
 void _TS_Storage::reset()
 {
+  STORAGE_LOCK;
+
   // Reset data structures
   lastCleanupMins = 0;
+  idsTmpMerge.begin(0);
   tempPeers.clear();
   peerCache.clear();
 }
@@ -208,21 +284,37 @@ TS_Settings* _TS_Storage::settings_get()
 
 void _TS_Storage::settings_reset()
 {
+  STORAGE_LOCK;
+
   // Reset values to defaults
   this->settingsRuntime.settingsVersion = SETTINGS_VERSION;
   memset(this->settingsRuntime.userId, 0, sizeof(this->settingsRuntime.userId));
   memset(this->settingsRuntime.wifiSsid, 0, sizeof(this->settingsRuntime.wifiSsid));
   memset(this->settingsRuntime.wifiPass, 0, sizeof(this->settingsRuntime.wifiPass));
+  this->settingsRuntime.connectionless_flag = false;
   this->settings_save();
 }
 
 void _TS_Storage::settings_load()
 {
+  STORAGE_LOCK;
+
   EEPROM.readBytes(0, &(this->settingsRuntime), sizeof(this->settingsRuntime));
+
+  // keeps the user id and WiFi credentials, new fields get their defaults
+  if(this->settingsRuntime.settingsVersion == SETTINGS_VERSION_V2)
+  {
+    log_i("Migrating settings from version %d", SETTINGS_VERSION_V2);
+    this->settingsRuntime.settingsVersion = SETTINGS_VERSION;
+    this->settingsRuntime.connectionless_flag = false;
+    this->settings_save();
+  }
 }
 
 void _TS_Storage::settings_save()
 {
+  STORAGE_LOCK;
+
   EEPROM.writeBytes(0, &(this->settingsRuntime), sizeof(this->settingsRuntime));
   EEPROM.commit();
 }
@@ -234,11 +326,15 @@ void _TS_Storage::settings_save()
 //
 uint8_t _TS_Storage::freespace_get_pct()
 {
+  STORAGE_LOCK;
+
   return 100 - this->usedspace_get_pct();
 }
 
 uint8_t _TS_Storage::usedspace_get_pct()
 {
+  STORAGE_LOCK;
+
   uint32_t totalBytes = StorageFFat::totalBytes();
   uint32_t freeBytes = StorageFFat::freeBytes();
   uint32_t pct = ((totalBytes - freeBytes) * 100) / totalBytes;  // 0-100 range
@@ -247,11 +343,15 @@ uint8_t _TS_Storage::usedspace_get_pct()
 
 uint32_t _TS_Storage::freespace_get()
 {
+  STORAGE_LOCK;
+
   uint32_t total = StorageFFat::freeBytes();
 }
 
 uint32_t _TS_Storage::usedspace_get()
 {
+  STORAGE_LOCK;
+
   uint32_t totalBytes = StorageFFat::totalBytes();
   uint32_t freeBytes = StorageFFat::freeBytes();
   return totalBytes - freeBytes;
@@ -261,8 +361,23 @@ uint32_t _TS_Storage::usedspace_get()
 // File: ids
 //
 
-uint8_t _TS_Storage::file_ids_readall(uint8_t maxCount, std::string *ids)
+// internal function
+// - times of an id;start;expiry entry, false if it has none
+static bool _ids_entry_times(const String &entry, uint32_t &startTime, uint32_t &expiryTime)
 {
+  const char *start = strchr(entry.c_str(), ';');
+  const char *expiry = start == NULL ? NULL : strchr(start + 1, ';');
+  if(expiry == NULL) return false;
+
+  startTime = strtoul(start + 1, NULL, 10);
+  expiryTime = strtoul(expiry + 1, NULL, 10);
+  return true;
+}
+
+uint8_t _TS_Storage::file_ids_readall(uint8_t maxCount, std::string *ids, uint32_t *startTimes, uint32_t *expiryTimes)
+{
+  STORAGE_LOCK;
+
   // TODO: an optimization is to read only a lookup table, not all the contents
   
   uint8_t count = 0;
@@ -278,6 +393,15 @@ uint8_t _TS_Storage::file_ids_readall(uint8_t maxCount, std::string *ids)
     if(!f.available()) break;
     String s = f.readStringUntil(',');
     ids[count] = std::string(s.c_str());
+
+    uint32_t startTime = 0, expiryTime = 0;
+    _ids_entry_times(s, startTime, expiryTime);
+    if(startTimes != NULL) startTimes[count] = startTime;
+    if(expiryTimes != NULL) expiryTimes[count] = expiryTime;
+
+    // drop start and expiry times
+    size_t times = ids[count].find(';');
+    if(times != std::string::npos) ids[count].erase(times);
     ++count;
   }
 
@@ -287,6 +411,8 @@ uint8_t _TS_Storage::file_ids_readall(uint8_t maxCount, std::string *ids)
 
 uint8_t _TS_Storage::file_ids_writeall(uint8_t maxCount, std::string *ids)
 {
+  STORAGE_LOCK;
+
   // TODO: test free space and run cleanup
   
   File f = StorageFFat::openWrite(tempIdsFile);
@@ -306,12 +432,136 @@ uint8_t _TS_Storage::file_ids_writeall(uint8_t maxCount, std::string *ids)
   return maxCount;
 }
 
+uint8_t _TS_Storage::file_ids_valid(uint32_t nowTime, uint32_t &horizon)
+{
+  STORAGE_LOCK;
+
+  uint8_t count = 0;
+  horizon = 0;
+
+  File f = StorageFFat::openRead(tempIdsFile);
+  if(!f) return 0;
+
+  uint32_t startTime, expiryTime;
+  while(f.available() && count < UINT8_MAX)
+  {
+    String entry = f.readStringUntil(',');
+    if(!_ids_entry_times(entry, startTime, expiryTime) || expiryTime <= nowTime) continue;
+
+    ++count;
+    if(expiryTime > horizon) horizon = expiryTime;
+  }
+
+  f.close();
+  return count;
+}
+
+bool _TS_Storage::file_ids_begin(uint32_t keepAfter)
+{
+  STORAGE_LOCK;
+
+  if(this->idsTmpFile) this->idsTmpFile.close();
+
+  this->idsTmpMerge.begin(keepAfter);
+  this->idsTmpFile = StorageFFat::openWrite(tempIdsTmpFile);
+  if(!this->idsTmpFile)
+  {
+    log_e("Failed to open file %s for w+", tempIdsTmpFile);
+    return false;
+  }
+
+  if(keepAfter == 0) return true;
+
+  // expired ids are dropped, the rest stay in order at the front, see TS_TempIdMerge
+  File f = StorageFFat::openRead(tempIdsFile);
+  if(!f) return true;
+
+  uint32_t startTime, expiryTime;
+  while(f.available() && !this->idsTmpMerge.is_full())
+  {
+    String entry = f.readStringUntil(',');
+    if(!_ids_entry_times(entry, startTime, expiryTime) || !this->idsTmpMerge.carries(expiryTime)) continue;
+
+    if(this->idsTmpFile.write((const uint8_t *)entry.c_str(), entry.length()) != entry.length() || this->idsTmpFile.write(',') != 1)
+    {
+      log_e("Failed to carry over id");
+      f.close();
+      return false;
+    }
+
+    this->idsTmpMerge.add_carried(expiryTime);
+  }
+
+  f.close();
+  return true;
+}
+
+bool _TS_Storage::file_ids_append(const char *id, uint32_t startTime, uint32_t expiryTime)
+{
+  STORAGE_LOCK;
+
+  if(!this->idsTmpFile || this->idsTmpMerge.is_full()) return false;
+
+  // already held
+  if(!this->idsTmpMerge.takes(expiryTime)) return true;
+
+  // id;start;expiry,
+  char times[24];
+  snprintf(times, sizeof(times), ";%u;%u,", startTime, expiryTime);
+
+  size_t idLength = strlen(id);
+  size_t timesLength = strlen(times);
+  if(this->idsTmpFile.write((const uint8_t *)id, idLength) != idLength
+    || this->idsTmpFile.write((const uint8_t *)times, timesLength) != timesLength)
+  {
+    log_e("Failed to append id");
+    return false;
+  }
+
+  this->idsTmpMerge.add_taken();
+  return true;
+}
+
+uint8_t _TS_Storage::file_ids_get_appended()
+{
+  STORAGE_LOCK;
+
+  return this->idsTmpMerge.get_taken();
+}
+
+uint8_t _TS_Storage::file_ids_commit(bool keep)
+{
+  STORAGE_LOCK;
+
+  if(!this->idsTmpFile) return 0;
+  this->idsTmpFile.close();
+
+  if(!keep || this->idsTmpMerge.get_count() == 0)
+  {
+    StorageFFat::deleteFile(tempIdsTmpFile);
+    return 0;
+  }
+
+  // FAT does not rename over an existing file
+  if(FFat.exists(tempIdsFile) && !StorageFFat::deleteFile(tempIdsFile)) return 0;
+  if(!StorageFFat::renameFile(tempIdsTmpFile, tempIdsFile)) return 0;
+
+  return this->idsTmpMerge.get_count();
+}
+
 //
 // Peering functions
 // 
 
 bool _TS_Storage::peer_log_incident(std::string id, std::string org, std::string deviceType, int8_t rssi, TS_DateTime *current)
 {
+  return this->peer_log_incident(id, org, deviceType, &rssi, 1, current);
+}
+
+bool _TS_Storage::peer_log_incident(std::string id, std::string org, std::string deviceType, const int8_t *rssi, uint8_t samples, TS_DateTime *current)
+{
+  STORAGE_LOCK;
+
   int currentTimeToSecs = time_to_secs(current);
   
   // if exist in tempPeers, cumulate. If mins >= PEERCACHE_ACCEPT_MINS , move into peerCache, delete from tempPeers
@@ -320,7 +570,7 @@ bool _TS_Storage::peer_log_incident(std::string id, std::string org, std::string
     if (peer != this->tempPeers.end())
     {
       // found, cumulate rssi samples
-      peer_rssi_add_sample(&peer->second, rssi);
+      peer_rssi_add_samples(&peer->second, rssi, samples);
   
       // update nearest minutes
       int peerTimeDiff = time_diff(currentTimeToSecs, time_to_secs(&peer->second.firstSeen), SECS_PER_DAY);
@@ -351,7 +601,7 @@ bool _TS_Storage::peer_log_incident(std::string id, std::string org, std::string
     if (peer != this->peerCache.end())
     {
       // found, cumulate rssi samples
-      peer_rssi_add_sample(&peer->second, rssi);
+      peer_rssi_add_samples(&peer->second, rssi, samples);
   
       // update nearest minutes
       int peerTimeDiff = time_diff(currentTimeToSecs, time_to_secs(&peer->second.firstSeen), SECS_PER_DAY);
@@ -368,7 +618,7 @@ bool _TS_Storage::peer_log_incident(std::string id, std::string org, std::string
     peer.deviceType = deviceType;
     peer.firstSeen = *current;
 
-    peer_rssi_add_sample(&peer, rssi);
+    peer_rssi_add_samples(&peer, rssi, samples);
     
     this->tempPeers[ id ] = peer;
     return true;
@@ -377,6 +627,8 @@ bool _TS_Storage::peer_log_incident(std::string id, std::string org, std::string
 
 TS_PeerIterator* _TS_Storage::peer_get_next(TS_PeerIterator* it)
 {
+  STORAGE_LOCK;
+
   // log_i("DEBUG: Enter peer_get_next");
   
   if(it == NULL)
@@ -445,8 +697,7 @@ TS_PeerIterator* _TS_Storage::peer_get_next(TS_PeerIterator* it)
 
     std::string dayPeersIdFile = it->dayFileName + "/id";
   
-    it->fileId = StorageFFat::openRead(dayPeersIdFile.c_str());
-    if(!it->fileId)
+    if(!it->fileId.begin_read(StorageFFat::openRead(dayPeersIdFile.c_str())))
     {
       log_e("Failed to open file %s for r", dayPeersIdFile.c_str());
       delete it;
@@ -463,6 +714,8 @@ TS_PeerIterator* _TS_Storage::peer_get_next(TS_PeerIterator* it)
 
 TS_PeerIterator* _TS_Storage::peer_get_next_peer(TS_PeerIterator* it)
 {
+  STORAGE_LOCK;
+
   if(it == NULL) return NULL;
   it->validPeer = false;
   it->validIncident = false;
@@ -498,15 +751,15 @@ TS_PeerIterator* _TS_Storage::peer_get_next_peer(TS_PeerIterator* it)
 
     log_i("DEBUG: filename: %s", filename);
     
-    it->fileIncident = StorageFFat::openRead(filename);
-    if(!it->fileIncident)
+    // a peer whose incidents can't be read is still a peer, without incidents
+    // - readers tell it from the end of the day, and positions in the day hold
+    it->validPeer = true;
+    if(!it->fileIncident.begin_read(StorageFFat::openRead(filename)))
     {
       log_e("Failed to open file %s for r", filename);
       return it;
     }
 
-    it->validPeer = true;
-
     // get next incident
     this->peer_get_next_incident(it);
   }
@@ -516,6 +769,8 @@ TS_PeerIterator* _TS_Storage::peer_get_next_peer(TS_PeerIterator* it)
 
 TS_PeerIterator* _TS_Storage::peer_get_next_incident(TS_PeerIterator* it)
 {
+  STORAGE_LOCK;
+
   if(it == NULL) return NULL;
   it->validIncident = false;
   if(!it->fileIncident)
@@ -527,17 +782,44 @@ TS_PeerIterator* _TS_Storage::peer_get_next_incident(TS_PeerIterator* it)
   // Get the next entry in file
   if(it->fileIncident.available())
   {
-    PeerIncidentFileFrame frame;
-    it->fileIncident.read((byte *)&frame, sizeof(frame));
+    // the first byte tells the frame apart
+    // - the marker, or the hour of a legacy frame
+    uint8_t first;
+    if(it->fileIncident.read(&first, 1) != 1) return it;
+
+    if(first == PEER_FRAME_MARKER)
+    {
+      PeerIncidentFileFrame frame;
+      frame.marker = first;
+      if(it->fileIncident.read((byte *)&frame + 1, sizeof(frame) - 1) != sizeof(frame) - 1)
+      {
+        log_w("Truncated peer incident frame");
+        return it;
+      }
 
-    // populate peer data
-    it->peer.firstSeen = frame.firstSeen;
-    it->peer.mins = frame.mins;
-    it->peer.rssi_min = frame.rssi_min;
-    it->peer.rssi_max = frame.rssi_max;
-    it->peer.rssi_sum = frame.rssi_sum;
-    it->peer.rssi_samples = frame.rssi_samples;
-    it->peer.rssi_dsquared = frame.rssi_dsquared;
+      // populate peer data
+      it->peer.firstSeen = frame.firstSeen;
+      it->peer.mins = frame.mins;
+      it->peer.rssi.restore(frame.rssi);
+    }
+    else if(first < 24)
+    {
+      PeerIncidentLegacyFrame legacy;
+      legacy.firstSeen.hour = first;
+      if(it->fileIncident.read((byte *)&legacy + 1, sizeof(legacy) - 1) != sizeof(legacy) - 1)
+      {
+        log_w("Truncated legacy peer incident frame");
+        return it;
+      }
+
+      peer_frame_migrate(legacy, it->peer);
+    }
+    else
+    {
+      // frame size unknown, the rest of the file can't be read
+      log_w("Peer incident frame marker 0x%02x not supported", first);
+      return it;
+    }
 
     it->validIncident = true;
   }
@@ -545,8 +827,56 @@ TS_PeerIterator* _TS_Storage::peer_get_next_incident(TS_PeerIterator* it)
   return it;
 }
 
+void _TS_Storage::peer_upload_cursor_get(const std::string &dayFile, TS_UploadCursor &cursor)
+{
+  STORAGE_LOCK;
+
+  cursor.peers = 0;
+  cursor.done = false;
+
+  std::string filename = dayFile + peerUploadCursorFile;
+  if(!FFat.exists(filename.c_str())) return;
+
+  File file = StorageFFat::openRead(filename.c_str());
+  if(!file) return;
+
+  if(file.read((byte *)&cursor, sizeof(cursor)) != sizeof(cursor))
+  {
+    log_w("Invalid upload cursor %s, starting over", filename.c_str());
+    cursor.peers = 0;
+    cursor.done = false;
+  }
+  file.close();
+}
+
+bool _TS_Storage::peer_upload_cursor_set(const std::string &dayFile, const TS_UploadCursor &cursor)
+{
+  STORAGE_LOCK;
+
+  std::string filename = dayFile + peerUploadCursorFile;
+  File file = StorageFFat::openWrite(filename.c_str());
+  if(!file)
+  {
+    log_e("Failed to open file %s for w", filename.c_str());
+    return false;
+  }
+
+  bool written = file.write((const byte *)&cursor, sizeof(cursor)) == sizeof(cursor);
+  file.close();
+  return written;
+}
+
 int _TS_Storage::peer_prune(uint8_t days, TS_DateTime *current)
 {
+  STORAGE_LOCK;
+
+  // the files of an iterator would go from under it, a later call prunes them
+  if(this->peerIterators > 0)
+  {
+    log_w("Prune skipped, %d peer iterators out", (int)this->peerIterators);
+    return 0;
+  }
+
   // prune files which are older than [days]
   int removed = 0;
 
@@ -601,6 +931,8 @@ int _TS_Storage::peer_prune(uint8_t days, TS_DateTime *current)
 
 uint16_t _TS_Storage::peer_cleanup(TS_DateTime *current)
 {
+  STORAGE_LOCK;
+
   int16_t tDiff = time_diff(current->minute, lastCleanupMins, SECS_PER_MIN);
   uint16_t entriesRemoved = 0;
 
@@ -702,6 +1034,8 @@ uint16_t _TS_Storage::peer_cleanup(TS_DateTime *current)
 
 void _TS_Storage::peer_cache_commit(const std::string &key, TS_Peer *peer, TS_DateTime *current)
 {
+  STORAGE_LOCK;
+
   // get id
   uint16_t id = this->peer_id_get_or_add(key, peer);
   peer->id = id;
@@ -717,6 +1051,8 @@ void _TS_Storage::peer_cache_commit(const std::string &key, TS_Peer *peer, TS_Da
 
 int _TS_Storage::peer_cache_commit_all(TS_DateTime *current)
 {
+  STORAGE_LOCK;
+
   int count = 0;
   for(auto peer = this->peerCache.begin(); peer != this->peerCache.end();)
   {
@@ -749,8 +1085,8 @@ uint16_t _TS_Storage::peer_id_get_or_add(const std::string &tempId, TS_Peer *pee
   // Open file for read, file may not exist
   {
     log_d("Opening file for read");
-    File f = StorageFFat::openRead(filename);
-    if(f)
+    TS_LogFile f;
+    if(f.begin_read(StorageFFat::openRead(filename)))
     {
       // file exist, look for tempid
       log_d("Looking for tempid in file");
@@ -789,8 +1125,18 @@ uint16_t _TS_Storage::peer_id_get_or_add(const std::string &tempId, TS_Peer *pee
     StorageFFat::tryCreateDir(foldername);
   }
 
+  // the radio is up by the first peer of a day, the hardware RNG is then random
+#if LOGCRYPT_ENABLED
+  if(!TS_LogCrypt.is_ready()) this->log_key_begin(true);
+#endif
+
   log_d("Opening file for append");
-  File f = StorageFFat::openAppend(filename);
+  TS_LogFile f;
+  if(!f.begin_append(StorageFFat::openAppendRead(filename), LOGCRYPT_ENABLED))
+  {
+    log_e("Failed to open file %s for a+", filename);
+    return id;
+  }
 
   // append new entry
   log_d("Appending new entry to file");
@@ -809,36 +1155,138 @@ void _TS_Storage::peer_incident_add(TS_Peer *peer)
   sprintf(filename, peerEncounterLogFile, peer->firstSeen.month, peer->firstSeen.day, peer->id);
 
   // Open file for append
-  File f = StorageFFat::openAppend(filename);
-  if(!f)
+  TS_LogFile f;
+  if(!f.begin_append(StorageFFat::openAppendRead(filename), LOGCRYPT_ENABLED))
   {
     log_e("Failed to open file %s for a+", filename);
     return;
   }
 
   PeerIncidentFileFrame frame = {
+    .marker = PEER_FRAME_MARKER,
     .firstSeen = peer->firstSeen,
     .mins = peer->mins,
-    .rssi_min = peer->rssi_min,
-    .rssi_max = peer->rssi_max,
-    .rssi_sum = peer->rssi_sum,
-    .rssi_samples = peer->rssi_samples,
-    .rssi_dsquared = peer->rssi_dsquared,
   };
+  peer->rssi.summarize(frame.rssi);
 
   f.write((byte *)&frame, sizeof(frame));
   f.close();
 }
 
-void _TS_Storage::peer_rssi_add_sample(TS_Peer *peer, int8_t rssi)
+bool _TS_Storage::peer_log_bench(const char *dir, uint16_t peers, uint16_t incidents, bool encrypted, TS_LogBenchResult &result)
+{
+  STORAGE_LOCK;
+
+  memset(&result, 0, sizeof(result));
+  // with encryption off too, to know what turning it on costs
+  if(encrypted && !TS_LogCrypt.is_ready() && !this->log_key_begin(true)) return false;
+
+  StorageFFat::removeDirForce(dir);
+  if(!StorageFFat::tryCreateDir(dir)) return false;
+
+  std::string idFile = std::string(dir) + "/id";
+  char filename[32];
+  PeerIncidentFileFrame frame;
+  memset(&frame, 0, sizeof(frame));
+  frame.marker = PEER_FRAME_MARKER;
+
+  // as peer_id_get_or_add and peer_incident_add
+  bool success = true;
+  uint32_t startUs = micros();
+  for(uint16_t peer = 1; peer <= peers && success; ++peer)
+  {
+    TS_LogFile idLog;
+    success = idLog.begin_append(StorageFFat::openAppendRead(idFile.c_str()), encrypted);
+    if(!success) break;
+    result.bytes += idLog.printf("%088u,%d,%s,%s\n", peer, peer, "SG_MOH", "iPhone");
+    idLog.close();
+
+    snprintf(filename, sizeof(filename), "%s/%d", dir, peer);
+    for(uint16_t incident = 0; incident < incidents && success; ++incident)
+    {
+      TS_LogFile incidentLog;
+      success = incidentLog.begin_append(StorageFFat::openAppendRead(filename), encrypted);
+      if(!success) break;
+      frame.mins = incident;
+      result.bytes += incidentLog.write((byte *)&frame, sizeof(frame));
+      incidentLog.close();
+    }
+  }
+  result.appendUs = micros() - startUs;
+
+  // as peer_get_next_peer and peer_get_next_incident
+  startUs = micros();
+  TS_LogFile ids;
+  success = success && ids.begin_read(StorageFFat::openRead(idFile.c_str()));
+  uint16_t scanned = 0;
+  while(success && ids.available() > 0)
+  {
+    String line = ids.readStringUntil('\n');
+    snprintf(filename, sizeof(filename), "%s/%d", dir, ++scanned);
+    if(strstr(line.c_str(), ",SG_MOH,iPhone") == NULL) success = false;
+
+    TS_LogFile f;
+    success = success && f.begin_read(StorageFFat::openRead(filename));
+    uint16_t read = 0;
+    while(success && f.available() > 0)
+    {
+      success = f.read((uint8_t *)&frame, sizeof(frame)) == sizeof(frame) && frame.mins == (uint8_t)read++;
+    }
+    success = success && read == incidents;
+    f.close();
+  }
+  ids.close();
+  result.scanUs = micros() - startUs;
+
+  StorageFFat::removeDirForce(dir);
+  return success && scanned == peers;
+}
+
+void _TS_Storage::peer_rssi_add_samples(TS_Peer *peer, const int8_t *rssi, uint8_t samples)
 { 
-  if(rssi < peer->rssi_min) peer->rssi_min = rssi;
-  if(rssi > peer->rssi_max) peer->rssi_max = rssi;
-  peer->rssi_sum += rssi;
-  ++peer->rssi_samples;
-  int16_t mean = peer->rssi_sum / peer->rssi_samples;
-  int16_t ds = (rssi - mean) * (rssi - mean);
-  peer->rssi_dsquared += ds;
+  for(uint8_t i = 0; i < samples; ++i) peer->rssi.add(rssi[i]);
+}
+
+// Device key in NVS through EEPROM, made once from the hardware RNG
+// - the log key is its SHA-256 with the eFuse MAC, bound to this chip
+bool _TS_Storage::log_key_begin(bool create)
+{
+  TS_DeviceKey deviceKey;
+  EEPROM.readBytes(EEPROM_DEVICEKEY_OFFSET, &deviceKey, sizeof(deviceKey));
+  if(deviceKey.magic != DEVICEKEY_MAGIC)
+  {
+    if(!create) return false;
+
+    log_i("Creating device key");
+    deviceKey.magic = DEVICEKEY_MAGIC;
+    for(uint8_t i = 0; i < LOGCRYPT_KEY_SIZE; i += 4)
+    {
+      uint32_t r = esp_random();
+      memcpy(deviceKey.key + i, &r, 4);
+    }
+
+    EEPROM.writeBytes(EEPROM_DEVICEKEY_OFFSET, &deviceKey, sizeof(deviceKey));
+    if(!EEPROM.commit())
+    {
+      log_e("Unable to save device key");
+      return false;
+    }
+  }
+
+  uint8_t material[LOGCRYPT_KEY_SIZE + sizeof(uint64_t) + sizeof(LOGKEY_LABEL)];
+  uint64_t mac = ESP.getEfuseMac();
+  memcpy(material, deviceKey.key, LOGCRYPT_KEY_SIZE);
+  memcpy(material + LOGCRYPT_KEY_SIZE, &mac, sizeof(mac));
+  memcpy(material + LOGCRYPT_KEY_SIZE + sizeof(mac), LOGKEY_LABEL, sizeof(LOGKEY_LABEL));
+
+  uint8_t logKey[LOGCRYPT_KEY_SIZE];
+  mbedtls_sha256_ret(material, sizeof(material), logKey, 0);
+  TS_LogCrypt.begin(logKey);
+
+  memset(material, 0, sizeof(material));
+  memset(&deviceKey, 0, sizeof(deviceKey));
+  memset(logKey, 0, sizeof(logKey));
+  return true;
 }
 
 bool _TS_Storage::filename_older_than(const char * filename, int8_t days, TS_DateTime *current)
@@ -921,5 +1369,121 @@ bool _TS_StorageTests::test_ffat()
   return StorageFFat::testFileIO("/test.txt");
 }
 
+bool _TS_StorageTests::test_ids_merge()
+{
+  // the ids of the device are set aside meanwhile
+  const char *backupFile = "/ids.bak";
+  bool backup = FFat.exists(tempIdsFile) && StorageFFat::renameFile(tempIdsFile, backupFile);
+
+  std::string ids[4];
+  uint32_t horizon = 0;
+  bool success = false;
+
+  do
+  {
+    TS_Storage.file_ids_begin();
+    TS_Storage.file_ids_append("a", 0, 1000);
+    TS_Storage.file_ids_append("b", 1000, 2000);
+    TS_Storage.file_ids_append("c", 2000, 3000);
+    if(TS_Storage.file_ids_commit(true) != 3)
+    {
+      log_e("Expected 3 ids written");
+      break;
+    }
+
+    if(TS_Storage.file_ids_valid(1500, horizon) != 2 || horizon != 3000)
+    {
+      log_e("Expected 2 ids valid until 3000, horizon: %u", horizon);
+      break;
+    }
+
+    // a expired, c is sent again
+    TS_Storage.file_ids_begin(1500);
+    TS_Storage.file_ids_append("c", 2000, 3000);
+    TS_Storage.file_ids_append("d", 3000, 4000);
+    if(TS_Storage.file_ids_get_appended() != 1 || TS_Storage.file_ids_commit(true) != 3)
+    {
+      log_e("Expected 1 id appended to 2 kept");
+      break;
+    }
+
+    if(TS_Storage.file_ids_readall(4, ids) != 3 || ids[0] != "b" || ids[1] != "c" || ids[2] != "d")
+    {
+      log_e("Unexpected ids after merge");
+      break;
+    }
+
+    success = true;
+  } while(false);
+
+  StorageFFat::deleteFile(tempIdsFile);
+  if(backup) StorageFFat::renameFile(backupFile, tempIdsFile);
+
+  return success;
+}
+
+// files of frames without a marker, as older builds wrote them, still read
+bool _TS_StorageTests::test_legacy_frames()
+{
+  const char *dayDir = "/p/0606";
+  const uint8_t hours[] = { 2, 10, 23 };
+  bool success = false;
+
+  do
+  {
+    if(!StorageFFat::tryCreateDir(appPeersDir) || !StorageFFat::tryCreateDir(dayDir)) break;
+
+    File file = StorageFFat::openWrite("/p/0606/id");
+    if(!file) break;
+    file.print("abc,1,test org,test device\n");
+    file.close();
+
+    file = StorageFFat::openWrite("/p/0606/1");
+    if(!file) break;
+    for(uint8_t i = 0; i < sizeof(hours); ++i)
+    {
+      PeerIncidentLegacyFrame legacy;
+      memset(&legacy, 0, sizeof(legacy));
+      legacy.firstSeen = test_time;
+      legacy.firstSeen.hour = hours[i];
+      legacy.mins = i;
+      legacy.rssi_min = -50;
+      legacy.rssi_max = -30;
+      legacy.rssi_sum = -40 * 4;
+      legacy.rssi_samples = 4;
+      file.write((byte *)&legacy, sizeof(legacy));
+    }
+    file.close();
+
+    auto it = TS_Storage.peer_get_next(NULL);
+    uint8_t incidents = 0;
+    for(TS_Peer *pi = it->getPeerIncident(); pi != NULL; pi = it->getPeerIncident())
+    {
+      if(incidents >= sizeof(hours) || pi->firstSeen.hour != hours[incidents] || pi->mins != incidents
+        || pi->rssi.get_samples() != 4 || pi->rssi.get_min() != -50 || pi->rssi.get_max() != -30
+        || pi->rssi.get_smoothed() != -40 || pi->rssi.get_bucket() == RSSI_BUCKET_NONE)
+      {
+        log_e("Unexpected legacy incident %d", incidents);
+        break;
+      }
+
+      ++incidents;
+      TS_Storage.peer_get_next_incident(it);
+    }
+    delete it;
+
+    if(incidents != sizeof(hours))
+    {
+      log_e("Expected %d legacy incidents, read %d", (int)sizeof(hours), incidents);
+      break;
+    }
+
+    success = true;
+  } while(false);
+
+  StorageFFat::removeDirForce(dayDir);
+  return success;
+}
+
 #endif
 
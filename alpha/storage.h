@@ -7,8 +7,13 @@
 #define __TS_STORAGE__
 
 #include "hal.h"
+#include "rssi.h"
 #include "tests.h"
+#include "logcrypt.h"
+#include "tempids.h"
 #include <list>
+#include <map>
+#include <atomic>
 #include "FFat.h"
 
 //
@@ -27,11 +32,12 @@ struct TS_Settings
   char wifiSsid[32];
   char wifiPass[32];
   bool upload_flag;
+  bool connectionless_flag;
 };
 
 struct TS_Peer
 {
-  TS_Peer();
+  TS_Peer() : id(0), mins(0) {}
   
   uint16_t id;  // may not be used until just about to store
   
@@ -39,13 +45,24 @@ struct TS_Peer
   std::string deviceType;
 
   // Incident
-  TS_DateTime firstSeen;
-  uint8_t     mins;
-  int8_t      rssi_min;
-  int8_t      rssi_max;
-  int16_t     rssi_sum;
-  int8_t      rssi_samples;
-  int16_t     rssi_dsquared;
+  TS_DateTime       firstSeen;
+  uint8_t           mins;
+  TS_RssiEstimator  rssi;
+};
+
+// How far a day of peers got uploaded
+struct TS_UploadCursor
+{
+  uint16_t peers;   // peers of the day accepted by the server, in id file order
+  bool     done;    // the whole day was accepted
+};
+
+// Times of a day of peers written and scanned back by peer_log_bench
+struct TS_LogBenchResult
+{
+  uint32_t appendUs;
+  uint32_t scanUs;
+  uint32_t bytes;
 };
 
 class TS_PeerIterator
@@ -66,8 +83,8 @@ class TS_PeerIterator
     std::list<std::string> dayFileNames;
     std::string dayFileName;
     
-    File fileId;
-    File fileIncident;
+    TS_LogFile fileId;
+    TS_LogFile fileIncident;
 
     bool validPeer;
     std::string peerId;
@@ -79,10 +96,13 @@ class TS_PeerIterator
 
 
 // Storage class
-// - not threadsafe unless stated
+// - shared by the encounter and sync tasks, public functions hold a recursive mutex
+// - settings_get() returns the settings themselves, they are not guarded
+// - iterators keep files open between calls, prune skips while one is out
 class _TS_Storage
 {
   friend class _TS_StorageTests;
+  friend class TS_PeerIterator;
   
   public:
     _TS_Storage();
@@ -110,13 +130,31 @@ class _TS_Storage
     // File: ids
     // - strings are of uneven lengths, can either read-all or write-all
     // - TempIDs used for OTv2
+    // - ids may be followed by ";start;expiry", in unix seconds, readers skip them
 
     // read all ids of maxCount, returns count of ids read
-    uint8_t file_ids_readall(uint8_t maxCount, std::string *ids);
+    // - startTimes and expiryTimes, if given, get the times of each id, 0 for ids without
+    uint8_t file_ids_readall(uint8_t maxCount, std::string *ids, uint32_t *startTimes = NULL, uint32_t *expiryTimes = NULL);
 
     // write all ids of maxCount, returns count of ids written
     uint8_t file_ids_writeall(uint8_t maxCount, std::string *ids);
 
+    // Count of ids still valid at nowTime, horizon is the expiry of the last
+    // - ids without times are not counted
+    uint8_t file_ids_valid(uint32_t nowTime, uint32_t &horizon);
+
+    // Streams ids one at a time into a temporary file, replacing the ids file on commit
+    // - the ids file is untouched until then, so an interrupted download keeps the old ids
+    // - keepAfter: ids still valid then are carried over first, appended ids only extend past them
+    bool file_ids_begin(uint32_t keepAfter = 0);
+    bool file_ids_append(const char *id, uint32_t startTime, uint32_t expiryTime);
+
+    // Ids appended since begin, not counting those carried over
+    uint8_t file_ids_get_appended();
+
+    // keep: replace the ids file, else discard, returns count of ids written
+    uint8_t file_ids_commit(bool keep);
+
     //
     // Peering functions
     // 
@@ -124,12 +162,20 @@ class _TS_Storage
     // Log incident for OTv2 protocol
     bool peer_log_incident(std::string id, std::string org, std::string deviceType, int8_t rssi, TS_DateTime *current);
 
+    // Logs samples rssi values seen in one incident, in the order they were seen
+    bool peer_log_incident(std::string id, std::string org, std::string deviceType, const int8_t *rssi, uint8_t samples, TS_DateTime *current);
+
     // Obtain an iterator to get next day
     // - delete after use
     TS_PeerIterator* peer_get_next(TS_PeerIterator* it);
     TS_PeerIterator* peer_get_next_peer(TS_PeerIterator* it);     // Get next peer
     TS_PeerIterator* peer_get_next_incident(TS_PeerIterator* it); // Get next incident of current peer
 
+    // Upload cursor of a day, by its iterator day file, /p/mmdd/up
+    // - a day without one starts at its first peer
+    void peer_upload_cursor_get(const std::string &dayFile, TS_UploadCursor &cursor);
+    bool peer_upload_cursor_set(const std::string &dayFile, const TS_UploadCursor &cursor);
+
     // Delete the last N days of incidents depending on free space
     int peer_prune(uint8_t days, TS_DateTime *current);
 
@@ -144,14 +190,28 @@ class _TS_Storage
 
     // Commit all entries to flash, useful when gracefully shutting down
     int peer_cache_commit_all(TS_DateTime *current);
+
+    // Writes a day of peers to dir as the peer log does, an append per id line and per incident frame,
+    // then scans it back as the iterator does and removes it
+    // - encrypted: with the log key, else in plaintext, to compare the two on the device's flash
+    // - logging waits for it, keep it short
+    bool peer_log_bench(const char *dir, uint16_t peers, uint16_t incidents, bool encrypted, TS_LogBenchResult &result);
     
   private:
-  
+    SemaphoreHandle_t mutex;
+
+    // counted by the iterators themselves, they outlive any one call
+    std::atomic<uint8_t> peerIterators;
+
     TS_Settings settingsRuntime;
 
     // minutes since last cleanup
     uint8_t lastCleanupMins;
 
+    // ids being streamed by file_ids_append
+    File           idsTmpFile;
+    TS_TempIdMerge idsTmpMerge;
+
     // Incident peers which are < 5min
     std::map<std::string, TS_Peer> tempPeers;
 
@@ -174,7 +234,10 @@ class _TS_Storage
     // Other helper functions
     //
     
-    void peer_rssi_add_sample(TS_Peer *peer, int8_t rssi);
+    void peer_rssi_add_samples(TS_Peer *peer, const int8_t *rssi, uint8_t samples);
+
+    // Loads the device key and sets the log key from it, create: a missing one is made first
+    bool log_key_begin(bool create);
 
     bool filename_older_than(const char * filename, int8_t days, TS_DateTime *current);
 
@@ -229,6 +292,12 @@ public:
   // basic ffat tests (in cpp)
   bool test_ffat();
 
+  // ids carried over and merged with newer ones (in cpp)
+  bool test_ids_merge();
+
+  // frames written by older builds migrated on read (in cpp)
+  bool test_legacy_frames();
+
   // test writing a log
   bool test_peer_log()
   { 
@@ -309,6 +378,15 @@ public:
     int ret = it->log();
     if(ret != 0)
     {
+      // all samples were logged at the same rssi
+      TS_Peer *pi = it->getPeerIncident();
+      if(pi == NULL || pi->rssi.get_samples() != 6 || pi->rssi.get_smoothed() != test_rssi || pi->rssi.get_stddev_q4() != 0)
+      {
+        log_e("Incident rssi statistics not stored");
+        delete it;
+        return false;
+      }
+
       it = TS_Storage.peer_get_next(it);
       int ret2 = it->log();
       
@@ -386,6 +464,22 @@ public:
     return true;
   }
 
+  bool test_prune_iterator_out()
+  {
+    // files exist but an iterator is reading them
+    auto it = TS_Storage.peer_get_next(NULL);
+    int pruned = TS_Storage.peer_prune(-1, &test_time);
+    delete it;
+
+    if(pruned != 0)
+    {
+      log_e("Prune should wait for the iterator, %d files removed", pruned);
+      return false;
+    }
+
+    return true;
+  }
+
   bool test_prune_noop()
   {
     // calls prune but nothing should happen
@@ -431,9 +525,14 @@ public:
     // Iterate again when files actually exist
     add(std::bind(&_TS_StorageTests::test_iterate_logs_one, this), "test_iterate_logs_one");
     
+    add(std::bind(&_TS_StorageTests::test_ids_merge, this), "test_ids_merge");
+
     // test pruning
+    add(std::bind(&_TS_StorageTests::test_prune_iterator_out, this), "test_prune_iterator_out");
     add(std::bind(&_TS_StorageTests::test_prune_noop, this), "test_prune_noop");
     add(std::bind(&_TS_StorageTests::test_prune_all, this), "test_prune_all");
+
+    add(std::bind(&_TS_StorageTests::test_legacy_frames, this), "test_legacy_frames");
   }
 } TS_StorageTests;
 
@@ -73,6 +73,18 @@ namespace StorageFFat {
     return file;
   }
   
+  // Reads from the start, writes go to the end
+  File openAppendRead(const char * path)
+  {
+    File file = FFat.open(path, "a+");
+    if(!file)
+    {
+      log_e("- failed to open file for appending");
+    }
+  
+    return file;
+  }
+  
   bool renameFile(const char * path1, const char * path2)
   {
     if (!FFat.rename(path1, path2))
@@ -0,0 +1,191 @@
+#include "tempids.h"
+#include "inflate.h"
+#include "jsonpull.h"
+#include <string.h>
+
+//
+// getTempIDs request
+//
+
+bool request_temp_ids(TS_HttpClient &http, char *body, size_t bodySize, const char *userId, uint32_t after, uint8_t count, bool acceptGzip)
+{
+  if(snprintf(body, bodySize, TEMPIDS_BODY_TEMPLATE, userId, after, count) >= (int)bodySize) return false;
+
+  return http.request("POST", TEMPIDS_URI, TEMPIDS_CONTENT_TYPE, (const uint8_t*)body, strlen(body), acceptGzip);
+}
+
+bool receive_temp_ids(TS_HttpClient &http, char *value, char *tempId, TS_TempIdSink sink, volatile bool &cancelled, TS_TempIdsReceived &received)
+{
+  bool parsed;
+  received.gzip = http.is_gzip();
+  received.corrupt = false;
+
+  if(received.gzip)
+  {
+    TS_InflateStream inflate(http);
+    parsed = inflate.begin() && parse_temp_ids(inflate, value, tempId, sink, cancelled);
+    parsed = inflate.finish() && parsed;
+    received.bytes = inflate.get_inflated();
+    received.corrupt = inflate.is_corrupt();
+    log_i("TempIDs inflated from %u to %u bytes", inflate.get_deflated(), inflate.get_inflated());
+  }
+  else
+  {
+    uint32_t before = http.get_bytes_received();
+    parsed = parse_temp_ids(http, value, tempId, sink, cancelled);
+    received.bytes = http.get_bytes_received() - before;
+  }
+
+  http.end();
+  return parsed;
+}
+
+//
+// getTempIDs response
+//
+
+bool parse_temp_ids(Stream &stream, char *value, char *tempId, TS_TempIdSink sink, volatile bool &cancelled)
+{
+  uint32_t startTime = 0;
+  uint32_t expiryTime = 0;
+  bool statusOk = false;
+  bool appendOk = true;
+
+  TS_JsonPull json(stream, value, TEMPIDS_ID_MAX + 1);
+  if(json.next() != JSON_OBJECT_START) return false;
+
+  while(!cancelled)
+  {
+    TS_JsonToken token = json.next();
+    uint8_t depth = json.get_depth();
+
+    if(token == JSON_END || token == JSON_ERROR)
+    {
+      log_w("TempIDs response ended early");
+      return false;
+    }
+
+    // top level object closed
+    if(depth == 0) break;
+
+    if(token != JSON_KEY) continue;
+
+    // result
+    if(depth == 1)
+    {
+      if(strcmp(value, "result") != 0 && !json.skip_value()) return false;
+    }
+    // result.status, result.tempIDs
+    else if(depth == 2)
+    {
+      if(strcmp(value, "status") == 0)
+      {
+        statusOk = json.next() == JSON_STRING && strcmp(value, "SUCCESS") == 0;
+      }
+      else if(strcmp(value, "tempIDs") == 0)
+      {
+        if(json.next() != JSON_ARRAY_START) return false;
+
+        // one object per TempID
+        for(token = json.next(); token == JSON_OBJECT_START && !cancelled; token = json.next())
+        {
+          tempId[0] = '\0';
+          startTime = expiryTime = 0;
+
+          for(token = json.next(); token == JSON_KEY; token = json.next())
+          {
+            if(strcmp(value, "tempID") == 0)
+            {
+              if(json.next() != JSON_STRING || json.is_truncated()) return false;
+              strlcpy(tempId, value, TEMPIDS_ID_MAX + 1);
+            }
+            else if(strcmp(value, "startTime") == 0)
+            {
+              if(json.next() != JSON_NUMBER) return false;
+              startTime = strtoul(value, NULL, 10);
+            }
+            else if(strcmp(value, "expiryTime") == 0)
+            {
+              if(json.next() != JSON_NUMBER) return false;
+              expiryTime = strtoul(value, NULL, 10);
+            }
+            else if(!json.skip_value())
+            {
+              return false;
+            }
+          }
+
+          if(token != JSON_OBJECT_END) return false;
+          if(tempId[0] != '\0') appendOk &= sink(tempId, startTime, expiryTime);
+        }
+
+        if(token != JSON_ARRAY_END) return false;
+      }
+      else if(!json.skip_value())
+      {
+        return false;
+      }
+    }
+  }
+
+  return statusOk && appendOk && !cancelled;
+}
+
+//
+// TS_TempIdMerge
+//
+
+TS_TempIdMerge::TS_TempIdMerge()
+{
+  this->begin(0);
+}
+
+void TS_TempIdMerge::begin(uint32_t keepAfter)
+{
+  this->keepAfter = keepAfter;
+  this->horizon = 0;
+  this->count = 0;
+  this->taken = 0;
+}
+
+bool TS_TempIdMerge::carries(uint32_t expiryTime)
+{
+  return this->keepAfter != 0 && expiryTime > this->keepAfter;
+}
+
+bool TS_TempIdMerge::takes(uint32_t expiryTime)
+{
+  return expiryTime == 0 || expiryTime > this->horizon;
+}
+
+bool TS_TempIdMerge::is_full()
+{
+  return this->count == UINT8_MAX;
+}
+
+void TS_TempIdMerge::add_carried(uint32_t expiryTime)
+{
+  ++this->count;
+  if(expiryTime > this->horizon) this->horizon = expiryTime;
+}
+
+void TS_TempIdMerge::add_taken()
+{
+  ++this->count;
+  ++this->taken;
+}
+
+uint8_t TS_TempIdMerge::get_count()
+{
+  return this->count;
+}
+
+uint8_t TS_TempIdMerge::get_taken()
+{
+  return this->taken;
+}
+
+uint32_t TS_TempIdMerge::get_horizon()
+{
+  return this->horizon;
+}
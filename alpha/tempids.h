@@ -0,0 +1,80 @@
+//
+// getTempIDs contract
+// - the request, the streamed response parser and the merge with the ids held,
+//   shared with the host sync bench in tools/synchost
+// - the request asks for count ids past after, the last expiry held, in unix seconds
+// - the response is parsed one token at a time, each TempID is handed on as its object closes:
+//   {"result":{"status":"SUCCESS","tempIDs":[{"tempID":"..","startTime":..,"expiryTime":..},..]}}
+// - 304 means there is nothing past after
+//
+
+#ifndef __TS_TEMPIDS__
+#define __TS_TEMPIDS__
+
+#include <stdint.h>
+#include <Arduino.h>
+#include <functional>
+#include "http.h"
+
+#define TEMPIDS_URI           "/getTempIDs"
+#define TEMPIDS_CONTENT_TYPE  "application/json"
+#define TEMPIDS_BODY_TEMPLATE "{\"data\":{\"uid\":\"%s\",\"after\":%u,\"count\":%u}}"
+#define TEMPIDS_ID_MAX        128   // base64, as OT_CR_ID_MAX
+
+// Takes one TempID, false if it could not be kept
+typedef std::function<bool(const char *tempId, uint32_t startTime, uint32_t expiryTime)> TS_TempIdSink;
+
+// Parses a getTempIDs response body
+// - value, tempId: buffers of TEMPIDS_ID_MAX + 1 bytes
+// - returns true if the status was SUCCESS and the sink kept every TempID
+// - stops early once cancelled
+bool parse_temp_ids(Stream &stream, char *value, char *tempId, TS_TempIdSink sink, volatile bool &cancelled);
+
+// Sends the request for count ids past after
+// - body: a buffer of bodySize bytes the request is built in
+// - acceptGzip: the response may come deflated, only with the heap to inflate it
+bool request_temp_ids(TS_HttpClient &http, char *body, size_t bodySize, const char *userId, uint32_t after, uint8_t count, bool acceptGzip);
+
+// Of a response body read by receive_temp_ids
+struct TS_TempIdsReceived
+{
+  uint32_t bytes;     // inflated, if it was gzipped
+  bool     gzip;
+  bool     corrupt;   // gzip failed its CRC, ids already handed on are not to be kept
+};
+
+// Parses a 200 response, inflating it if gzipped, then ends it
+// - value, tempId and the return value as parse_temp_ids
+bool receive_temp_ids(TS_HttpClient &http, char *value, char *tempId, TS_TempIdSink sink, volatile bool &cancelled, TS_TempIdsReceived &received);
+
+// Which ids a download keeps, as the ids file is rewritten
+// - held ids expiring after keepAfter are carried over first, none when it is 0
+// - downloaded ids are taken only past the horizon, the last expiry carried over,
+//   the server may send a window overlapping ours
+// - UINT8_MAX ids at most
+class TS_TempIdMerge
+{
+  public:
+    TS_TempIdMerge();
+
+    void begin(uint32_t keepAfter);
+
+    bool carries(uint32_t expiryTime);
+    bool takes(uint32_t expiryTime);
+    bool is_full();
+
+    void add_carried(uint32_t expiryTime);
+    void add_taken();
+
+    uint8_t get_count();
+    uint8_t get_taken();
+    uint32_t get_horizon();
+
+  protected:
+    uint32_t keepAfter;
+    uint32_t horizon;
+    uint8_t  count;
+    uint8_t  taken;
+};
+
+#endif
@@ -4,6 +4,39 @@
 // TEST: Define TESTDRIVER_STORAGE to enable STORAGE tests
 #define TESTDRIVER_STORAGE
 
+// TEST: Define TESTDRIVER_SCHEDULER to enable SCHEDULER tests
+#define TESTDRIVER_SCHEDULER
+
+// TEST: Define TESTDRIVER_DENSITY to enable DENSITY tests
+#define TESTDRIVER_DENSITY
+
+// TEST: Define TESTDRIVER_RSSI to enable RSSI tests
+#define TESTDRIVER_RSSI
+
+// TEST: Define TESTDRIVER_METRICS to enable METRICS tests
+#define TESTDRIVER_METRICS
+
+// TEST: Define TESTDRIVER_OPENTRACE to enable OPENTRACE tests
+#define TESTDRIVER_OPENTRACE
+
+// TEST: Define TESTDRIVER_TXPOWER to enable TXPOWER tests
+#define TESTDRIVER_TXPOWER
+
+// TEST: Define TESTDRIVER_JSONPULL to enable JSONPULL tests
+#define TESTDRIVER_JSONPULL
+
+// TEST: Define TESTDRIVER_HTTP to enable HTTP tests
+#define TESTDRIVER_HTTP
+
+// TEST: Define TESTDRIVER_UPLOAD to enable UPLOAD tests
+#define TESTDRIVER_UPLOAD
+
+// TEST: Define TESTDRIVER_INFLATE to enable INFLATE tests
+#define TESTDRIVER_INFLATE
+
+// TEST: Define TESTDRIVER_LOGCRYPT to enable LOGCRYPT tests
+#define TESTDRIVER_LOGCRYPT
+
 #ifdef TESTDRIVER
 
 #ifndef __TS_TESTS__
@@ -14,6 +47,7 @@
 #include <list>
 #include <exception>
 #include <functional>
+#include <vector>
 #include <string>
 
 #define TEST_REPEAT_INTERVAL    5000
@@ -50,7 +84,8 @@ public:
   virtual void setup() {}
   virtual void teardown() {}
 
-  virtual void run_all()
+  // Returns the number of tests failed
+  virtual int run_all()
   {
     init();
 
@@ -71,19 +106,20 @@ public:
         
       teardown();
      
-      log_i("[%3dms,%6dB] Test %s: %s", (tsEnd-tsStart), FREEMEM, fnName->c_str(), (result ? "PASS" : "FAIL"));
+      log_i("[%3dms,%6dB] Test %s: %s", (int)(tsEnd-tsStart), (int)FREEMEM, fnName->c_str(), (result ? "PASS" : "FAIL"));
       if (result) ++passed;
       ++fnName;
     }
 
-    log_i("Tests passed: %d / %d", passed, testFunctions.size());
+    log_i("Tests passed: %d / %d", passed, (int)testFunctions.size());
+    return testFunctions.size() - passed;
   }
 
   virtual void run_all_repeatedly()
   {
     for(uint8_t i = 0; i < TEST_REPEAT_ITERATIONS; ++i)
     {
-      log_i("=======================", i+1);
+      log_i("=======================");
       log_i("Test iteration %d ...", i+1);
       this->run_all();
       delay(TEST_REPEAT_INTERVAL);
@@ -0,0 +1,132 @@
+#include "txpower.h"
+
+// Default power of 1dBm for ~1-2m range, as set by the HAL
+#define TXPOWER_INITIAL  TS_BlePower::P1
+
+//
+// TS_TxPowerController
+//
+
+TS_TxPowerController::TS_TxPowerController()
+: reports(0), strongest(INT8_MIN)
+{
+  this->reset(0);
+}
+
+void TS_TxPowerController::reset(uint32_t nowMs)
+{
+  this->reports = 0;
+  this->strongest = INT8_MIN;
+  this->advPower = TXPOWER_INITIAL;
+  this->periodStartMs = nowMs;
+  this->idlePeriods = 0;
+  this->decisionCount = 0;
+  this->decisionNext = 0;
+}
+
+void TS_TxPowerController::report(int8_t rssi)
+{
+  // peers without a measurement send 0 or 127
+  if(rssi >= 0) return;
+
+  int32_t current = this->strongest.load();
+  while(rssi > current && !this->strongest.compare_exchange_weak(current, rssi));
+  this->reports.fetch_add(1);
+}
+
+bool TS_TxPowerController::update(uint32_t nowMs, TS_PowerState state)
+{
+  TS_BlePower maxPower = get_max_power(state);
+  if(this->advPower > maxPower)
+  {
+    this->decide(nowMs, state, 0, 0, maxPower, TXPOWER_BOUNDS);
+    return true;
+  }
+
+  if(nowMs - this->periodStartMs < TXPOWER_PERIOD_SECS * 1000) return false;
+  this->periodStartMs = nowMs;
+
+  uint16_t reports = this->reports.exchange(0);
+  int8_t strongest = this->strongest.exchange(INT8_MIN);
+
+  if(reports < TXPOWER_MIN_REPORTS)
+  {
+    if(++this->idlePeriods < TXPOWER_IDLE_PERIODS) return false;
+    this->idlePeriods = 0;
+
+    if(this->advPower >= maxPower) return false;
+    this->decide(nowMs, state, reports, 0, (TS_BlePower)(this->advPower + 1), TXPOWER_IDLE);
+    return true;
+  }
+
+  this->idlePeriods = 0;
+
+  if(strongest > TXPOWER_TARGET_HIGH && this->advPower > TS_BlePower::N14)
+  {
+    this->decide(nowMs, state, reports, strongest, (TS_BlePower)(this->advPower - 1), TXPOWER_LOUD);
+    return true;
+  }
+
+  if(strongest < TXPOWER_TARGET_LOW && this->advPower < maxPower)
+  {
+    this->decide(nowMs, state, reports, strongest, (TS_BlePower)(this->advPower + 1), TXPOWER_WEAK);
+    return true;
+  }
+
+  return false;
+}
+
+TS_BlePower TS_TxPowerController::get_adv_power()
+{
+  return this->advPower;
+}
+
+TS_BlePower TS_TxPowerController::get_conn_power(int8_t peerRssi, TS_PowerState state)
+{
+  int8_t maxPower = get_max_power(state);
+  int8_t level = maxPower - (peerRssi - TXPOWER_CONN_TARGET) / TXPOWER_STEP_DB;
+
+  if(level < TS_BlePower::N14) level = TS_BlePower::N14;
+  if(level > maxPower) level = maxPower;
+  return (TS_BlePower)level;
+}
+
+// Low power stays at the default level, high power may go one step above for weak links
+TS_BlePower TS_TxPowerController::get_max_power(TS_PowerState state)
+{
+  return state == HIGH_POWER ? TS_BlePower::P4 : TS_BlePower::P1;
+}
+
+const char* TS_TxPowerController::get_reason_name(TS_TxPowerReason reason)
+{
+  static const char *names[] = { "loud", "weak", "idle", "bounds" };
+  return reason <= TXPOWER_BOUNDS ? names[reason] : "";
+}
+
+bool TS_TxPowerController::get_decision(uint8_t i, TS_TxPowerDecision &decision)
+{
+  if(i >= this->decisionCount) return false;
+
+  decision = this->decisions[(this->decisionNext + TXPOWER_LOG_MAX - 1 - i) % TXPOWER_LOG_MAX];
+  return true;
+}
+
+void TS_TxPowerController::decide(uint32_t nowMs, TS_PowerState state, uint16_t reports, int8_t strongest, TS_BlePower to, TS_TxPowerReason reason)
+{
+  TS_TxPowerDecision &decision = this->decisions[this->decisionNext];
+  decision.atMs = nowMs;
+  decision.state = state;
+  decision.reports = reports;
+  decision.strongest = strongest;
+  decision.from = this->advPower;
+  decision.to = to;
+  decision.reason = reason;
+
+  this->decisionNext = (this->decisionNext + 1) % TXPOWER_LOG_MAX;
+  if(this->decisionCount < TXPOWER_LOG_MAX) ++this->decisionCount;
+
+  // csv for offline analysis: time, power state, reports, strongest, from, to, reason
+  log_i("txpower,%u,%d,%d,%d,%d,%d,%s", nowMs, state, reports, strongest, decision.from, to, get_reason_name(reason));
+
+  this->advPower = to;
+}
@@ -0,0 +1,199 @@
+//
+// BLE transmit power control
+// - advertising power follows the rssi peers report seeing us at, in their writes
+// - connection power follows the rssi of the peer being connected to
+// - levels are bounded by the power state, decisions are kept for the serial console and logged
+// - deterministic, only depends on the reports and times fed to it
+//
+
+#ifndef __TS_TXPOWER__
+#define __TS_TXPOWER__
+
+#include <stdint.h>
+#include <atomic>
+#include "hal.h"
+#include "power.h"
+#include "tests.h"
+
+// Advertising power is reconsidered once per period, from the strongest report in it
+// - the strongest report stands for the nearest peer, which should hear us within this window
+// - one 3dB step per period, hysteresis is the width of the window
+#define TXPOWER_PERIOD_SECS     120
+#define TXPOWER_MIN_REPORTS     2
+#define TXPOWER_TARGET_HIGH     -58   // louder than needed for 1-2m, step down
+#define TXPOWER_TARGET_LOW      -68   // barely heard, step up
+#define TXPOWER_IDLE_PERIODS    5     // periods without reports before stepping up
+
+// Rssi we aim for at the far end of a connection, peers are assumed to transmit like us
+#define TXPOWER_CONN_TARGET     -75
+
+// Levels are 3dB apart
+#define TXPOWER_STEP_DB         3
+
+#define TXPOWER_LOG_MAX         8
+
+enum TS_TxPowerReason
+{
+  TXPOWER_LOUD,     // nearest peer hears us above the target
+  TXPOWER_WEAK,     // nearest peer hears us below the target
+  TXPOWER_IDLE,     // nobody reported for a while, reach further
+  TXPOWER_BOUNDS,   // power state changed the allowed range
+};
+
+struct TS_TxPowerDecision
+{
+  uint32_t         atMs;
+  uint8_t          state;       // TS_PowerState
+  uint16_t         reports;
+  int8_t           strongest;   // 0 if no reports
+  TS_BlePower      from;
+  TS_BlePower      to;
+  TS_TxPowerReason reason;
+};
+
+class TS_TxPowerController
+{
+  public:
+    TS_TxPowerController();
+
+    void reset(uint32_t nowMs);
+
+    // Rssi a peer reports seeing us at, may be called from any task
+    void report(int8_t rssi);
+
+    // Reconsiders the advertising power once per period
+    // - returns true if it changed
+    bool update(uint32_t nowMs, TS_PowerState state);
+
+    TS_BlePower get_adv_power();
+
+    // Lowest level expected to keep the link to a peer seen at peerRssi
+    TS_BlePower get_conn_power(int8_t peerRssi, TS_PowerState state);
+
+    static TS_BlePower get_max_power(TS_PowerState state);
+    static const char* get_reason_name(TS_TxPowerReason reason);
+
+    // Decisions, most recent first, returns false past the last one
+    bool get_decision(uint8_t i, TS_TxPowerDecision &decision);
+
+  private:
+    void decide(uint32_t nowMs, TS_PowerState state, uint16_t reports, int8_t strongest, TS_BlePower to, TS_TxPowerReason reason);
+
+    std::atomic<uint32_t> reports;
+    std::atomic<int32_t>  strongest;
+
+    TS_BlePower advPower;
+    uint32_t    periodStartMs;
+    uint8_t     idlePeriods;
+
+    TS_TxPowerDecision decisions[TXPOWER_LOG_MAX];
+    uint8_t            decisionCount;
+    uint8_t            decisionNext;
+};
+
+
+
+//
+// Tests
+//
+
+#if defined(TESTDRIVER) && defined(TESTDRIVER_TXPOWER)
+
+static class _TS_TxPowerTests : public _TS_Tests
+{
+public:
+  void init() override {}
+
+  bool test_txpower_steps_down_when_loud()
+  {
+    TS_TxPowerController controller;
+    controller.reset(0);
+
+    uint32_t nowMs = 0;
+    TS_BlePower start = controller.get_adv_power();
+    for(uint8_t i = 0; i < 3; ++i)
+    {
+      controller.report(-50);
+      controller.report(-70);
+      nowMs += TXPOWER_PERIOD_SECS * 1000;
+      if(!controller.update(nowMs, HIGH_POWER))
+      {
+        log_e("Should step down when the nearest peer is loud, period %d", i);
+        return false;
+      }
+    }
+
+    if(controller.get_adv_power() != start - 3)
+    {
+      log_e("Expected 3 steps down, %d -> %d", start, controller.get_adv_power());
+      return false;
+    }
+
+    // inside the window, hold
+    controller.report(-62);
+    controller.report(-64);
+    nowMs += TXPOWER_PERIOD_SECS * 1000;
+    if(controller.update(nowMs, HIGH_POWER))
+    {
+      log_e("Should hold inside the target window");
+      return false;
+    }
+
+    TS_TxPowerDecision decision;
+    if(!controller.get_decision(0, decision) || decision.reason != TXPOWER_LOUD || decision.strongest != -50 || decision.reports != 2)
+    {
+      log_e("Last decision not logged");
+      return false;
+    }
+
+    return true;
+  }
+
+  bool test_txpower_bounds()
+  {
+    TS_TxPowerController controller;
+    controller.reset(0);
+
+    // nobody around reaches further, up to the bound of the state
+    uint32_t nowMs = 0;
+    for(uint8_t i = 0; i < TXPOWER_IDLE_PERIODS * 10; ++i)
+    {
+      nowMs += TXPOWER_PERIOD_SECS * 1000;
+      controller.update(nowMs, HIGH_POWER);
+    }
+
+    if(controller.get_adv_power() != TS_TxPowerController::get_max_power(HIGH_POWER))
+    {
+      log_e("Idle should reach the high power bound, %d", controller.get_adv_power());
+      return false;
+    }
+
+    // low power clamps right away
+    controller.update(nowMs + 1, LOW_POWER);
+    if(controller.get_adv_power() != TS_TxPowerController::get_max_power(LOW_POWER))
+    {
+      log_e("Low power should clamp, %d", controller.get_adv_power());
+      return false;
+    }
+
+    // close peers need less power, never below the lowest level
+    if(controller.get_conn_power(-40, HIGH_POWER) != N14 || controller.get_conn_power(-85, LOW_POWER) != TS_TxPowerController::get_max_power(LOW_POWER))
+    {
+      log_e("Connection power off, %d/%d", controller.get_conn_power(-40, HIGH_POWER), controller.get_conn_power(-85, LOW_POWER));
+      return false;
+    }
+
+    return true;
+  }
+
+  // Ctor
+  _TS_TxPowerTests()
+  {
+    add(std::bind(&_TS_TxPowerTests::test_txpower_steps_down_when_loud, this), "test_txpower_steps_down_when_loud");
+    add(std::bind(&_TS_TxPowerTests::test_txpower_bounds, this), "test_txpower_bounds");
+  }
+} TS_TxPowerTests;
+
+#endif
+
+#endif
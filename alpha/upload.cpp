@@ -0,0 +1,69 @@
+#include "upload.h"
+
+_TS_Uploader TS_Uploader;
+
+//
+// TS_StorageUploadSource
+// - the day the peer iterator is on, its cursor in the day's directory
+//
+
+class TS_StorageUploadSource : public TS_UploadSource
+{
+  public:
+    TS_StorageUploadSource(TS_PeerIterator *it)
+    : it(it), day(*it->getDayFile())
+    {
+    };
+
+    const std::string& get_day() override { return this->day; }
+
+    std::string* get_peer_id() override { return this->it->getPeerId(); }
+    TS_Peer* get_incident() override { return this->it->getPeerIncident(); }
+
+    void next_peer() override { TS_Storage.peer_get_next_peer(this->it); }
+    void next_incident() override { TS_Storage.peer_get_next_incident(this->it); }
+
+    void cursor_get(TS_UploadCursor &cursor) override { TS_Storage.peer_upload_cursor_get(this->day, cursor); }
+    bool cursor_set(const TS_UploadCursor &cursor) override { return TS_Storage.peer_upload_cursor_set(this->day, cursor); }
+
+  private:
+    TS_PeerIterator *it;
+    const std::string day;
+};
+
+//
+// _TS_Uploader
+//
+
+bool _TS_Uploader::upload(TS_HttpClient &http, const char *uri, const char *userId, TS_DateTime &today, volatile bool *cancelled)
+{
+  char todayFile[8];
+  snprintf(todayFile, sizeof(todayFile), "/p/%02d%02d", today.month, today.day);
+
+  this->batches = 0;
+  this->peers = 0;
+  this->incidents = 0;
+
+  // the iterator stays on the last day once there are no more
+  bool success = true;
+  std::string previous;
+  TS_PeerIterator *it = TS_Storage.peer_get_next(NULL);
+  while(it != NULL && !it->getDayFile()->empty() && *it->getDayFile() != previous)
+  {
+    previous = *it->getDayFile();
+
+    TS_StorageUploadSource source(it);
+    if(previous != todayFile && !this->upload_day(http, uri, userId, source, cancelled))
+    {
+      success = false;
+      break;
+    }
+
+    it = TS_Storage.peer_get_next(it);
+  }
+
+  delete it;
+
+  log_i("Upload %s, batches: %d, peers: %d, incidents: %d", success ? "done" : "stopped", this->batches, this->peers, this->incidents);
+  return success;
+}
@@ -0,0 +1,142 @@
+//
+// Contact log upload
+// - streams each day of peers from a TS_UploadSource into POST bodies with chunked encoding,
+//   nothing is held but the current peer and the chunk buffer of the http client
+// - one POST per batch of peers, the day's cursor advances when the server accepts a batch,
+//   so an interrupted sync resumes at the first batch not accepted
+// - only past days, today's log is still being written to
+// - compact line encoding, one record per line:
+//   v1,<uid>,<mmdd>,<first peer>                                   batch header
+//   P,<tempId>,<org>,<deviceType>                                  peer
+//   I,<hhmmss>,<mins>,<rssi>,<min>,<max>,<samples>,<stddev q4>     incident of the peer above
+//
+
+#ifndef __TS_UPLOAD__
+#define __TS_UPLOAD__
+
+#include <Arduino.h>
+#include "hal.h"
+#include "http.h"
+#include "storage.h"
+#include "tests.h"
+
+#define UPLOAD_VERSION        "v1"
+#define UPLOAD_CONTENT_TYPE   "text/csv"
+#define UPLOAD_BATCH_PEERS    50
+
+// A day of peers to upload, and where its cursor is kept
+// - the peer log in storage on the device, generated peers in tools/synchost
+// - a peer without incidents still has an id, only the end of the day has none
+class TS_UploadSource
+{
+  public:
+    virtual ~TS_UploadSource() {}
+
+    // /p/mmdd
+    virtual const std::string& get_day() = 0;
+
+    // NULL at the end of the day, past the last incident of the peer
+    virtual std::string* get_peer_id() = 0;
+    virtual TS_Peer* get_incident() = 0;
+
+    virtual void next_peer() = 0;
+    virtual void next_incident() = 0;
+
+    virtual void cursor_get(TS_UploadCursor &cursor) = 0;
+    virtual bool cursor_set(const TS_UploadCursor &cursor) = 0;
+};
+
+class _TS_Uploader
+{
+  public:
+    _TS_Uploader();
+
+    // Uploads every past day not accepted yet, returns false if it stopped early
+    // - a cancel stops it before the next batch, accepted batches are kept
+    bool upload(TS_HttpClient &http, const char *uri, const char *userId, TS_DateTime &today, volatile bool *cancelled = NULL);
+
+    // Uploads the day from its cursor on, in batches of UPLOAD_BATCH_PEERS, returns false if it stopped early
+    bool upload_day(TS_HttpClient &http, const char *uri, const char *userId, TS_UploadSource &source, volatile bool *cancelled = NULL);
+
+    // Encoding
+    static void write_header(Print &out, const char *userId, const std::string &dayFile, uint16_t firstPeer);
+    static void write_peer(Print &out, const std::string &tempId, TS_Peer &peer);
+    static void write_incident(Print &out, TS_Peer &peer);
+
+    // Of the last upload
+    uint16_t get_batches();
+    uint16_t get_peers();
+    uint32_t get_incidents();
+
+  private:
+    uint16_t batches;
+    uint16_t peers;
+    uint32_t incidents;
+};
+
+extern _TS_Uploader TS_Uploader;
+
+
+
+//
+// Tests
+//
+
+#if defined(TESTDRIVER) && defined(TESTDRIVER_UPLOAD)
+
+// Print into a string
+class TS_UploadTestPrint : public Print
+{
+  public:
+    size_t write(uint8_t c) override { this->data += (char)c; return 1; }
+    size_t write(const uint8_t *buffer, size_t size) override { this->data.append((const char*)buffer, size); return size; }
+
+    std::string data;
+};
+
+static class _TS_UploadTests : public _TS_Tests
+{
+public:
+  void init() override {}
+
+  bool test_upload_encoding()
+  {
+    TS_UploadTestPrint out;
+
+    TS_Peer peer;
+    peer.org = "SG_MOH";
+    peer.deviceType = "iPhone";
+    peer.firstSeen.hour = 9;
+    peer.firstSeen.minute = 5;
+    peer.firstSeen.second = 7;
+    peer.mins = 12;
+    peer.rssi.add(-60);
+    peer.rssi.add(-60);
+
+    _TS_Uploader::write_header(out, "uid", "/p/0612", 50);
+    _TS_Uploader::write_peer(out, "dGVtcA==", peer);
+    _TS_Uploader::write_incident(out, peer);
+
+    char expected[128];
+    snprintf(expected, sizeof(expected), "v1,uid,0612,50\nP,dGVtcA==,SG_MOH,iPhone\nI,090507,12,%d,%d,%d,%d,%d\n",
+      peer.rssi.get_smoothed(), peer.rssi.get_min(), peer.rssi.get_max(), peer.rssi.get_samples(), peer.rssi.get_stddev_q4());
+
+    if(out.data != expected)
+    {
+      log_e("Unexpected encoding:\n%s", out.data.c_str());
+      return false;
+    }
+
+    return true;
+  }
+
+  // Ctor
+  _TS_UploadTests()
+  {
+    add(std::bind(&_TS_UploadTests::test_upload_encoding, this), "test_upload_encoding");
+  }
+} TS_UploadTests;
+
+#endif
+
+#endif
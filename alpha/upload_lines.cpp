@@ -0,0 +1,104 @@
+#include "upload.h"
+
+//
+// _TS_Uploader, a day at a time and its line encoding
+// - apart from upload.cpp, it needs no storage and tools/synchost builds it
+//
+
+_TS_Uploader::_TS_Uploader()
+: batches(0), peers(0), incidents(0)
+{
+}
+
+bool _TS_Uploader::upload_day(TS_HttpClient &http, const char *uri, const char *userId, TS_UploadSource &source, volatile bool *cancelled)
+{
+  const std::string &day = source.get_day();
+
+  TS_UploadCursor cursor;
+  source.cursor_get(cursor);
+  if(cursor.done) return true;
+
+  // accepted by an earlier sync
+  for(uint16_t i = 0; i < cursor.peers && source.get_peer_id() != NULL; ++i)
+  {
+    source.next_peer();
+  }
+
+  // a peer whose incidents can't be read still has an id and is skipped, only the end of the day has none
+  while(source.get_peer_id() != NULL)
+  {
+    if(cancelled != NULL && *cancelled) return false;
+    if(!http.request_begin("POST", uri, UPLOAD_CONTENT_TYPE)) return false;
+
+    write_header(http, userId, day, cursor.peers);
+
+    uint16_t count = 0;
+    uint32_t batchIncidents = 0;
+    for(; count < UPLOAD_BATCH_PEERS && source.get_peer_id() != NULL; ++count)
+    {
+      // peers without incidents have nothing to trace
+      TS_Peer *incident = source.get_incident();
+      if(incident != NULL) write_peer(http, *source.get_peer_id(), *incident);
+
+      for(; incident != NULL; source.next_incident(), incident = source.get_incident())
+      {
+        write_incident(http, *incident);
+        ++batchIncidents;
+      }
+
+      source.next_peer();
+    }
+
+    if(!http.request_end()) return false;
+
+    uint16_t status = http.response();
+    http.end();
+    if(status != 200)
+    {
+      log_w("Upload of %s rejected, status: %d", day.c_str(), status);
+      return false;
+    }
+
+    cursor.peers += count;
+    ++this->batches;
+    this->peers += count;
+    this->incidents += batchIncidents;
+    if(!source.cursor_set(cursor)) return false;
+  }
+
+  cursor.done = true;
+  return source.cursor_set(cursor);
+}
+
+// dayFile is /p/mmdd
+void _TS_Uploader::write_header(Print &out, const char *userId, const std::string &dayFile, uint16_t firstPeer)
+{
+  out.printf("%s,%s,%s,%u\n", UPLOAD_VERSION, userId, dayFile.c_str() + 3, firstPeer);
+}
+
+void _TS_Uploader::write_peer(Print &out, const std::string &tempId, TS_Peer &peer)
+{
+  out.printf("P,%s,%s,%s\n", tempId.c_str(), peer.org.c_str(), peer.deviceType.c_str());
+}
+
+void _TS_Uploader::write_incident(Print &out, TS_Peer &peer)
+{
+  out.printf("I,%02d%02d%02d,%d,%d,%d,%d,%d,%d\n",
+    peer.firstSeen.hour, peer.firstSeen.minute, peer.firstSeen.second, peer.mins,
+    peer.rssi.get_smoothed(), peer.rssi.get_min(), peer.rssi.get_max(), peer.rssi.get_samples(), peer.rssi.get_stddev_q4());
+}
+
+uint16_t _TS_Uploader::get_batches()
+{
+  return this->batches;
+}
+
+uint16_t _TS_Uploader::get_peers()
+{
+  return this->peers;
+}
+
+uint32_t _TS_Uploader::get_incidents()
+{
+  return this->incidents;
+}
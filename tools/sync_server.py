@@ -0,0 +1,226 @@
+#!/usr/bin/env python3
+"""
+Stand-in sync server
+
+Serves getTempIDs and accepts uploadEncounters as the Cloud Functions do, over plain HTTP/1.1 with keep-alive,
+for the host sync bench in tools/synchost or a device built with SYNC_HOST, SYNC_PORT and SYNC_SECURE=0.
+
+- getTempIDs returns up to count TempIDs past after, 304 if it has none, ids are stable per uid and slot
+- uploadEncounters takes the v1 line encoding, plain or chunked, and checks its batch header
+- uploadMetrics takes the exchange phase metrics the device posts after the contact logs
+- faults to exercise the sync: latency, server errors and responses cut off halfway with the connection closed
+- --gzip compresses responses to requests that accept it, --gzip-window sets the deflate window the device has to hold
+
+  python3 tools/sync_server.py --port 8080 --latency 200 --error-rate 0.1 --truncate-rate 0.1
+"""
+
+import argparse
+import base64
+import hashlib
+import json
+import random
+import sys
+import threading
+import time
+import zlib
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+TEMPID_SECONDS = 900
+
+
+class Stats:
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.requests = 0
+        self.errors = 0
+        self.truncated = 0
+        self.tempids = 0
+        self.peers = 0
+        self.incidents = 0
+        self.metrics = 0
+
+    def add(self, **counts):
+        with self.lock:
+            for name, count in counts.items():
+                setattr(self, name, getattr(self, name) + count)
+
+
+def temp_id(uid, slot):
+    # 64 bytes, 88 base64 characters like the real ones
+    return base64.b64encode(hashlib.sha512(('%s:%d' % (uid, slot)).encode()).digest()).decode()
+
+
+def get_temp_ids(body, options, stats):
+    try:
+        data = json.loads(body or b'{}').get('data', {})
+    except ValueError:
+        return 400, {'error': 'invalid json'}
+
+    uid = data.get('uid', '')
+    after = int(data.get('after', 0))
+    count = int(data.get('count', 0)) or options.supply
+
+    # slots from the current one up to the supply the server hands out
+    now = int(time.time())
+    first = max(now - now % TEMPID_SECONDS, after - after % TEMPID_SECONDS if after else 0)
+    last = now - now % TEMPID_SECONDS + options.supply * TEMPID_SECONDS
+    starts = range(first, min(last, first + count * TEMPID_SECONDS), TEMPID_SECONDS)
+    if not starts:
+        return 304, None
+
+    ids = [{'tempID': temp_id(uid, start // TEMPID_SECONDS), 'startTime': start, 'expiryTime': start + TEMPID_SECONDS}
+           for start in starts]
+    stats.add(tempids=len(ids))
+    return 200, {'result': {'status': 'SUCCESS', 'tempIDs': ids, 'refreshTime': ids[-1]['startTime']}}
+
+
+def upload_encounters(body, options, stats):
+    lines = body.decode(errors='replace').splitlines()
+    header = lines[0].split(',') if lines else []
+    if len(header) != 4 or header[0] != 'v1':
+        return 400, {'error': 'bad batch header'}
+
+    peers = sum(1 for line in lines if line.startswith('P,'))
+    incidents = sum(1 for line in lines if line.startswith('I,'))
+    stats.add(peers=peers, incidents=incidents)
+    if not options.quiet:
+        sys.stderr.write('upload uid: %s, day: %s, first peer: %s, peers: %d, incidents: %d\n'
+                         % (header[1], header[2], header[3], peers, incidents))
+    return 200, {'result': {'status': 'SUCCESS'}}
+
+
+def upload_metrics(body, options, stats):
+    try:
+        data = json.loads(body or b'{}').get('data', {})
+    except ValueError:
+        return 400, {'error': 'invalid json'}
+
+    phases = data.get('phases')
+    if not isinstance(phases, dict):
+        return 400, {'error': 'no phases'}
+
+    stats.add(metrics=1)
+    if not options.quiet:
+        sys.stderr.write('metrics uid: %s, %s\n' % (data.get('uid', ''), ', '.join(
+            '%s: %d/%d' % (name, phase.get('ok', 0), phase.get('ok', 0) + phase.get('fail', 0)) for name, phase in phases.items())))
+    return 200, {'result': {'status': 'SUCCESS'}}
+
+
+ROUTES = {
+    '/getTempIDs': get_temp_ids,
+    '/uploadEncounters': upload_encounters,
+    '/uploadMetrics': upload_metrics,
+}
+
+
+class SyncHandler(BaseHTTPRequestHandler):
+    protocol_version = 'HTTP/1.1'
+
+    def log_message(self, format, *args):
+        if not self.server.options.quiet:
+            sys.stderr.write('%s %s\n' % (self.address_string(), format % args))
+
+    def read_body(self):
+        if 'chunked' not in self.headers.get('Transfer-Encoding', '').lower():
+            return self.rfile.read(int(self.headers.get('Content-Length', 0)))
+
+        body = bytearray()
+        while True:
+            size = int(self.rfile.readline().split(b';')[0].strip() or b'0', 16)
+            if size == 0:
+                # trailers up to the empty line
+                while self.rfile.readline() not in (b'\r\n', b'\n', b''):
+                    pass
+                return bytes(body)
+            body += self.rfile.read(size)
+            self.rfile.readline()
+
+    def do_POST(self):
+        options = self.server.options
+        stats = self.server.stats
+        stats.add(requests=1)
+
+        body = self.read_body()
+
+        if options.latency or options.jitter:
+            time.sleep(max(0, options.latency + random.uniform(-options.jitter, options.jitter)) / 1000)
+
+        route = ROUTES.get(self.path)
+        if route is None:
+            status, result = 404, {'error': 'not found'}
+        elif random.random() < options.error_rate:
+            stats.add(errors=1)
+            status, result = 500, {'error': 'injected'}
+        else:
+            status, result = route(body, options, stats)
+
+        self.reply(status, result)
+
+    def reply(self, status, result):
+        options = self.server.options
+        payload = json.dumps(result, separators=(',', ':')).encode() if result is not None else b''
+
+        self.send_response(status)
+        self.send_header('Content-Type', 'application/json')
+        if options.gzip and payload and 'gzip' in self.headers.get('Accept-Encoding', '').lower():
+            compressor = zlib.compressobj(9, zlib.DEFLATED, 16 + options.gzip_window)
+            payload = compressor.compress(payload) + compressor.flush()
+            self.send_header('Content-Encoding', 'gzip')
+        if options.chunked and payload:
+            self.send_header('Transfer-Encoding', 'chunked')
+            data = b''.join(b'%x\r\n%s\r\n' % (len(chunk), chunk)
+                            for chunk in (payload[i:i + options.chunk] for i in range(0, len(payload), options.chunk)))
+            data += b'0\r\n\r\n'
+        else:
+            self.send_header('Content-Length', str(len(payload)))
+            data = payload
+        self.end_headers()
+
+        # half of the body, then the connection is gone
+        if data and random.random() < options.truncate_rate:
+            self.server.stats.add(truncated=1)
+            data = data[:len(data) // 2]
+            self.close_connection = True
+
+        self.wfile.write(data)
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Stand-in sync server for getTempIDs and uploadEncounters')
+    parser.add_argument('--host', default='0.0.0.0')
+    parser.add_argument('--port', type=int, default=8080)
+    parser.add_argument('--supply', type=int, default=100, help='TempIDs handed out ahead of now, in 15 minute slots')
+    parser.add_argument('--chunked', action='store_true', help='send responses with chunked encoding')
+    parser.add_argument('--chunk', type=int, default=1024, help='chunk size of chunked responses')
+    parser.add_argument('--latency', type=float, default=0, help='delay before each response, ms')
+    parser.add_argument('--jitter', type=float, default=0, help='+- on the latency, ms')
+    parser.add_argument('--error-rate', type=float, default=0, help='share of requests answered with 500')
+    parser.add_argument('--truncate-rate', type=float, default=0, help='share of responses cut off halfway')
+    parser.add_argument('--gzip', action='store_true', help='gzip responses when the request accepts it')
+    parser.add_argument('--gzip-window', type=int, default=15, choices=range(9, 16), metavar='BITS',
+                        help='deflate window of gzip responses, 2^BITS bytes, 9 to 15')
+    parser.add_argument('--seed', type=int, help='seed of the fault injection')
+    parser.add_argument('--quiet', action='store_true')
+    options = parser.parse_args()
+
+    if options.seed is not None:
+        random.seed(options.seed)
+
+    server = ThreadingHTTPServer((options.host, options.port), SyncHandler)
+    server.daemon_threads = True
+    server.options = options
+    server.stats = Stats()
+
+    sys.stderr.write('Sync server on %s:%d\n' % (options.host, options.port))
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+
+    stats = server.stats
+    sys.stderr.write('\nrequests: %d, errors: %d, truncated: %d, tempids: %d, peers: %d, incidents: %d, metrics: %d\n'
+                     % (stats.requests, stats.errors, stats.truncated, stats.tempids, stats.peers, stats.incidents, stats.metrics))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,82 @@
+//
+// Arduino core on POSIX, as far as the sync client needs it
+// - Print, Stream, millis(), delay(), esp_random(), ESP.getFreeHeap() and the log macros
+// - String and the FreeRTOS handles by name only, for the alpha headers that declare with them
+//
+
+#ifndef __TS_HOST_ARDUINO__
+#define __TS_HOST_ARDUINO__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PROGMEM
+
+class String;
+typedef void *SemaphoreHandle_t;
+
+// Log level, 1=Error to 4=Debug as CORE_DEBUG_LEVEL
+#ifndef HOST_LOG_LEVEL
+#define HOST_LOG_LEVEL 2
+#endif
+
+#define host_log(level, tag, format, ...) do { if (HOST_LOG_LEVEL >= level) fprintf(stderr, "[" tag "] " format "\n", ##__VA_ARGS__); } while(0)
+#define log_e(format, ...) host_log(1, "E", format, ##__VA_ARGS__)
+#define log_w(format, ...) host_log(2, "W", format, ##__VA_ARGS__)
+#define log_i(format, ...) host_log(3, "I", format, ##__VA_ARGS__)
+#define log_d(format, ...) host_log(4, "D", format, ##__VA_ARGS__)
+
+unsigned long millis();
+void delay(uint32_t ms);
+
+// From the OS random source, the RNG of the device
+uint32_t esp_random();
+
+// FREEMEM of the test logs, the host has no heap limit to report
+class EspClass
+{
+  public:
+    uint32_t getFreeHeap() { return 0; }
+};
+
+extern EspClass ESP;
+
+// glibc has it from 2.38
+size_t host_strlcpy(char *dst, const char *src, size_t size);
+#define strlcpy host_strlcpy
+
+class Print
+{
+  public:
+    virtual ~Print() {}
+
+    virtual size_t write(uint8_t c) = 0;
+    virtual size_t write(const uint8_t *buffer, size_t size);
+
+    size_t write(const char *s) { return this->write((const uint8_t*)s, strlen(s)); }
+    size_t print(const char *s) { return this->write(s); }
+    size_t print(char c) { return this->write((uint8_t)c); }
+    size_t printf(const char *format, ...) __attribute__((format(printf, 2, 3)));
+};
+
+class Stream : public Print
+{
+  public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() = 0;
+    virtual void flush() {}
+
+    void setTimeout(unsigned long timeoutMs) { this->timeoutMs = timeoutMs; }
+
+    // Waits up to the timeout for each byte
+    size_t readBytes(char *buffer, size_t length);
+
+  protected:
+    unsigned long timeoutMs = 1000;
+};
+
+#endif
@@ -0,0 +1,19 @@
+//
+// ESP32 BLE library on POSIX, the names hal.h declares with and nothing more
+// - the host targets build the encoders of the alpha sources, none of them reach the radio
+//
+
+#ifndef __TS_HOST_BLEDEVICE__
+#define __TS_HOST_BLEDEVICE__
+
+#include <Arduino.h>
+
+typedef uint8_t esp_bd_addr_t[6];
+typedef uint8_t esp_ble_addr_type_t;
+
+class BLEServer;
+class BLEScan;
+class BLEAdvertising;
+class BLEAdvertisedDevice;
+
+#endif
@@ -0,0 +1,2 @@
+// ESP32 BLE library on POSIX, see BLEDevice.h
+#include <BLEDevice.h>
@@ -0,0 +1,14 @@
+#ifndef __TS_HOST_CLIENT__
+#define __TS_HOST_CLIENT__
+
+#include "Arduino.h"
+
+class Client : public Stream
+{
+  public:
+    virtual int connect(const char *host, uint16_t port) = 0;
+    virtual uint8_t connected() = 0;
+    virtual void stop() = 0;
+};
+
+#endif
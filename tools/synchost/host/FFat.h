@@ -0,0 +1,2 @@
+// FFat on POSIX, storage.h only declares with it, files are opened with host_open()
+#include <FS.h>
@@ -0,0 +1,48 @@
+//
+// Arduino File on stdio, as far as the contact log files need it
+// - host_open() stands for FFat.open(), paths are of the host
+//
+
+#ifndef __TS_HOST_FS__
+#define __TS_HOST_FS__
+
+#include <Arduino.h>
+#include <memory>
+#include <string>
+
+#define FILE_READ   "r"
+#define FILE_WRITE  "w"
+#define FILE_APPEND "a"
+
+enum SeekMode { SeekSet = 0, SeekCur = 1, SeekEnd = 2 };
+
+class File : public Stream
+{
+  public:
+    File() {}
+    File(FILE *file, const char *path) : file(file, fclose), path(path) {}
+
+    operator bool() const { return this->file != nullptr; }
+
+    int available() override;
+    int read() override;
+    int peek() override;
+    size_t read(uint8_t *buffer, size_t size);
+
+    size_t write(uint8_t c) override { return this->write(&c, 1); }
+    size_t write(const uint8_t *buffer, size_t size) override;
+
+    bool seek(uint32_t pos, SeekMode mode = SeekSet);
+    size_t position() const;
+    size_t size() const;
+    const char *name() const { return this->path.c_str(); }
+    void close() { this->file.reset(); }
+
+  private:
+    std::shared_ptr<FILE> file;
+    std::string path;
+};
+
+File host_open(const char *path, const char *mode = FILE_READ);
+
+#endif
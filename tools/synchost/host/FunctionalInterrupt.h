@@ -0,0 +1,7 @@
+// ESP32 interrupt attributes on POSIX, io.h only declares with them
+#ifndef __TS_HOST_FUNCTIONALINTERRUPT__
+#define __TS_HOST_FUNCTIONALINTERRUPT__
+
+#define IRAM_ATTR
+
+#endif
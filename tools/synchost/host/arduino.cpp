@@ -0,0 +1,95 @@
+#include "Arduino.h"
+#include <stdarg.h>
+#include <random>
+#include <time.h>
+#include <unistd.h>
+
+unsigned long millis()
+{
+  static struct timespec start = { 0, 0 };
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (start.tv_sec == 0 && start.tv_nsec == 0) start = now;
+
+  return (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+}
+
+void delay(uint32_t ms)
+{
+  usleep(ms * 1000);
+}
+
+EspClass ESP;
+
+uint32_t esp_random()
+{
+  static std::random_device source;
+  return source();
+}
+
+size_t host_strlcpy(char *dst, const char *src, size_t size)
+{
+  size_t length = strlen(src);
+  if (size > 0)
+  {
+    size_t copied = length < size - 1 ? length : size - 1;
+    memcpy(dst, src, copied);
+    dst[copied] = '\0';
+  }
+  return length;
+}
+
+//
+// Print
+//
+
+size_t Print::write(const uint8_t *buffer, size_t size)
+{
+  size_t written = 0;
+  while (written < size && this->write(buffer[written]) == 1) ++written;
+  return written;
+}
+
+size_t Print::printf(const char *format, ...)
+{
+  char line[256];
+  va_list args;
+  va_start(args, format);
+  int length = vsnprintf(line, sizeof(line), format, args);
+  va_end(args);
+
+  if (length < 0) return 0;
+  if ((size_t)length < sizeof(line)) return this->write((const uint8_t*)line, length);
+
+  // longer than the line, formatted again into the heap
+  char *buffer = (char*)malloc(length + 1);
+  if (buffer == NULL) return 0;
+  va_start(args, format);
+  vsnprintf(buffer, length + 1, format, args);
+  va_end(args);
+
+  size_t written = this->write((const uint8_t*)buffer, length);
+  free(buffer);
+  return written;
+}
+
+//
+// Stream
+//
+
+// Each byte is tried at least once, a timeout of 0 takes what read() has without waiting
+size_t Stream::readBytes(char *buffer, size_t length)
+{
+  size_t count = 0;
+  while (count < length)
+  {
+    int c;
+    unsigned long startMs = millis();
+    while ((c = this->read()) < 0 && millis() - startMs < this->timeoutMs) delay(1);
+    if (c < 0) break;
+
+    buffer[count++] = c;
+  }
+
+  return count;
+}
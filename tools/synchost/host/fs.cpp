@@ -0,0 +1,61 @@
+#include "FS.h"
+#include <sys/stat.h>
+
+File host_open(const char *path, const char *mode)
+{
+  FILE *file = fopen(path, mode);
+  return file == NULL ? File() : File(file, path);
+}
+
+int File::available()
+{
+  if (!this->file) return 0;
+  return this->size() - this->position();
+}
+
+int File::read()
+{
+  uint8_t c;
+  return this->read(&c, 1) == 1 ? c : -1;
+}
+
+int File::peek()
+{
+  if (!this->file) return -1;
+  int c = fgetc(this->file.get());
+  if (c != EOF) ungetc(c, this->file.get());
+  return c == EOF ? -1 : c;
+}
+
+size_t File::read(uint8_t *buffer, size_t size)
+{
+  if (!this->file) return 0;
+  return fread(buffer, 1, size, this->file.get());
+}
+
+size_t File::write(const uint8_t *buffer, size_t size)
+{
+  if (!this->file) return 0;
+  return fwrite(buffer, 1, size, this->file.get());
+}
+
+bool File::seek(uint32_t pos, SeekMode mode)
+{
+  if (!this->file) return false;
+  return fseek(this->file.get(), pos, mode == SeekSet ? SEEK_SET : mode == SeekCur ? SEEK_CUR : SEEK_END) == 0;
+}
+
+size_t File::position() const
+{
+  if (!this->file) return 0;
+  return ftell(this->file.get());
+}
+
+size_t File::size() const
+{
+  if (!this->file) return 0;
+
+  // of the file on disk, as stat() of the device
+  struct stat st;
+  return fstat(fileno(this->file.get()), &st) == 0 ? st.st_size : 0;
+}
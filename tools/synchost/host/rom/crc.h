@@ -0,0 +1,16 @@
+//
+// ROM CRC32 on zlib, the same little endian CRC as gzip
+//
+
+#ifndef __TS_HOST_ROM_CRC__
+#define __TS_HOST_ROM_CRC__
+
+#include <stdint.h>
+#include <zlib.h>
+
+static inline uint32_t crc32_le(uint32_t crc, const uint8_t *buf, uint32_t len)
+{
+  return crc32(crc, buf, len);
+}
+
+#endif
@@ -0,0 +1,82 @@
+//
+// ROM tinfl on zlib, as far as TS_InflateStream uses it
+// - the same statuses and flags, raw deflate without a zlib header
+// - zlib keeps its own 32KB window, so unlike tinfl a circular output buffer smaller than the
+//   server's window still decodes, the CRC check of the device is what catches that
+// - zlib state is freed at the end or on an error, a stream given up halfway leaks it
+//
+
+#ifndef __TS_HOST_ROM_MINIZ__
+#define __TS_HOST_ROM_MINIZ__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <zlib.h>
+
+typedef enum
+{
+  TINFL_STATUS_BAD_PARAM = -3,
+  TINFL_STATUS_ADLER32_MISMATCH = -2,
+  TINFL_STATUS_FAILED = -1,
+  TINFL_STATUS_DONE = 0,
+  TINFL_STATUS_NEEDS_MORE_INPUT = 1,
+  TINFL_STATUS_HAS_MORE_OUTPUT = 2
+} tinfl_status;
+
+enum
+{
+  TINFL_FLAG_PARSE_ZLIB_HEADER = 1,
+  TINFL_FLAG_HAS_MORE_INPUT = 2,
+  TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF = 4,
+  TINFL_FLAG_COMPUTE_ADLER32 = 8
+};
+
+typedef struct
+{
+  uint32_t m_state;   // 0 until the first call
+  z_stream m_zlib;
+} tinfl_decompressor;
+
+#define tinfl_init(r) do { (r)->m_state = 0; } while (0)
+
+static inline tinfl_status tinfl_decompress(tinfl_decompressor *r, const uint8_t *pIn_buf_next, size_t *pIn_buf_size,
+  uint8_t *pOut_buf_start, uint8_t *pOut_buf_next, size_t *pOut_buf_size, const uint32_t decomp_flags)
+{
+  z_stream &z = r->m_zlib;
+  if (r->m_state == 0)
+  {
+    memset(&z, 0, sizeof(z));
+    if (inflateInit2(&z, -MAX_WBITS) != Z_OK) return TINFL_STATUS_BAD_PARAM;
+    r->m_state = 1;
+  }
+  else if (r->m_state != 1)
+  {
+    return TINFL_STATUS_FAILED;
+  }
+
+  z.next_in = (Bytef*)pIn_buf_next;
+  z.avail_in = *pIn_buf_size;
+  z.next_out = pOut_buf_next;
+  z.avail_out = *pOut_buf_size;
+
+  int result = inflate(&z, Z_SYNC_FLUSH);
+  *pIn_buf_size -= z.avail_in;
+  *pOut_buf_size -= z.avail_out;
+
+  tinfl_status status;
+  if (result == Z_STREAM_END) status = TINFL_STATUS_DONE;
+  else if (result != Z_OK && result != Z_BUF_ERROR) status = TINFL_STATUS_FAILED;
+  else if (z.avail_out == 0) status = TINFL_STATUS_HAS_MORE_OUTPUT;
+  else if (decomp_flags & TINFL_FLAG_HAS_MORE_INPUT) status = TINFL_STATUS_NEEDS_MORE_INPUT;
+  else status = TINFL_STATUS_FAILED;
+
+  if (status <= TINFL_STATUS_DONE)
+  {
+    inflateEnd(&z);
+    r->m_state = 2;
+  }
+  return status;
+}
+
+#endif
@@ -0,0 +1,19 @@
+//
+// Host tests
+// - runs the device test classes of the alpha sources built here, the same TESTDRIVER tests as on the device
+// - make test, exits non-zero if any test failed
+//
+
+#include <Arduino.h>
+#include "density.h"
+#include "rssi.h"
+
+int main()
+{
+  int failed = 0;
+  failed += TS_DensityTests.run_all();
+  failed += TS_RssiTests.run_all();
+
+  printf("%s, %d failed\n", failed == 0 ? "ok" : "FAILED", failed);
+  return failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,209 @@
+//
+// Contact log bench
+// - writes days of peers the way storage does, an "a+" open per id line and per incident frame, then scans them back
+//   as TS_PeerIterator does, through the same TS_LogFile in plaintext and encrypted
+// - reports append and scan time of both and the overhead of encryption, the budget on the device is 10%,
+//   and that less a pass of the AES alone over a day's bytes, roughly what TS_LogFile adds around the AES
+// - the host AES is a software stand-in for the peripheral, so the overhead here is an upper bound,
+//   the logbench command of the device runs the same workload on its flash
+//
+
+#include <Arduino.h>
+#include <FS.h>
+#include <getopt.h>
+#include <sys/stat.h>
+#include <string>
+#include "logcrypt.h"
+
+#define BENCH_FRAME_SIZE 20   // about a PeerIncidentFileFrame
+
+struct TS_LogBenchOptions
+{
+  const char *dir;
+  uint16_t peers;
+  uint16_t incidents;   // per peer
+  uint8_t rounds;
+};
+
+struct TS_LogBenchResult
+{
+  bool ok;
+  uint32_t appendUs;
+  uint32_t scanUs;
+  uint32_t bytes;
+};
+
+static uint64_t micros64()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static std::string bench_path(const TS_LogBenchOptions &options, const char *name)
+{
+  return std::string(options.dir) + "/" + name;
+}
+
+static bool bench_append(const std::string &path, const uint8_t *data, size_t length, bool encrypted, uint32_t &bytes)
+{
+  TS_LogFile file;
+  if (!file.begin_append(host_open(path.c_str(), "a+"), encrypted)) return false;
+
+  bool written = file.write(data, length) == length;
+  file.close();
+  bytes += length;
+  return written;
+}
+
+static void bench_frame(uint16_t peer, uint16_t incident, uint8_t *frame)
+{
+  for (uint8_t i = 0; i < BENCH_FRAME_SIZE; ++i) frame[i] = peer * 31 + incident * 7 + i;
+}
+
+// Line up to '\n', false at the end of the file
+static bool bench_line(Stream &file, std::string &line)
+{
+  line.clear();
+  for (int c = file.read(); c >= 0; c = file.read())
+  {
+    if (c == '\n') return true;
+    line += (char)c;
+  }
+  return !line.empty();
+}
+
+static TS_LogBenchResult bench_day(const TS_LogBenchOptions &options, bool encrypted)
+{
+  TS_LogBenchResult result;
+  memset(&result, 0, sizeof(result));
+
+  std::string idPath = bench_path(options, "id");
+  remove(idPath.c_str());
+  for (uint16_t peer = 1; peer <= options.peers; ++peer) remove(bench_path(options, std::to_string(peer).c_str()).c_str());
+
+  // as peer_id_get_or_add and peer_incident_add
+  uint64_t startUs = micros64();
+  for (uint16_t peer = 1; peer <= options.peers; ++peer)
+  {
+    char line[160];
+    int length = snprintf(line, sizeof(line), "%088u,%u,SG_MOH,iPhone\n", peer, peer);
+    if (!bench_append(idPath, (const uint8_t*)line, length, encrypted, result.bytes)) return result;
+
+    std::string incidentPath = bench_path(options, std::to_string(peer).c_str());
+    for (uint16_t incident = 0; incident < options.incidents; ++incident)
+    {
+      uint8_t frame[BENCH_FRAME_SIZE];
+      bench_frame(peer, incident, frame);
+      if (!bench_append(incidentPath, frame, sizeof(frame), encrypted, result.bytes)) return result;
+    }
+  }
+  result.appendUs = micros64() - startUs;
+
+  // as peer_get_next_peer and peer_get_next_incident, checking what was written
+  startUs = micros64();
+  TS_LogFile ids;
+  if (!ids.begin_read(host_open(idPath.c_str()))) return result;
+
+  uint16_t peers = 0;
+  std::string line;
+  while (bench_line(ids, line))
+  {
+    uint16_t peer = atoi(line.c_str());
+    if (peer != ++peers || line.find(",SG_MOH,iPhone") == std::string::npos) return result;
+
+    TS_LogFile incidents;
+    if (!incidents.begin_read(host_open(bench_path(options, std::to_string(peer).c_str()).c_str()))) return result;
+
+    uint16_t incident = 0;
+    uint8_t frame[BENCH_FRAME_SIZE], expected[BENCH_FRAME_SIZE];
+    while (incidents.available() > 0)
+    {
+      bench_frame(peer, incident++, expected);
+      if (incidents.read(frame, sizeof(frame)) != sizeof(frame) || memcmp(frame, expected, sizeof(frame)) != 0) return result;
+    }
+    if (incident != options.incidents) return result;
+  }
+  result.scanUs = micros64() - startUs;
+
+  result.ok = peers == options.peers;
+  return result;
+}
+
+static void usage(const char *name)
+{
+  fprintf(stderr,
+    "usage: %s [-d dir] [-k peers] [-i incidents] [-r rounds]\n"
+    "  -d dir        directory of the day, created, /tmp/log_bench\n"
+    "  -k peers      peers of the day, 200\n"
+    "  -i incidents  incidents per peer, 10\n"
+    "  -r rounds     days written and scanned per mode, 3\n", name);
+}
+
+int main(int argc, char **argv)
+{
+  TS_LogBenchOptions options = { "/tmp/log_bench", 200, 10, 3 };
+
+  int option;
+  while ((option = getopt(argc, argv, "d:k:i:r:")) != -1)
+  {
+    switch (option)
+    {
+      case 'd': options.dir = optarg; break;
+      case 'k': options.peers = atoi(optarg); break;
+      case 'i': options.incidents = atoi(optarg); break;
+      case 'r': options.rounds = atoi(optarg); break;
+      default: usage(argv[0]); return 2;
+    }
+  }
+
+  mkdir(options.dir, 0755);
+  printf("%-10s %-5s %-4s %9s %11s %9s\n", "mode", "round", "ok", "bytes", "append(ms)", "scan(ms)");
+
+  uint8_t key[LOGCRYPT_KEY_SIZE];
+  for (uint8_t i = 0; i < sizeof(key); i += 4)
+  {
+    uint32_t r = esp_random();
+    memcpy(key + i, &r, 4);
+  }
+  TS_LogCrypt.begin(key);
+
+  // plaintext then encrypted each round, as the logbench command of the device
+  uint64_t appendUs[2] = { 0, 0 }, scanUs[2] = { 0, 0 };
+  uint32_t bytes = 0;
+  uint16_t failed = 0;
+  for (uint8_t round = 0; round < options.rounds; ++round)
+  {
+    for (uint8_t mode = 0; mode < 2; ++mode)
+    {
+      TS_LogBenchResult result = bench_day(options, mode == 1);
+      if (!result.ok) ++failed;
+      appendUs[mode] += result.appendUs;
+      scanUs[mode] += result.scanUs;
+      bytes = result.bytes;
+
+      printf("%-10s %-5u %-4s %9u %11.1f %9.1f\n", mode == 0 ? "plaintext" : "encrypted", round, result.ok ? "ok" : "fail",
+        result.bytes, result.appendUs / 1000.0, result.scanUs / 1000.0);
+    }
+  }
+
+  printf("\nfailed: %u\n", failed);
+  if (options.rounds > 0 && appendUs[0] > 0 && scanUs[0] > 0)
+  {
+    printf("encrypted vs plaintext, append: %+.1f%%, scan: %+.1f%%\n",
+      100.0 * appendUs[1] / appendUs[0] - 100, 100.0 * scanUs[1] / scanUs[0] - 100);
+
+    // the AES alone over a day's bytes, it is the peripheral's on the device
+    uint8_t nonce[LOGCRYPT_NONCE_SIZE], buffer[LOGFILE_BUFFER];
+    TS_LogCrypt.nonce_new(nonce);
+    memset(buffer, 0, sizeof(buffer));
+    uint64_t startUs = micros64();
+    for (uint32_t offset = 0; offset < bytes; offset += sizeof(buffer)) TS_LogCrypt.apply(nonce, offset, buffer, sizeof(buffer));
+    uint64_t aesUs = (micros64() - startUs) * options.rounds;
+
+    printf("less the stand-in AES, %.1fms a round, append: %+.1f%%, scan: %+.1f%%\n", aesUs / 1000.0 / options.rounds,
+      100.0 * ((int64_t)appendUs[1] - (int64_t)aesUs) / appendUs[0] - 100, 100.0 * ((int64_t)scanUs[1] - (int64_t)aesUs) / scanUs[0] - 100);
+  }
+
+  return failed == 0 ? 0 : 1;
+}
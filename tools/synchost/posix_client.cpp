@@ -0,0 +1,153 @@
+#include "posix_client.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+//
+// TS_PosixClient
+//
+
+TS_PosixClient::TS_PosixClient()
+: fd(-1), peerClosed(false), bufferLength(0), bufferPos(0)
+{
+}
+
+TS_PosixClient::~TS_PosixClient()
+{
+  this->stop();
+}
+
+int TS_PosixClient::connect(const char *host, uint16_t port)
+{
+  this->stop();
+
+  char service[8];
+  snprintf(service, sizeof(service), "%u", port);
+
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+
+  struct addrinfo *addresses = NULL;
+  if (getaddrinfo(host, service, &hints, &addresses) != 0)
+  {
+    log_e("Unable to resolve %s", host);
+    return 0;
+  }
+
+  for (struct addrinfo *address = addresses; address != NULL && this->fd < 0; address = address->ai_next)
+  {
+    this->fd = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+    if (this->fd < 0) continue;
+
+    // non-blocking from the start, connect is waited for with a timeout
+    fcntl(this->fd, F_SETFL, O_NONBLOCK);
+    int noDelay = 1;
+    setsockopt(this->fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+
+    if (::connect(this->fd, address->ai_addr, address->ai_addrlen) == 0) break;
+
+    struct pollfd pfd = { this->fd, POLLOUT, 0 };
+    int error = 0;
+    socklen_t errorLength = sizeof(error);
+    if (errno == EINPROGRESS && poll(&pfd, 1, POSIX_CLIENT_TIMEOUT_MS) == 1
+      && getsockopt(this->fd, SOL_SOCKET, SO_ERROR, &error, &errorLength) == 0 && error == 0) break;
+
+    close(this->fd);
+    this->fd = -1;
+  }
+
+  freeaddrinfo(addresses);
+  return this->fd >= 0;
+}
+
+uint8_t TS_PosixClient::connected()
+{
+  if (this->fd < 0) return 0;
+  if (this->bufferPos < this->bufferLength) return 1;
+
+  this->fill();
+  return !this->peerClosed || this->bufferPos < this->bufferLength;
+}
+
+void TS_PosixClient::stop()
+{
+  if (this->fd >= 0) close(this->fd);
+
+  this->fd = -1;
+  this->peerClosed = false;
+  this->bufferLength = 0;
+  this->bufferPos = 0;
+}
+
+// Takes what has arrived, without waiting
+bool TS_PosixClient::fill()
+{
+  if (this->bufferPos < this->bufferLength) return true;
+  if (this->fd < 0 || this->peerClosed) return false;
+
+  ssize_t length = recv(this->fd, this->buffer, sizeof(this->buffer), 0);
+  if (length == 0 || (length < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+  {
+    this->peerClosed = true;
+    return false;
+  }
+  if (length < 0) return false;
+
+  this->bufferLength = length;
+  this->bufferPos = 0;
+  return true;
+}
+
+int TS_PosixClient::available()
+{
+  if (!this->fill()) return 0;
+  return this->bufferLength - this->bufferPos;
+}
+
+int TS_PosixClient::read()
+{
+  if (!this->fill()) return -1;
+  return this->buffer[this->bufferPos++];
+}
+
+int TS_PosixClient::peek()
+{
+  if (!this->fill()) return -1;
+  return this->buffer[this->bufferPos];
+}
+
+size_t TS_PosixClient::write(uint8_t c)
+{
+  return this->write(&c, 1);
+}
+
+size_t TS_PosixClient::write(const uint8_t *buffer, size_t size)
+{
+  if (this->fd < 0) return 0;
+
+  size_t written = 0;
+  while (written < size)
+  {
+    ssize_t length = send(this->fd, buffer + written, size - written, MSG_NOSIGNAL);
+    if (length > 0)
+    {
+      written += length;
+      continue;
+    }
+
+    // send buffer full, wait for room
+    struct pollfd pfd = { this->fd, POLLOUT, 0 };
+    if (length < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && poll(&pfd, 1, POSIX_CLIENT_TIMEOUT_MS) == 1) continue;
+
+    break;
+  }
+
+  return written;
+}
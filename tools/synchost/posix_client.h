@@ -0,0 +1,42 @@
+//
+// Client over a POSIX TCP socket, in place of WiFiClient
+// - reads are non-blocking like lwIP's, -1 while nothing has arrived
+// - received bytes are buffered like the lwIP receive window, so available() is cheap
+//
+
+#ifndef __TS_POSIX_CLIENT__
+#define __TS_POSIX_CLIENT__
+
+#include <Client.h>
+
+#define POSIX_CLIENT_BUFFER      1460   // one TCP segment
+#define POSIX_CLIENT_TIMEOUT_MS  5000   // connect and write
+
+class TS_PosixClient : public Client
+{
+  public:
+    TS_PosixClient();
+    ~TS_PosixClient();
+
+    int connect(const char *host, uint16_t port) override;
+    uint8_t connected() override;
+    void stop() override;
+
+    int available() override;
+    int read() override;
+    int peek() override;
+
+    size_t write(uint8_t c) override;
+    size_t write(const uint8_t *buffer, size_t size) override;
+
+  private:
+    bool fill();
+
+    int     fd;
+    bool    peerClosed;
+    uint8_t buffer[POSIX_CLIENT_BUFFER];
+    size_t  bufferLength;
+    size_t  bufferPos;
+};
+
+#endif
@@ -0,0 +1,338 @@
+//
+// Sync bench
+// - runs the sync of the device against a server: the same TS_HttpClient, getTempIDs contract and parser,
+//   with a POSIX socket in place of WiFiClientSecure
+// - each sync: connect, TempID request parsed as it streams, upload batches with chunked bodies, teardown
+// - the TempIDs go through the device's request, receive and merge in alpha/tempids.cpp, counted instead of written
+// - the upload is the device's upload_day in alpha/upload_lines.cpp, over a day of generated peers
+// - -z asks for the TempIDs gzipped and inflates them as the device does, with a zlib stand-in for the ROM tinfl
+// - reports bytes, wall time and peak heap per sync, the heap being what the sync allocates on top of its start
+// - plain HTTP only, the TLS handshake and record buffers of the device are not part of it
+//
+
+#include <Arduino.h>
+#include <getopt.h>
+#include <malloc.h>
+#include <new>
+#include <vector>
+#include "http.h"
+#include "tempids.h"
+#include "inflate.h"
+#include "upload.h"
+#include "posix_client.h"
+
+#define UPLOAD_URI          "/uploadEncounters"
+#define TEMPID_SLOT_SECS    900   // as tools/sync_server.py
+
+//
+// Heap accounting, every malloc and operator new of the process
+// - malloc and friends are wrapped at link time (ld --wrap), so the malloc() of TS_InflateStream counts too
+// - operator new goes through malloc, sizes are those the allocator hands out
+//
+
+static size_t heapInUse = 0;
+static size_t heapPeak = 0;
+
+static void heap_add(void *p)
+{
+  if (p == NULL) return;
+
+  heapInUse += malloc_usable_size(p);
+  if (heapInUse > heapPeak) heapPeak = heapInUse;
+}
+
+static void heap_remove(void *p)
+{
+  if (p != NULL) heapInUse -= malloc_usable_size(p);
+}
+
+extern "C"
+{
+  void* __real_malloc(size_t size);
+  void* __real_calloc(size_t count, size_t size);
+  void* __real_realloc(void *p, size_t size);
+  void __real_free(void *p);
+
+  void* __wrap_malloc(size_t size)
+  {
+    void *p = __real_malloc(size);
+    heap_add(p);
+    return p;
+  }
+
+  void* __wrap_calloc(size_t count, size_t size)
+  {
+    void *p = __real_calloc(count, size);
+    heap_add(p);
+    return p;
+  }
+
+  void* __wrap_realloc(void *p, size_t size)
+  {
+    heap_remove(p);
+    void *resized = __real_realloc(p, size);
+    heap_add(resized != NULL || size == 0 ? resized : p);
+    return resized;
+  }
+
+  void __wrap_free(void *p)
+  {
+    heap_remove(p);
+    __real_free(p);
+  }
+}
+
+static void* heap_alloc(size_t size)
+{
+  void *p = malloc(size);
+  if (p == NULL) throw std::bad_alloc();
+  return p;
+}
+
+void* operator new(size_t size) { return heap_alloc(size); }
+void* operator new[](size_t size) { return heap_alloc(size); }
+void operator delete(void *p) noexcept { free(p); }
+void operator delete[](void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+void operator delete[](void *p, size_t) noexcept { free(p); }
+
+struct TS_BenchOptions
+{
+  const char *host;
+  uint16_t port;
+  const char *userId;
+  uint16_t syncs;
+  uint32_t after;
+  uint8_t count;
+  uint16_t batches;     // of UPLOAD_BATCH_PEERS peers
+  uint8_t incidents;    // per peer
+  bool gzip;
+};
+
+struct TS_BenchResult
+{
+  bool ok;
+  uint16_t ids;
+  uint32_t idsBytes;    // TempID body, inflated
+  uint16_t batches;
+  uint32_t bytesSent;
+  uint32_t bytesReceived;
+  uint32_t connects;
+  uint32_t requests;
+  uint32_t wallMs;
+  size_t heapPeak;
+};
+
+// getTempIDs through the device's request, receive and merge, as _TS_RADIO::sync_temp_ids
+// - the ids held are one per slot from now up to after, counted instead of kept in a file
+static bool bench_temp_ids(TS_HttpClient &http, const TS_BenchOptions &options, TS_BenchResult &result)
+{
+  uint32_t nowTime = time(NULL);
+  TS_TempIdMerge merge;
+  merge.begin(nowTime);
+  for (uint32_t expiry = nowTime - nowTime % TEMPID_SLOT_SECS + TEMPID_SLOT_SECS; expiry <= options.after && !merge.is_full(); expiry += TEMPID_SLOT_SECS)
+  {
+    if (merge.carries(expiry)) merge.add_carried(expiry);
+  }
+
+  char body[128];
+  if (!request_temp_ids(http, body, sizeof(body), options.userId, merge.get_horizon(), options.count, options.gzip)) return false;
+
+  uint16_t status = http.response();
+  if (status == 304)
+  {
+    http.end();
+    return true;
+  }
+
+  if (status != 200)
+  {
+    log_w("getTempIDs status %d", status);
+    http.end();
+    return false;
+  }
+
+  // as file_ids_append, without the file
+  char value[TEMPIDS_ID_MAX + 1];
+  char tempId[TEMPIDS_ID_MAX + 1];
+  volatile bool cancelled = false;
+  TS_TempIdSink append = [&merge](const char *id, uint32_t startTime, uint32_t expiryTime) {
+    if (merge.is_full()) return false;
+    if (merge.takes(expiryTime)) merge.add_taken();
+    return true;
+  };
+
+  TS_TempIdsReceived received;
+  bool parsed = receive_temp_ids(http, value, tempId, append, cancelled, received);
+  result.ids = merge.get_taken();
+  result.idsBytes = received.bytes;
+  return parsed;
+}
+
+// A day of generated peers, with its cursor in memory
+// - each incident a few minutes of sightings, as storage hands them to the uploader
+class TS_BenchDay : public TS_UploadSource
+{
+  public:
+    TS_BenchDay(uint16_t peers, uint8_t incidents)
+    : day("/p/0612"), peers(peers), incidents(incidents), peer(0), incident(0)
+    {
+      memset(&this->cursor, 0, sizeof(this->cursor));
+      this->incidentPeer.org = "SG_MOH";
+      this->incidentPeer.deviceType = "iPhone";
+      this->load();
+    };
+
+    const std::string& get_day() override { return this->day; }
+
+    std::string* get_peer_id() override { return this->peer < this->peers ? &this->peerId : NULL; }
+    TS_Peer* get_incident() override { return this->peer < this->peers && this->incident < this->incidents ? &this->incidentPeer : NULL; }
+
+    void next_peer() override { ++this->peer; this->incident = 0; this->load(); }
+    void next_incident() override { ++this->incident; this->load(); }
+
+    void cursor_get(TS_UploadCursor &cursor) override { cursor = this->cursor; }
+    bool cursor_set(const TS_UploadCursor &cursor) override { this->cursor = cursor; return true; }
+
+  private:
+    void load()
+    {
+      char tempId[89];
+      snprintf(tempId, sizeof(tempId), "%088u", this->peer);
+      this->peerId = tempId;
+
+      this->incidentPeer.firstSeen.hour = 9 + this->incident;
+      this->incidentPeer.firstSeen.minute = this->peer % 60;
+      this->incidentPeer.firstSeen.second = 0;
+      this->incidentPeer.mins = 5 + this->incident;
+      this->incidentPeer.rssi.reset();
+      for (int8_t rssi = -80; rssi <= -60; rssi += 2) this->incidentPeer.rssi.add(rssi);
+    }
+
+    const std::string day;
+    uint16_t peers;
+    uint8_t incidents;
+
+    uint16_t peer;
+    uint8_t incident;
+    std::string peerId;
+    TS_Peer incidentPeer;
+    TS_UploadCursor cursor;
+};
+
+// A day of batches through the device's upload_day
+static bool bench_upload(TS_HttpClient &http, const TS_BenchOptions &options, TS_BenchResult &result)
+{
+  if (options.batches == 0) return true;
+
+  TS_BenchDay day(options.batches * UPLOAD_BATCH_PEERS, options.incidents);
+  _TS_Uploader uploader;
+  bool uploaded = uploader.upload_day(http, UPLOAD_URI, options.userId, day, NULL);
+  result.batches = uploader.get_batches();
+  return uploaded;
+}
+
+static TS_BenchResult bench_sync(const TS_BenchOptions &options)
+{
+  TS_BenchResult result;
+  memset(&result, 0, sizeof(result));
+
+  size_t heapStart = heapInUse;
+  heapPeak = heapInUse;
+  unsigned long startMs = millis();
+
+  {
+    TS_PosixClient client;
+    TS_HttpClient http(client, options.host, options.port);
+
+    result.ok = http.connect() && bench_temp_ids(http, options, result) && bench_upload(http, options, result);
+    http.stop();
+
+    result.bytesSent = http.get_bytes_sent();
+    result.bytesReceived = http.get_bytes_received();
+    result.connects = http.get_connects();
+    result.requests = http.get_requests();
+  }
+
+  result.wallMs = millis() - startMs;
+  result.heapPeak = heapPeak - heapStart;
+  return result;
+}
+
+static void usage(const char *name)
+{
+  fprintf(stderr,
+    "usage: %s [-h host] [-p port] [-u uid] [-n syncs] [-a after] [-c count] [-b batches] [-i incidents] [-z]\n"
+    "  -h host       server, 127.0.0.1\n"
+    "  -p port       8080\n"
+    "  -u uid        user id sent with the requests\n"
+    "  -n syncs      syncs to run, 10\n"
+    "  -a after      TempIDs held up to then, unix seconds, 0 for none\n"
+    "  -c count      TempIDs asked for, 100\n"
+    "  -b batches    upload batches per sync, of %d peers, 0 for none\n"
+    "  -i incidents  incidents per peer, 2\n"
+    "  -z            accept gzip TempID responses\n", name, UPLOAD_BATCH_PEERS);
+}
+
+int main(int argc, char **argv)
+{
+  TS_BenchOptions options = { "127.0.0.1", 8080, "bench", 10, 0, 100, 0, 2, false };
+
+  int option;
+  while ((option = getopt(argc, argv, "h:p:u:n:a:c:b:i:z")) != -1)
+  {
+    switch (option)
+    {
+      case 'h': options.host = optarg; break;
+      case 'p': options.port = atoi(optarg); break;
+      case 'u': options.userId = optarg; break;
+      case 'n': options.syncs = atoi(optarg); break;
+      case 'a': options.after = strtoul(optarg, NULL, 10); break;
+      case 'c': options.count = atoi(optarg); break;
+      case 'b': options.batches = atoi(optarg); break;
+      case 'i': options.incidents = atoi(optarg); break;
+      case 'z': options.gzip = true; break;
+      default: usage(argv[0]); return 2;
+    }
+  }
+
+  printf("%-5s %-4s %5s %9s %7s %9s %9s %5s %5s %8s %9s\n", "sync", "ok", "ids", "ids(B)", "batches", "sent", "received", "conn", "reqs", "wall(ms)", "heap(B)");
+
+  std::vector<TS_BenchResult> results;
+  uint16_t failed = 0;
+  for (uint16_t i = 0; i < options.syncs; ++i)
+  {
+    TS_BenchResult result = bench_sync(options);
+    results.push_back(result);
+    if (!result.ok) ++failed;
+
+    printf("%-5u %-4s %5u %9u %7u %9u %9u %5u %5u %8u %9zu\n", i, result.ok ? "ok" : "fail", result.ids, result.idsBytes, result.batches,
+      result.bytesSent, result.bytesReceived, result.connects, result.requests, result.wallMs, result.heapPeak);
+  }
+
+  // of the syncs that went through
+  uint64_t sent = 0, received = 0, wallMs = 0;
+  uint32_t wallMaxMs = 0;
+  size_t heapMax = 0;
+  uint16_t ok = 0;
+  for (const TS_BenchResult &result : results)
+  {
+    if (!result.ok) continue;
+
+    ++ok;
+    sent += result.bytesSent;
+    received += result.bytesReceived;
+    wallMs += result.wallMs;
+    if (result.wallMs > wallMaxMs) wallMaxMs = result.wallMs;
+    if (result.heapPeak > heapMax) heapMax = result.heapPeak;
+  }
+
+  printf("\nsyncs ok: %u, failed: %u\n", ok, failed);
+  if (ok > 0)
+  {
+    printf("avg sent: %llu, received: %llu, wall: %llums, max wall: %ums, max heap: %zu\n",
+      (unsigned long long)(sent / ok), (unsigned long long)(received / ok), (unsigned long long)(wallMs / ok), wallMaxMs, heapMax);
+  }
+
+  return failed == 0 ? 0 : 1;
+}